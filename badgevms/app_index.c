@@ -0,0 +1,781 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "app_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_STRING UINT32_MAX
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t strings_size;
+    int64_t  stamp;
+    uint32_t crc; // Of the whole file with this field zeroed
+    uint32_t reserved;
+} app_index_header_t;
+
+typedef struct {
+    uint32_t offsets[APP_INDEX_STRINGS]; // Into the string table, NO_STRING for NULL
+    uint32_t source;
+} app_index_record_t;
+
+static uint32_t crc32_update(uint32_t crc, void const *data, size_t len) {
+    uint8_t const *bytes = data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t file_crc(app_index_header_t const *header, void const *body, size_t body_len) {
+    app_index_header_t copy = *header;
+    copy.crc                = 0;
+    return crc32_update(crc32_update(0, &copy, sizeof(copy)), body, body_len);
+}
+
+// Position of unique_identifier, or where it would have to be inserted
+static size_t entry_position(app_index_t const *index, char const *unique_identifier, bool *found) {
+    size_t low  = 0;
+    size_t high = index->count;
+
+    *found = false;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int    cmp = strcmp(index->entries[mid].strings[APP_INDEX_UNIQUE_IDENTIFIER], unique_identifier);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void entry_free(app_index_entry_t *entry) {
+    for (int i = 0; i < APP_INDEX_STRINGS; ++i) {
+        free(entry->strings[i]);
+        entry->strings[i] = NULL;
+    }
+}
+
+static bool entry_copy(app_index_entry_t *dst, app_index_entry_t const *src) {
+    memset(dst, 0, sizeof(*dst));
+    for (int i = 0; i < APP_INDEX_STRINGS; ++i) {
+        if (src->strings[i] && !(dst->strings[i] = strdup(src->strings[i]))) {
+            entry_free(dst);
+            return false;
+        }
+    }
+    dst->source = src->source;
+    return true;
+}
+
+void app_index_init(app_index_t *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+void app_index_clear(app_index_t *index) {
+    for (size_t i = 0; i < index->count; ++i) {
+        entry_free(&index->entries[i]);
+    }
+    free(index->entries);
+    app_index_init(index);
+}
+
+app_index_entry_t const *app_index_find(app_index_t const *index, char const *unique_identifier) {
+    bool   found;
+    size_t position = entry_position(index, unique_identifier, &found);
+    return found ? &index->entries[position] : NULL;
+}
+
+bool app_index_put(app_index_t *index, app_index_entry_t const *entry) {
+    char const *unique_identifier = entry->strings[APP_INDEX_UNIQUE_IDENTIFIER];
+    if (!unique_identifier)
+        return false;
+
+    app_index_entry_t copy;
+    if (!entry_copy(&copy, entry))
+        return false;
+
+    bool   found;
+    size_t position = entry_position(index, unique_identifier, &found);
+    if (found) {
+        entry_free(&index->entries[position]);
+        index->entries[position] = copy;
+        return true;
+    }
+
+    if (index->count == index->capacity) {
+        size_t             capacity = index->capacity ? index->capacity * 2 : 16;
+        app_index_entry_t *entries  = realloc(index->entries, capacity * sizeof(app_index_entry_t));
+        if (!entries) {
+            entry_free(&copy);
+            return false;
+        }
+        index->entries  = entries;
+        index->capacity = capacity;
+    }
+
+    memmove(
+        &index->entries[position + 1],
+        &index->entries[position],
+        (index->count - position) * sizeof(app_index_entry_t)
+    );
+    index->entries[position] = copy;
+    index->count++;
+    return true;
+}
+
+bool app_index_remove(app_index_t *index, char const *unique_identifier) {
+    bool   found;
+    size_t position = entry_position(index, unique_identifier, &found);
+    if (!found)
+        return false;
+
+    entry_free(&index->entries[position]);
+    memmove(
+        &index->entries[position],
+        &index->entries[position + 1],
+        (index->count - position - 1) * sizeof(app_index_entry_t)
+    );
+    index->count--;
+    return true;
+}
+
+bool app_index_encode(app_index_t const *index, void **out, size_t *out_len) {
+    size_t strings_size = 0;
+    for (size_t i = 0; i < index->count; ++i) {
+        for (int s = 0; s < APP_INDEX_STRINGS; ++s) {
+            if (index->entries[i].strings[s]) {
+                strings_size += strlen(index->entries[i].strings[s]) + 1;
+            }
+        }
+    }
+
+    size_t   body_len = index->count * sizeof(app_index_record_t) + strings_size;
+    uint8_t *data     = malloc(sizeof(app_index_header_t) + body_len);
+    if (!data)
+        return false;
+
+    app_index_header_t header = {
+        .magic        = APP_INDEX_MAGIC,
+        .version      = APP_INDEX_VERSION,
+        .record_size  = sizeof(app_index_record_t),
+        .count        = index->count,
+        .strings_size = strings_size,
+        .stamp        = index->stamp,
+    };
+
+    uint8_t *body    = data + sizeof(app_index_header_t);
+    char    *strings = (char *)body + index->count * sizeof(app_index_record_t);
+    uint32_t offset  = 0;
+
+    for (size_t i = 0; i < index->count; ++i) {
+        app_index_record_t record = {.source = index->entries[i].source};
+        for (int s = 0; s < APP_INDEX_STRINGS; ++s) {
+            char const *string = index->entries[i].strings[s];
+            if (!string) {
+                record.offsets[s] = NO_STRING;
+                continue;
+            }
+            size_t len        = strlen(string) + 1;
+            record.offsets[s] = offset;
+            memcpy(strings + offset, string, len);
+            offset += len;
+        }
+        memcpy(body + i * sizeof(app_index_record_t), &record, sizeof(record));
+    }
+
+    header.crc = file_crc(&header, body, body_len);
+    memcpy(data, &header, sizeof(header));
+
+    *out     = data;
+    *out_len = sizeof(app_index_header_t) + body_len;
+    return true;
+}
+
+bool app_index_decode(app_index_t *index, void const *data, size_t len) {
+    app_index_header_t header;
+
+    app_index_clear(index);
+    if (len < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != APP_INDEX_MAGIC || header.version != APP_INDEX_VERSION ||
+        header.record_size != sizeof(app_index_record_t))
+        return false;
+
+    size_t body_len = len - sizeof(header);
+    if (header.count > body_len / sizeof(app_index_record_t) ||
+        body_len - header.count * sizeof(app_index_record_t) != header.strings_size)
+        return false;
+
+    uint8_t const *body    = (uint8_t const *)data + sizeof(header);
+    char const    *strings = (char const *)body + header.count * sizeof(app_index_record_t);
+    if (file_crc(&header, body, body_len) != header.crc)
+        return false;
+
+    // Every offset inside the table then points at a terminated string
+    if (header.strings_size && strings[header.strings_size - 1] != '\0')
+        return false;
+
+    index->entries = malloc(header.count * sizeof(app_index_entry_t));
+    if (header.count && !index->entries)
+        return false;
+    index->capacity = header.count;
+
+    for (size_t i = 0; i < header.count; ++i) {
+        app_index_record_t record;
+        app_index_entry_t  entry = {0};
+
+        memcpy(&record, body + i * sizeof(app_index_record_t), sizeof(record));
+        for (int s = 0; s < APP_INDEX_STRINGS; ++s) {
+            if (record.offsets[s] == NO_STRING)
+                continue;
+            if (record.offsets[s] >= header.strings_size)
+                goto error;
+            entry.strings[s] = (char *)strings + record.offsets[s];
+        }
+        entry.source = record.source;
+
+        // Entries are stored sorted, which also rules out duplicates
+        char const *unique_identifier = entry.strings[APP_INDEX_UNIQUE_IDENTIFIER];
+        if (!unique_identifier ||
+            (i && strcmp(index->entries[i - 1].strings[APP_INDEX_UNIQUE_IDENTIFIER], unique_identifier) >= 0))
+            goto error;
+
+        if (!entry_copy(&index->entries[i], &entry))
+            goto error;
+        index->count++;
+    }
+
+    index->stamp = header.stamp;
+    return true;
+
+error:
+    app_index_clear(index);
+    return false;
+}
+
+static bool store_index(app_index_t const *index, app_index_ops_t const *ops, void *context) {
+    void  *data;
+    size_t len;
+    if (!app_index_encode(index, &data, &len))
+        return false;
+
+    bool success = ops->store(context, data, len);
+    free(data);
+    return success;
+}
+
+void app_index_stamp_add(int64_t *stamp, char const *name, int64_t mtime, int64_t size) {
+    // FNV-1a of the name, mtime and size. Summing the hashes keeps the order
+    // the directory lists the files in out of it.
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t)*name) * 0x100000001B3ull;
+    }
+
+    int64_t const  numbers[] = {mtime, size};
+    uint8_t const *bytes     = (uint8_t const *)numbers;
+    for (size_t i = 0; i < sizeof(numbers); ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+
+    *stamp = (int64_t)((uint64_t)*stamp + hash);
+}
+
+// The metadata files were written first, the index file is not in the stamp
+bool app_index_save(app_index_t *index, app_index_ops_t const *ops, void *context) {
+    if (!ops->stamp(context, &index->stamp))
+        return false;
+
+    return store_index(index, ops, context);
+}
+
+bool app_index_sync(app_index_t *index, app_index_ops_t const *ops, void *context) {
+    int64_t stamp;
+    if (!ops->stamp(context, &stamp)) {
+        app_index_clear(index);
+        return false;
+    }
+
+    if (index->loaded && index->stamp == stamp)
+        return true;
+
+    size_t len;
+    void  *data  = ops->load(context, &len);
+    bool   valid = data && app_index_decode(index, data, len) && index->stamp == stamp;
+    free(data);
+
+    if (valid) {
+        index->loaded = true;
+        return true;
+    }
+
+    app_index_clear(index);
+    if (!ops->scan(context, index)) {
+        app_index_clear(index);
+        return false;
+    }
+
+    index->stamp  = stamp;
+    index->loaded = true;
+
+    // A read only device just gets scanned again next boot
+    app_index_save(index, ops, context);
+    return true;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define MAX_APPS 200
+
+// A directory of metadata files and the index file next to them
+typedef struct {
+    bool              exists;
+    bool              read_only;
+    int64_t           clock; // Of the other side, in FAT's two second steps
+    app_index_entry_t apps[MAX_APPS];
+    int64_t           mtimes[MAX_APPS];
+    int               num_apps;
+    uint8_t          *file;
+    size_t            file_len;
+    int               scans;
+    int               loads;
+    int               stores;
+} fake_dir_t;
+
+#define TEST_RNG_SEED 0x7A3C91E5
+#include "test_rng.h"
+
+// Stands in for the size of the metadata file
+static int64_t fake_size(app_index_entry_t const *entry) {
+    int64_t size = 0;
+    for (int s = 0; s < APP_INDEX_STRINGS; ++s) {
+        size += entry->strings[s] ? strlen(entry->strings[s]) + 16 : 0;
+    }
+    return size;
+}
+
+static bool fake_stamp(void *context, int64_t *stamp) {
+    fake_dir_t *dir = context;
+    *stamp          = 0;
+
+    for (int i = 0; i < dir->num_apps; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s.json", dir->apps[i].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+        app_index_stamp_add(stamp, name, dir->mtimes[i], fake_size(&dir->apps[i]));
+    }
+    return dir->exists;
+}
+
+static void *fake_load(void *context, size_t *len) {
+    fake_dir_t *dir = context;
+    dir->loads++;
+    if (!dir->file)
+        return NULL;
+
+    void *data = malloc(dir->file_len);
+    memcpy(data, dir->file, dir->file_len);
+    *len = dir->file_len;
+    return data;
+}
+
+static bool fake_store(void *context, void const *data, size_t len) {
+    fake_dir_t *dir = context;
+    if (dir->read_only)
+        return false;
+
+    dir->stores++;
+    free(dir->file);
+    dir->file     = malloc(len);
+    dir->file_len = len;
+    memcpy(dir->file, data, len);
+    return true;
+}
+
+static bool fake_scan(void *context, app_index_t *index) {
+    fake_dir_t *dir = context;
+    dir->scans++;
+    for (int i = 0; i < dir->num_apps; ++i) {
+        if (!app_index_put(index, &dir->apps[i]))
+            return false;
+    }
+    return true;
+}
+
+static app_index_ops_t const fake_ops = {
+    .stamp = fake_stamp,
+    .load  = fake_load,
+    .store = fake_store,
+    .scan  = fake_scan,
+};
+
+static char *random_string(void) {
+    static char const alphabet[] = "abcdefghij_.0123";
+    char              buf[24];
+    int               len = rng() % 20;
+
+    for (int i = 0; i < len; ++i) {
+        buf[i] = alphabet[rng() % (sizeof(alphabet) - 1)];
+    }
+    buf[len] = '\0';
+    return strdup(buf);
+}
+
+static void random_entry(app_index_entry_t *entry, int id) {
+    char unique_identifier[16];
+    snprintf(unique_identifier, sizeof(unique_identifier), "app_%d", id);
+
+    entry->strings[APP_INDEX_UNIQUE_IDENTIFIER] = strdup(unique_identifier);
+    for (int s = 1; s < APP_INDEX_STRINGS; ++s) {
+        entry->strings[s] = rng() % 4 ? random_string() : NULL;
+    }
+    entry->source = rng() % 3;
+}
+
+static int fake_find(fake_dir_t *dir, char const *unique_identifier) {
+    for (int i = 0; i < dir->num_apps; ++i) {
+        if (strcmp(dir->apps[i].strings[APP_INDEX_UNIQUE_IDENTIFIER], unique_identifier) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Like FatFs, creating and deleting files leaves the directory mtime alone,
+// only the file written gets a new one
+static void fake_write_app(fake_dir_t *dir, app_index_entry_t const *entry, int64_t mtime) {
+    int i = fake_find(dir, entry->strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    if (i < 0) {
+        i = dir->num_apps++;
+    } else {
+        entry_free(&dir->apps[i]);
+    }
+    entry_copy(&dir->apps[i], entry);
+    dir->mtimes[i] = mtime;
+}
+
+static void fake_delete_app(fake_dir_t *dir, char const *unique_identifier) {
+    int i = fake_find(dir, unique_identifier);
+    entry_free(&dir->apps[i]);
+    dir->apps[i]   = dir->apps[--dir->num_apps];
+    dir->mtimes[i] = dir->mtimes[dir->num_apps];
+}
+
+static void fake_free(fake_dir_t *dir) {
+    for (int i = 0; i < dir->num_apps; ++i) {
+        entry_free(&dir->apps[i]);
+    }
+    free(dir->file);
+}
+
+static bool string_equal(char const *a, char const *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool index_matches(app_index_t const *index, fake_dir_t *dir) {
+    if (index->count != (size_t)dir->num_apps)
+        return false;
+
+    for (size_t i = 1; i < index->count; ++i) {
+        if (strcmp(
+                index->entries[i - 1].strings[APP_INDEX_UNIQUE_IDENTIFIER],
+                index->entries[i].strings[APP_INDEX_UNIQUE_IDENTIFIER]
+            ) >= 0)
+            return false;
+    }
+
+    for (int i = 0; i < dir->num_apps; ++i) {
+        app_index_entry_t const *entry = app_index_find(index, dir->apps[i].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+        if (!entry || entry->source != dir->apps[i].source)
+            return false;
+        for (int s = 0; s < APP_INDEX_STRINGS; ++s) {
+            if (!string_equal(entry->strings[s], dir->apps[i].strings[s]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// What a fresh boot sees
+static bool reboot_matches(fake_dir_t *dir, int *scans) {
+    app_index_t index;
+    app_index_init(&index);
+
+    int  before = dir->scans;
+    bool ok     = app_index_sync(&index, &fake_ops, dir) && index_matches(&index, dir);
+    *scans      = dir->scans - before;
+
+    app_index_clear(&index);
+    return ok;
+}
+
+int main(void) {
+    int errors = 0;
+    int scans;
+
+    // Build from the metadata files, then serve from memory
+    fake_dir_t dir = {.exists = true, .clock = 1000};
+    for (int i = 0; i < 50; ++i) {
+        dir.mtimes[dir.num_apps] = dir.clock - rng() % 1000 * 2;
+        random_entry(&dir.apps[dir.num_apps++], i);
+    }
+
+    app_index_t index;
+    app_index_init(&index);
+    if (!app_index_sync(&index, &fake_ops, &dir) || !index_matches(&index, &dir) || dir.scans != 1 || !dir.file) {
+        printf("\033[31mInitial build failed\033[0m\n");
+        errors++;
+    }
+
+    int loads = dir.loads;
+    for (int i = 0; i < 10; ++i) {
+        app_index_sync(&index, &fake_ops, &dir);
+    }
+    if (dir.scans != 1 || dir.loads != loads) {
+        printf("\033[31mUnchanged directory was not served from memory\033[0m\n");
+        errors++;
+    }
+
+    if (!reboot_matches(&dir, &scans) || scans) {
+        printf("\033[31mIndex file not used after reboot, %d scans\033[0m\n", scans);
+        errors++;
+    }
+
+    // Incremental install, update and uninstall
+    int next_id = 50;
+    for (int round = 0; round < 2000; ++round) {
+        uint32_t op = rng() % 3;
+        if (op == 0 && dir.num_apps < MAX_APPS) {
+            app_index_entry_t entry = {0};
+            random_entry(&entry, next_id++);
+            app_index_sync(&index, &fake_ops, &dir);
+            fake_write_app(&dir, &entry, dir.clock += 2);
+            app_index_put(&index, &entry);
+            app_index_save(&index, &fake_ops, &dir);
+            entry_free(&entry);
+        } else if (op == 1 && dir.num_apps) {
+            app_index_entry_t entry = {0};
+            int               i     = rng() % dir.num_apps;
+            random_entry(&entry, 0);
+            free(entry.strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+            entry.strings[APP_INDEX_UNIQUE_IDENTIFIER] = strdup(dir.apps[i].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+            app_index_sync(&index, &fake_ops, &dir);
+            fake_write_app(&dir, &entry, dir.clock += 2);
+            app_index_put(&index, &entry);
+            app_index_save(&index, &fake_ops, &dir);
+            entry_free(&entry);
+        } else if (op == 2 && dir.num_apps) {
+            char *unique_identifier = strdup(dir.apps[rng() % dir.num_apps].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+            app_index_sync(&index, &fake_ops, &dir);
+            fake_delete_app(&dir, unique_identifier);
+            if (!app_index_remove(&index, unique_identifier)) {
+                printf("\033[31mRemoving %s failed\033[0m\n", unique_identifier);
+                errors++;
+            }
+            app_index_save(&index, &fake_ops, &dir);
+            free(unique_identifier);
+        }
+
+        if (!index_matches(&index, &dir)) {
+            printf("\033[31mIndex diverged in round %d\033[0m\n", round);
+            errors++;
+            break;
+        }
+        if (round % 100 == 0 && (!reboot_matches(&dir, &scans) || scans)) {
+            printf("\033[31mIndex file stale in round %d, %d scans\033[0m\n", round, scans);
+            errors++;
+            break;
+        }
+    }
+    if (dir.scans != 1) {
+        printf("\033[31mIncremental updates rescanned %d times\033[0m\n", dir.scans - 1);
+        errors++;
+    }
+
+    // Changes made behind our back show up through the metadata files: a new
+    // one, a rewritten one, and one swapped for an older one, which keeps both
+    // the count and the newest mtime
+    app_index_entry_t foreign = {0};
+    random_entry(&foreign, next_id++);
+    fake_write_app(&dir, &foreign, dir.clock += 2);
+    entry_free(&foreign);
+    if (!app_index_sync(&index, &fake_ops, &dir) || !index_matches(&index, &dir) || dir.scans != 2) {
+        printf("\033[31mForeign install not picked up\033[0m\n");
+        errors++;
+    }
+
+    random_entry(&foreign, 0);
+    free(foreign.strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    foreign.strings[APP_INDEX_UNIQUE_IDENTIFIER] = strdup(dir.apps[0].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    fake_write_app(&dir, &foreign, dir.clock += 2);
+    entry_free(&foreign);
+    if (!app_index_sync(&index, &fake_ops, &dir) || !index_matches(&index, &dir) || dir.scans != 3) {
+        printf("\033[31mForeign update not picked up\033[0m\n");
+        errors++;
+    }
+
+    int oldest = 0;
+    for (int i = 1; i < dir.num_apps; ++i) {
+        oldest = dir.mtimes[i] < dir.mtimes[oldest] ? i : oldest;
+    }
+    int64_t older = dir.mtimes[oldest] - 2;
+    fake_delete_app(&dir, dir.apps[oldest].strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    random_entry(&foreign, next_id++);
+    fake_write_app(&dir, &foreign, older);
+    entry_free(&foreign);
+    if (!app_index_sync(&index, &fake_ops, &dir) || !index_matches(&index, &dir) || dir.scans != 4) {
+        printf("\033[31mForeign swap not picked up\033[0m\n");
+        errors++;
+    }
+
+    app_index_t decoded;
+    app_index_init(&decoded);
+    if (!app_index_decode(&decoded, dir.file, dir.file_len) || !index_matches(&decoded, &dir)) {
+        printf("\033[31mRound trip failed\033[0m\n");
+        errors++;
+    }
+
+    // Every truncation and every bit flip of a small file is rejected
+    app_index_t small;
+    app_index_init(&small);
+    for (int i = 0; i < 6; ++i) {
+        app_index_entry_t entry = {0};
+        random_entry(&entry, i);
+        app_index_put(&small, &entry);
+        entry_free(&entry);
+    }
+
+    uint8_t *good;
+    size_t   good_len;
+    app_index_encode(&small, (void **)&good, &good_len);
+    app_index_clear(&small);
+
+    for (size_t len = 0; len < good_len; ++len) {
+        if (app_index_decode(&decoded, good, len) || decoded.count) {
+            printf("\033[31mAccepted truncation to %zu bytes\033[0m\n", len);
+            errors++;
+            break;
+        }
+    }
+
+    for (size_t bit = 0; bit < good_len * 8; ++bit) {
+        good[bit / 8] ^= 1 << (bit % 8);
+        if (app_index_decode(&decoded, good, good_len) || decoded.count) {
+            printf("\033[31mAccepted flip of bit %zu\033[0m\n", bit);
+            errors++;
+            break;
+        }
+        good[bit / 8] ^= 1 << (bit % 8);
+    }
+
+    // Garbage with a valid checksum is rejected as well
+    app_index_header_t header;
+    memcpy(&header, good, sizeof(header));
+    for (int i = 0; i < 1000; ++i) {
+        uint8_t *bad = malloc(good_len);
+        memcpy(bad, good, good_len);
+        for (int flips = 1 + rng() % 4; flips; --flips) {
+            bad[sizeof(header) + rng() % (good_len - sizeof(header))] = rng();
+        }
+        header.crc = file_crc(&header, bad + sizeof(header), good_len - sizeof(header));
+        memcpy(bad, &header, sizeof(header));
+        // May decode if only string contents changed, but must stay consistent
+        if (app_index_decode(&decoded, bad, good_len)) {
+            for (size_t e = 0; e < decoded.count; ++e) {
+                if (!decoded.entries[e].strings[APP_INDEX_UNIQUE_IDENTIFIER] ||
+                    (e && strcmp(
+                              decoded.entries[e - 1].strings[APP_INDEX_UNIQUE_IDENTIFIER],
+                              decoded.entries[e].strings[APP_INDEX_UNIQUE_IDENTIFIER]
+                          ) >= 0)) {
+                    printf("\033[31mAccepted an unsorted index\033[0m\n");
+                    errors++;
+                    break;
+                }
+            }
+        }
+        free(bad);
+    }
+    app_index_clear(&decoded);
+
+    // A damaged file gets rebuilt on the next boot
+    dir.file[dir.file_len / 2] ^= 0x40;
+    if (!reboot_matches(&dir, &scans) || scans != 1 || !reboot_matches(&dir, &scans) || scans) {
+        printf("\033[31mDamaged index not rebuilt\033[0m\n");
+        errors++;
+    }
+
+    // As does one that is missing or from another format version
+    free(dir.file);
+    dir.file = NULL;
+    if (!reboot_matches(&dir, &scans) || scans != 1) {
+        printf("\033[31mMissing index not rebuilt\033[0m\n");
+        errors++;
+    }
+    ((app_index_header_t *)dir.file)->version++;
+    if (!reboot_matches(&dir, &scans) || scans != 1) {
+        printf("\033[31mOther version accepted\033[0m\n");
+        errors++;
+    }
+    free(good);
+
+    // Read only devices still get served from memory
+    dir.read_only = true;
+    app_index_clear(&index);
+    free(dir.file);
+    dir.file = NULL;
+    if (!app_index_sync(&index, &fake_ops, &dir) || !index_matches(&index, &dir) ||
+        !app_index_sync(&index, &fake_ops, &dir) || dir.scans != 8) {
+        printf("\033[31mRead only directory not served, %d scans\033[0m\n", dir.scans);
+        errors++;
+    }
+
+    dir.exists = false;
+    if (app_index_sync(&index, &fake_ops, &dir) || index.count) {
+        printf("\033[31mMissing directory not reported\033[0m\n");
+        errors++;
+    }
+
+    app_index_clear(&index);
+    fake_free(&dir);
+
+    if (errors) {
+        printf("\033[31m%d errors\033[0m\n", errors);
+        return 1;
+    }
+
+    printf("\033[32mAll tests passed\033[0m\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,89 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define APP_INDEX_MAGIC   0x58444941 // "AIDX"
+#define APP_INDEX_VERSION 1
+
+typedef enum {
+    APP_INDEX_UNIQUE_IDENTIFIER,
+    APP_INDEX_NAME,
+    APP_INDEX_AUTHOR,
+    APP_INDEX_VERSION_STRING,
+    APP_INDEX_INTERPRETER,
+    APP_INDEX_METADATA_FILE,
+    APP_INDEX_BINARY_PATH,
+    APP_INDEX_STRINGS,
+} app_index_string_t;
+
+// What the metadata json of one application holds. Strings are NULL when unset.
+typedef struct {
+    char    *strings[APP_INDEX_STRINGS];
+    uint32_t source;
+} app_index_entry_t;
+
+// The applications installed in one directory, sorted by unique identifier.
+// Not thread safe, the caller locks around it.
+typedef struct {
+    app_index_entry_t *entries;
+    size_t             count;
+    size_t             capacity;
+    int64_t            stamp; // Of the metadata files the index is valid for
+    bool               loaded;
+} app_index_t;
+
+// How the index reaches the directory it describes
+typedef struct {
+    // app_index_stamp_add() of every metadata file in the directory, false if
+    // it does not exist
+    bool (*stamp)(void *context, int64_t *stamp);
+    // Contents of the index file, malloc'd, NULL if there is none
+    void *(*load)(void *context, size_t *len);
+    bool (*store)(void *context, void const *data, size_t len);
+    // Rebuild the index from the metadata files
+    bool (*scan)(void *context, app_index_t *index);
+} app_index_ops_t;
+
+void                     app_index_init(app_index_t *index);
+void                     app_index_clear(app_index_t *index);
+app_index_entry_t const *app_index_find(app_index_t const *index, char const *unique_identifier);
+// Copies the entry, replacing the one with the same unique identifier
+bool                     app_index_put(app_index_t *index, app_index_entry_t const *entry);
+bool                     app_index_remove(app_index_t *index, char const *unique_identifier);
+
+// The file format is native endian. Decoding rejects anything truncated,
+// corrupted or written by another version and leaves the index empty.
+bool app_index_encode(app_index_t const *index, void **out, size_t *out_len);
+bool app_index_decode(app_index_t *index, void const *data, size_t len);
+
+// FatFs leaves the directory mtime alone when files are created or deleted,
+// so staleness is told from the metadata files themselves. Folds one of them
+// into a stamp that starts at 0, in any order. Adding, removing, renaming or
+// rewriting a file changes the stamp, the index file itself is not part of it.
+void app_index_stamp_add(int64_t *stamp, char const *name, int64_t mtime, int64_t size);
+
+// Makes sure the index matches the directory. Does nothing while the stamp is
+// unchanged, otherwise loads the index file and rescans the metadata files if
+// that is missing, damaged or stale. Returns false if the directory does not
+// exist or could not be scanned.
+bool app_index_sync(app_index_t *index, app_index_ops_t const *ops, void *context);
+// Writes the index file after an incremental update
+bool app_index_save(app_index_t *index, app_index_ops_t const *ops, void *context);
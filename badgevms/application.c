@@ -16,9 +16,13 @@
 
 #include "badgevms/application.h"
 
+#include "app_index.h"
 #include "badgevms/pathfuncs.h"
 #include "badgevms/process.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "logical_names.h"
 #include "thirdparty/cJSON.h"
 #include "why_io.h"
 
@@ -36,9 +40,23 @@
 
 #define APPLICATION_MAGIC 0xDEADBEEF
 #define MAX_PATH_LEN      512
+#define MAX_LOCATIONS     4
+#define INDEX_FILE        "apps.idx"
 
 static char applications_base_dir[MAX_PATH_LEN] = "";
 
+// Every element of the applications_base_dir search list keeps an index of
+// the applications whose metadata it holds, so listing them does not have to
+// parse every json file.
+typedef struct {
+    char       *dir;
+    app_index_t index;
+} app_location_t;
+
+static app_location_t    locations[MAX_LOCATIONS];
+static size_t            num_locations;
+static SemaphoreHandle_t index_lock;
+
 typedef struct application_list {
     application_t **applications;
     size_t          count;
@@ -116,41 +134,275 @@ static cJSON *application_to_json(application_t const *app) {
     return json;
 }
 
-static application_t *json_to_application(cJSON *json) {
+static void json_to_entry(cJSON *json, app_index_entry_t *entry) {
+    static char const *const keys[APP_INDEX_STRINGS] = {
+        [APP_INDEX_UNIQUE_IDENTIFIER] = "unique_identifier",
+        [APP_INDEX_NAME]              = "name",
+        [APP_INDEX_AUTHOR]            = "author",
+        [APP_INDEX_VERSION_STRING]    = "version",
+        [APP_INDEX_INTERPRETER]       = "interpreter",
+        [APP_INDEX_METADATA_FILE]     = "metadata_file",
+        [APP_INDEX_BINARY_PATH]       = "binary_path",
+    };
+
+    memset(entry, 0, sizeof(*entry));
+
+    // The strings stay owned by the json
+    cJSON *item;
+    for (int i = 0; i < APP_INDEX_STRINGS; ++i) {
+        if ((item = cJSON_GetObjectItem(json, keys[i])) && cJSON_IsString(item)) {
+            entry->strings[i] = item->valuestring;
+        }
+    }
+    if ((item = cJSON_GetObjectItem(json, "source")) && cJSON_IsNumber(item)) {
+        entry->source = item->valueint;
+    }
+}
+
+static application_t *entry_to_application(app_index_entry_t const *entry) {
     application_t *app = why_calloc(1, sizeof(application_t));
     if (!app)
         return NULL;
 
     // Cast away const for internal modification
+    app->unique_identifier                  = why_strdup(entry->strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    app->installed_path                     = get_application_dir(entry->strings[APP_INDEX_UNIQUE_IDENTIFIER]);
+    app->name                               = why_strdup(entry->strings[APP_INDEX_NAME]);
+    app->author                             = why_strdup(entry->strings[APP_INDEX_AUTHOR]);
+    app->version                            = why_strdup(entry->strings[APP_INDEX_VERSION_STRING]);
+    app->interpreter                        = why_strdup(entry->strings[APP_INDEX_INTERPRETER]);
+    app->metadata_file                      = why_strdup(entry->strings[APP_INDEX_METADATA_FILE]);
+    app->binary_path                        = why_strdup(entry->strings[APP_INDEX_BINARY_PATH]);
+    *((application_source_t *)&app->source) = (application_source_t)entry->source;
 
-    cJSON *item;
-    if ((item = cJSON_GetObjectItem(json, "unique_identifier")) && cJSON_IsString(item)) {
-        app->unique_identifier = why_strdup(item->valuestring);
-        app->installed_path    = get_application_dir(item->valuestring);
-    }
-    if ((item = cJSON_GetObjectItem(json, "name")) && cJSON_IsString(item)) {
-        app->name = why_strdup(item->valuestring);
+    return app;
+}
+
+static cJSON *load_json(char const *path) {
+    FILE *fp = why_fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    why_fseek(fp, 0, SEEK_END);
+    long file_size = why_ftell(fp);
+    why_fseek(fp, 0, SEEK_SET);
+
+    char *content = why_malloc(file_size + 1);
+    if (!content) {
+        why_fclose(fp);
+        return NULL;
     }
-    if ((item = cJSON_GetObjectItem(json, "author")) && cJSON_IsString(item)) {
-        app->author = why_strdup(item->valuestring);
+
+    why_fread(content, 1, file_size, fp);
+    content[file_size] = '\0';
+    why_fclose(fp);
+
+    cJSON *json = cJSON_Parse(content);
+    why_free(content);
+    return json;
+}
+
+static char *location_file(app_location_t const *location, char const *unique_identifier) {
+    char *filename = NULL;
+    if (unique_identifier) {
+        why_asprintf(&filename, "%s.json", unique_identifier);
+    } else {
+        filename = why_strdup(INDEX_FILE);
     }
-    if ((item = cJSON_GetObjectItem(json, "version")) && cJSON_IsString(item)) {
-        app->version = why_strdup(item->valuestring);
+    if (!filename)
+        return NULL;
+
+    char *path = path_fileconcat(location->dir, filename);
+    why_free(filename);
+    return path;
+}
+
+// The metadata files rather than the directory, whose mtime FatFs does not
+// update when they are created or deleted
+static bool index_stamp(void *context, int64_t *stamp) {
+    app_location_t *location = context;
+
+    DIR *dir = why_opendir(location->dir);
+    if (!dir)
+        return false;
+
+    *stamp = 0;
+    struct dirent *entry;
+    while ((entry = why_readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 5 || strcmp(entry->d_name + len - 5, ".json") != 0)
+            continue;
+
+        char *path = path_fileconcat(location->dir, entry->d_name);
+        if (!path) {
+            why_closedir(dir);
+            return false;
+        }
+
+        // One that cannot be stat'ed still counts by name
+        struct stat st = {0};
+        why_stat(path, &st);
+        why_free(path);
+
+        app_index_stamp_add(stamp, entry->d_name, st.st_mtime, st.st_size);
     }
-    if ((item = cJSON_GetObjectItem(json, "interpreter")) && cJSON_IsString(item)) {
-        app->interpreter = why_strdup(item->valuestring);
+
+    why_closedir(dir);
+    return true;
+}
+
+static void *index_load(void *context, size_t *len) {
+    char *path = location_file(context, NULL);
+    if (!path)
+        return NULL;
+
+    FILE *fp = why_fopen(path, "r");
+    why_free(path);
+    if (!fp)
+        return NULL;
+
+    why_fseek(fp, 0, SEEK_END);
+    long file_size = why_ftell(fp);
+    why_fseek(fp, 0, SEEK_SET);
+
+    // The index frees this, so it comes from the kernel heap
+    void *data = file_size > 0 ? malloc(file_size) : NULL;
+    if (data && why_fread(data, 1, file_size, fp) != (size_t)file_size) {
+        free(data);
+        data = NULL;
     }
-    if ((item = cJSON_GetObjectItem(json, "metadata_file")) && cJSON_IsString(item)) {
-        app->metadata_file = why_strdup(item->valuestring);
+    why_fclose(fp);
+
+    *len = file_size;
+    return data;
+}
+
+static bool index_store(void *context, void const *data, size_t len) {
+    char *path = location_file(context, NULL);
+    if (!path)
+        return false;
+
+    FILE *fp = why_fopen(path, "w");
+    why_free(path);
+    if (!fp)
+        return false;
+
+    bool success = why_fwrite(data, 1, len, fp) == len;
+    return why_fclose(fp) == 0 && success;
+}
+
+static bool index_scan(void *context, app_index_t *index) {
+    app_location_t *location = context;
+
+    ESP_LOGI(TAG, "Rebuilding the application index of %s", location->dir);
+    DIR *dir = why_opendir(location->dir);
+    if (!dir)
+        return false;
+
+    bool           success = true;
+    struct dirent *entry;
+    while (success && (entry = why_readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 5 || strcmp(entry->d_name + len - 5, ".json") != 0)
+            continue;
+
+        char *path = path_fileconcat(location->dir, entry->d_name);
+        if (!path) {
+            success = false;
+            break;
+        }
+
+        cJSON *json = load_json(path);
+        why_free(path);
+        if (!json)
+            continue;
+
+        // Applications are looked up by their file name
+        app_index_entry_t app_entry;
+        json_to_entry(json, &app_entry);
+        entry->d_name[len - 5]                         = '\0';
+        app_entry.strings[APP_INDEX_UNIQUE_IDENTIFIER] = entry->d_name;
+
+        success = app_index_put(index, &app_entry);
+        cJSON_Delete(json);
     }
-    if ((item = cJSON_GetObjectItem(json, "binary_path")) && cJSON_IsString(item)) {
-        app->binary_path = why_strdup(item->valuestring);
+
+    why_closedir(dir);
+    return success;
+}
+
+static app_index_ops_t const index_ops = {
+    .stamp = index_stamp,
+    .load  = index_load,
+    .store = index_store,
+    .scan  = index_scan,
+};
+
+// Takes the index lock, returns false if no location could be indexed
+static bool index_begin(void) {
+    bool any = false;
+
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    for (size_t i = 0; i < num_locations; ++i) {
+        any |= app_index_sync(&locations[i].index, &index_ops, &locations[i]);
     }
-    if ((item = cJSON_GetObjectItem(json, "source")) && cJSON_IsNumber(item)) {
-        *((application_source_t *)&app->source) = (application_source_t)item->valueint;
+    return any;
+}
+
+static void index_end(void) {
+    xSemaphoreGive(index_lock);
+}
+
+// Whether an earlier location hides this application
+static bool index_shadowed(size_t location, char const *unique_identifier) {
+    for (size_t i = 0; i < location; ++i) {
+        if (app_index_find(&locations[i].index, unique_identifier))
+            return true;
     }
+    return false;
+}
 
-    return app;
+// Brings the indices in line with the metadata file of one application after
+// it was written or deleted through the search list. Entry is what was written.
+static void index_update(char const *unique_identifier, app_index_entry_t const *entry) {
+    bool found = false;
+
+    for (size_t i = 0; i < num_locations; ++i) {
+        app_location_t *location = &locations[i];
+        if (!location->index.loaded)
+            continue;
+
+        char *path = location_file(location, unique_identifier);
+        if (!path)
+            continue;
+
+        struct stat st;
+        bool        exists  = why_stat(path, &st) == 0;
+        bool        changed = false;
+        bool        failed  = false;
+        why_free(path);
+
+        if (!exists) {
+            changed = app_index_remove(&location->index, unique_identifier);
+        } else if (!found && entry) {
+            // The write landed in the first location that has the file
+            changed = true;
+            failed  = !app_index_put(&location->index, entry);
+        }
+        found |= exists;
+
+        if (failed) {
+            // Make the next lookup rescan rather than trust a stale index
+            app_index_clear(&location->index);
+            char *index_path = location_file(location, NULL);
+            if (index_path) {
+                why_unlink(index_path);
+                why_free(index_path);
+            }
+        } else if (changed) {
+            app_index_save(&location->index, &index_ops, location);
+        }
+    }
 }
 
 static bool save_application_metadata(application_t const *app) {
@@ -168,66 +420,46 @@ static bool save_application_metadata(application_t const *app) {
     }
 
     char *json_string = cJSON_Print(json);
-    cJSON_Delete(json);
-
     if (!json_string) {
+        cJSON_Delete(json);
         why_free(metadata_path);
         return false;
     }
 
-    FILE *fp = why_fopen(metadata_path, "w");
-    if (!fp) {
-        why_free(json_string);
-        why_free(metadata_path);
-        return false;
+    index_begin();
+    FILE *fp      = why_fopen(metadata_path, "w");
+    bool  success = fp != NULL;
+    if (fp) {
+        why_fputs(json_string, fp);
+        why_fclose(fp);
     }
 
-    why_fputs(json_string, fp);
-    why_fclose(fp);
+    app_index_entry_t entry;
+    json_to_entry(json, &entry);
+    index_update(app->unique_identifier, &entry);
+    index_end();
+
+    cJSON_Delete(json);
     why_free(json_string);
     why_free(metadata_path);
 
-    return true;
+    return success;
 }
 
 static application_t *load_application_metadata(char const *unique_identifier) {
     if (!unique_identifier)
         return NULL;
 
-    char *metadata_path = get_metadata_path(unique_identifier);
-    if (!metadata_path)
-        return NULL;
-
-    FILE *fp = why_fopen(metadata_path, "r");
-    if (!fp) {
-        why_free(metadata_path);
-        return NULL;
-    }
-
-    why_fseek(fp, 0, SEEK_END);
-    long file_size = why_ftell(fp);
-    why_fseek(fp, 0, SEEK_SET);
-
-    char *content = why_malloc(file_size + 1);
-    if (!content) {
-        why_fclose(fp);
-        why_free(metadata_path);
-        return NULL;
+    application_t *app = NULL;
+    index_begin();
+    for (size_t i = 0; i < num_locations; ++i) {
+        app_index_entry_t const *entry = app_index_find(&locations[i].index, unique_identifier);
+        if (entry) {
+            app = entry_to_application(entry);
+            break;
+        }
     }
-
-    why_fread(content, 1, file_size, fp);
-    content[file_size] = '\0';
-    why_fclose(fp);
-    why_free(metadata_path);
-
-    cJSON *json = cJSON_Parse(content);
-    why_free(content);
-
-    if (!json)
-        return NULL;
-
-    application_t *app = json_to_application(json);
-    cJSON_Delete(json);
+    index_end();
 
     return app;
 }
@@ -240,6 +472,27 @@ bool application_init(char const *applications_dir, char const *flash_dir, char
     strncpy(applications_base_dir, applications_dir, MAX_PATH_LEN - 1);
     applications_base_dir[MAX_PATH_LEN - 1] = '\0';
 
+    if (!index_lock) {
+        index_lock = xSemaphoreCreateMutex();
+    }
+
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    for (size_t i = 0; i < num_locations; ++i) {
+        app_index_clear(&locations[i].index);
+        free(locations[i].dir);
+    }
+
+    logical_name_result_t lname = logical_name_resolve_const(applications_base_dir, 0);
+    size_t                count = lname.result_count < MAX_LOCATIONS ? lname.result_count : MAX_LOCATIONS;
+    for (num_locations = 0; num_locations < count; ++num_locations) {
+        // Keeps the resolved string
+        locations[num_locations].dir = lname.result;
+        app_index_init(&locations[num_locations].index);
+        lname = logical_name_resolve_const(applications_base_dir, num_locations + 1);
+    }
+    logical_name_result_free(lname);
+    xSemaphoreGive(index_lock);
+
     if (flash_dir) {
         mkdir_p(flash_dir);
     }
@@ -396,6 +649,16 @@ bool application_destroy(application_t *app) {
         ESP_LOGW(TAG, "No valid app_dir for %s\n", app->unique_identifier);
     }
 
+    // Without its metadata the application is no longer listed
+    char *metadata_path = get_metadata_path(unique_id);
+    if (success && metadata_path) {
+        index_begin();
+        why_unlink(metadata_path);
+        index_update(unique_id, NULL);
+        index_end();
+    }
+    why_free(metadata_path);
+
     return success;
 }
 
@@ -449,62 +712,51 @@ application_list_handle application_list(application_t **out) {
     if (!applications_base_dir[0])
         return NULL;
 
-    DIR *dir = why_opendir(applications_base_dir);
-    if (!dir) {
-        ESP_LOGW(TAG, "Unable to opendir(%s)", applications_base_dir);
+    if (!index_begin()) {
+        index_end();
+        ESP_LOGW(TAG, "Unable to index %s", applications_base_dir);
         return NULL;
     }
 
     application_list_t *list = why_calloc(1, sizeof(application_list_t));
     if (!list) {
-        why_closedir(dir);
+        index_end();
         return NULL;
     }
 
-    // Count .json files first
-    struct dirent *entry;
-    size_t         json_count = 0;
-
-    while ((entry = why_readdir(dir)) != NULL) {
-        size_t len = strlen(entry->d_name);
-        if (len > 5 && strcmp(entry->d_name + len - 5, ".json") == 0) {
-            json_count++;
-        }
+    size_t app_count = 0;
+    for (size_t i = 0; i < num_locations; ++i) {
+        app_count += locations[i].index.count;
     }
 
-    if (json_count == 0) {
-        why_closedir(dir);
+    if (app_count == 0) {
+        index_end();
         if (out)
             *out = NULL;
         return list;
     }
 
-    list->applications = why_calloc(json_count, sizeof(application_t *));
+    list->applications = why_calloc(app_count, sizeof(application_t *));
     if (!list->applications) {
-        why_closedir(dir);
+        index_end();
         why_free(list);
         return NULL;
     }
 
-    why_rewinddir(dir);
-    while ((entry = why_readdir(dir)) != NULL && list->count < json_count) {
-        size_t len = strlen(entry->d_name);
-        if (len > 5 && strcmp(entry->d_name + len - 5, ".json") == 0) {
-            char *unique_id = why_malloc(len - 4);
-            if (unique_id) {
-                strncpy(unique_id, entry->d_name, len - 5);
-                unique_id[len - 5] = '\0';
-
-                application_t *app = load_application_metadata(unique_id);
-                if (app) {
-                    list->applications[list->count++] = app;
-                }
-                why_free(unique_id);
+    for (size_t i = 0; i < num_locations; ++i) {
+        app_index_t const *index = &locations[i].index;
+        for (size_t j = 0; j < index->count; ++j) {
+            if (index_shadowed(i, index->entries[j].strings[APP_INDEX_UNIQUE_IDENTIFIER]))
+                continue;
+
+            application_t *app = entry_to_application(&index->entries[j]);
+            if (app) {
+                list->applications[list->count++] = app;
             }
         }
     }
 
-    why_closedir(dir);
+    index_end();
 
     if (out && list->count > 0) {
         *out = list->applications[0];
@@ -23,14 +23,58 @@
 #define FRAMEBUFFER_MAX_REFRESH 60
 #define FRAMEBUFFER_BPP         2 // 16 bits per pixel
 
+// The panel drops to this refresh rate when nothing changed on screen for a
+// while, which leaves more PSRAM bandwidth to applications
+#define FRAMEBUFFER_IDLE_REFRESH    30
+#define FRAMEBUFFER_IDLE_TIMEOUT_MS 500
+
 #define FRAMEBUFFER_BYTES (FRAMEBUFFER_MAX_W * FRAMEBUFFER_MAX_W * FRAMEBUFFER_BPP)
 
-// Maximum number of pending events for a window
-#define WINDOW_MAX_EVENTS 10
+// Pending events a window can hold by default, and at most, see
+// window_event_queue_depth_set()
+#define WINDOW_DEFAULT_EVENTS 32
+#define WINDOW_MAX_EVENTS     64
 
 // Maximum windows allowed on the screen
 #define MAX_WINDOWS 10
 
+// Drop processes whose windows are all covered below normal priority
+#define SCHED_THROTTLE_OCCLUDED true
+
+// PSRAM the compositor expands 8 bit windows into a band at a time before the
+// PPA scales them, larger bands take fewer PPA operations
+#define COMPOSITOR_EXPAND_STRIP_BYTES (64 * 1024)
+
+// Default number of panel framebuffers, 2 or 3. Overridden on boot by
+// framebuffers in the [display] table of init.toml, set it in SD0:init.toml
+// since FLASH0:init.toml is rewritten from the firmware on every boot.
 #define DISPLAY_FRAMEBUFFERS 3
 
+// GPIO the TCA8418 INT line is connected to, -1 to poll the keyboard instead
+#define KEYBOARD_INT_PIN          -1
+#define KEYBOARD_POLL_INTERVAL_MS 10
+#define KEYBOARD_REPEAT_DELAY_MS  500
+#define KEYBOARD_REPEAT_RATE_MS   40
+
+// How often the BMI270 FIFO is emptied while streaming, and the highest
+// sample rate streams get. At 800Hz the FIFO reads take a quarter of the bus.
+#define IMU_STREAM_POLL_MS 20
+#define IMU_STREAM_MAX_HZ  800
+#define IMU_I2C_FREQ_HZ    400 * 1000
+
+// When fatfs devices sync written files, see drivers/writeback.h. Files kept
+// open are synced this long after they were first written.
+#define FATFS_FLASH_WRITEBACK     WRITEBACK_DEFERRED
+#define FATFS_SD_WRITEBACK        WRITEBACK_DEFERRED
+#define FATFS_WRITEBACK_WINDOW_MS 2000
+
+// PSRAM each fatfs device caches sectors in, see drivers/block_cache.h, and the
+// most a sequential read fetches ahead in one transfer
+#define FATFS_CACHE_BYTES     (256 * 1024)
+#define FATFS_READAHEAD_BYTES (32 * 1024)
+
+// Most PSRAM the RAM0: scratch filesystem can hold, taken as files grow
+#define RAMDISK_MAX_BYTES (8 * 1024 * 1024)
+
 #define I2C0_MASTER_FREQ_HZ 100 * 1000 // i2c bus speed for the i2c bus on the carrier board, being I2C_NUM_0
+#define I2C_MAX_FREQ_HZ     400 * 1000 // Fastest speed a device on the bus can ask for
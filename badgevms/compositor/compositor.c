@@ -23,16 +23,25 @@
 #include "badgevms/process.h"
 #include "badgevms_config.h"
 #include "compositor_private.h"
+#include "compositor_stats.h"
+#include "display_buffers.h"
 #include "driver/ppa.h"
 #include "esp_cache.h"
+#include "esp_heap_caps.h"
 #include "esp_ipc.h"
 #include "esp_log.h"
 #include "esp_private/esp_cache_private.h"
+#include "esp_timer.h"
+#include "event_queue.h"
 #include "font.h"
 #include "memory.h"
+#include "pixel_expand.h"
 #include "pixel_functions.h"
+#include "refresh_policy.h"
 #include "task.h"
 #include "window_decorations.h"
+#include "window_transaction.h"
+#include "yuv.h"
 
 #include <stdatomic.h>
 
@@ -48,19 +57,39 @@
         y              = SWAP;                                                                                         \
     } while (0)
 
-static TaskHandle_t  compositor_handle;
-static lcd_device_t *lcd_device;
-static device_t     *keyboard_device;
+static TaskHandle_t       compositor_handle;
+static lcd_device_t      *lcd_device;
+static keyboard_device_t *keyboard_device;
 
 static window_t     *window_stack = NULL;
 static QueueHandle_t compositor_queue;
 
-static int        cur_fb = 0;
-static atomic_int cur_num_windows;
-static uint16_t  *framebuffers[DISPLAY_FRAMEBUFFERS];
-
-static int  background_damaged    = 7;
-static int  decoration_damaged    = 7;
+static int               cur_fb = 0;
+static atomic_int        cur_num_windows;
+static uint16_t         *framebuffers[DISPLAY_BUFFERS_MAX];
+static display_buffers_t display_buffers;
+static int               display_fb_mask;
+
+static region_t background;
+static uint16_t rgb332_lut[PIXEL_EXPAND_LUT_SIZE];
+
+// 8 bit windows are expanded into this a band at a time for the PPA
+#define EXPAND_STRIP_PIXELS (COMPOSITOR_EXPAND_STRIP_BYTES / sizeof(uint16_t))
+static uint16_t *expand_strip;
+static size_t    expand_strip_alignment;
+
+static frame_ring_t frame_ring;
+static atomic_uint  stat_frames;
+static atomic_uint  stat_missed_refreshes;
+static atomic_uint  pending_refreshes;
+static atomic_uint  refresh_time_us; // Low bits of esp_timer_get_time() at the last refresh
+static atomic_int   stat_refresh_rate = FRAMEBUFFER_MAX_REFRESH;
+static atomic_uint  stat_ppa_ops;
+static atomic_uint  stat_fps;
+static atomic_bool  fps_overlay;
+
+static int  background_damaged    = (1 << DISPLAY_BUFFERS_MAX) - 1;
+static int  decoration_damaged    = (1 << DISPLAY_BUFFERS_MAX) - 1;
 static bool visible_regions_valid = false;
 
 typedef enum {
@@ -69,6 +98,8 @@ typedef enum {
     WINDOW_FLAGS,
     WINDOW_MOVE,
     WINDOW_RESIZE,
+    WINDOW_FRAMEBUFFER_RESIZE,
+    WINDOW_TRANSACTION,
     FRAMEBUFFER_SWAP
 } compositor_command_t;
 
@@ -80,6 +111,7 @@ typedef struct {
     window_size_t          size;
     managed_framebuffer_t *fb_a;
     managed_framebuffer_t *fb_b;
+    window_transaction_t  *transaction;
     TaskHandle_t           caller;
 } compositor_message_t;
 
@@ -88,16 +120,50 @@ rotation_angle_t rotation = ROTATION_ANGLE_270;
 #define WINDOW_MAX_W (FRAMEBUFFER_MAX_W - (2 * BORDER_PX) - SIDE_BAR_PX)
 #define WINDOW_MAX_H (FRAMEBUFFER_MAX_H - BORDER_TOP_PX - TOP_BAR_PX)
 
-#define ALL_DISPLAY_FB_MASK 7 // (1 + 2 + 4)
+#define STATS_SAMPLE_INTERVAL_US 1000000
+
+// A finished frame is only handed to the panel straight away while the
+// refresh in progress is this far from done, otherwise it waits for the next
+// refresh. Too close to the end the panel might already have picked its next
+// buffer and we would lose track of which one it reads.
+#define DISPLAY_SUBMIT_MARGIN_US 2000
 
 #define WINDOW_MOVE_STEP          10
 #define WINDOW_COMMANDS_PER_FRAME 5
-#define KEYBOARD_EVENTS_PER_FRAME 10
+#define KEYBOARD_EVENTS_PER_READ  10
+
+// Notification bits the compositor task wakes up on
+#define COMPOSITOR_WAKE_REFRESH (1 << 0)
+#define COMPOSITOR_WAKE_INPUT   (1 << 1)
+
+// Focus or visibility may have changed, let the kernel reclassify the window owners
+static void update_sched_classes(void) {
+    sched_window_t windows[MAX_WINDOWS];
+    int            num_windows = 0;
+
+    if (window_stack) {
+        window_t *window = window_stack;
+        do {
+            task_info_t *task_info = (task_info_t *)atomic_load(&window->task_info);
+            if (task_info && num_windows < MAX_WINDOWS) {
+                windows[num_windows++] = (sched_window_t){
+                    .pid          = task_info->pid,
+                    .focused      = window == window_stack,
+                    .visible      = !region_is_empty(&window->visible),
+                    .low_priority = window->flags & WINDOW_FLAG_LOW_PRIORITY,
+                };
+            }
+            window = window->next;
+        } while (window != window_stack);
+    }
+
+    task_sched_classes_update(windows, num_windows);
+}
 
 static inline void mark_scene_damaged(void) {
     visible_regions_valid = false;
-    decoration_damaged    = ALL_DISPLAY_FB_MASK;
-    background_damaged    = ALL_DISPLAY_FB_MASK;
+    decoration_damaged    = display_fb_mask;
+    background_damaged    = display_fb_mask;
 }
 
 __attribute__((always_inline)) static inline ppa_srm_rotation_angle_t rotation_to_srm(rotation_angle_t rotation) {
@@ -205,80 +271,88 @@ __attribute__((always_inline)) static inline bool is_problematic_block_height(in
     return false;
 }
 
-__attribute__((always_inline)) static inline bool ppa_workaround_split_rects(rect_array_t *visible, float scale) {
-    rect_array_t new_visible = {0};
-    bool         split       = false;
+#define PPA_SPLIT_MAX_RECTS 4
 
-    for (int i = 0; i < visible->count; i++) {
-        window_rect_t rect = visible->rects[i];
+// Returns the number of pieces written to out
+__attribute__((always_inline)) static inline int
+    ppa_workaround_split_rect(window_rect_t rect, float scale, window_rect_t out[PPA_SPLIT_MAX_RECTS]) {
+    int count    = 0;
+    out[count++] = rect;
 
-        if (is_problematic_block_height(rect.h, scale)) {
-            split           = true;
-            int first_half  = (rect.h / 2) - 1;
-            int second_half = rect.h - first_half;
-            ESP_LOGW(TAG, "Splitting block of problematic height %u in %u and %u", rect.h, first_half, second_half);
+    for (int i = 0; i < count; i++) {
+        while (count < PPA_SPLIT_MAX_RECTS && is_problematic_block_height(out[i].h, scale)) {
+            int first_half  = (out[i].h / 2) - 1;
+            int second_half = out[i].h - first_half;
+            ESP_LOGW(TAG, "Splitting block of problematic height %u in %u and %u", out[i].h, first_half, second_half);
 
-            new_visible.rects[new_visible.count++] =
-                (window_rect_t){.x = rect.x, .y = rect.y, .w = rect.w, .h = first_half};
-
-            if (new_visible.count < MAX_VISIBLE_RECTS) {
-                new_visible.rects[new_visible.count++] =
-                    (window_rect_t){.x = rect.x, .y = rect.y + first_half, .w = rect.w, .h = second_half};
-            }
-        } else {
-            if (new_visible.count < MAX_VISIBLE_RECTS) {
-                new_visible.rects[new_visible.count++] = rect;
-            }
+            out[count++] =
+                (window_rect_t){.x = out[i].x, .y = out[i].y + first_half, .w = out[i].w, .h = second_half};
+            out[i].h = first_half;
         }
     }
 
-    *visible = new_visible;
-    return split;
+    return count;
+}
+
+__attribute__((always_inline)) static inline window_rect_t window_outer_rect(window_t *window) {
+    window_rect_t rect = window->rect;
+    if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
+        // Window decorations occlude as well
+        rect.w += (BORDER_PX * 2);
+        rect.h += BORDER_TOP_PX + BORDER_PX;
+    }
+    return rect;
 }
 
-void window_calculate_visible_regions(window_t *window, window_t *window_list_head, float scale) {
-    window->visible.count    = 1;
-    window->visible.rects[0] = window->rect;
+void window_calculate_visible_regions(window_t *window, window_t *window_list_head) {
+    window_rect_t content = window->rect;
 
     if (!(window->flags & WINDOW_FLAG_FULLSCREEN)) {
         // For occlusion we only care about our OWN content region
-        window->visible.rects[0].x += BORDER_PX;
-        window->visible.rects[0].y += BORDER_TOP_PX;
+        content.x += BORDER_PX;
+        content.y += BORDER_TOP_PX;
+    }
+
+    region_clear(&window->visible);
+    if (!region_union_rect(&window->visible, &window->visible, content)) {
+        ESP_LOGE(TAG, "Out of memory calculating visible region for window %p", window);
+        return;
     }
 
     window_t *occluder = window_list_head;
 
-    while (occluder != NULL && occluder != window) {
-        rect_array_t new_visible = {0};
+    while (occluder != NULL && occluder != window && !region_is_empty(&window->visible)) {
+        if (!region_subtract_rect(&window->visible, &window->visible, window_outer_rect(occluder))) {
+            ESP_LOGE(TAG, "Out of memory calculating visible region for window %p", window);
+        }
+        occluder = occluder->next;
+    }
+}
 
-        for (int j = 0; j < window->visible.count; j++) {
-            window_rect_t occluder_rect = occluder->rect;
-            if (!(occluder->flags & WINDOW_FLAG_FULLSCREEN)) {
-                // But other window decorations do occlude us
-                occluder_rect.w += (BORDER_PX * 2);
-                occluder_rect.h += BORDER_TOP_PX + BORDER_PX;
-            }
+// Everything not covered by a window with content gets the background pattern
+static void calculate_background_region(void) {
+    region_clear(&background);
+    region_union_rect(&background, &background, (window_rect_t){0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H});
 
-            small_rect_array_t pieces = rect_subtract(window->visible.rects[j], occluder_rect);
+    if (!window_stack) {
+        return;
+    }
 
-            for (int k = 0; k < pieces.count; k++) {
-                if (new_visible.count < MAX_VISIBLE_RECTS) {
-                    new_visible.rects[new_visible.count++] = pieces.rects[k];
-                }
-            }
+    window_t *window = window_stack;
+    do {
+        if (window->framebuffers[window->front_fb]) {
+            region_subtract_rect(&background, &background, window_outer_rect(window));
         }
+        window = window->next;
+    } while (window != window_stack && !region_is_empty(&background));
+}
 
-        window->visible = new_visible;
-
-        if (window->visible.count == 0) {
-            break;
+static void fill_background(uint16_t *fb) {
+    for (int i = 0; i < background.count; i++) {
+        window_rect_t rect = rotate_rect(background.rects[i], rotation);
+        for (int y = rect.y; y < rect.y + rect.h; y++) {
+            memset(&fb[y * FRAMEBUFFER_MAX_W + rect.x], 0xaa, rect.w * FRAMEBUFFER_BPP);
         }
-
-        occluder = occluder->next;
-    }
-
-    merge_rectangles(&window->visible);
-    while (ppa_workaround_split_rects(&window->visible, scale)) {
     }
 }
 
@@ -305,102 +379,173 @@ window_rect_t content_to_framebuffer_rect(window_rect_t content_rect, window_t *
     return fb_rect;
 }
 
-static void reassign_vaddr(uintptr_t new_vaddr_start, size_t num_pages, allocation_range_t *head) {
-    // we go backwards because we start from the highest address
-    // and don't forget our guard page
-    uintptr_t cur_vaddr_offset = new_vaddr_start + ((num_pages - 1) * SOC_MMU_PAGE_SIZE);
-
-    allocation_range_t *r = head;
-    while (r) {
-        cur_vaddr_offset -= r->size;
-        // ESP_LOGW(TAG, "Swapping vaddr %08lx with %08lx", r->vaddr_start, cur_vaddr_offset);
-        r->vaddr_start    = cur_vaddr_offset;
-        r                 = r->next;
-    }
+static void framebuffer_writeback(uintptr_t vaddr_start, size_t size) {
+    esp_cache_msync((void *)vaddr_start, size, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE);
 }
 
-static void framebuffer_swap(managed_framebuffer_t *fb_a, managed_framebuffer_t *fb_b) {
-    if (!fb_a || !fb_b || !fb_a->framebuffer.pixels || !fb_b->framebuffer.pixels) {
+// Swap the pages behind the fixed vaddrs of two framebuffers. Only the buffer
+// the application renders into can hold dirty cache lines, it is written back
+// and invalidated before its vaddr points at other pages. The other buffer is
+// only read by the PPA through DMA and needs no cache maintenance at all, so
+// written is false when neither buffer was touched by the CPU.
+static void framebuffer_swap(managed_framebuffer_t *back, managed_framebuffer_t *other, bool written) {
+    if (!back || !other || !back->framebuffer.pixels || !other->framebuffer.pixels) {
         return;
     }
 
-    // ESP_LOGV(TAG, "Attempting to swap framebuffers %p and %p", fb_a, fb_b);
+    // ESP_LOGV(TAG, "Attempting to swap framebuffers %p and %p", back, other);
 
-    esp_cache_msync(
-        fb_a->framebuffer.pixels,
-        fb_a->num_pages * SOC_MMU_PAGE_SIZE,
-        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
-    );
-    esp_cache_msync(
-        fb_b->framebuffer.pixels,
-        fb_b->num_pages * SOC_MMU_PAGE_SIZE,
-        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
-    );
+    if (written) {
+        framebuffer_writeback(back->pages.vaddr, back->pages.mapped * SOC_MMU_PAGE_SIZE);
+    }
 
-    framebuffer_unmap_pages(fb_a->head_pages);
-    framebuffer_unmap_pages(fb_b->head_pages);
+    if (back->pages.mapped == other->pages.mapped) {
+        // Both vaddr ranges stay fully mapped, rewrite the entries in place
+        framebuffer_pages_rebase(&back->pages, other->pages.vaddr);
+        framebuffer_pages_rebase(&other->pages, back->pages.vaddr);
+        framebuffer_swap_pages(back->pages.head, other->pages.head);
+    } else {
+        framebuffer_unmap_pages(back->pages.head);
+        framebuffer_unmap_pages(other->pages.head);
 
-    uintptr_t fb_a_vaddr = fb_a->tail_pages->vaddr_start;
-    uintptr_t fb_b_vaddr = fb_b->tail_pages->vaddr_start;
+        framebuffer_pages_rebase(&back->pages, other->pages.vaddr);
+        framebuffer_pages_rebase(&other->pages, back->pages.vaddr);
 
-    reassign_vaddr(fb_b_vaddr, fb_a->num_pages, fb_a->head_pages);
-    reassign_vaddr(fb_a_vaddr, fb_b->num_pages, fb_b->head_pages);
+        framebuffer_map_pages(back->pages.head, back->pages.tail);
+        framebuffer_map_pages(other->pages.head, other->pages.tail);
+    }
 
-    // Caches are already invalidated
-    framebuffer_map_pages(fb_a->head_pages, fb_a->tail_pages);
-    framebuffer_map_pages(fb_b->head_pages, fb_b->tail_pages);
+    // Keep each page list describing what is mapped at its own vaddr
+    framebuffer_pages_exchange(&back->pages, &other->pages);
 }
 
-framebuffer_t *framebuffer_allocate(uint32_t w, uint32_t h, pixel_format_t format) {
+__attribute__((always_inline)) static inline bool framebuffer_is_8bpp(managed_framebuffer_t const *framebuffer) {
+    return framebuffer->format == BADGEVMS_PIXELFORMAT_INDEX8 || framebuffer->format == BADGEVMS_PIXELFORMAT_RGB332;
+}
+
+// Content rows of rect whose framebuffer rows fit in the expansion strip. The
+// rows of a band can round up by one, hence the spare row.
+static int expand_band_height(window_rect_t rect, window_t *window, float scale) {
+    window_rect_t fb_rect = content_to_framebuffer_rect(rect, window, scale);
+    int           rows    = (int)(EXPAND_STRIP_PIXELS / MAX(fb_rect.w, 1)) - 1;
+
+    return MAX(1, MIN(rect.h, (int)(rows * scale)));
+}
+
+// Expand the block of an 8 bit frame the PPA is about to read into the strip.
+// Only extreme downscaling can need more rows than fit, those are dropped.
+static void window_expand_strip(window_t *window, managed_framebuffer_t *framebuffer, window_rect_t *fb_rect) {
+    uint16_t const *lut = window->palette ? window->palette : rgb332_lut;
+    uint8_t const  *src = (uint8_t const *)framebuffer->framebuffer.pixels + fb_rect->y * framebuffer->w + fb_rect->x;
+
+    fb_rect->h = MIN(fb_rect->h, (int)(EXPAND_STRIP_PIXELS / fb_rect->w));
+    expand_8bpp_rect(expand_strip, src, framebuffer->w, fb_rect->w, fb_rect->h, lut);
+
+    size_t bytes = fb_rect->w * fb_rect->h * sizeof(uint16_t);
+    bytes        = (bytes + expand_strip_alignment - 1) & ~(expand_strip_alignment - 1);
+    esp_cache_msync(expand_strip, bytes, ESP_CACHE_MSYNC_FLAG_DIR_C2M);
+}
+
+// YUV frames are converted by the PPA in one pass over the whole frame. Visible
+// regions and the split workaround produce blocks at odd offsets, which YUV
+// input can't express, so the blits that follow read the shadow instead.
+static bool window_convert_yuv_shadow(window_t *window, managed_framebuffer_t *framebuffer, ppa_client_handle_t ppa) {
+    managed_framebuffer_t *shadow = window->shadow;
+    ppa_srm_color_mode_t   mode   = PPA_SRM_COLOR_MODE_YUV420;
+
+    if (framebuffer->format == BADGEVMS_PIXELFORMAT_YUY2) {
+        mode = PPA_SRM_COLOR_MODE_YUV422;
+    }
+
+    ppa_srm_oper_config_t oper_config = {
+        .in.buffer    = framebuffer->framebuffer.pixels,
+        .in.pic_w     = framebuffer->w,
+        .in.pic_h     = framebuffer->h,
+        .in.block_w   = framebuffer->w,
+        .in.block_h   = framebuffer->h,
+        .in.srm_cm    = mode,
+        .in.yuv_range = PPA_COLOR_RANGE_LIMIT,
+        .in.yuv_std   = PPA_COLOR_CONV_STD_RGB_YUV_BT601,
+
+        .out.buffer      = shadow->framebuffer.pixels,
+        .out.buffer_size = shadow->pages.mapped * SOC_MMU_PAGE_SIZE,
+        .out.pic_w       = shadow->w,
+        .out.pic_h       = shadow->h,
+        .out.srm_cm      = PPA_SRM_COLOR_MODE_RGB565,
+
+        .rotation_angle = PPA_SRM_ROTATION_ANGLE_0,
+        .scale_x        = 1,
+        .scale_y        = 1,
+        .mode           = PPA_TRANS_MODE_BLOCKING,
+    };
+
+    esp_err_t result = ppa_do_scale_rotate_mirror(ppa, &oper_config);
+    if (result != ESP_OK) {
+        ESP_LOGW(TAG, "YUV conversion for window %p failed: %s", window, esp_err_to_name(result));
+        return false;
+    }
+    return true;
+}
+
+static framebuffer_page_ops_t const framebuffer_page_ops = {
+    .vaddr_allocate   = framebuffer_vaddr_allocate,
+    .vaddr_deallocate = framebuffer_vaddr_deallocate,
+    .pages_allocate   = pages_allocate,
+    .pages_deallocate = pages_deallocate,
+    .map              = framebuffer_map_pages,
+    .unmap            = framebuffer_unmap_pages,
+    .writeback        = framebuffer_writeback,
+};
+
+static size_t framebuffer_format_size(pixel_format_t *format, uint32_t w, uint32_t h) {
     // Don't use BADGEVMS_BYTESPERPIXEL here because we also want to
     // clamp the pixel formats we want to support here anyway
-
-    short framebuffer_bpp = 2;
-    switch (format) {
+    switch (*format) {
         case BADGEVMS_PIXELFORMAT_BGRA8888: // fallthrough
         case BADGEVMS_PIXELFORMAT_RGBA8888: // fallthrough
         case BADGEVMS_PIXELFORMAT_ARGB8888: // fallthrough
-        case BADGEVMS_PIXELFORMAT_ABGR8888: framebuffer_bpp = 4; break;
+        case BADGEVMS_PIXELFORMAT_ABGR8888: return w * h * 4;
         case BADGEVMS_PIXELFORMAT_RGB565: // fallthrough
-        case BADGEVMS_PIXELFORMAT_BGR565: break;
-        default: format = BADGEVMS_PIXELFORMAT_RGB565;
+        case BADGEVMS_PIXELFORMAT_BGR565: return w * h * 2;
+        case BADGEVMS_PIXELFORMAT_INDEX8: // fallthrough
+        case BADGEVMS_PIXELFORMAT_RGB332: return w * h;
+        case BADGEVMS_PIXELFORMAT_OUYY_EVYY: // fallthrough
+        case BADGEVMS_PIXELFORMAT_YUY2: return yuv_frame_size(*format, w, h);
+        default: *format = BADGEVMS_PIXELFORMAT_RGB565; return w * h * 2;
     }
+}
 
-    size_t    num_pages        = 0;
-    size_t    framebuffer_size = (w * h * framebuffer_bpp) + SOC_MMU_PAGE_SIZE;
-    uintptr_t vaddr_start      = framebuffer_vaddr_allocate(framebuffer_size, &num_pages);
+// YUV can't be blitted at arbitrary offsets, so it is converted into a shadow
+// framebuffer first. 8 bit formats go through the expansion strip instead.
+static pixel_format_t framebuffer_shadow_format(pixel_format_t format) {
+    switch (format) {
+        case BADGEVMS_PIXELFORMAT_OUYY_EVYY: // fallthrough
+        case BADGEVMS_PIXELFORMAT_YUY2: return BADGEVMS_PIXELFORMAT_BGR565; // What the PPA writes
+        default: return BADGEVMS_PIXELFORMAT_UNKNOWN;
+    }
+}
 
-    if (!vaddr_start) {
-        ESP_LOGE(TAG, "No vaddr space for frame buffer");
+framebuffer_t *framebuffer_allocate(uint32_t w, uint32_t h, pixel_format_t format) {
+    if (!yuv_align_size(format, &w, &h)) {
+        ESP_LOGE(TAG, "Frame buffer too small for pixel format %08x", format);
         return NULL;
     }
 
+    size_t framebuffer_size = framebuffer_format_size(&format, w, h);
+
     managed_framebuffer_t *framebuffer = calloc(1, sizeof(managed_framebuffer_t));
     if (!framebuffer) {
         ESP_LOGE(TAG, "No kernel RAM for frame buffer container");
-        framebuffer_vaddr_deallocate(vaddr_start);
         return NULL;
     }
 
-    allocation_range_t *tail_range = NULL;
-    if (!pages_allocate(vaddr_start, num_pages - 1, &framebuffer->head_pages, &framebuffer->tail_pages)) {
-        ESP_LOGE(TAG, "No physical memory pages for frame buffer");
-        framebuffer_vaddr_deallocate(vaddr_start);
+    if (!framebuffer_pages_init(&framebuffer->pages, framebuffer_size, &framebuffer_page_ops)) {
+        ESP_LOGE(TAG, "No vaddr space or physical memory pages for frame buffer");
         free(framebuffer);
         return NULL;
     }
 
-    ESP_LOGI(
-        TAG,
-        "Attempting to map our vaddr %p head_range %p tail_range %p",
-        (void *)framebuffer->head_pages->vaddr_start,
-        framebuffer->head_pages,
-        tail_range
-    );
-
-    framebuffer_map_pages(framebuffer->head_pages, framebuffer->tail_pages);
-    framebuffer->framebuffer.pixels = (uint16_t *)vaddr_start;
-
+    framebuffer->framebuffer.pixels = (uint16_t *)framebuffer->pages.vaddr;
     framebuffer->framebuffer.w      = w;
     framebuffer->framebuffer.h      = h;
     framebuffer->framebuffer.format = format;
@@ -408,17 +553,18 @@ framebuffer_t *framebuffer_allocate(uint32_t w, uint32_t h, pixel_format_t forma
     framebuffer->w                  = w;
     framebuffer->h                  = h;
     framebuffer->format             = format;
-    framebuffer->num_pages          = num_pages;
     atomic_flag_test_and_set(&framebuffer->clean);
 
-    memset(framebuffer->framebuffer.pixels, 0, (w * h * framebuffer_bpp));
+    memset(framebuffer->framebuffer.pixels, 0, framebuffer_size);
+    // Swaps only write back the application's buffer, don't leave dirty lines behind
+    framebuffer_writeback(framebuffer->pages.vaddr, framebuffer->pages.mapped * SOC_MMU_PAGE_SIZE);
 
     ESP_LOGW(
         TAG,
         "Allocated framebuffer at %p, pixels at %p, size %zi, dimensions %u x %u",
         framebuffer,
         framebuffer->framebuffer.pixels,
-        num_pages,
+        framebuffer->pages.mapped,
         framebuffer->framebuffer.w,
         framebuffer->framebuffer.h
     );
@@ -428,144 +574,270 @@ framebuffer_t *framebuffer_allocate(uint32_t w, uint32_t h, pixel_format_t forma
 
 void framebuffer_free(managed_framebuffer_t *framebuffer) {
     if (framebuffer) {
-        framebuffer_unmap_pages(framebuffer->head_pages);
-        pages_deallocate(framebuffer->head_pages);
-        framebuffer_vaddr_deallocate((uintptr_t)framebuffer->framebuffer.pixels);
-
+        framebuffer_pages_free(&framebuffer->pages, &framebuffer_page_ops);
         free(framebuffer);
     }
 }
 
-IRAM_ATTR static void on_refresh(void *ignored) {
-    xTaskNotifyGiveIndexed(compositor_handle, 0);
-}
+// Resize every framebuffer of a window between two frames, reusing the pages
+// that are already mapped. Either all framebuffers are resized or none are.
+static void window_apply_framebuffer_resize(window_t *window, window_size_t size) {
+    managed_framebuffer_t *first = window->framebuffers[0];
 
-// static bool IRAM_ATTR ppa_srm_callback(ppa_client_handle_t ppa_client, ppa_event_data_t *event_data, void *user_data)
-// {
-//     xTaskNotifyGiveIndexed(compositor_handle, 0);
-//     return true;
-// }
+    if (!first) {
+        return;
+    }
 
-static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
-    static ppa_client_handle_t ppa_srm_handle = NULL;
+    // Same limits as window_framebuffer_allocate() and framebuffer_allocate()
+    size.w = size.w > FRAMEBUFFER_MAX_W ? FRAMEBUFFER_MAX_W : size.w;
+    size.h = size.h > FRAMEBUFFER_MAX_H ? FRAMEBUFFER_MAX_H : size.h;
+    size   = window_clamp_size(window, size);
 
-    ppa_client_config_t ppa_srm_config = {
-        .oper_type             = PPA_OPERATION_SRM,
-        .max_pending_trans_num = 1,
-    };
+    uint32_t w = size.w;
+    uint32_t h = size.h;
+    if (!yuv_align_size(first->format, &w, &h) || ((int)w == first->w && (int)h == first->h)) {
+        return;
+    }
+    size = (window_size_t){.w = w, .h = h};
 
-    // ppa_event_callbacks_t srm_callbacks = {
-    //     .on_trans_done = ppa_srm_callback,
-    // };
+    managed_framebuffer_t *targets[WINDOW_FRAMEBUFFERS + 1];
+    int                    num_targets = 0;
+    int                    done        = 0;
 
-    ppa_register_client(&ppa_srm_config, &ppa_srm_handle);
-    // ppa_client_register_event_callbacks(ppa_srm_handle, &srm_callbacks);
+    for (int i = 0; i < WINDOW_FRAMEBUFFERS && window->framebuffers[i]; ++i) {
+        targets[num_targets++] = window->framebuffers[i];
+    }
+    if (window->shadow) {
+        targets[num_targets++] = window->shadow;
+    }
 
-    bool   fn_down               = false;
-    bool   frame_ready           = false;
-    time_t launcher_last_started = time(NULL);
+    if (window->mailbox_lock) {
+        xSemaphoreTake(window->mailbox_lock, portMAX_DELAY);
+    }
 
-    while (1) {
-        bool changes   = false;
-        int  processed = 0;
-        ulTaskNotifyTakeIndexed(0, pdTRUE, portMAX_DELAY);
+    for (; done < num_targets; ++done) {
+        managed_framebuffer_t *framebuffer = targets[done];
+        pixel_format_t         format      = framebuffer->format;
+        size_t                 old_mapped  = framebuffer->pages.mapped;
 
-        if (frame_ready) {
-            lcd_device->_draw(lcd_device, 0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H, framebuffers[cur_fb]);
-            cur_fb      = (cur_fb + 1) % DISPLAY_FRAMEBUFFERS;
-            frame_ready = false;
+        framebuffer_resize_t result = framebuffer_pages_resize(
+            &framebuffer->pages,
+            framebuffer_format_size(&format, size.w, size.h),
+            &framebuffer_page_ops
+        );
+        if (result == FRAMEBUFFER_RESIZE_FAILED) {
+            ESP_LOGW(TAG, "Unable to resize framebuffer %i for window %p", done, window);
+            break;
         }
 
-        if (!window_stack) {
-            time_t current_time = time(NULL);
-            if (current_time - launcher_last_started > 2) {
-                application_launch("badgevms_launcher");
-                launcher_last_started = current_time;
-            }
+        framebuffer->framebuffer.pixels = (uint16_t *)framebuffer->pages.vaddr;
+        if (result == FRAMEBUFFER_RESIZE_GREW || result == FRAMEBUFFER_RESIZE_RELOCATED) {
+            // Fresh pages may still hold another process's data
+            uintptr_t fresh = framebuffer->pages.vaddr + old_mapped * SOC_MMU_PAGE_SIZE;
+            size_t    len   = (framebuffer->pages.mapped - old_mapped) * SOC_MMU_PAGE_SIZE;
+            memset((void *)fresh, 0, len);
+            framebuffer_writeback(fresh, len);
         }
+    }
 
-        compositor_message_t message;
+    if (done < num_targets) {
+        // Only growing can fail, so shrinking the others back always works
+        for (int i = 0; i < done; ++i) {
+            pixel_format_t format = targets[i]->format;
+            size_t         bytes  = framebuffer_format_size(&format, targets[i]->w, targets[i]->h);
+            framebuffer_pages_resize(&targets[i]->pages, bytes, &framebuffer_page_ops);
+        }
+    } else {
+        for (int i = 0; i < num_targets; ++i) {
+            targets[i]->framebuffer.w = size.w;
+            targets[i]->framebuffer.h = size.h;
+            targets[i]->w             = size.w;
+            targets[i]->h             = size.h;
+        }
+        atomic_flag_clear(&window->framebuffers[window->front_fb]->clean);
+        window->fb_dirty = display_fb_mask;
+        mark_scene_damaged();
+    }
 
-        while (xQueueReceive(compositor_queue, &message, 0) == pdTRUE) {
-            ++processed;
-            switch (message.command) {
-                case WINDOW_CREATE:
-                    push_window(message.window);
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_DESTROY:
-                    remove_window(message.window);
-                    vQueueDelete(message.window->event_queue);
+    if (window->mailbox_lock) {
+        xSemaphoreGive(window->mailbox_lock);
+    }
+}
 
-                    for (int i = 0; i < 2; ++i) {
-                        ESP_LOGW(TAG, "Destroying framebuffer %u for window %p", i, message.window);
-                        framebuffer_free(message.window->framebuffers[i]);
-                    }
+static void window_apply_flags(window_t *window, window_flag_t flags) {
+    // Preserve the buffering flags, the framebuffers were allocated for them
+    window_flag_t buffering  = window->flags & (WINDOW_FLAG_DOUBLE_BUFFERED | WINDOW_FLAG_TRIPLE_BUFFERED);
+    flags                   &= ~(WINDOW_FLAG_DOUBLE_BUFFERED | WINDOW_FLAG_TRIPLE_BUFFERED);
+    flags                   |= buffering;
 
-                    free(message.window->title);
-                    free(message.window);
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_FLAGS:
-                    // Preserve the double buffered flag
-                    bool double_buffered  = message.window->flags & WINDOW_FLAG_DOUBLE_BUFFERED;
-                    message.flags        &= ~WINDOW_FLAG_DOUBLE_BUFFERED;
-                    if (double_buffered) {
-                        message.flags |= WINDOW_FLAG_DOUBLE_BUFFERED;
-                    }
+    if (window->flags & WINDOW_FLAG_FULLSCREEN) {
+        if (!(flags & WINDOW_FLAG_FULLSCREEN)) {
+            window->rect = window->rect_orig;
+        }
+    } else {
+        if (flags & WINDOW_FLAG_FULLSCREEN) {
+            window->rect_orig = window->rect;
+            window->rect.x    = 0;
+            window->rect.y    = 0;
+            window->rect.w    = FRAMEBUFFER_MAX_W;
+            window->rect.h    = FRAMEBUFFER_MAX_H;
+        }
+    }
+    window->flags = flags;
+    mark_scene_damaged();
+}
 
-                    if (message.window->flags & WINDOW_FLAG_FULLSCREEN) {
-                        if (!(message.flags & WINDOW_FLAG_FULLSCREEN)) {
-                            message.window->rect = message.window->rect_orig;
-                        }
-                    } else {
-                        if (message.flags & WINDOW_FLAG_FULLSCREEN) {
-                            message.window->rect_orig = message.window->rect;
-                            message.window->rect.x    = 0;
-                            message.window->rect.y    = 0;
-                            message.window->rect.w    = FRAMEBUFFER_MAX_W;
-                            message.window->rect.h    = FRAMEBUFFER_MAX_H;
-                        }
-                    }
-                    message.window->flags = message.flags;
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_MOVE:
-                    window_coords_t coords = window_clamp_position(message.window, message.coords);
-                    message.window->rect.x = coords.x;
-                    message.window->rect.y = coords.y;
-                    mark_scene_damaged();
-                    break;
-                case WINDOW_RESIZE:
-                    window_size_t size     = window_clamp_size(message.window, message.size);
-                    message.window->rect.w = size.w;
-                    message.window->rect.h = size.h;
-                    mark_scene_damaged();
-                    break;
-                case FRAMEBUFFER_SWAP: framebuffer_swap(message.fb_a, message.fb_b); break;
-                default: ESP_LOGE(TAG, "Unknown command %u", message.command);
-            }
+static void window_apply_move(window_t *window, window_coords_t coords) {
+    coords         = window_clamp_position(window, coords);
+    window->rect.x = coords.x;
+    window->rect.y = coords.y;
+    mark_scene_damaged();
+}
 
-            if (message.caller) {
-                if (eTaskGetState(message.caller) != eDeleted) {
-                    xTaskNotifyGiveIndexed(message.caller, 0);
-                }
-            }
+static void window_apply_resize(window_t *window, window_size_t size) {
+    size           = window_clamp_size(window, size);
+    window->rect.w = size.w;
+    window->rect.h = size.h;
+    mark_scene_damaged();
+}
 
-            if (processed > WINDOW_COMMANDS_PER_FRAME) {
-                break;
-            }
+__attribute__((always_inline)) static inline bool window_is_mailbox(window_t *window) {
+    return window->flags & WINDOW_FLAG_TRIPLE_BUFFERED && window->mailbox_lock;
+}
+
+// Application side of a triple buffered window. The finished frame replaces
+// whatever sits in the mailbox, this never waits for the compositor.
+static void window_mailbox_present(window_t *window) {
+    xSemaphoreTake(window->mailbox_lock, portMAX_DELAY);
+    if (mailbox_present(&window->mailbox)) {
+        atomic_fetch_add(&window->drops, 1);
+    }
+    framebuffer_swap(window->framebuffers[window->back_fb], window->framebuffers[window->mailbox_fb], true);
+    xSemaphoreGive(window->mailbox_lock);
+}
+
+// Compositor side, once per refresh. If the application is in the middle of
+// presenting we simply pick the frame up on the next refresh.
+static bool window_mailbox_latch(window_t *window) {
+    if (xSemaphoreTake(window->mailbox_lock, 0) != pdTRUE) {
+        return false;
+    }
+
+    bool latched = mailbox_latch(&window->mailbox);
+    if (latched) {
+        framebuffer_swap(window->framebuffers[window->mailbox_fb], window->framebuffers[window->front_fb], false);
+    }
+    xSemaphoreGive(window->mailbox_lock);
+
+    return latched;
+}
+
+static void window_present_account(window_t *window) {
+    atomic_fetch_add(&window->presents, 1);
+    if (window_is_mailbox(window)) {
+        // Drops are counted by the mailbox itself
+        return;
+    }
+
+    if (atomic_exchange(&window->frame_pending, 1)) {
+        // The compositor never got to see the previous frame
+        atomic_fetch_add(&window->drops, 1);
+    }
+}
+
+// Staged presents count once their transaction is applied, aborted ones never
+static void window_apply_present(window_t *window) {
+    managed_framebuffer_t *front_buffer = window->framebuffers[window->front_fb];
+
+    if (!front_buffer) {
+        return;
+    }
+
+    window_present_account(window);
+    if (window_is_mailbox(window)) {
+        window_mailbox_present(window);
+        return;
+    }
+
+    if (window->flags & WINDOW_FLAG_DOUBLE_BUFFERED && window->framebuffers[1]) {
+        framebuffer_swap(window->framebuffers[window->back_fb], front_buffer, true);
+    }
+
+    atomic_flag_clear(&front_buffer->clean);
+}
+
+static void transaction_apply_op(transaction_op_t *op, void *ignored) {
+    window_t *window = op->window;
+
+    switch (op->type) {
+        case TRANSACTION_OP_MOVE: window_apply_move(window, op->coords); break;
+        case TRANSACTION_OP_RESIZE: window_apply_resize(window, op->size); break;
+        case TRANSACTION_OP_FLAGS: window_apply_flags(window, op->flags); break;
+        case TRANSACTION_OP_TITLE:
+            // The compositor takes ownership of the staged title
+            free(window->title);
+            window->title      = op->title;
+            op->title          = NULL;
+            decoration_damaged = display_fb_mask;
+            break;
+        case TRANSACTION_OP_PRESENT: window_apply_present(window); break;
+    }
+}
+
+static void draw_fps_overlay(uint16_t *fb, frame_record_t const *last_frame) {
+    char text[48];
+    snprintf(
+        text,
+        sizeof(text),
+        "FPS %u FRAME %luUS PPA %lu",
+        atomic_load(&stat_fps),
+        (unsigned long)last_frame->stage_us[COMPOSITOR_STAGE_FRAME],
+        (unsigned long)last_frame->ppa_ops
+    );
+
+    int width = strlen(text) * (FONT_WIDTH + 1) + 3;
+    draw_filled_rect_rotated(fb, 0, 0, width, FONT_HEIGHT + 4, 0x0000);
+    draw_text_rotated(fb, text, 2, 2, 0xFFFF);
+}
+
+// Once a second turn the frame and present counters into rates
+static void stats_sample_rates(int frames) {
+    atomic_store(&stat_fps, frames);
+
+    if (!window_stack) {
+        return;
+    }
+
+    window_t *window = window_stack;
+    do {
+        unsigned int presents = atomic_load(&window->presents);
+        atomic_store(&window->present_rate, presents - window->presents_sampled);
+        window->presents_sampled = presents;
+        window                   = window->next;
+    } while (window != window_stack);
+}
+
+// Hands keyboard input to the focused window, except for FN combinations and
+// ALT-TAB which are for the compositor itself. Returns the number of events.
+static int dispatch_keyboard_events(bool *fn_down) {
+    event_t events[KEYBOARD_EVENTS_PER_READ];
+    ssize_t res;
+    int     total = 0;
+
+    do {
+        res = keyboard_device->device._read(keyboard_device, 0, events, sizeof(event_t) * KEYBOARD_EVENTS_PER_READ);
+        if (res <= 0) {
+            break;
         }
+        total += res / sizeof(event_t);
 
-        event_t events[KEYBOARD_EVENTS_PER_FRAME];
-        ssize_t res = keyboard_device->_read(keyboard_device, 0, events, sizeof(event_t) * KEYBOARD_EVENTS_PER_FRAME);
         for (int i = 0; i < res / sizeof(event_t); ++i) {
             event_t *c = &events[i];
             if (c->keyboard.scancode == KEY_SCANCODE_FN) {
                 if (c->keyboard.down) {
-                    fn_down = true;
+                    *fn_down = true;
                 } else {
-                    fn_down = false;
+                    *fn_down = false;
                 }
                 // Hide the FN key
                 c->type = EVENT_NONE;
@@ -589,10 +861,10 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     c->type               = EVENT_NONE;
                     // No need to redraw the background
                     visible_regions_valid = false;
-                    decoration_damaged    = 7;
+                    decoration_damaged    = display_fb_mask;
                 }
 
-                if (fn_down) {
+                if (*fn_down) {
                     if (c->keyboard.down) {
                         window_coords_t cur_pos = {
                             .x = window_stack->rect.x,
@@ -638,23 +910,210 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     }
                 }
 
-                if (!fn_down && c->type != EVENT_NONE) {
-                    if (xQueueSend(window_stack->event_queue, c, 0) != pdTRUE) {
-                        ESP_LOGW(TAG, "Unable to send event to task");
+                if (!*fn_down && c->type != EVENT_NONE) {
+                    if (!event_queue_push(&window_stack->events, c)) {
+                        ESP_LOGW(TAG, "Event queue of window %p full, dropping event", window_stack);
                     }
+                    xSemaphoreGive(window_stack->event_signal);
                 }
             }
         }
+    } while (res == sizeof(event_t) * KEYBOARD_EVENTS_PER_READ);
+
+    return total;
+}
+
+IRAM_ATTR static void on_refresh(void *ignored) {
+    atomic_store(&refresh_time_us, (uint32_t)esp_timer_get_time());
+    atomic_fetch_add(&pending_refreshes, 1);
+    xTaskNotifyIndexedFromISR(compositor_handle, 0, COMPOSITOR_WAKE_REFRESH, eSetBits, NULL);
+}
+
+// Whether a buffer handed to the panel now is picked up at the end of the
+// refresh in progress. Counted from the refresh interrupt rather than from when
+// the compositor got to run, and never once the next refresh already happened.
+static bool submit_in_time(void) {
+    uint32_t since = (uint32_t)esp_timer_get_time() - atomic_load(&refresh_time_us);
+    return !atomic_load(&pending_refreshes) &&
+           since < 1000000 / atomic_load(&stat_refresh_rate) - DISPLAY_SUBMIT_MARGIN_US;
+}
+
+static void on_input(void *ignored) {
+    xTaskNotifyIndexed(compositor_handle, 0, COMPOSITOR_WAKE_INPUT, eSetBits);
+}
+
+// static bool IRAM_ATTR ppa_srm_callback(ppa_client_handle_t ppa_client, ppa_event_data_t *event_data, void *user_data)
+// {
+//     xTaskNotifyGiveIndexed(compositor_handle, 0);
+//     return true;
+// }
+
+static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
+    static ppa_client_handle_t ppa_srm_handle = NULL;
+
+    ppa_client_config_t ppa_srm_config = {
+        .oper_type             = PPA_OPERATION_SRM,
+        .max_pending_trans_num = 1,
+    };
+
+    // ppa_event_callbacks_t srm_callbacks = {
+    //     .on_trans_done = ppa_srm_callback,
+    // };
+
+    ppa_register_client(&ppa_srm_config, &ppa_srm_handle);
+    // ppa_client_register_event_callbacks(ppa_srm_handle, &srm_callbacks);
+
+    bool           fn_down               = false;
+    int            input_events          = 0;
+    bool           frame_ready           = false;
+    bool           overlay_shown         = false;
+    time_t         launcher_last_started = time(NULL);
+    int64_t        sample_start          = esp_timer_get_time();
+    int            sample_frames         = 0;
+    frame_record_t last_frame            = {0};
+
+    refresh_policy_t refresh_policy;
+    refresh_policy_init(
+        &refresh_policy,
+        FRAMEBUFFER_MAX_REFRESH,
+        FRAMEBUFFER_IDLE_REFRESH,
+        FRAMEBUFFER_IDLE_TIMEOUT_MS * 1000,
+        esp_timer_get_time()
+    );
+
+    while (1) {
+        bool     changes   = false;
+        int      processed = 0;
+        uint32_t wake      = 0;
+
+        xTaskNotifyWaitIndexed(0, 0, UINT32_MAX, &wake, portMAX_DELAY);
+
+        // Input reaches the focused window right away instead of at the next refresh
+        if (wake & COMPOSITOR_WAKE_INPUT) {
+            input_events += dispatch_keyboard_events(&fn_down);
+        }
+
+        if (!(wake & COMPOSITOR_WAKE_REFRESH)) {
+            continue;
+        }
+
+        uint32_t refreshes = atomic_exchange(&pending_refreshes, 0);
+
+        // More than one refresh went by while we were busy with the last frame
+        if (refreshes > 1) {
+            atomic_fetch_add(&stat_missed_refreshes, refreshes - 1);
+        }
+
+        int64_t        frame_start = esp_timer_get_time();
+        int64_t        t;
+        frame_record_t record = {0};
+
+        // Whatever was submitted in time before this refresh is being scanned out now
+        display_buffers_refresh(&display_buffers);
+        if (frame_ready && display_buffers_submit(&display_buffers, refreshes > 1 || !submit_in_time())) {
+            lcd_device->_draw(lcd_device, 0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H, framebuffers[cur_fb]);
+            frame_ready = false;
+        }
+
+        // Double buffered and both buffers are in use until the next refresh
+        if (display_buffers.drawing < 0) {
+            continue;
+        }
+        cur_fb = display_buffers.drawing;
+
+        if (!window_stack) {
+            time_t current_time = time(NULL);
+            if (current_time - launcher_last_started > 2) {
+                application_launch("badgevms_launcher");
+                launcher_last_started = current_time;
+            }
+        }
+
+        compositor_message_t message;
+
+        while (xQueueReceive(compositor_queue, &message, 0) == pdTRUE) {
+            ++processed;
+            switch (message.command) {
+                case WINDOW_CREATE:
+                    push_window(message.window);
+                    mark_scene_damaged();
+                    break;
+                case WINDOW_DESTROY:
+                    remove_window(message.window);
+                    vSemaphoreDelete(message.window->event_signal);
+                    region_fini(&message.window->visible);
+
+                    for (int i = 0; i < WINDOW_FRAMEBUFFERS; ++i) {
+                        ESP_LOGW(TAG, "Destroying framebuffer %u for window %p", i, message.window);
+                        framebuffer_free(message.window->framebuffers[i]);
+                    }
+
+                    if (message.window->mailbox_lock) {
+                        vSemaphoreDelete(message.window->mailbox_lock);
+                    }
+
+                    framebuffer_free(message.window->shadow);
+                    free(message.window->palette);
+
+                    free(message.window->title);
+                    free(message.window);
+                    mark_scene_damaged();
+                    break;
+                case WINDOW_FLAGS: window_apply_flags(message.window, message.flags); break;
+                case WINDOW_MOVE: window_apply_move(message.window, message.coords); break;
+                case WINDOW_RESIZE: window_apply_resize(message.window, message.size); break;
+                case WINDOW_FRAMEBUFFER_RESIZE: window_apply_framebuffer_resize(message.window, message.size); break;
+                case WINDOW_TRANSACTION:
+                    // The whole transaction lands in this frame, however many windows it touches
+                    transaction_apply(message.transaction, transaction_apply_op, NULL);
+                    transaction_free(message.transaction);
+                    break;
+                case FRAMEBUFFER_SWAP: framebuffer_swap(message.fb_a, message.fb_b, true); break;
+                default: ESP_LOGE(TAG, "Unknown command %u", message.command);
+            }
+
+            if (message.caller) {
+                if (eTaskGetState(message.caller) != eDeleted) {
+                    xTaskNotifyGiveIndexed(message.caller, 0);
+                }
+            }
+
+            if (processed > WINDOW_COMMANDS_PER_FRAME) {
+                break;
+            }
+        }
+
+        input_events += dispatch_keyboard_events(&fn_down);
+
+        if (atomic_load(&fps_overlay) != overlay_shown) {
+            // Showing or hiding the overlay needs everything underneath redrawn
+            overlay_shown = !overlay_shown;
+            mark_scene_damaged();
+        }
+
+        record.stage_us[COMPOSITOR_STAGE_COMMANDS] = esp_timer_get_time() - frame_start;
 
         bool framebuffer_cleared = false;
+        bool reclassify          = !visible_regions_valid;
+        if (!visible_regions_valid) {
+            t = esp_timer_get_time();
+            calculate_background_region();
+            record.stage_us[COMPOSITOR_STAGE_REGIONS] += esp_timer_get_time() - t;
+        }
+
         if (background_damaged & (1 << cur_fb)) {
-            memset(framebuffers[cur_fb], 0xaa, FRAMEBUFFER_BYTES);
+            t = esp_timer_get_time();
+            fill_background(framebuffers[cur_fb]);
+            record.stage_us[COMPOSITOR_STAGE_DECORATIONS] += esp_timer_get_time() - t;
+
             // Make sure the ppa will see our new background
+            t = esp_timer_get_time();
             esp_cache_msync(
                 framebuffers[cur_fb],
                 FRAMEBUFFER_BYTES,
                 ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
             );
+            record.stage_us[COMPOSITOR_STAGE_CACHE_SYNC] += esp_timer_get_time() - t;
             background_damaged  &= ~(1 << cur_fb);
             changes              = true;
             framebuffer_cleared  = true;
@@ -670,33 +1129,31 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     break;
                 }
 
-                if (eTaskGetState(task_info->handle) != eDeleted) {
-                    if ((window == window_stack) && (window_stack->flags & WINDOW_FLAG_FULLSCREEN) &&
-                        (!(window_stack->flags & WINDOW_FLAG_LOW_PRIORITY))) {
-                        // A foreground full-screen app gets as much CPU time as it can handle
-                        vTaskPrioritySet(task_info->handle, TASK_PRIORITY_FOREGROUND);
-                    } else {
-                        vTaskPrioritySet(task_info->handle, TASK_PRIORITY);
-                    }
-                }
-
                 managed_framebuffer_t *framebuffer = window->framebuffers[window->front_fb];
 
                 if (!framebuffer) {
                     // Not yet allocated, or in the process of being destroyed
                     if (!visible_regions_valid) {
-                        window_calculate_visible_regions(window, window_stack, 1.0);
+                        t = esp_timer_get_time();
+                        window_calculate_visible_regions(window, window_stack);
+                        record.stage_us[COMPOSITOR_STAGE_REGIONS] += esp_timer_get_time() - t;
                     }
                     window = window->prev;
                     continue;
                 }
 
+                if (window_is_mailbox(window) && window_mailbox_latch(window)) {
+                    atomic_flag_clear(&framebuffer->clean);
+                }
+
                 float scale_x = ((float)window->rect.w / (float)framebuffer->w);
                 float scale_y = ((float)window->rect.h / (float)framebuffer->h);
                 float scale   = fminf(scale_x, scale_y);
 
                 if (!visible_regions_valid) {
-                    window_calculate_visible_regions(window, window_stack, scale);
+                    t = esp_timer_get_time();
+                    window_calculate_visible_regions(window, window_stack);
+                    record.stage_us[COMPOSITOR_STAGE_REGIONS] += esp_timer_get_time() - t;
                 }
 
                 bool is_clean             = atomic_flag_test_and_set(&framebuffer->clean);
@@ -708,8 +1165,32 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                         need_content_draw = true;
                     }
                 } else {
-                    window->fb_dirty  = 7;
+                    window->fb_dirty  = display_fb_mask;
                     need_content_draw = true;
+                    atomic_store(&window->frame_pending, 0);
+                    atomic_fetch_add(&window->composited, 1);
+                }
+
+                bool expand = framebuffer_is_8bpp(framebuffer);
+                if (atomic_exchange(&window->palette_changed, false)) {
+                    window->fb_dirty  = display_fb_mask;
+                    need_content_draw = true;
+                }
+
+                if (!is_clean && (window->shadow || (expand && window->front_fb != window->back_fb))) {
+                    t = esp_timer_get_time();
+                    if (window->shadow) {
+                        window_convert_yuv_shadow(window, framebuffer, ppa_srm_handle);
+                        record.ppa_ops++;
+                    } else {
+                        // Swaps change the pages behind this vaddr, drop what we cached of an older frame
+                        esp_cache_msync(
+                            framebuffer->framebuffer.pixels,
+                            framebuffer->pages.mapped * SOC_MMU_PAGE_SIZE,
+                            ESP_CACHE_MSYNC_FLAG_DIR_M2C
+                        );
+                    }
+                    record.stage_us[COMPOSITOR_STAGE_CONVERT] += esp_timer_get_time() - t;
                 }
 
                 if (framebuffer_cleared || window == window_stack) {
@@ -722,13 +1203,18 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                     bool                     rgb_swap     = false;
                     bool                     byte_swap    = false;
                     ppa_srm_color_mode_t     mode         = PPA_SRM_COLOR_MODE_RGB565;
+                    managed_framebuffer_t   *source       = window->shadow ? window->shadow : framebuffer;
 
                     if (window->flags & WINDOW_FLAG_FLIP_HORIZONTAL) {
                         ppa_rotation = PPA_SRM_ROTATION_ANGLE_270;
                     }
 
                     switch (framebuffer->format) {
+                        case BADGEVMS_PIXELFORMAT_INDEX8:                  // Fallthrough
+                        case BADGEVMS_PIXELFORMAT_RGB332:                  // Fallthrough, the strip is RGB565
                         case BADGEVMS_PIXELFORMAT_RGB565: rgb_swap = true; // Fallthrough
+                        case BADGEVMS_PIXELFORMAT_OUYY_EVYY:               // Fallthrough
+                        case BADGEVMS_PIXELFORMAT_YUY2:                    // Fallthrough, the shadow is BGR565
                         case BADGEVMS_PIXELFORMAT_BGR565: break;
                         case BADGEVMS_PIXELFORMAT_BGRA8888: rgb_swap = true; // Fallthrough
                         case BADGEVMS_PIXELFORMAT_RGBA8888: mode = PPA_SRM_COLOR_MODE_ARGB8888; break;
@@ -737,8 +1223,27 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                         default:
                     }
 
-                    for (int i = 0; i < window->visible.count; i++) {
-                        window_rect_t visible_content = window->visible.rects[i];
+                    window_rect_t pieces[PPA_SPLIT_MAX_RECTS];
+                    int           num_pieces = 0;
+                    int           next_rect  = 0;
+                    window_rect_t rest       = {0}; // Of the visible rect, 8 bit windows take it in strip bands
+
+                    while (num_pieces || rest.h > 0 || next_rect < window->visible.count) {
+                        if (!num_pieces) {
+                            if (rest.h <= 0) {
+                                rest = window->visible.rects[next_rect++];
+                            }
+
+                            window_rect_t band = rest;
+                            if (expand) {
+                                band.h = expand_band_height(rest, window, scale);
+                            }
+                            rest.y     += band.h;
+                            rest.h     -= band.h;
+                            num_pieces  = ppa_workaround_split_rect(band, scale, pieces);
+                        }
+
+                        window_rect_t visible_content = pieces[--num_pieces];
                         window_rect_t fb_rect         = content_to_framebuffer_rect(visible_content, window, scale);
 
                         if (fb_rect.w <= 0 || fb_rect.h <= 0) {
@@ -746,11 +1251,24 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                         }
 
                         window_rect_t rotated_output = rotate_rect(visible_content, rotation);
+                        uint16_t     *in_pixels      = source->framebuffer.pixels;
+                        window_size_t in_size        = {.w = source->w, .h = source->h};
+
+                        if (expand) {
+                            t = esp_timer_get_time();
+                            window_expand_strip(window, framebuffer, &fb_rect);
+                            record.stage_us[COMPOSITOR_STAGE_CONVERT] += esp_timer_get_time() - t;
+
+                            in_pixels = expand_strip;
+                            in_size   = (window_size_t){.w = fb_rect.w, .h = fb_rect.h};
+                            fb_rect.x = 0;
+                            fb_rect.y = 0;
+                        }
 
                         ppa_srm_oper_config_t oper_config = {
-                            .in.buffer         = framebuffer->framebuffer.pixels,
-                            .in.pic_w          = framebuffer->w,
-                            .in.pic_h          = framebuffer->h,
+                            .in.buffer         = in_pixels,
+                            .in.pic_w          = in_size.w,
+                            .in.pic_h          = in_size.h,
                             .in.block_w        = fb_rect.w,
                             .in.block_h        = fb_rect.h,
                             .in.block_offset_x = fb_rect.x,
@@ -773,7 +1291,10 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
                             .mode           = PPA_TRANS_MODE_BLOCKING,
                         };
 
+                        t                    = esp_timer_get_time();
                         esp_err_t ppa_result = ppa_do_scale_rotate_mirror(ppa_srm_handle, &oper_config);
+                        record.stage_us[COMPOSITOR_STAGE_PPA] += esp_timer_get_time() - t;
+                        record.ppa_ops++;
                         if (ppa_result != ESP_OK) {
                             printf("PPA operation failed: %s\n", esp_err_to_name(ppa_result));
                         } else {
@@ -792,16 +1313,22 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
 
                 if (need_decoration_draw && !(window->flags & WINDOW_FLAG_FULLSCREEN)) {
                     // Cache sync before drawing decorations
+                    t = esp_timer_get_time();
                     esp_cache_msync(framebuffers[cur_fb], FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_M2C);
+                    record.stage_us[COMPOSITOR_STAGE_CACHE_SYNC] += esp_timer_get_time() - t;
 
+                    t = esp_timer_get_time();
                     draw_window_box(framebuffers[cur_fb], window, window == window_stack);
+                    record.stage_us[COMPOSITOR_STAGE_DECORATIONS] += esp_timer_get_time() - t;
 
                     // Cache sync after drawing decorations
+                    t = esp_timer_get_time();
                     esp_cache_msync(
                         framebuffers[cur_fb],
                         FRAMEBUFFER_BYTES,
                         ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
                     );
+                    record.stage_us[COMPOSITOR_STAGE_CACHE_SYNC] += esp_timer_get_time() - t;
                     changes = true;
                 }
 
@@ -813,8 +1340,52 @@ static void IRAM_ATTR NOINLINE_ATTR compositor(void *ignored) {
             visible_regions_valid  = true;
         }
 
+        if (reclassify) {
+            update_sched_classes();
+        }
+
+        if (changes && overlay_shown) {
+            t = esp_timer_get_time();
+            esp_cache_msync(framebuffers[cur_fb], FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_M2C);
+            draw_fps_overlay(framebuffers[cur_fb], &last_frame);
+            esp_cache_msync(
+                framebuffers[cur_fb],
+                FRAMEBUFFER_BYTES,
+                ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE
+            );
+            record.stage_us[COMPOSITOR_STAGE_DECORATIONS] += esp_timer_get_time() - t;
+        }
+
+        int64_t now = esp_timer_get_time();
+
         if (changes) {
-            frame_ready = true;
+            frame_ready                             = true;
+            record.stage_us[COMPOSITOR_STAGE_FRAME] = now - frame_start;
+            frame_ring_push(&frame_ring, &record);
+            atomic_fetch_add(&stat_frames, 1);
+            atomic_fetch_add(&stat_ppa_ops, record.ppa_ops);
+            last_frame = record;
+            ++sample_frames;
+
+            // Still early enough for the panel to show it from the next refresh on
+            if (refreshes == 1 && submit_in_time() && display_buffers_submit(&display_buffers, false)) {
+                lcd_device->_draw(lcd_device, 0, 0, FRAMEBUFFER_MAX_W, FRAMEBUFFER_MAX_H, framebuffers[cur_fb]);
+                frame_ready = false;
+            }
+        }
+
+        // Presents, window commands and input all count, so the full rate is back before the next frame
+        int refresh_hz = refresh_policy.current_hz;
+        if (refresh_policy_update(&refresh_policy, now, changes || processed || input_events) != refresh_hz &&
+            lcd_device->_set_refresh_rate) {
+            atomic_store(&stat_refresh_rate, lcd_device->_set_refresh_rate(lcd_device, refresh_policy.current_hz));
+        }
+        input_events = 0;
+
+        if (now - sample_start >= STATS_SAMPLE_INTERVAL_US) {
+            stats_sample_rates(sample_frames);
+            sample_start  = now;
+            sample_frames = 0;
         }
     }
 }
@@ -846,37 +1417,84 @@ framebuffer_t *window_framebuffer_create(window_t *window, window_size_t size, p
         return NULL;
     }
 
-    if (window->framebuffers[0] || window->framebuffers[1]) {
-        return NULL;
+    for (int i = 0; i < WINDOW_FRAMEBUFFERS; ++i) {
+        if (window->framebuffers[i]) {
+            return NULL;
+        }
     }
-    window->front_fb = 0;
-    window->back_fb  = 0;
-
-    window->framebuffers[0] = window_framebuffer_allocate(window, size, pixel_format);
-    if (!window->framebuffers[0]) {
-        ESP_LOGW(
-            TAG,
-            "Unable to allocate framebuffer 0 for window %p, task %u",
-            window,
-            ((task_info_t *)window->task_info)->pid
-        );
-        return NULL;
+    window->front_fb   = 0;
+    window->back_fb    = 0;
+    window->mailbox_fb = 0;
+
+    int num_framebuffers = 1;
+    if (window->flags & WINDOW_FLAG_TRIPLE_BUFFERED) {
+        num_framebuffers = 3;
+    } else if (window->flags & WINDOW_FLAG_DOUBLE_BUFFERED) {
+        num_framebuffers = 2;
     }
 
-    if (window->flags & WINDOW_FLAG_DOUBLE_BUFFERED) {
-        window->framebuffers[1] = window_framebuffer_allocate(window, size, pixel_format);
-        if (!window->framebuffers[1]) {
-            ESP_LOGW(TAG, "Unable to allocate framebuffer 1 for window %p", window);
-            framebuffer_free(window->framebuffers[0]);
-            window->framebuffers[0] = NULL;
-            return NULL;
+    for (int i = 0; i < num_framebuffers; ++i) {
+        window->framebuffers[i] = window_framebuffer_allocate(window, size, pixel_format);
+        if (!window->framebuffers[i]) {
+            ESP_LOGW(
+                TAG,
+                "Unable to allocate framebuffer %i for window %p, task %u",
+                i,
+                window,
+                ((task_info_t *)window->task_info)->pid
+            );
+            goto error;
         }
+    }
+
+    if (num_framebuffers > 1) {
         window->back_fb = 1;
     }
 
-    window->fb_dirty = 7;
+    pixel_format                 = window->framebuffers[0]->format;
+    pixel_format_t shadow_format = framebuffer_shadow_format(pixel_format);
+    if (shadow_format != BADGEVMS_PIXELFORMAT_UNKNOWN) {
+        window_size_t shadow_size = {.w = window->framebuffers[0]->w, .h = window->framebuffers[0]->h};
+        window->shadow            = window_framebuffer_allocate(window, shadow_size, shadow_format);
+        if (!window->shadow) {
+            ESP_LOGW(TAG, "Unable to allocate shadow framebuffer for window %p", window);
+            goto error;
+        }
+    }
+
+    if (pixel_format == BADGEVMS_PIXELFORMAT_INDEX8) {
+        window->palette = malloc(PIXEL_EXPAND_LUT_SIZE * sizeof(uint16_t));
+        if (!window->palette) {
+            ESP_LOGW(TAG, "Unable to allocate palette for window %p", window);
+            goto error;
+        }
+        memcpy(window->palette, rgb332_lut, sizeof(rgb332_lut));
+    }
+
+    if (num_framebuffers > 2) {
+        window->mailbox_lock = xSemaphoreCreateMutex();
+        if (!window->mailbox_lock) {
+            ESP_LOGW(TAG, "Unable to create mailbox lock for window %p", window);
+            goto error;
+        }
+        window->mailbox_fb = 2;
+        mailbox_init(&window->mailbox);
+    }
+
+    window->fb_dirty = display_fb_mask;
 
     return (framebuffer_t *)window->framebuffers[window->back_fb];
+
+error:
+    for (int i = 0; i < num_framebuffers; ++i) {
+        framebuffer_free(window->framebuffers[i]);
+        window->framebuffers[i] = NULL;
+    }
+    framebuffer_free(window->shadow);
+    free(window->palette);
+    window->shadow  = NULL;
+    window->palette = NULL;
+    return NULL;
 }
 
 window_t *window_create(char const *title, window_size_t size, window_flag_t flags) {
@@ -900,8 +1518,13 @@ window_t *window_create(char const *title, window_size_t size, window_flag_t fla
         }
     }
 
-    window->event_queue = xQueueCreate(WINDOW_MAX_EVENTS, sizeof(event_t));
-    if (!window->event_queue) {
+    if (!event_queue_init(&window->events, WINDOW_DEFAULT_EVENTS)) {
+        ESP_LOGW(TAG, "Unable to set up window event queue");
+        goto error;
+    }
+
+    window->event_signal = xSemaphoreCreateBinary();
+    if (!window->event_signal) {
         ESP_LOGW(TAG, "Out of memory trying to allocate window event queue");
         goto error;
     }
@@ -928,7 +1551,9 @@ window_t *window_create(char const *title, window_size_t size, window_flag_t fla
 
     return window;
 error:
-    free(window->title);
+    if (window) {
+        free(window->title);
+    }
     free(window);
     return NULL;
 }
@@ -1070,9 +1695,33 @@ window_size_t window_framebuffer_size_get(window_handle_t window) {
 }
 
 window_size_t window_framebuffer_size_set(window_handle_t window, window_size_t size) {
+    if (!(window && window->framebuffers[0]) || size.w <= 0 || size.h <= 0) {
+        return window_framebuffer_size_get(window);
+    }
+
+    compositor_message_t message = {
+        .command = WINDOW_FRAMEBUFFER_RESIZE,
+        .size    = size,
+        .window  = window,
+        .caller  = xTaskGetCurrentTaskHandle(),
+    };
+
+    xQueueSend(compositor_queue, &message, portMAX_DELAY);
+    ulTaskNotifyTakeIndexed(0, pdTRUE, portMAX_DELAY);
+
     return window_framebuffer_size_get(window);
 }
 
+bool window_palette_set(window_handle_t window, int first, int count, uint32_t const *colors) {
+    if (!window || !window->palette || !colors || first < 0 || count < 0 || first + count > PIXEL_EXPAND_LUT_SIZE) {
+        return false;
+    }
+
+    expand_lut_palette(window->palette, first, count, colors);
+    atomic_store(&window->palette_changed, true);
+    return true;
+}
+
 pixel_format_t window_framebuffer_format_get(window_handle_t window) {
     if (!(window && window->framebuffers[0])) {
         return 0;
@@ -1085,7 +1734,7 @@ pixel_format_t window_framebuffer_format_get(window_handle_t window) {
 static inline void copy_framebuffer_rect(managed_framebuffer_t *dst, managed_framebuffer_t *src, window_rect_t rect) {
     if (rect.x == 0 && rect.y == 0 && rect.w == dst->w && rect.h == dst->h) {
         // Full rect damage
-        memcpy(dst->framebuffer.pixels, src->framebuffer.pixels, dst->num_pages * SOC_MMU_PAGE_SIZE);
+        memcpy(dst->framebuffer.pixels, src->framebuffer.pixels, dst->pages.mapped * SOC_MMU_PAGE_SIZE);
         return;
     }
 
@@ -1125,6 +1774,16 @@ void window_present(window_t *window, bool block, window_rect_t *rects, int num_
     managed_framebuffer_t *front_buffer = NULL;
     managed_framebuffer_t *back_buffer  = NULL;
 
+    if (window_is_mailbox(window)) {
+        window_present_account(window);
+        window_mailbox_present(window);
+
+        if (block) {
+            ulTaskNotifyTakeIndexed(1, pdTRUE, portMAX_DELAY);
+        }
+        return;
+    }
+
     if (window->flags & WINDOW_FLAG_DOUBLE_BUFFERED && window->framebuffers[1]) {
         front_buffer = window->framebuffers[window->front_fb];
         back_buffer  = window->framebuffers[window->back_fb];
@@ -1135,8 +1794,8 @@ void window_present(window_t *window, bool block, window_rect_t *rects, int num_
 
         compositor_message_t message = {
             .command = FRAMEBUFFER_SWAP,
-            .fb_a    = front_buffer,
-            .fb_b    = back_buffer,
+            .fb_a    = back_buffer,
+            .fb_b    = front_buffer,
             .caller  = xTaskGetCurrentTaskHandle(),
         };
 
@@ -1149,6 +1808,7 @@ void window_present(window_t *window, bool block, window_rect_t *rects, int num_
         front_buffer = window->framebuffers[window->front_fb];
     }
 
+    window_present_account(window);
     atomic_flag_clear(&front_buffer->clean);
 
     if (block) {
@@ -1156,45 +1816,245 @@ void window_present(window_t *window, bool block, window_rect_t *rects, int num_
     }
 }
 
-event_t window_event_poll(window_t *window, bool block, uint32_t timeout_msec) {
-    event_t    e;
+window_transaction_t *window_transaction_begin(void) {
+    window_transaction_t *transaction = transaction_create();
+    if (!transaction) {
+        ESP_LOGW(TAG, "Unable to allocate window transaction");
+    }
+    return transaction;
+}
+
+bool window_transaction_position_set(window_transaction_t *transaction, window_t *window, window_coords_t coords) {
+    if (!transaction || !window) {
+        return false;
+    }
+
+    transaction_op_t op = {.type = TRANSACTION_OP_MOVE, .window = window, .coords = coords};
+    return transaction_stage(transaction, &op);
+}
+
+bool window_transaction_size_set(window_transaction_t *transaction, window_t *window, window_size_t size) {
+    if (!transaction || !window) {
+        return false;
+    }
+
+    transaction_op_t op = {.type = TRANSACTION_OP_RESIZE, .window = window, .size = size};
+    return transaction_stage(transaction, &op);
+}
+
+bool window_transaction_flags_set(window_transaction_t *transaction, window_t *window, window_flag_t flags) {
+    if (!transaction || !window) {
+        return false;
+    }
+
+    transaction_op_t op = {.type = TRANSACTION_OP_FLAGS, .window = window, .flags = flags};
+    return transaction_stage(transaction, &op);
+}
+
+bool window_transaction_title_set(window_transaction_t *transaction, window_t *window, char const *title) {
+    if (!transaction || !window) {
+        return false;
+    }
+
+    transaction_op_t op = {.type = TRANSACTION_OP_TITLE, .window = window};
+    if (title) {
+        op.title = strndup(title, 20);
+        if (!op.title) {
+            ESP_LOGW(TAG, "Unable to allocate window title");
+            transaction->failed = true;
+            return false;
+        }
+    }
+
+    if (!transaction_stage(transaction, &op)) {
+        free(op.title);
+        return false;
+    }
+    return true;
+}
+
+bool window_transaction_present(window_transaction_t *transaction, window_t *window) {
+    if (!transaction || !window || !window->framebuffers[0]) {
+        return false;
+    }
+
+    transaction_op_t op = {.type = TRANSACTION_OP_PRESENT, .window = window};
+    return transaction_stage(transaction, &op);
+}
+
+bool window_transaction_commit(window_transaction_t *transaction, bool block) {
+    if (!transaction) {
+        return false;
+    }
+
+    if (transaction->failed) {
+        transaction_free(transaction);
+        return false;
+    }
+
+    if (!transaction->count) {
+        transaction_free(transaction);
+        return true;
+    }
+
+    compositor_message_t message = {
+        .command     = WINDOW_TRANSACTION,
+        .transaction = transaction,
+        .caller      = block ? xTaskGetCurrentTaskHandle() : NULL,
+    };
+
+    // The compositor owns and frees the transaction from here on
+    xQueueSend(compositor_queue, &message, portMAX_DELAY);
+    if (block) {
+        ulTaskNotifyTakeIndexed(0, pdTRUE, portMAX_DELAY);
+    }
+
+    return true;
+}
+
+void window_transaction_abort(window_transaction_t *transaction) {
+    transaction_free(transaction);
+}
+
+int window_event_poll_many(window_t *window, event_t *events, int max_events, bool block, uint32_t timeout_msec) {
+    if (!window || !events || max_events <= 0) {
+        return 0;
+    }
+
     TickType_t wait = block ? portMAX_DELAY : timeout_msec / portTICK_PERIOD_MS;
+    TimeOut_t  timeout;
+    vTaskSetTimeOutState(&timeout);
+
+    // The signal may be left over from events we already took, so check again after every wake up
+    int n;
+    while (!(n = event_queue_pop_many(&window->events, events, max_events)) && wait) {
+        xSemaphoreTake(window->event_signal, wait);
+        if (xTaskCheckForTimeOut(&timeout, &wait) == pdTRUE) {
+            return event_queue_pop_many(&window->events, events, max_events);
+        }
+    }
+
+    return n;
+}
 
-    if (xQueueReceive(window->event_queue, &e, wait) != pdTRUE) {
+event_t window_event_poll(window_t *window, bool block, uint32_t timeout_msec) {
+    event_t e;
+
+    if (window_event_poll_many(window, &e, 1, block, timeout_msec) != 1) {
         e.type = EVENT_NONE;
     }
 
     return e;
 }
 
+bool window_event_queue_depth_set(window_t *window, int depth) {
+    if (!window || depth <= 0) {
+        return false;
+    }
+
+    return event_queue_depth_set(&window->events, depth);
+}
+
+bool compositor_stats_get(compositor_stats_t *stats) {
+    if (!stats) {
+        return false;
+    }
+
+    frame_record_t *records = malloc(FRAME_RING_SIZE * sizeof(frame_record_t));
+    if (!records) {
+        return false;
+    }
+
+    int count = frame_ring_snapshot(&frame_ring, records, FRAME_RING_SIZE);
+    compositor_stats_build(stats, records, count);
+    free(records);
+
+    stats->frames           = atomic_load(&stat_frames);
+    stats->missed_refreshes = atomic_load(&stat_missed_refreshes);
+    stats->refresh_rate     = atomic_load(&stat_refresh_rate);
+    stats->ppa_ops          = atomic_load(&stat_ppa_ops);
+    stats->fps              = atomic_load(&stat_fps);
+
+    return true;
+}
+
+bool window_stats_get(window_t *window, window_stats_t *stats) {
+    if (!window || !stats) {
+        return false;
+    }
+
+    stats->presents     = atomic_load(&window->presents);
+    stats->drops        = atomic_load(&window->drops);
+    stats->composited   = atomic_load(&window->composited);
+    stats->present_rate = atomic_load(&window->present_rate);
+
+    return true;
+}
+
+void compositor_fps_overlay_set(bool enable) {
+    atomic_store(&fps_overlay, enable);
+}
+
 bool compositor_init(char const *lcd_device_name, char const *keyboard_device_name) {
     ESP_LOGI(TAG, "Initializing");
 
+    expand_lut_rgb332(rgb332_lut);
+
+    esp_cache_get_alignment(MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA, &expand_strip_alignment);
+    expand_strip_alignment = MAX(expand_strip_alignment, sizeof(void *));
+    expand_strip           = heap_caps_aligned_calloc(
+        expand_strip_alignment,
+        1,
+        COMPOSITOR_EXPAND_STRIP_BYTES,
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA
+    );
+    if (!expand_strip) {
+        ESP_LOGE(TAG, "Unable to allocate the 8 bit expansion strip");
+        return false;
+    }
+
     lcd_device = (lcd_device_t *)device_get(lcd_device_name);
     if (!lcd_device) {
         ESP_LOGE(TAG, "Unable to access the LCD device '%s'", lcd_device_name);
         return false;
     }
 
-    keyboard_device = (device_t *)device_get(keyboard_device_name);
+    keyboard_device = (keyboard_device_t *)device_get(keyboard_device_name);
     if (!keyboard_device) {
         ESP_LOGE(TAG, "Unable to access the keyboard device '%s'", keyboard_device_name);
         return false;
     }
 
-    for (int i = 0; i < DISPLAY_FRAMEBUFFERS; ++i) {
+    // The panel driver decides how many buffers it has
+    int num_framebuffers = 0;
+    for (int i = 0; i < DISPLAY_BUFFERS_MAX; ++i) {
         lcd_device->_getfb(lcd_device, i, (void *)&framebuffers[i]);
+        if (!framebuffers[i]) {
+            break;
+        }
         memset(framebuffers[i], 0xaa, FRAMEBUFFER_BYTES);
         esp_cache_msync(framebuffers[i], FRAMEBUFFER_BYTES, ESP_CACHE_MSYNC_FLAG_DIR_C2M);
         ESP_LOGW(TAG, "Got framebuffer[%i]: %p", i, framebuffers[i]);
+        ++num_framebuffers;
     }
 
-    cur_fb = (cur_fb + 1) % DISPLAY_FRAMEBUFFERS;
+    if (num_framebuffers < 2) {
+        ESP_LOGE(TAG, "The LCD device needs at least two framebuffers");
+        return false;
+    }
+
+    display_buffers_init(&display_buffers, num_framebuffers);
+    display_fb_mask = (1 << num_framebuffers) - 1;
+    cur_fb          = display_buffers.drawing;
 
     lcd_device->_set_refresh_cb(lcd_device, NULL, on_refresh);
 
     compositor_queue = xQueueCreate(10, sizeof(compositor_message_t));
     create_kernel_task(compositor, "Compositor", 8192, NULL, 20, &compositor_handle, 0);
 
+    if (keyboard_device->_set_event_cb) {
+        keyboard_device->_set_event_cb(keyboard_device, NULL, on_input);
+    }
+
     return true;
 }
@@ -19,7 +19,13 @@
 #include "badgevms/compositor.h"
 #include "badgevms/framebuffer.h"
 #include "badgevms_config.h"
+#include "event_queue.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "framebuffer_pages.h"
+#include "mailbox.h"
 #include "memory.h"
+#include "region.h"
 #include "task.h"
 
 #include <stdatomic.h>
@@ -27,33 +33,23 @@
 #define TOP_BAR_PX  50
 #define SIDE_BAR_PX 0
 
-#define MAX_VISIBLE_RECTS 64
-
-typedef struct {
-    window_rect_t rects[MAX_VISIBLE_RECTS];
-    int           count;
-} rect_array_t;
-
-typedef struct {
-    window_rect_t rects[4];
-    int           count;
-} small_rect_array_t;
+// Front and back buffer, plus the mailbox for triple buffered windows
+#define WINDOW_FRAMEBUFFERS 3
 
 typedef struct managed_framebuffer {
     framebuffer_t       framebuffer;
     int                 w;
     int                 h;
     pixel_format_t      format;
-    allocation_range_t *head_pages;
-    allocation_range_t *tail_pages;
-    size_t              num_pages;
+    framebuffer_pages_t pages;
     atomic_flag         clean;
 } managed_framebuffer_t;
 
 typedef struct window {
-    managed_framebuffer_t *framebuffers[2];
+    managed_framebuffer_t *framebuffers[WINDOW_FRAMEBUFFERS];
     uint8_t                front_fb;
     uint8_t                back_fb;
+    uint8_t                mailbox_fb;
     window_flag_t          flags;
     char                  *title;
     int                    fb_dirty;
@@ -61,9 +57,29 @@ typedef struct window {
     window_rect_t    rect;
     // Store the previous rect if we go fullscreen/maximized
     window_rect_t    rect_orig;
-    rect_array_t     visible;
+    region_t         visible;
     atomic_uintptr_t task_info;
-    QueueHandle_t    event_queue;
+
+    event_queue_t     events;
+    SemaphoreHandle_t event_signal; // Given after every push, the queue itself needs no lock
+
+    // Statistics, see window_stats_get()
+    atomic_uint  presents;
+    atomic_uint  drops;
+    atomic_uint  composited;
+    atomic_uint  frame_pending;
+    atomic_uint  present_rate;
+    unsigned int presents_sampled;
+
+    // Only used by triple buffered windows
+    mailbox_t         mailbox;
+    SemaphoreHandle_t mailbox_lock;
+
+    // YUV formats are converted into an RGB shadow for the PPA, 8 bit formats
+    // are expanded through the palette while compositing
+    managed_framebuffer_t *shadow;
+    uint16_t              *palette;
+    atomic_bool            palette_changed;
 
     struct window *next;
     struct window *prev;
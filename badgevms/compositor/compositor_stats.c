@@ -0,0 +1,321 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compositor_stats.h"
+
+#include <string.h>
+
+// Exact buckets for tiny values, then four sub-buckets per power of two
+#define HISTOGRAM_EXACT      4
+#define HISTOGRAM_SUBBUCKETS 4
+
+void frame_ring_push(frame_ring_t *ring, frame_record_t const *record) {
+    unsigned int  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    frame_slot_t *slot = &ring->slots[head & (FRAME_RING_SIZE - 1)];
+
+    // Readers that catch the slot while it is being written see seq 0 or a
+    // seq that changed underneath them and drop it
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = *record;
+    atomic_store_explicit(&slot->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copies up to max of the most recent records into out, oldest first
+int frame_ring_snapshot(frame_ring_t *ring, frame_record_t *out, int max) {
+    unsigned int head  = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned int avail = head < FRAME_RING_SIZE ? head : FRAME_RING_SIZE;
+    int          count = 0;
+
+    if ((unsigned int)max < avail) {
+        avail = max;
+    }
+
+    for (unsigned int i = head - avail; i != head; ++i) {
+        frame_slot_t *slot = &ring->slots[i & (FRAME_RING_SIZE - 1)];
+        unsigned int  seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != i + 1) {
+            continue;
+        }
+
+        frame_record_t record = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        out[count++] = record;
+    }
+
+    return count;
+}
+
+int histogram_bucket(uint32_t value) {
+    if (value < HISTOGRAM_EXACT) {
+        return value;
+    }
+
+    int octave = 31 - __builtin_clz(value);
+    int sub    = (value >> (octave - 2)) & (HISTOGRAM_SUBBUCKETS - 1);
+    int bucket = HISTOGRAM_EXACT + (octave - 2) * HISTOGRAM_SUBBUCKETS + sub;
+
+    return bucket < COMPOSITOR_HISTOGRAM_BUCKETS ? bucket : COMPOSITOR_HISTOGRAM_BUCKETS - 1;
+}
+
+uint32_t histogram_bucket_start(int bucket) {
+    if (bucket < HISTOGRAM_EXACT) {
+        return bucket;
+    }
+
+    int octave = (bucket - HISTOGRAM_EXACT) / HISTOGRAM_SUBBUCKETS + 2;
+    int sub    = (bucket - HISTOGRAM_EXACT) % HISTOGRAM_SUBBUCKETS;
+    return (uint32_t)(HISTOGRAM_SUBBUCKETS + sub) << (octave - 2);
+}
+
+void histogram_clear(compositor_histogram_t *histogram) {
+    memset(histogram, 0, sizeof(compositor_histogram_t));
+    histogram->min_us = UINT32_MAX;
+}
+
+void histogram_add(compositor_histogram_t *histogram, uint32_t value) {
+    histogram->buckets[histogram_bucket(value)]++;
+    histogram->count++;
+
+    if (value < histogram->min_us) {
+        histogram->min_us = value;
+    }
+    if (value > histogram->max_us) {
+        histogram->max_us = value;
+    }
+}
+
+// Returns the upper bound of the bucket holding the given percentile, clamped
+// to the observed range so exact buckets and single samples report exactly.
+uint32_t histogram_percentile(compositor_histogram_t const *histogram, int percentile) {
+    if (!histogram->count) {
+        return 0;
+    }
+
+    uint64_t target = ((uint64_t)histogram->count * percentile + 99) / 100;
+    uint64_t seen   = 0;
+
+    if (!target) {
+        target = 1;
+    }
+
+    for (int i = 0; i < COMPOSITOR_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= target) {
+            uint32_t upper = i == COMPOSITOR_HISTOGRAM_BUCKETS - 1 ? histogram->max_us
+                                                                   : histogram_bucket_start(i + 1) - 1;
+            if (upper > histogram->max_us) {
+                upper = histogram->max_us;
+            }
+            if (upper < histogram->min_us) {
+                upper = histogram->min_us;
+            }
+            return upper;
+        }
+    }
+
+    return histogram->max_us;
+}
+
+void histogram_finish(compositor_histogram_t *histogram, uint64_t sum) {
+    if (!histogram->count) {
+        histogram->min_us = 0;
+        return;
+    }
+
+    histogram->mean_us = sum / histogram->count;
+    histogram->p50_us  = histogram_percentile(histogram, 50);
+    histogram->p99_us  = histogram_percentile(histogram, 99);
+}
+
+void compositor_stats_build(compositor_stats_t *stats, frame_record_t const *records, int count) {
+    uint64_t stage_sum[COMPOSITOR_STAGE_COUNT] = {0};
+    uint64_t ppa_sum                           = 0;
+
+    for (int s = 0; s < COMPOSITOR_STAGE_COUNT; ++s) {
+        histogram_clear(&stats->stage[s]);
+    }
+    histogram_clear(&stats->ppa_ops_per_frame);
+
+    for (int i = 0; i < count; ++i) {
+        for (int s = 0; s < COMPOSITOR_STAGE_COUNT; ++s) {
+            histogram_add(&stats->stage[s], records[i].stage_us[s]);
+            stage_sum[s] += records[i].stage_us[s];
+        }
+        histogram_add(&stats->ppa_ops_per_frame, records[i].ppa_ops);
+        ppa_sum += records[i].ppa_ops;
+    }
+
+    for (int s = 0; s < COMPOSITOR_STAGE_COUNT; ++s) {
+        histogram_finish(&stats->stage[s], stage_sum[s]);
+    }
+    histogram_finish(&stats->ppa_ops_per_frame, ppa_sum);
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+static frame_ring_t   ring;
+static frame_record_t snapshot[FRAME_RING_SIZE];
+
+int main() {
+    bool error = false;
+
+    // Every value lands in a bucket whose range contains it, and buckets are
+    // ordered
+    int last_bucket = 0;
+    for (uint32_t v = 0; v < 200000; ++v) {
+        int b = histogram_bucket(v);
+        if (b < last_bucket) {
+            printf("\033[31mBucket for %u went backwards (%d after %d)\033[0m\n", v, b, last_bucket);
+            error = true;
+            break;
+        }
+        last_bucket = b;
+
+        if (histogram_bucket_start(b) > v ||
+            (b < COMPOSITOR_HISTOGRAM_BUCKETS - 1 && histogram_bucket_start(b + 1) <= v)) {
+            printf("\033[31mValue %u is outside of its bucket %d\033[0m\n", v, b);
+            error = true;
+            break;
+        }
+    }
+
+    if (histogram_bucket(UINT32_MAX) != COMPOSITOR_HISTOGRAM_BUCKETS - 1) {
+        printf("\033[31mHuge values do not land in the overflow bucket\033[0m\n");
+        error = true;
+    }
+
+    // A 60Hz frame time must be resolved to within a quarter octave
+    uint32_t frame_time = 16667;
+    int      fb         = histogram_bucket(frame_time);
+    if (histogram_bucket_start(fb + 1) - histogram_bucket_start(fb) > frame_time / 4) {
+        printf("\033[31mBuckets too coarse around %uus\033[0m\n", frame_time);
+        error = true;
+    }
+
+    // Uniform distribution
+    compositor_histogram_t h;
+    uint64_t               sum = 0;
+    histogram_clear(&h);
+    for (uint32_t v = 1; v <= 1000; ++v) {
+        histogram_add(&h, v);
+        sum += v;
+    }
+    histogram_finish(&h, sum);
+
+    if (h.count != 1000 || h.min_us != 1 || h.max_us != 1000 || h.mean_us != 500) {
+        printf(
+            "\033[31mUniform: count %u min %u max %u mean %u\033[0m\n",
+            h.count,
+            h.min_us,
+            h.max_us,
+            h.mean_us
+        );
+        error = true;
+    }
+
+    if (h.p50_us < 500 || h.p50_us > 500 + 500 / 4) {
+        printf("\033[31mUniform: p50 %u not near 500\033[0m\n", h.p50_us);
+        error = true;
+    }
+
+    if (h.p99_us < 990 || h.p99_us > 1000) {
+        printf("\033[31mUniform: p99 %u not near 990\033[0m\n", h.p99_us);
+        error = true;
+    }
+
+    // Exact small values and a single outlier
+    histogram_clear(&h);
+    for (int i = 0; i < 99; ++i) {
+        histogram_add(&h, 2);
+    }
+    histogram_add(&h, 50000);
+    histogram_finish(&h, 99 * 2 + 50000);
+    if (h.p50_us != 2 || h.p99_us != 2 || histogram_percentile(&h, 100) != 50000) {
+        printf(
+            "\033[31mOutlier: p50 %u p99 %u p100 %u\033[0m\n",
+            h.p50_us,
+            h.p99_us,
+            histogram_percentile(&h, 100)
+        );
+        error = true;
+    }
+
+    // Empty histograms report zeros
+    histogram_clear(&h);
+    histogram_finish(&h, 0);
+    if (h.min_us || h.max_us || h.p50_us || h.p99_us || h.mean_us) {
+        printf("\033[31mEmpty histogram is not all zeros\033[0m\n");
+        error = true;
+    }
+
+    // The ring keeps the most recent records, oldest first
+    for (uint32_t i = 0; i < FRAME_RING_SIZE + 44; ++i) {
+        frame_record_t r = {0};
+        r.stage_us[COMPOSITOR_STAGE_FRAME] = i;
+        r.ppa_ops                          = i % 7;
+        frame_ring_push(&ring, &r);
+    }
+
+    int n = frame_ring_snapshot(&ring, snapshot, FRAME_RING_SIZE);
+    if (n != FRAME_RING_SIZE) {
+        printf("\033[31mRing snapshot returned %d records\033[0m\n", n);
+        error = true;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (snapshot[i].stage_us[COMPOSITOR_STAGE_FRAME] != (uint32_t)(44 + i)) {
+            printf("\033[31mRing record %d holds frame %u\033[0m\n", i, snapshot[i].stage_us[COMPOSITOR_STAGE_FRAME]);
+            error = true;
+            break;
+        }
+    }
+
+    n = frame_ring_snapshot(&ring, snapshot, 10);
+    if (n != 10 || snapshot[9].stage_us[COMPOSITOR_STAGE_FRAME] != FRAME_RING_SIZE + 43) {
+        printf("\033[31mPartial ring snapshot is wrong\033[0m\n");
+        error = true;
+    }
+
+    // A slot caught mid-write is skipped
+    atomic_store(&ring.slots[(FRAME_RING_SIZE + 43) & (FRAME_RING_SIZE - 1)].seq, 0);
+    n = frame_ring_snapshot(&ring, snapshot, 10);
+    if (n != 9) {
+        printf("\033[31mTorn slot was not skipped\033[0m\n");
+        error = true;
+    }
+
+    compositor_stats_t stats;
+    n = frame_ring_snapshot(&ring, snapshot, FRAME_RING_SIZE);
+    compositor_stats_build(&stats, snapshot, n);
+    if (stats.stage[COMPOSITOR_STAGE_FRAME].count != (uint32_t)n || stats.ppa_ops_per_frame.max_us != 6 ||
+        stats.stage[COMPOSITOR_STAGE_PPA].max_us != 0) {
+        printf("\033[31mcompositor_stats_build produced wrong histograms\033[0m\n");
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
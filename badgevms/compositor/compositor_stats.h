@@ -0,0 +1,56 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/compositor.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Power of two, about four seconds worth of frames at 60Hz
+#define FRAME_RING_SIZE 256
+
+typedef struct {
+    uint32_t stage_us[COMPOSITOR_STAGE_COUNT];
+    uint32_t ppa_ops;
+} frame_record_t;
+
+typedef struct {
+    atomic_uint    seq;
+    frame_record_t record;
+} frame_slot_t;
+
+// Single writer (the compositor), any number of readers. The writer never
+// waits; readers detect slots that were overwritten while they copied them
+// and skip those.
+typedef struct {
+    atomic_uint  head;
+    frame_slot_t slots[FRAME_RING_SIZE];
+} frame_ring_t;
+
+void frame_ring_push(frame_ring_t *ring, frame_record_t const *record);
+int  frame_ring_snapshot(frame_ring_t *ring, frame_record_t *out, int max);
+
+int      histogram_bucket(uint32_t value);
+uint32_t histogram_bucket_start(int bucket);
+void     histogram_clear(compositor_histogram_t *histogram);
+void     histogram_add(compositor_histogram_t *histogram, uint32_t value);
+void     histogram_finish(compositor_histogram_t *histogram, uint64_t sum);
+uint32_t histogram_percentile(compositor_histogram_t const *histogram, int percentile);
+
+void compositor_stats_build(compositor_stats_t *stats, frame_record_t const *records, int count);
@@ -0,0 +1,240 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "display_buffers.h"
+
+static int find_free(display_buffers_t const *buffers) {
+    for (int i = 0; i < buffers->count; ++i) {
+        if (i != buffers->pending && i != buffers->scanning) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The panel starts out scanning buffer 0
+void display_buffers_init(display_buffers_t *buffers, int count) {
+    buffers->count    = count;
+    buffers->pending  = -1;
+    buffers->scanning = 0;
+    buffers->wait     = 0;
+    buffers->late     = false;
+    buffers->drawing  = find_free(buffers);
+}
+
+// Hand the drawing buffer to the panel. A buffer that was submitted in time
+// before and never reached the panel is simply replaced by a submit in time
+// and becomes free again. Returns false if nothing could be submitted.
+bool display_buffers_submit(display_buffers_t *buffers, bool late) {
+    if (buffers->drawing < 0 || (buffers->pending >= 0 && (late || buffers->late))) {
+        return false;
+    }
+
+    buffers->pending = buffers->drawing;
+    buffers->wait    = late ? 2 : 1;
+    buffers->late    = late;
+    buffers->drawing = find_free(buffers);
+    return true;
+}
+
+// The panel finished a refresh and picked up whatever was submitted in time
+// before it
+void display_buffers_refresh(display_buffers_t *buffers) {
+    if (buffers->pending >= 0 && --buffers->wait == 0) {
+        buffers->scanning = buffers->pending;
+        buffers->pending  = -1;
+        buffers->late     = false;
+    }
+
+    if (buffers->drawing < 0) {
+        buffers->drawing = find_free(buffers);
+    }
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define TEST_RNG_SEED 0xD15B1A7
+#include "test_rng.h"
+
+// What the DPI driver does: submitting sets the buffer the DMA restarts with
+// at the end of the current refresh. A late submit may miss that and only be
+// picked up at the refresh after.
+typedef struct {
+    int next;
+    int late; // -1 if none
+    int scanning;
+} panel_t;
+
+static void panel_refresh(panel_t *panel) {
+    if (panel->late >= 0 && (rng() & 1)) {
+        panel->next = panel->late;
+        panel->late = -1;
+    }
+    panel->scanning = panel->next;
+    if (panel->late >= 0) {
+        panel->next = panel->late;
+        panel->late = -1;
+    }
+}
+
+static bool check(display_buffers_t const *b, panel_t const *panel, char const *when) {
+    if (b->drawing >= 0 &&
+        (b->drawing == panel->scanning || b->drawing == panel->next || b->drawing == panel->late)) {
+        printf("\033[31m%s: drawing into buffer %d which the panel reads\033[0m\n", when, b->drawing);
+        return false;
+    }
+
+    // Only a late submit leaves it open which of the two is shown
+    if (b->scanning != panel->scanning && !(b->late && b->pending == panel->scanning)) {
+        printf("\033[31m%s: thinks buffer %d is scanned, panel reads %d\033[0m\n", when, b->scanning, panel->scanning);
+        return false;
+    }
+
+    if (b->count == 3 && b->drawing < 0) {
+        printf("\033[31m%s: three buffers but none free\033[0m\n", when);
+        return false;
+    }
+
+    return true;
+}
+
+static bool run(int count) {
+    display_buffers_t b;
+    panel_t           panel = {0, -1, 0};
+    int               shown = 0;
+    int               drawn = 0;
+
+    display_buffers_init(&b, count);
+    if (!check(&b, &panel, "init")) {
+        return false;
+    }
+
+    for (int i = 0; i < 100000; ++i) {
+        switch (rng() % 4) {
+            case 0:
+            case 1: {
+                int  drawing = b.drawing;
+                bool late    = (rng() % 4) == 0;
+                if (display_buffers_submit(&b, late)) {
+                    *(late ? &panel.late : &panel.next) = drawing;
+                    ++drawn;
+                    if (!check(&b, &panel, "submit")) {
+                        return false;
+                    }
+                }
+                break;
+            }
+            default: {
+                int scanning = panel.scanning;
+                panel_refresh(&panel);
+                shown += panel.scanning != scanning;
+                display_buffers_refresh(&b);
+                if (!check(&b, &panel, "refresh")) {
+                    return false;
+                }
+                if (b.drawing < 0 && b.pending < 0) {
+                    printf("\033[31mNo buffer free right after a refresh\033[0m\n");
+                    return false;
+                }
+                break;
+            }
+        }
+    }
+
+    if (!shown || !drawn) {
+        printf("\033[31m%d buffers: nothing was ever shown\033[0m\n", count);
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    bool              error = false;
+    display_buffers_t b;
+
+    // Double buffering: a submit blocks drawing until the next refresh
+    display_buffers_init(&b, 2);
+    if (b.drawing != 1 || b.scanning != 0) {
+        printf("\033[31mDouble buffering starts out wrong\033[0m\n");
+        error = true;
+    }
+    display_buffers_submit(&b, false);
+    if (b.drawing != -1 || b.pending != 1) {
+        printf("\033[31mDouble buffering allowed drawing into the scanned out buffer\033[0m\n");
+        error = true;
+    }
+    display_buffers_refresh(&b);
+    if (b.drawing != 0 || b.scanning != 1 || b.pending != -1) {
+        printf("\033[31mDouble buffering did not flip on refresh\033[0m\n");
+        error = true;
+    }
+
+    // A refresh without a new frame changes nothing
+    display_buffers_refresh(&b);
+    if (b.drawing != 0 || b.scanning != 1) {
+        printf("\033[31mIdle refresh changed the buffers\033[0m\n");
+        error = true;
+    }
+
+    // A late submit keeps both buffers busy for another refresh
+    display_buffers_init(&b, 2);
+    display_buffers_submit(&b, true);
+    display_buffers_refresh(&b);
+    if (b.drawing != -1 || b.pending != 1 || b.scanning != 0) {
+        printf("\033[31mLate submit freed a buffer the panel may still read\033[0m\n");
+        error = true;
+    }
+    display_buffers_init(&b, 3);
+    display_buffers_submit(&b, true);
+    display_buffers_refresh(&b);
+    if (display_buffers_submit(&b, false)) {
+        printf("\033[31mReplaced a late submit the panel may already show\033[0m\n");
+        error = true;
+    }
+    display_buffers_refresh(&b);
+    if (b.scanning != 1 || b.pending != -1 || !display_buffers_submit(&b, false)) {
+        printf("\033[31mLate submit never reached the panel\033[0m\n");
+        error = true;
+    }
+
+    // Triple buffering always has one to draw into
+    display_buffers_init(&b, 3);
+    for (int i = 0; i < 10; ++i) {
+        display_buffers_submit(&b, false);
+        if (b.drawing < 0) {
+            printf("\033[31mTriple buffering ran out of buffers\033[0m\n");
+            error = true;
+            break;
+        }
+        if (i & 1) {
+            display_buffers_refresh(&b);
+        }
+    }
+
+    if (!run(2) || !run(3)) {
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
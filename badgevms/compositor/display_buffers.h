@@ -0,0 +1,46 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DISPLAY_BUFFERS_MAX 3
+
+// Which of the panel's framebuffers the compositor may render into. A
+// submitted buffer is picked up by the panel at the end of the refresh in
+// progress; the buffer it replaces is being scanned out until then. With three
+// buffers one is always free, with two the compositor has to wait for that
+// refresh before it can draw the next frame.
+//
+// A late submit, one made too close to the end of a refresh, may be picked up
+// at that refresh or only at the one after. Until then both the old and the
+// new buffer may be scanned out, and nothing else can be submitted. A late
+// submit can't replace a buffer that is still pending either.
+typedef struct {
+    int  count;
+    int  drawing;  // Buffer being rendered into, -1 while none is free
+    int  pending;  // Submitted, scanned out from the next refresh on, -1 if none
+    int  scanning; // Buffer the panel reads right now
+    int  wait;     // Refreshes until pending is surely scanned out
+    bool late;     // Pending was submitted late
+} display_buffers_t;
+
+void display_buffers_init(display_buffers_t *buffers, int count);
+bool display_buffers_submit(display_buffers_t *buffers, bool late);
+void display_buffers_refresh(display_buffers_t *buffers);
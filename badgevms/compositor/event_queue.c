@@ -0,0 +1,262 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "event_queue.h"
+
+#include <string.h>
+
+#define STATE_EVENTS ((1u << EVENT_WINDOW_RESIZE) | (1u << EVENT_QUIT))
+
+bool event_queue_init(event_queue_t *queue, unsigned int depth) {
+    memset(queue->events, 0, sizeof(queue->events));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->depth, WINDOW_DEFAULT_EVENTS);
+    atomic_init(&queue->pending, 0);
+    atomic_init(&queue->dropped, 0);
+    atomic_init(&queue->coalesced, 0);
+    return event_queue_depth_set(queue, depth);
+}
+
+// Safe at any time, events already queued beyond a smaller depth are kept
+bool event_queue_depth_set(event_queue_t *queue, unsigned int depth) {
+    if (depth < 1 || depth > WINDOW_MAX_EVENTS) {
+        return false;
+    }
+
+    atomic_store(&queue->depth, depth);
+    return true;
+}
+
+// Returns false if the event had to be dropped
+bool event_queue_push(event_queue_t *queue, event_t const *event) {
+    unsigned int state = (1u << event->type) & STATE_EVENTS;
+    if (state) {
+        if (atomic_fetch_or(&queue->pending, state) & state) {
+            atomic_fetch_add_explicit(&queue->coalesced, 1, memory_order_relaxed);
+        }
+        return true;
+    }
+
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head - tail >= atomic_load_explicit(&queue->depth, memory_order_relaxed)) {
+        // The key is already known to be down, the application misses nothing
+        if ((event->type == EVENT_KEY_DOWN) && event->keyboard.repeat) {
+            atomic_fetch_add_explicit(&queue->coalesced, 1, memory_order_relaxed);
+            return true;
+        }
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    queue->events[head % WINDOW_MAX_EVENTS] = *event;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+// State events come first, then queued events in order
+int event_queue_pop_many(event_queue_t *queue, event_t *events, int max_events) {
+    int n = 0;
+
+    if (max_events <= 0) {
+        return 0;
+    }
+
+    if (atomic_load_explicit(&queue->pending, memory_order_relaxed)) {
+        unsigned int pending = atomic_exchange(&queue->pending, 0);
+        for (event_type_t type = EVENT_NONE; pending; ++type) {
+            unsigned int bit = 1u << type;
+            if (!(pending & bit)) {
+                continue;
+            }
+            if (n == max_events) {
+                // No room, deliver these next time
+                atomic_fetch_or(&queue->pending, pending);
+                return n;
+            }
+            memset(&events[n], 0, sizeof(event_t));
+            events[n++].type  = type;
+            pending          &= ~bit;
+        }
+    }
+
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    while (n < max_events && tail != head) {
+        events[n++] = queue->events[tail % WINDOW_MAX_EVENTS];
+        ++tail;
+    }
+
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    return n;
+}
+
+#ifdef RUN_TEST
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define STRESS_EVENTS 200000
+
+static event_queue_t stress_queue;
+
+static event_t key(uint64_t n, bool repeat) {
+    event_t e;
+    memset(&e, 0, sizeof(event_t));
+    e.type               = EVENT_KEY_DOWN;
+    e.keyboard.timestamp = n;
+    e.keyboard.down      = true;
+    e.keyboard.repeat    = repeat;
+    return e;
+}
+
+static void *producer(void *ignored) {
+    (void)ignored;
+    for (uint64_t i = 0; i < STRESS_EVENTS; ++i) {
+        event_t e = key(i, false);
+        while (!event_queue_push(&stress_queue, &e)) {
+            sched_yield();
+        }
+        if (i % 1000 == 0) {
+            event_t resize = {.type = EVENT_WINDOW_RESIZE};
+            event_queue_push(&stress_queue, &resize);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    bool          error = false;
+    event_queue_t q;
+    event_t       out[WINDOW_MAX_EVENTS + 2];
+
+    if (event_queue_init(&q, 0) || event_queue_init(&q, WINDOW_MAX_EVENTS + 1)) {
+        printf("\033[31mQueue set up with a depth out of range\033[0m\n");
+        error = true;
+    }
+
+    event_queue_init(&q, 4);
+    if (event_queue_pop_many(&q, out, 8) != 0) {
+        printf("\033[31mEmpty queue returned events\033[0m\n");
+        error = true;
+    }
+
+    // Fill to the configured depth, further keys are lost, repeats coalesced
+    for (int i = 0; i < 4; ++i) {
+        event_t e = key(i, false);
+        if (!event_queue_push(&q, &e)) {
+            printf("\033[31mPush %d into a queue of 4 failed\033[0m\n", i);
+            error = true;
+        }
+    }
+    event_t e = key(4, false);
+    if (event_queue_push(&q, &e) || atomic_load(&q.dropped) != 1) {
+        printf("\033[31mPush into a full queue was not dropped\033[0m\n");
+        error = true;
+    }
+    e = key(5, true);
+    if (!event_queue_push(&q, &e) || atomic_load(&q.coalesced) != 1) {
+        printf("\033[31mRepeat into a full queue was not coalesced\033[0m\n");
+        error = true;
+    }
+
+    // Any number of resizes end up as one, and come first
+    event_t resize = {.type = EVENT_WINDOW_RESIZE};
+    for (int i = 0; i < 5; ++i) {
+        event_queue_push(&q, &resize);
+    }
+    if (atomic_load(&q.coalesced) != 5) {
+        printf("\033[31mExpected 5 coalesced events, got %u\033[0m\n", atomic_load(&q.coalesced));
+        error = true;
+    }
+
+    // Batches of two
+    int n = event_queue_pop_many(&q, out, 2);
+    if (n != 2 || out[0].type != EVENT_WINDOW_RESIZE || out[1].keyboard.timestamp != 0) {
+        printf("\033[31mFirst batch is wrong\033[0m\n");
+        error = true;
+    }
+    n = event_queue_pop_many(&q, out, 8);
+    if (n != 3 || out[0].keyboard.timestamp != 1 || out[2].keyboard.timestamp != 3) {
+        printf("\033[31mSecond batch is wrong\033[0m\n");
+        error = true;
+    }
+
+    // State events that don't fit stay pending
+    event_t quit = {.type = EVENT_QUIT};
+    event_queue_push(&q, &quit);
+    event_queue_push(&q, &resize);
+    if (event_queue_pop_many(&q, out, 1) != 1 || out[0].type != EVENT_QUIT ||
+        event_queue_pop_many(&q, out, 1) != 1 || out[0].type != EVENT_WINDOW_RESIZE ||
+        event_queue_pop_many(&q, out, 1) != 0) {
+        printf("\033[31mState events got lost\033[0m\n");
+        error = true;
+    }
+
+    // Depth limits
+    if (event_queue_depth_set(&q, 0) || event_queue_depth_set(&q, WINDOW_MAX_EVENTS + 1) ||
+        !event_queue_depth_set(&q, WINDOW_MAX_EVENTS)) {
+        printf("\033[31mDepth limits are not enforced\033[0m\n");
+        error = true;
+    }
+    for (int i = 0; i < WINDOW_MAX_EVENTS + 2; ++i) {
+        e = key(i, false);
+        event_queue_push(&q, &e);
+    }
+    if (event_queue_pop_many(&q, out, WINDOW_MAX_EVENTS + 2) != WINDOW_MAX_EVENTS) {
+        printf("\033[31mQueue of maximum depth does not hold %d events\033[0m\n", WINDOW_MAX_EVENTS);
+        error = true;
+    }
+
+    // Producer and consumer on different threads, nothing lost or reordered
+    event_queue_init(&stress_queue, WINDOW_DEFAULT_EVENTS);
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer, NULL);
+    uint64_t next    = 0;
+    int      resizes = 0;
+    while (next < STRESS_EVENTS && !error) {
+        n = event_queue_pop_many(&stress_queue, out, 7);
+        if (!n) {
+            sched_yield();
+        }
+        for (int i = 0; i < n; ++i) {
+            if (out[i].type == EVENT_WINDOW_RESIZE) {
+                ++resizes;
+            } else if (out[i].keyboard.timestamp != next++) {
+                printf("\033[31mStress: expected event %llu\033[0m\n", (unsigned long long)next - 1);
+                error = true;
+                break;
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+    resizes += event_queue_pop_many(&stress_queue, out, 1);
+    if (!resizes || resizes > STRESS_EVENTS / 1000) {
+        printf("\033[31mStress: %d resize events delivered\033[0m\n", resizes);
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
@@ -0,0 +1,44 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/event.h"
+#include "badgevms_config.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// A window's events. The compositor is the only producer and the application
+// the only consumer, so neither ever takes a lock. Window state events (resize,
+// quit) only say that something happened and are kept as pending flags
+// instead, so any number of them take up no room.
+typedef struct {
+    event_t     events[WINDOW_MAX_EVENTS];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint depth;     // How many of events[] are used, at most WINDOW_MAX_EVENTS
+    atomic_uint pending;   // State events waiting for delivery, one bit per event type
+    atomic_uint dropped;   // Events lost because the queue was full
+    atomic_uint coalesced; // Events merged into one already queued
+} event_queue_t;
+
+// False if depth is out of range, the queue is then unusable
+bool event_queue_init(event_queue_t *queue, unsigned int depth);
+bool event_queue_depth_set(event_queue_t *queue, unsigned int depth);
+bool event_queue_push(event_queue_t *queue, event_t const *event);
+int  event_queue_pop_many(event_queue_t *queue, event_t *events, int max_events);
@@ -0,0 +1,468 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framebuffer_pages.h"
+
+#ifdef RUN_TEST
+#define SOC_MMU_PAGE_SIZE 0x10000
+#else
+#include "memory.h"
+#endif
+
+#include <string.h>
+
+static size_t bytes_to_pages(size_t bytes) {
+    size_t pages = (bytes + SOC_MMU_PAGE_SIZE - 1) / SOC_MMU_PAGE_SIZE;
+    return pages ? pages : 1;
+}
+
+// framebuffer_vaddr_allocate() reports the pages it was asked for, the buddy
+// block behind it is the next power of two
+static size_t vaddr_block_pages(size_t pages) {
+    size_t block = 1;
+    while (block < pages) {
+        block <<= 1;
+    }
+    return block;
+}
+
+static bool vaddr_allocate(framebuffer_pages_t *pages, size_t mapped, framebuffer_page_ops_t const *ops) {
+    size_t    vaddr_pages = 0;
+    uintptr_t vaddr       = ops->vaddr_allocate((mapped + 1) * SOC_MMU_PAGE_SIZE, &vaddr_pages);
+    if (!vaddr) {
+        return false;
+    }
+
+    pages->vaddr       = vaddr;
+    pages->vaddr_pages = vaddr_block_pages(vaddr_pages);
+    return true;
+}
+
+bool framebuffer_pages_init(framebuffer_pages_t *pages, size_t bytes, framebuffer_page_ops_t const *ops) {
+    size_t mapped = bytes_to_pages(bytes);
+
+    memset(pages, 0, sizeof(framebuffer_pages_t));
+    if (!vaddr_allocate(pages, mapped, ops)) {
+        return false;
+    }
+
+    if (!ops->pages_allocate(pages->vaddr, mapped, &pages->head, &pages->tail)) {
+        ops->vaddr_deallocate(pages->vaddr);
+        memset(pages, 0, sizeof(framebuffer_pages_t));
+        return false;
+    }
+
+    ops->map(pages->head, pages->tail);
+    pages->mapped = mapped;
+    return true;
+}
+
+void framebuffer_pages_free(framebuffer_pages_t *pages, framebuffer_page_ops_t const *ops) {
+    if (pages->head) {
+        ops->unmap(pages->head);
+        ops->pages_deallocate(pages->head);
+    }
+    if (pages->vaddr) {
+        ops->vaddr_deallocate(pages->vaddr);
+    }
+    memset(pages, 0, sizeof(framebuffer_pages_t));
+}
+
+// Recompute the vaddr of every range for a new base, the MMU is not touched
+void framebuffer_pages_rebase(framebuffer_pages_t *pages, uintptr_t vaddr) {
+    uintptr_t cur_vaddr = vaddr + pages->mapped * SOC_MMU_PAGE_SIZE;
+
+    for (allocation_range_t *r = pages->head; r; r = r->next) {
+        cur_vaddr      -= r->size;
+        r->vaddr_start  = cur_vaddr;
+    }
+}
+
+// Release whole ranges from the top until no more than wanted pages remain
+static framebuffer_resize_t shrink(framebuffer_pages_t *pages, size_t wanted, framebuffer_page_ops_t const *ops) {
+    allocation_range_t *released      = pages->head;
+    allocation_range_t *released_tail = NULL;
+    size_t              mapped        = pages->mapped;
+
+    for (allocation_range_t *r = pages->head; r != pages->tail; r = r->next) {
+        size_t range_pages = r->size / SOC_MMU_PAGE_SIZE;
+        if (mapped - range_pages < wanted) {
+            break;
+        }
+        mapped        -= range_pages;
+        released_tail  = r;
+    }
+
+    if (!released_tail) {
+        return FRAMEBUFFER_RESIZE_UNCHANGED;
+    }
+
+    pages->head         = released_tail->next;
+    released_tail->next = NULL;
+
+    // Dirty lines have to reach the pages while they are still mapped here
+    ops->writeback(released_tail->vaddr_start, (pages->mapped - mapped) * SOC_MMU_PAGE_SIZE);
+    ops->unmap(released);
+    ops->pages_deallocate(released);
+
+    pages->mapped = mapped;
+    return FRAMEBUFFER_RESIZE_SHRUNK;
+}
+
+static framebuffer_resize_t grow(framebuffer_pages_t *pages, size_t wanted, framebuffer_page_ops_t const *ops) {
+    framebuffer_pages_t old   = *pages;
+    allocation_range_t *head  = NULL;
+    allocation_range_t *tail  = NULL;
+    bool                moved = wanted + 1 > pages->vaddr_pages;
+
+    if (moved && !vaddr_allocate(pages, wanted, ops)) {
+        *pages = old;
+        return FRAMEBUFFER_RESIZE_FAILED;
+    }
+
+    // Only the delta is allocated, it goes right above the pages we keep
+    if (!ops->pages_allocate(pages->vaddr + old.mapped * SOC_MMU_PAGE_SIZE, wanted - old.mapped, &head, &tail)) {
+        if (moved) {
+            ops->vaddr_deallocate(pages->vaddr);
+        }
+        *pages = old;
+        return FRAMEBUFFER_RESIZE_FAILED;
+    }
+
+    if (moved) {
+        ops->writeback(old.vaddr, old.mapped * SOC_MMU_PAGE_SIZE);
+        ops->unmap(pages->head);
+        framebuffer_pages_rebase(pages, pages->vaddr);
+        ops->map(pages->head, pages->tail);
+        ops->vaddr_deallocate(old.vaddr);
+    }
+
+    ops->map(head, tail);
+    tail->next    = pages->head;
+    pages->head   = head;
+    pages->mapped = wanted;
+
+    return moved ? FRAMEBUFFER_RESIZE_RELOCATED : FRAMEBUFFER_RESIZE_GREW;
+}
+
+// Resize in place where possible. Pages that stay keep their contents, on
+// failure nothing changed.
+framebuffer_resize_t
+    framebuffer_pages_resize(framebuffer_pages_t *pages, size_t bytes, framebuffer_page_ops_t const *ops) {
+    size_t wanted = bytes_to_pages(bytes);
+
+    if (wanted < pages->mapped) {
+        return shrink(pages, wanted, ops);
+    }
+    if (wanted > pages->mapped) {
+        return grow(pages, wanted, ops);
+    }
+    return FRAMEBUFFER_RESIZE_UNCHANGED;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_VADDR_BASE 0x48000000
+#define TEST_VADDR_SIZE 1024
+#define TEST_PHYS_PAGES 96
+
+static uintptr_t mmu[TEST_VADDR_SIZE];
+static bool      phys_used[TEST_PHYS_PAGES];
+static uintptr_t vaddr_next = TEST_VADDR_BASE;
+static int       vaddr_live;
+static int       pages_allocated;
+static bool      fail_pages;
+static bool      error;
+
+static void fail(char const *what) {
+    printf("\033[31m%s\033[0m\n", what);
+    error = true;
+}
+
+static uintptr_t *mmu_entry(uintptr_t vaddr) {
+    return &mmu[(vaddr - TEST_VADDR_BASE) / SOC_MMU_PAGE_SIZE];
+}
+
+static uintptr_t test_vaddr_allocate(size_t size, size_t *out_pages) {
+    size_t    pages = (size + SOC_MMU_PAGE_SIZE - 1) / SOC_MMU_PAGE_SIZE;
+    size_t    block = vaddr_block_pages(pages);
+    uintptr_t vaddr = vaddr_next;
+
+    // Never reused, so a stale mapping of a freed block is always caught
+    vaddr_next += block * SOC_MMU_PAGE_SIZE;
+    *out_pages  = pages;
+    vaddr_live++;
+    return vaddr;
+}
+
+static void test_vaddr_deallocate(uintptr_t start_address) {
+    if (*mmu_entry(start_address)) {
+        fail("Freed vaddr block is still mapped");
+    }
+    vaddr_live--;
+}
+
+static bool test_pages_allocate(
+    uintptr_t vaddr_start, uintptr_t pages, allocation_range_t **head_range, allocation_range_t **tail_range
+) {
+    *head_range = NULL;
+    *tail_range = NULL;
+    if (fail_pages) {
+        return false;
+    }
+
+    for (uintptr_t i = 0; i < pages; ++i) {
+        int p = 1;
+        while (p < TEST_PHYS_PAGES && phys_used[p]) {
+            ++p;
+        }
+        if (p == TEST_PHYS_PAGES) {
+            while (*head_range) {
+                allocation_range_t *n = (*head_range)->next;
+                phys_used[(*head_range)->paddr_start / SOC_MMU_PAGE_SIZE] = false;
+                pages_allocated--;
+                free(*head_range);
+                *head_range = n;
+            }
+            *tail_range = NULL;
+            return false;
+        }
+
+        allocation_range_t *r = malloc(sizeof(allocation_range_t));
+        phys_used[p]          = true;
+        pages_allocated++;
+        r->vaddr_start = vaddr_start + i * SOC_MMU_PAGE_SIZE;
+        r->paddr_start = p * SOC_MMU_PAGE_SIZE;
+        r->size        = SOC_MMU_PAGE_SIZE;
+        r->next        = *head_range;
+        if (!*tail_range) {
+            *tail_range = r;
+        }
+        *head_range = r;
+    }
+    return true;
+}
+
+static void test_pages_deallocate(allocation_range_t *head_range) {
+    while (head_range) {
+        allocation_range_t *n = head_range->next;
+        phys_used[head_range->paddr_start / SOC_MMU_PAGE_SIZE] = false;
+        pages_allocated--;
+        free(head_range);
+        head_range = n;
+    }
+}
+
+static void test_map(allocation_range_t *head_range, allocation_range_t *tail_range) {
+    (void)tail_range;
+    for (allocation_range_t *r = head_range; r; r = r->next) {
+        if (*mmu_entry(r->vaddr_start)) {
+            fail("Mapping over an existing entry");
+        }
+        *mmu_entry(r->vaddr_start) = r->paddr_start;
+    }
+}
+
+static void test_unmap(allocation_range_t *head_range) {
+    for (allocation_range_t *r = head_range; r; r = r->next) {
+        if (*mmu_entry(r->vaddr_start) != r->paddr_start) {
+            fail("Unmapping an entry that is not mapped");
+        }
+        *mmu_entry(r->vaddr_start) = 0;
+    }
+}
+
+static void test_writeback(uintptr_t vaddr_start, size_t size) {
+    for (size_t off = 0; off < size; off += SOC_MMU_PAGE_SIZE) {
+        if (!*mmu_entry(vaddr_start + off)) {
+            fail("Writing back an unmapped page");
+            break;
+        }
+    }
+}
+
+static framebuffer_page_ops_t const ops = {
+    .vaddr_allocate   = test_vaddr_allocate,
+    .vaddr_deallocate = test_vaddr_deallocate,
+    .pages_allocate   = test_pages_allocate,
+    .pages_deallocate = test_pages_deallocate,
+    .map              = test_map,
+    .unmap            = test_unmap,
+    .writeback        = test_writeback,
+};
+
+static int mapped_entries(void) {
+    int count = 0;
+    for (int i = 0; i < TEST_VADDR_SIZE; ++i) {
+        count += mmu[i] != 0;
+    }
+    return count;
+}
+
+static bool check(framebuffer_pages_t const *fb, char const *when) {
+    uintptr_t expect = fb->vaddr + fb->mapped * SOC_MMU_PAGE_SIZE;
+    size_t    count  = 0;
+
+    for (allocation_range_t *r = fb->head; r; r = r->next) {
+        expect -= r->size;
+        if (r->vaddr_start != expect || *mmu_entry(r->vaddr_start) != r->paddr_start) {
+            printf("\033[31m%s: range list does not match the mmu\033[0m\n", when);
+            return false;
+        }
+        count += r->size / SOC_MMU_PAGE_SIZE;
+        if (!r->next && r != fb->tail) {
+            printf("\033[31m%s: tail is not the last range\033[0m\n", when);
+            return false;
+        }
+    }
+
+    if (count != fb->mapped || expect != fb->vaddr) {
+        printf("\033[31m%s: %zu pages listed, %zu mapped\033[0m\n", when, count, fb->mapped);
+        return false;
+    }
+    if (fb->mapped + 1 > fb->vaddr_pages || *mmu_entry(fb->vaddr + fb->mapped * SOC_MMU_PAGE_SIZE)) {
+        printf("\033[31m%s: guard page is missing\033[0m\n", when);
+        return false;
+    }
+    return true;
+}
+
+static void snapshot(framebuffer_pages_t const *fb, uintptr_t *paddrs) {
+    for (size_t i = 0; i < fb->mapped; ++i) {
+        paddrs[i] = *mmu_entry(fb->vaddr + i * SOC_MMU_PAGE_SIZE);
+    }
+}
+
+int main() {
+    framebuffer_pages_t fb;
+    uintptr_t           before[TEST_PHYS_PAGES];
+    uintptr_t           after[TEST_PHYS_PAGES];
+
+    // 320x200 RGB565 is two pages, the vaddr block has room for three
+    if (!framebuffer_pages_init(&fb, 320 * 200 * 2, &ops) || fb.mapped != 2 || fb.vaddr_pages != 4) {
+        fail("Initial allocation is wrong");
+    }
+    if (!check(&fb, "init")) {
+        error = true;
+    }
+
+    // Growing within the vaddr block reuses everything and allocates the delta
+    snapshot(&fb, before);
+    uintptr_t vaddr     = fb.vaddr;
+    int       allocated = pages_allocated;
+    if (framebuffer_pages_resize(&fb, 3 * SOC_MMU_PAGE_SIZE, &ops) != FRAMEBUFFER_RESIZE_GREW) {
+        fail("Growing within the vaddr block did not grow in place");
+    }
+    snapshot(&fb, after);
+    if (fb.vaddr != vaddr || pages_allocated != allocated + 1 || memcmp(before, after, 2 * sizeof(uintptr_t))) {
+        fail("Growing in place did not keep the existing pages");
+    }
+    if (!check(&fb, "grow")) {
+        error = true;
+    }
+
+    // Growing past it relocates, the existing pages move along
+    snapshot(&fb, before);
+    allocated = pages_allocated;
+    if (framebuffer_pages_resize(&fb, 720 * 720 * 2, &ops) != FRAMEBUFFER_RESIZE_RELOCATED) {
+        fail("Growing past the vaddr block did not relocate");
+    }
+    snapshot(&fb, after);
+    if (fb.vaddr == vaddr || fb.mapped != 16 || pages_allocated != allocated + 13 ||
+        memcmp(before, after, 3 * sizeof(uintptr_t))) {
+        fail("Relocation did not keep the existing pages");
+    }
+    if (vaddr_live != 1) {
+        fail("Old vaddr block was not released");
+    }
+    if (!check(&fb, "relocate")) {
+        error = true;
+    }
+
+    // Shrinking releases exactly the pages on top
+    snapshot(&fb, before);
+    vaddr = fb.vaddr;
+    if (framebuffer_pages_resize(&fb, 360 * 360 * 2, &ops) != FRAMEBUFFER_RESIZE_SHRUNK) {
+        fail("Shrinking did not shrink");
+    }
+    snapshot(&fb, after);
+    if (fb.vaddr != vaddr || fb.mapped != 4 || pages_allocated != 4 || memcmp(before, after, 4 * sizeof(uintptr_t))) {
+        fail("Shrinking did not keep the bottom pages");
+    }
+    if (!check(&fb, "shrink")) {
+        error = true;
+    }
+
+    // And growing back stays in the now larger vaddr block
+    if (framebuffer_pages_resize(&fb, 720 * 720 * 2, &ops) != FRAMEBUFFER_RESIZE_GREW || fb.vaddr != vaddr) {
+        fail("Growing back did not reuse the vaddr block");
+    }
+    if (!check(&fb, "regrow")) {
+        error = true;
+    }
+
+    if (framebuffer_pages_resize(&fb, 720 * 720 * 2, &ops) != FRAMEBUFFER_RESIZE_UNCHANGED) {
+        fail("Resizing to the same size changed something");
+    }
+
+    // Failures leave everything as it was
+    framebuffer_pages_resize(&fb, SOC_MMU_PAGE_SIZE, &ops);
+    snapshot(&fb, before);
+    fail_pages = true;
+    if (framebuffer_pages_resize(&fb, 4 * SOC_MMU_PAGE_SIZE, &ops) != FRAMEBUFFER_RESIZE_FAILED ||
+        framebuffer_pages_resize(&fb, 100 * SOC_MMU_PAGE_SIZE, &ops) != FRAMEBUFFER_RESIZE_FAILED) {
+        fail("Resizing without pages did not fail");
+    }
+    fail_pages = false;
+    snapshot(&fb, after);
+    if (fb.mapped != 1 || before[0] != after[0] || vaddr_live != 1) {
+        fail("Failed resize changed the framebuffer");
+    }
+    if (!check(&fb, "failed")) {
+        error = true;
+    }
+
+    // Random sequences of two framebuffers, including running out of pages
+    framebuffer_pages_t other;
+    framebuffer_pages_init(&other, SOC_MMU_PAGE_SIZE, &ops);
+    srand(1234);
+    for (int i = 0; i < 5000 && !error; ++i) {
+        framebuffer_pages_t *target = (rand() & 1) ? &fb : &other;
+        size_t               pages  = 1 + rand() % 60;
+        framebuffer_pages_resize(target, pages * SOC_MMU_PAGE_SIZE - rand() % SOC_MMU_PAGE_SIZE, &ops);
+        if (!check(&fb, "random") || !check(&other, "random")) {
+            error = true;
+        }
+        if (pages_allocated != (int)(fb.mapped + other.mapped) || mapped_entries() != pages_allocated) {
+            fail("Page accounting drifted");
+        }
+    }
+
+    framebuffer_pages_free(&fb, &ops);
+    framebuffer_pages_free(&other, &ops);
+    if (pages_allocated || vaddr_live || mapped_entries()) {
+        fail("Freeing leaked pages or mappings");
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
@@ -0,0 +1,75 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "allocation_range.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The pages behind one framebuffer. The vaddr allocation is followed by an
+// unmapped guard page, and since the buddy allocator hands out power of two
+// blocks it usually has room to grow without moving.
+typedef struct {
+    uintptr_t           vaddr;
+    size_t              vaddr_pages; // Size of the vaddr block, including the guard page
+    size_t              mapped;      // Pages mapped from vaddr upwards
+    allocation_range_t *head;        // Highest mapped range
+    allocation_range_t *tail;        // Lowest mapped range
+} framebuffer_pages_t;
+
+// The memory.c primitives, indirected so the sequencing can be tested on the host
+typedef struct {
+    uintptr_t (*vaddr_allocate)(size_t size, size_t *out_pages);
+    void (*vaddr_deallocate)(uintptr_t start_address);
+    bool (*pages_allocate)(
+        uintptr_t vaddr_start, uintptr_t pages, allocation_range_t **head_range, allocation_range_t **tail_range
+    );
+    void (*pages_deallocate)(allocation_range_t *head_range);
+    void (*map)(allocation_range_t *head_range, allocation_range_t *tail_range);
+    void (*unmap)(allocation_range_t *head_range);
+    void (*writeback)(uintptr_t vaddr_start, size_t size); // Write back and invalidate
+} framebuffer_page_ops_t;
+
+typedef enum {
+    FRAMEBUFFER_RESIZE_FAILED,
+    FRAMEBUFFER_RESIZE_UNCHANGED,
+    FRAMEBUFFER_RESIZE_SHRUNK,
+    FRAMEBUFFER_RESIZE_GREW,      // Pages from the old mapped size onwards are new
+    FRAMEBUFFER_RESIZE_RELOCATED, // Same as GREW, but vaddr changed
+} framebuffer_resize_t;
+
+bool framebuffer_pages_init(framebuffer_pages_t *pages, size_t bytes, framebuffer_page_ops_t const *ops);
+void framebuffer_pages_free(framebuffer_pages_t *pages, framebuffer_page_ops_t const *ops);
+void framebuffer_pages_rebase(framebuffer_pages_t *pages, uintptr_t vaddr);
+
+framebuffer_resize_t
+    framebuffer_pages_resize(framebuffer_pages_t *pages, size_t bytes, framebuffer_page_ops_t const *ops);
+
+// Trade mapped pages between two framebuffers after their MMU entries were swapped
+__attribute__((always_inline)) static inline void
+    framebuffer_pages_exchange(framebuffer_pages_t *a, framebuffer_pages_t *b) {
+    framebuffer_pages_t tmp = *a;
+
+    a->head   = b->head;
+    a->tail   = b->tail;
+    a->mapped = b->mapped;
+    b->head   = tmp.head;
+    b->tail   = tmp.tail;
+    b->mapped = tmp.mapped;
+}
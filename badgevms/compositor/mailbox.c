@@ -0,0 +1,188 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mailbox.h"
+
+#include <string.h>
+
+__attribute__((always_inline)) static inline void mailbox_swap(mailbox_t *mailbox, mailbox_slot_t a, mailbox_slot_t b) {
+    uint8_t  buffer    = mailbox->buffer[a];
+    uint32_t frame     = mailbox->frame[a];
+    mailbox->buffer[a] = mailbox->buffer[b];
+    mailbox->frame[a]  = mailbox->frame[b];
+    mailbox->buffer[b] = buffer;
+    mailbox->frame[b]  = frame;
+}
+
+void mailbox_init(mailbox_t *mailbox) {
+    memset(mailbox, 0, sizeof(mailbox_t));
+    for (int i = 0; i < MAILBOX_SLOTS; ++i) {
+        mailbox->buffer[i] = i;
+    }
+    mailbox->next_frame = 1;
+}
+
+// The application finished rendering into BACK. The new frame always goes
+// into the mailbox, so the caller swaps BACK and MAILBOX. Returns true if the
+// mailbox still held a frame the compositor never picked up, which is now
+// dropped and becomes the application's next render target.
+bool mailbox_present(mailbox_t *mailbox) {
+    bool dropped = mailbox->full;
+
+    mailbox->frame[MAILBOX_SLOT_BACK] = mailbox->next_frame++;
+    mailbox_swap(mailbox, MAILBOX_SLOT_BACK, MAILBOX_SLOT_MAILBOX);
+    mailbox->full = true;
+
+    mailbox->presented++;
+    if (dropped) {
+        mailbox->dropped++;
+    }
+
+    return dropped;
+}
+
+// Called by the compositor once per refresh. Returns true if there is a new
+// frame, in which case the caller swaps MAILBOX and FRONT before composing.
+bool mailbox_latch(mailbox_t *mailbox) {
+    if (!mailbox->full) {
+        return false;
+    }
+
+    mailbox_swap(mailbox, MAILBOX_SLOT_MAILBOX, MAILBOX_SLOT_FRONT);
+    mailbox->full = false;
+    mailbox->latched++;
+    return true;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define TEST_RNG_SEED 0xC0FFEE
+#include "test_rng.h"
+
+static bool check_invariants(mailbox_t const *m, char const *when) {
+    bool seen[MAILBOX_SLOTS] = {false};
+    for (int i = 0; i < MAILBOX_SLOTS; ++i) {
+        if (m->buffer[i] >= MAILBOX_SLOTS || seen[m->buffer[i]]) {
+            printf("\033[31m%s: buffers are not a permutation\033[0m\n", when);
+            return false;
+        }
+        seen[m->buffer[i]] = true;
+    }
+
+    if (m->full && m->frame[MAILBOX_SLOT_MAILBOX] <= m->frame[MAILBOX_SLOT_FRONT]) {
+        printf("\033[31m%s: mailbox holds an older frame than the front buffer\033[0m\n", when);
+        return false;
+    }
+
+    if (m->presented != m->latched + m->dropped + (m->full ? 1 : 0)) {
+        printf(
+            "\033[31m%s: %u presented != %u latched + %u dropped + %d pending\033[0m\n",
+            when,
+            m->presented,
+            m->latched,
+            m->dropped,
+            m->full
+        );
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    bool      error = false;
+    mailbox_t m;
+
+    mailbox_init(&m);
+
+    // Nothing to latch initially
+    if (mailbox_latch(&m)) {
+        printf("\033[31mEmpty mailbox latched a frame\033[0m\n");
+        error = true;
+    }
+
+    // One frame goes straight through
+    uint8_t rendered = m.buffer[MAILBOX_SLOT_BACK];
+    if (mailbox_present(&m)) {
+        printf("\033[31mFirst present reported a drop\033[0m\n");
+        error = true;
+    }
+    if (!mailbox_latch(&m) || m.buffer[MAILBOX_SLOT_FRONT] != rendered || m.frame[MAILBOX_SLOT_FRONT] != 1) {
+        printf("\033[31mFirst frame did not reach the front buffer\033[0m\n");
+        error = true;
+    }
+
+    // A fast application renders three frames per refresh, the compositor
+    // only ever shows the last one and the app never waits
+    for (int refresh = 0; refresh < 10; ++refresh) {
+        uint32_t last = 0;
+        for (int i = 0; i < 3; ++i) {
+            if (m.buffer[MAILBOX_SLOT_BACK] == m.buffer[MAILBOX_SLOT_FRONT]) {
+                printf("\033[31mApplication would render into the front buffer\033[0m\n");
+                error = true;
+            }
+            last = m.next_frame;
+            mailbox_present(&m);
+        }
+        mailbox_latch(&m);
+        if (m.frame[MAILBOX_SLOT_FRONT] != last) {
+            printf("\033[31mRefresh %d shows frame %u, expected %u\033[0m\n", refresh, m.frame[MAILBOX_SLOT_FRONT], last);
+            error = true;
+        }
+    }
+    if (m.dropped != 20) {
+        printf("\033[31mExpected 20 dropped frames, got %u\033[0m\n", m.dropped);
+        error = true;
+    }
+
+    // A slow application: refreshes without a new frame keep the old one
+    uint32_t shown = m.frame[MAILBOX_SLOT_FRONT];
+    if (mailbox_latch(&m) || m.frame[MAILBOX_SLOT_FRONT] != shown) {
+        printf("\033[31mLatching without a new frame changed the front buffer\033[0m\n");
+        error = true;
+    }
+
+    // Random interleavings
+    mailbox_init(&m);
+    uint32_t last_shown = 0;
+    for (int i = 0; i < 100000 && !error; ++i) {
+        if (rng() & 1) {
+            mailbox_present(&m);
+            if (!check_invariants(&m, "present")) {
+                error = true;
+            }
+        } else {
+            uint32_t newest = m.full ? m.frame[MAILBOX_SLOT_MAILBOX] : m.frame[MAILBOX_SLOT_FRONT];
+            mailbox_latch(&m);
+            if (!check_invariants(&m, "latch")) {
+                error = true;
+            }
+            if (m.frame[MAILBOX_SLOT_FRONT] != newest || m.frame[MAILBOX_SLOT_FRONT] < last_shown) {
+                printf("\033[31mFront buffer is not the newest completed frame\033[0m\n");
+                error = true;
+            }
+            last_shown = m.frame[MAILBOX_SLOT_FRONT];
+        }
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
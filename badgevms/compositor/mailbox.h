@@ -0,0 +1,48 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Buffer roles of a triple buffered ("mailbox") window. The application
+// always renders into BACK, the compositor always reads FRONT and MAILBOX
+// holds the most recently completed frame until the compositor latches it.
+// Roles are fixed virtual addresses; moving a frame between roles swaps the
+// physical pages behind them with framebuffer_swap().
+typedef enum {
+    MAILBOX_SLOT_BACK,
+    MAILBOX_SLOT_MAILBOX,
+    MAILBOX_SLOT_FRONT,
+    MAILBOX_SLOTS,
+} mailbox_slot_t;
+
+typedef struct {
+    uint8_t  buffer[MAILBOX_SLOTS]; // Which page set currently sits in each slot
+    uint32_t frame[MAILBOX_SLOTS];  // Frame number held by each slot, 0 for none
+    uint32_t next_frame;
+    bool     full;
+    uint32_t presented;
+    uint32_t dropped;
+    uint32_t latched;
+} mailbox_t;
+
+// Callers serialise these; the caller swaps the pages of the two slots
+// involved whenever a transition says so.
+void mailbox_init(mailbox_t *mailbox);
+bool mailbox_present(mailbox_t *mailbox);
+bool mailbox_latch(mailbox_t *mailbox);
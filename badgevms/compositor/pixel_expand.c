@@ -0,0 +1,237 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pixel_expand.h"
+
+#include <string.h>
+
+#ifndef RUN_TEST
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+// Replicate the top bits into the bottom ones so black and white stay exact
+void expand_lut_rgb332(uint16_t *lut) {
+    for (int i = 0; i < PIXEL_EXPAND_LUT_SIZE; ++i) {
+        uint16_t r3 = (i >> 5) & 0x7;
+        uint16_t g3 = (i >> 2) & 0x7;
+        uint16_t b2 = i & 0x3;
+
+        uint16_t r5 = (r3 << 2) | (r3 >> 1);
+        uint16_t g6 = (g3 << 3) | g3;
+        uint16_t b5 = (b2 << 3) | (b2 << 1) | (b2 >> 1);
+
+        lut[i] = (r5 << 11) | (g6 << 5) | b5;
+    }
+}
+
+// Colors are 0x00RRGGBB
+void expand_lut_palette(uint16_t *lut, int first, int count, uint32_t const *colors) {
+    for (int i = 0; i < count && first + i < PIXEL_EXPAND_LUT_SIZE; ++i) {
+        lut[first + i] = xrgb8888_to_rgb565(colors[i]);
+    }
+}
+
+// memcpy keeps the word accesses free of aliasing trouble and compiles to
+// single loads and stores on aligned pointers
+__attribute__((always_inline)) static inline uint32_t load32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((always_inline)) static inline void store_pair(uint16_t *p, uint16_t lo, uint16_t hi) {
+    uint32_t v = lo | ((uint32_t)hi << 16);
+    memcpy(p, &v, sizeof(v));
+}
+
+// Four source pixels per load and two destination pixels per store once the
+// source is word aligned. Framebuffers are page aligned, so in practice dst
+// is word aligned whenever src is.
+IRAM_ATTR void expand_8bpp(uint16_t *dst, uint8_t const *src, size_t count, uint16_t const *lut) {
+    while (count && ((uintptr_t)src & 3)) {
+        *dst++ = lut[*src++];
+        count--;
+    }
+
+    if (!((uintptr_t)dst & 3)) {
+        for (; count >= 8; count -= 8) {
+            uint32_t a = load32(src);
+            uint32_t b = load32(src + 4);
+
+            store_pair(dst, lut[a & 0xff], lut[(a >> 8) & 0xff]);
+            store_pair(dst + 2, lut[(a >> 16) & 0xff], lut[a >> 24]);
+            store_pair(dst + 4, lut[b & 0xff], lut[(b >> 8) & 0xff]);
+            store_pair(dst + 6, lut[(b >> 16) & 0xff], lut[b >> 24]);
+            src += 8;
+            dst += 8;
+        }
+    } else {
+        for (; count >= 4; count -= 4) {
+            uint32_t a = load32(src);
+
+            dst[0]  = lut[a & 0xff];
+            dst[1]  = lut[(a >> 8) & 0xff];
+            dst[2]  = lut[(a >> 16) & 0xff];
+            dst[3]  = lut[a >> 24];
+            src    += 4;
+            dst    += 4;
+        }
+    }
+
+    while (count--) {
+        *dst++ = lut[*src++];
+    }
+}
+
+IRAM_ATTR void
+    expand_8bpp_rect(uint16_t *dst, uint8_t const *src, size_t stride, size_t w, size_t h, uint16_t const *lut) {
+    for (size_t y = 0; y < h; ++y) {
+        expand_8bpp(dst + y * w, src + y * stride, w, lut);
+    }
+}
+
+#ifdef RUN_TEST
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_W 720
+#define TEST_H 720
+
+static uint8_t  src[TEST_W * TEST_H + 16];
+static uint16_t dst[TEST_W * TEST_H + 16];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reference_expand(uint16_t *d, uint8_t const *s, size_t count, uint16_t const *lut) {
+    for (size_t i = 0; i < count; ++i) {
+        d[i] = lut[s[i]];
+    }
+}
+
+int main() {
+    bool     error = false;
+    uint16_t lut[PIXEL_EXPAND_LUT_SIZE];
+    uint16_t expect[64];
+
+    // RGB332 keeps the extremes and every channel is monotonic
+    expand_lut_rgb332(lut);
+    if (lut[0x00] != 0x0000 || lut[0xff] != 0xffff || lut[0xe0] != 0xf800 || lut[0x1c] != 0x07e0 ||
+        lut[0x03] != 0x001f) {
+        printf("\033[31mRGB332 primaries expand wrong\033[0m\n");
+        error = true;
+    }
+    for (int r = 1; r < 8; ++r) {
+        if ((lut[r << 5] >> 11) <= (lut[(r - 1) << 5] >> 11)) {
+            printf("\033[31mRGB332 red is not monotonic\033[0m\n");
+            error = true;
+        }
+    }
+
+    // Palette conversion, including clipping at the end of the table
+    uint32_t colors[4] = {0x000000, 0xffffff, 0xff0000, 0x0000ff};
+    expand_lut_palette(lut, 254, 4, colors);
+    if (lut[254] != 0x0000 || lut[255] != 0xffff || xrgb8888_to_rgb565(0xff0000) != 0xf800 ||
+        xrgb8888_to_rgb565(0x00ff00) != 0x07e0 || xrgb8888_to_rgb565(0x0000ff) != 0x001f) {
+        printf("\033[31mPalette conversion is wrong\033[0m\n");
+        error = true;
+    }
+
+    // Every alignment and tail length against the reference
+    for (int i = 0; i < PIXEL_EXPAND_LUT_SIZE; ++i) {
+        lut[i] = (uint16_t)(i * 2654435761u >> 7);
+    }
+    for (size_t i = 0; i < sizeof(src); ++i) {
+        src[i] = rand();
+    }
+    for (int src_off = 0; src_off < 4 && !error; ++src_off) {
+        for (int dst_off = 0; dst_off < 4 && !error; ++dst_off) {
+            for (size_t count = 0; count < 40; ++count) {
+                memset(dst, 0x5a, 64 * sizeof(uint16_t));
+                expand_8bpp(dst + dst_off, src + src_off, count, lut);
+                reference_expand(expect, src + src_off, count, lut);
+                if (memcmp(dst + dst_off, expect, count * sizeof(uint16_t)) || dst[dst_off + count] != 0x5a5a) {
+                    printf("\033[31mExpansion wrong at src +%d dst +%d count %zu\033[0m\n", src_off, dst_off, count);
+                    error = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Blocks of a wider framebuffer come out as packed rows
+    for (int i = 0; i < 100 && !error; ++i) {
+        size_t x = rand() % TEST_W;
+        size_t y = rand() % TEST_H;
+        size_t w = 1 + rand() % (TEST_W - x);
+        size_t h = 1 + rand() % (TEST_H - y < 32 ? TEST_H - y : 32);
+
+        expand_8bpp_rect(dst, src + y * TEST_W + x, TEST_W, w, h, lut);
+        for (size_t row = 0; row < h && !error; ++row) {
+            for (size_t col = 0; col < w; ++col) {
+                if (dst[row * w + col] != lut[src[(y + row) * TEST_W + x + col]]) {
+                    printf("\033[31mBlock %zux%zu at %zu,%zu expanded wrong\033[0m\n", w, h, x, y);
+                    error = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Throughput of a full screen frame, the reference is the naive loop
+    int    frames = 50;
+    double t      = now();
+    for (int f = 0; f < frames; ++f) {
+        expand_8bpp(dst, src, TEST_W * TEST_H, lut);
+    }
+    double fast = (now() - t) / frames;
+
+    t = now();
+    for (int f = 0; f < frames; ++f) {
+        reference_expand(dst, src, TEST_W * TEST_H, lut);
+    }
+    double naive = (now() - t) / frames;
+
+    printf(
+        "Expanding %dx%d: %.0f us per frame (%.0f Mpixel/s), naive loop %.0f us\n",
+        TEST_W,
+        TEST_H,
+        fast * 1e6,
+        TEST_W * TEST_H / fast / 1e6,
+        naive * 1e6
+    );
+
+    expand_8bpp(dst, src, TEST_W * TEST_H, lut);
+    reference_expand(expect, src, 64, lut);
+    if (memcmp(dst, expect, sizeof(expect))) {
+        printf("\033[31mFull frame expansion is wrong\033[0m\n");
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
@@ -0,0 +1,34 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 8 bit framebuffer formats are expanded to RGB565 through a 256 entry
+// lookup table before the PPA scales and rotates them
+#define PIXEL_EXPAND_LUT_SIZE 256
+
+__attribute__((always_inline)) static inline uint16_t xrgb8888_to_rgb565(uint32_t color) {
+    return ((color >> 8) & 0xf800) | ((color >> 5) & 0x07e0) | ((color >> 3) & 0x001f);
+}
+
+void expand_lut_rgb332(uint16_t *lut);
+void expand_lut_palette(uint16_t *lut, int first, int count, uint32_t const *colors);
+void expand_8bpp(uint16_t *dst, uint8_t const *src, size_t count, uint16_t const *lut);
+// A w by h block of a framebuffer stride bytes wide into packed rows at dst
+void expand_8bpp_rect(uint16_t *dst, uint8_t const *src, size_t stride, size_t w, size_t h, uint16_t const *lut);
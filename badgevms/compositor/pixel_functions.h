@@ -98,9 +98,6 @@ __attribute__((always_inline)) inline static window_rect_t rect_intersection(win
     ){.x = left, .y = top, .w = (right > left) ? (right - left) : 0, .h = (bottom > top) ? (bottom - top) : 0};
 }
 
-small_rect_array_t rect_subtract(window_rect_t a, window_rect_t b);
-void               merge_rectangles(rect_array_t *arr);
-
 void draw_pixel_rotated(uint16_t *fb, int x, int y, uint16_t color);
 void draw_filled_rect_rotated(uint16_t *fb, int x, int y, int width, int height, uint16_t color);
 void draw_rect_rotated(uint16_t *fb, int x, int y, int width, int height, uint16_t color);
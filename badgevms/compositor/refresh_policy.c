@@ -0,0 +1,149 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "refresh_policy.h"
+
+void refresh_policy_init(refresh_policy_t *policy, int full_hz, int idle_hz, int64_t idle_after_us, int64_t now_us) {
+    policy->full_hz          = full_hz;
+    policy->idle_hz          = idle_hz;
+    policy->idle_after_us    = idle_after_us;
+    policy->last_activity_us = now_us;
+    policy->current_hz       = full_hz;
+    policy->switches         = 0;
+}
+
+// Called once per compositor pass, activity being presents, window commands,
+// input or anything else that changed the screen. Returns the rate the panel
+// should run at from now on.
+int refresh_policy_update(refresh_policy_t *policy, int64_t now_us, bool activity) {
+    int target = policy->full_hz;
+
+    if (activity) {
+        policy->last_activity_us = now_us;
+    } else if (now_us - policy->last_activity_us >= policy->idle_after_us) {
+        target = policy->idle_hz;
+    }
+
+    if (target != policy->current_hz) {
+        policy->current_hz = target;
+        policy->switches++;
+    }
+
+    return target;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define FULL_HZ  60
+#define IDLE_HZ  30
+#define IDLE_US  500000
+#define FRAME_US (1000000 / FULL_HZ)
+
+#define TEST_RNG_SEED 0x5EED
+#include "test_rng.h"
+
+int main() {
+    bool             error = false;
+    refresh_policy_t policy;
+    int64_t          now = 1000000;
+
+    refresh_policy_init(&policy, FULL_HZ, IDLE_HZ, IDLE_US, now);
+
+    // Stays at the full rate until the timeout passes
+    int hz = FULL_HZ;
+    while (now < 1000000 + IDLE_US - FRAME_US) {
+        now += FRAME_US;
+        hz   = refresh_policy_update(&policy, now, false);
+        if (hz != FULL_HZ) {
+            printf("\033[31mDropped to %d Hz after %lld us\033[0m\n", hz, (long long)(now - 1000000));
+            error = true;
+            break;
+        }
+    }
+
+    now += FRAME_US;
+    if (refresh_policy_update(&policy, now, false) != IDLE_HZ) {
+        printf("\033[31mDid not drop to the idle rate after the timeout\033[0m\n");
+        error = true;
+    }
+
+    // Idle passes come in at the lower rate and keep it there
+    for (int i = 0; i < 100; ++i) {
+        now += 1000000 / IDLE_HZ;
+        if (refresh_policy_update(&policy, now, false) != IDLE_HZ) {
+            printf("\033[31mLeft the idle rate without activity\033[0m\n");
+            error = true;
+            break;
+        }
+    }
+
+    // A single present snaps back immediately
+    now += 1000000 / IDLE_HZ;
+    if (refresh_policy_update(&policy, now, true) != FULL_HZ) {
+        printf("\033[31mActivity did not restore the full rate\033[0m\n");
+        error = true;
+    }
+
+    // And the timeout starts over
+    now += IDLE_US - FRAME_US;
+    if (refresh_policy_update(&policy, now, false) != FULL_HZ) {
+        printf("\033[31mTimeout did not restart after activity\033[0m\n");
+        error = true;
+    }
+
+    if (policy.switches != 2) {
+        printf("\033[31mExpected 2 rate switches, got %u\033[0m\n", policy.switches);
+        error = true;
+    }
+
+    // An application presenting every frame never lets the panel idle
+    refresh_policy_init(&policy, FULL_HZ, IDLE_HZ, IDLE_US, now);
+    for (int i = 0; i < 10000; ++i) {
+        now += FRAME_US;
+        if (refresh_policy_update(&policy, now, true) != FULL_HZ) {
+            printf("\033[31mDropped the rate under constant activity\033[0m\n");
+            error = true;
+            break;
+        }
+    }
+
+    // Random activity: the rate is idle exactly when the last activity is old enough
+    refresh_policy_init(&policy, FULL_HZ, IDLE_HZ, IDLE_US, now);
+    int64_t last = now;
+    for (int i = 0; i < 100000 && !error; ++i) {
+        now           += FRAME_US * (1 + rng() % 4);
+        bool activity  = (rng() % 64) == 0;
+        if (activity) {
+            last = now;
+        }
+
+        int expected = (now - last >= IDLE_US) ? IDLE_HZ : FULL_HZ;
+        hz           = refresh_policy_update(&policy, now, activity);
+        if (hz != expected || hz != policy.current_hz) {
+            printf("\033[31mRandom activity: got %d Hz, expected %d Hz\033[0m\n", hz, expected);
+            error = true;
+        }
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
@@ -0,0 +1,36 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Decides the panel refresh rate. The panel runs at the full rate while
+// anything changes on screen and drops to the idle rate once nothing did for
+// idle_after_us. Any activity snaps it straight back to the full rate.
+typedef struct {
+    int      full_hz;
+    int      idle_hz;
+    int64_t  idle_after_us;
+    int64_t  last_activity_us;
+    int      current_hz;
+    uint32_t switches;
+} refresh_policy_t;
+
+void refresh_policy_init(refresh_policy_t *policy, int full_hz, int idle_hz, int64_t idle_after_us, int64_t now_us);
+int  refresh_policy_update(refresh_policy_t *policy, int64_t now_us, bool activity);
@@ -0,0 +1,670 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "region.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGION_MIN_CAPACITY 8
+
+typedef enum {
+    REGION_OP_UNION,
+    REGION_OP_SUBTRACT,
+    REGION_OP_INTERSECT,
+} region_op_t;
+
+__attribute__((always_inline)) static inline bool region_op_apply(region_op_t op, bool in_a, bool in_b) {
+    switch (op) {
+        case REGION_OP_UNION: return in_a || in_b;
+        case REGION_OP_SUBTRACT: return in_a && !in_b;
+        case REGION_OP_INTERSECT: return in_a && in_b;
+    }
+    return false;
+}
+
+__attribute__((always_inline)) static inline bool extents_overlap(window_rect_t a, window_rect_t b) {
+    return (a.x < b.x + b.w) && (a.x + a.w > b.x) && (a.y < b.y + b.h) && (a.y + a.h > b.y);
+}
+
+static bool region_reserve(region_t *region, int needed) {
+    if (needed <= region->capacity) {
+        return true;
+    }
+
+    int capacity = region->capacity ? region->capacity : REGION_MIN_CAPACITY;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    window_rect_t *rects = realloc(region->rects, capacity * sizeof(window_rect_t));
+    if (!rects) {
+        return false;
+    }
+
+    region->rects    = rects;
+    region->capacity = capacity;
+    return true;
+}
+
+static void region_update_extents(region_t *region) {
+    if (!region->count) {
+        region->extents = (window_rect_t){0, 0, 0, 0};
+        return;
+    }
+
+    int x1 = INT_MAX;
+    int x2 = INT_MIN;
+    for (int i = 0; i < region->count; ++i) {
+        window_rect_t *r = &region->rects[i];
+        if (r->x < x1) {
+            x1 = r->x;
+        }
+        if (r->x + r->w > x2) {
+            x2 = r->x + r->w;
+        }
+    }
+
+    window_rect_t *first = &region->rects[0];
+    window_rect_t *last  = &region->rects[region->count - 1];
+    region->extents      = (window_rect_t){.x = x1, .y = first->y, .w = x2 - x1, .h = (last->y + last->h) - first->y};
+}
+
+// Index one past the last rectangle of the band starting at start
+__attribute__((always_inline)) static inline int band_end(region_t const *region, int start) {
+    int y = region->rects[start].y;
+    int i = start + 1;
+    while (i < region->count && region->rects[i].y == y) {
+        ++i;
+    }
+    return i;
+}
+
+// Span boundary number idx of a band, even indices are left edges and odd
+// indices are right edges. Spans never touch so boundaries strictly increase.
+__attribute__((always_inline)) static inline int span_boundary(window_rect_t const *spans, int count, int idx) {
+    if (idx >= count * 2) {
+        return INT_MAX;
+    }
+    window_rect_t const *s = &spans[idx / 2];
+    return (idx & 1) ? s->x + s->w : s->x;
+}
+
+static bool region_append_band(
+    region_t            *out,
+    int                 *prev_band,
+    window_rect_t const *a,
+    int                  a_count,
+    window_rect_t const *b,
+    int                  b_count,
+    region_op_t          op,
+    int                  y1,
+    int                  y2
+) {
+    int  band_start = out->count;
+    int  ia         = 0;
+    int  ib         = 0;
+    bool in_a       = false;
+    bool in_b       = false;
+    bool in         = false;
+    int  start      = 0;
+
+    while (ia < a_count * 2 || ib < b_count * 2) {
+        int xa = span_boundary(a, a_count, ia);
+        int xb = span_boundary(b, b_count, ib);
+        int x  = xa < xb ? xa : xb;
+
+        if (xa == x) {
+            in_a = !in_a;
+            ++ia;
+        }
+        if (xb == x) {
+            in_b = !in_b;
+            ++ib;
+        }
+
+        bool now = region_op_apply(op, in_a, in_b);
+        if (now && !in) {
+            start = x;
+            in    = true;
+        } else if (!now && in) {
+            if (!region_reserve(out, out->count + 1)) {
+                return false;
+            }
+            out->rects[out->count++] = (window_rect_t){.x = start, .y = y1, .w = x - start, .h = y2 - y1};
+            in                       = false;
+        }
+    }
+
+    int band_count = out->count - band_start;
+    if (!band_count) {
+        return true;
+    }
+
+    // Coalesce with the band above us if it touches and has identical spans
+    if (*prev_band >= 0) {
+        window_rect_t *prev       = &out->rects[*prev_band];
+        int            prev_count = band_start - *prev_band;
+        if (prev_count == band_count && prev->y + prev->h == y1) {
+            bool same = true;
+            for (int i = 0; i < band_count; ++i) {
+                if (prev[i].x != out->rects[band_start + i].x || prev[i].w != out->rects[band_start + i].w) {
+                    same = false;
+                    break;
+                }
+            }
+            if (same) {
+                for (int i = 0; i < band_count; ++i) {
+                    prev[i].h += y2 - y1;
+                }
+                out->count = band_start;
+                return true;
+            }
+        }
+    }
+
+    *prev_band = band_start;
+    return true;
+}
+
+// Walk both regions band by band, splitting at every band edge of either
+// input, and combine the spans of each horizontal slice with op.
+static bool region_op(region_t *dst, region_t const *a, region_t const *b, region_op_t op) {
+    region_t out       = {0};
+    int      prev_band = -1;
+    int      ia        = 0;
+    int      ib        = 0;
+    int      y         = INT_MIN;
+
+    while (ia < a->count || ib < b->count) {
+        while (ia < a->count && a->rects[ia].y + a->rects[ia].h <= y) {
+            ia = band_end(a, ia);
+        }
+        while (ib < b->count && b->rects[ib].y + b->rects[ib].h <= y) {
+            ib = band_end(b, ib);
+        }
+
+        bool have_a = ia < a->count;
+        bool have_b = ib < b->count;
+
+        if (!have_a && (op == REGION_OP_SUBTRACT || op == REGION_OP_INTERSECT)) {
+            break;
+        }
+        if (!have_b && op == REGION_OP_INTERSECT) {
+            break;
+        }
+        if (!have_a && !have_b) {
+            break;
+        }
+
+        int a_y1 = have_a ? a->rects[ia].y : INT_MAX;
+        int a_y2 = have_a ? a->rects[ia].y + a->rects[ia].h : INT_MAX;
+        int b_y1 = have_b ? b->rects[ib].y : INT_MAX;
+        int b_y2 = have_b ? b->rects[ib].y + b->rects[ib].h : INT_MAX;
+
+        int top = a_y1 < b_y1 ? a_y1 : b_y1;
+        if (top < y) {
+            top = y;
+        }
+
+        bool a_active = have_a && a_y1 <= top;
+        bool b_active = have_b && b_y1 <= top;
+
+        int bottom = INT_MAX;
+        if (have_a) {
+            int edge = a_active ? a_y2 : a_y1;
+            bottom   = edge < bottom ? edge : bottom;
+        }
+        if (have_b) {
+            int edge = b_active ? b_y2 : b_y1;
+            bottom   = edge < bottom ? edge : bottom;
+        }
+
+        window_rect_t const *a_spans = a_active ? &a->rects[ia] : NULL;
+        int                  a_count = a_active ? band_end(a, ia) - ia : 0;
+        window_rect_t const *b_spans = b_active ? &b->rects[ib] : NULL;
+        int                  b_count = b_active ? band_end(b, ib) - ib : 0;
+
+        if (!region_append_band(&out, &prev_band, a_spans, a_count, b_spans, b_count, op, top, bottom)) {
+            free(out.rects);
+            return false;
+        }
+
+        y = bottom;
+    }
+
+    region_update_extents(&out);
+    free(dst->rects);
+    *dst = out;
+    return true;
+}
+
+void region_init(region_t *region) {
+    *region = (region_t){0};
+}
+
+void region_init_rect(region_t *region, window_rect_t rect) {
+    region_init(region);
+    if (rect.w <= 0 || rect.h <= 0) {
+        return;
+    }
+
+    if (region_reserve(region, 1)) {
+        region->rects[0] = rect;
+        region->count    = 1;
+        region->extents  = rect;
+    }
+}
+
+void region_fini(region_t *region) {
+    free(region->rects);
+    region_init(region);
+}
+
+void region_clear(region_t *region) {
+    region->count   = 0;
+    region->extents = (window_rect_t){0, 0, 0, 0};
+}
+
+bool region_copy(region_t *dst, region_t const *src) {
+    if (dst == src) {
+        return true;
+    }
+
+    if (!region_reserve(dst, src->count)) {
+        return false;
+    }
+
+    if (src->count) {
+        memcpy(dst->rects, src->rects, src->count * sizeof(window_rect_t));
+    }
+    dst->count   = src->count;
+    dst->extents = src->extents;
+    return true;
+}
+
+bool region_union(region_t *dst, region_t const *a, region_t const *b) {
+    if (region_is_empty(a)) {
+        return region_copy(dst, b);
+    }
+    if (region_is_empty(b)) {
+        return region_copy(dst, a);
+    }
+    return region_op(dst, a, b, REGION_OP_UNION);
+}
+
+bool region_subtract(region_t *dst, region_t const *a, region_t const *b) {
+    if (region_is_empty(a) || region_is_empty(b) || !extents_overlap(a->extents, b->extents)) {
+        return region_copy(dst, a);
+    }
+    return region_op(dst, a, b, REGION_OP_SUBTRACT);
+}
+
+bool region_intersect(region_t *dst, region_t const *a, region_t const *b) {
+    if (region_is_empty(a) || region_is_empty(b) || !extents_overlap(a->extents, b->extents)) {
+        region_clear(dst);
+        return true;
+    }
+    return region_op(dst, a, b, REGION_OP_INTERSECT);
+}
+
+bool region_union_rect(region_t *dst, region_t const *a, window_rect_t rect) {
+    window_rect_t storage = rect;
+    region_t      r       = {.extents = rect, .count = 1, .capacity = 1, .rects = &storage};
+    if (rect.w <= 0 || rect.h <= 0) {
+        return region_copy(dst, a);
+    }
+    return region_union(dst, a, &r);
+}
+
+bool region_subtract_rect(region_t *dst, region_t const *a, window_rect_t rect) {
+    window_rect_t storage = rect;
+    region_t      r       = {.extents = rect, .count = 1, .capacity = 1, .rects = &storage};
+    if (rect.w <= 0 || rect.h <= 0) {
+        return region_copy(dst, a);
+    }
+    return region_subtract(dst, a, &r);
+}
+
+bool region_intersect_rect(region_t *dst, region_t const *a, window_rect_t rect) {
+    window_rect_t storage = rect;
+    region_t      r       = {.extents = rect, .count = 1, .capacity = 1, .rects = &storage};
+    if (rect.w <= 0 || rect.h <= 0) {
+        region_clear(dst);
+        return true;
+    }
+    return region_intersect(dst, a, &r);
+}
+
+void region_translate(region_t *region, int dx, int dy) {
+    for (int i = 0; i < region->count; ++i) {
+        region->rects[i].x += dx;
+        region->rects[i].y += dy;
+    }
+    if (region->count) {
+        region->extents.x += dx;
+        region->extents.y += dy;
+    }
+}
+
+bool region_equal(region_t const *a, region_t const *b) {
+    if (a->count != b->count) {
+        return false;
+    }
+
+    for (int i = 0; i < a->count; ++i) {
+        window_rect_t const *ra = &a->rects[i];
+        window_rect_t const *rb = &b->rects[i];
+        if (ra->x != rb->x || ra->y != rb->y || ra->w != rb->w || ra->h != rb->h) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool region_contains_point(region_t const *region, int x, int y) {
+    for (int i = 0; i < region->count; ++i) {
+        window_rect_t const *r = &region->rects[i];
+        if (r->y > y) {
+            break;
+        }
+        if (x >= r->x && x < r->x + r->w && y >= r->y && y < r->y + r->h) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t region_area(region_t const *region) {
+    size_t area = 0;
+    for (int i = 0; i < region->count; ++i) {
+        area += (size_t)region->rects[i].w * (size_t)region->rects[i].h;
+    }
+    return area;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define GRID_W     48
+#define GRID_H     40
+#define ITERATIONS 4000
+
+typedef struct {
+    unsigned char px[GRID_H][GRID_W];
+} bitmap_t;
+
+#define TEST_RNG_SEED 0x12345678
+#include "test_rng.h"
+
+static window_rect_t random_rect(void) {
+    // Allow rectangles to stick out of the grid so clipping paths get exercised
+    window_rect_t r;
+    r.x = (int)(rng() % (GRID_W + 8)) - 4;
+    r.y = (int)(rng() % (GRID_H + 8)) - 4;
+    r.w = (int)(rng() % (GRID_W / 2));
+    r.h = (int)(rng() % (GRID_H / 2));
+    return r;
+}
+
+static void bitmap_rect(bitmap_t *bm, window_rect_t r, region_op_t op) {
+    for (int y = 0; y < GRID_H; ++y) {
+        for (int x = 0; x < GRID_W; ++x) {
+            bool in_rect = x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h;
+            bm->px[y][x] = region_op_apply(op, bm->px[y][x], in_rect);
+        }
+    }
+}
+
+static void bitmap_op(bitmap_t *dst, bitmap_t const *b, region_op_t op) {
+    for (int y = 0; y < GRID_H; ++y) {
+        for (int x = 0; x < GRID_W; ++x) {
+            dst->px[y][x] = region_op_apply(op, dst->px[y][x], b->px[y][x]);
+        }
+    }
+}
+
+// Regions only ever hold pixels that went into them, so clipping everything
+// to the grid keeps the bitmap reference exact.
+static window_rect_t clip_to_grid(window_rect_t r) {
+    int x1 = r.x < 0 ? 0 : r.x;
+    int y1 = r.y < 0 ? 0 : r.y;
+    int x2 = r.x + r.w > GRID_W ? GRID_W : r.x + r.w;
+    int y2 = r.y + r.h > GRID_H ? GRID_H : r.y + r.h;
+    return (window_rect_t){x1, y1, x2 > x1 ? x2 - x1 : 0, y2 > y1 ? y2 - y1 : 0};
+}
+
+static bool check_canonical(region_t const *r, char const *what) {
+    int prev_band = -1;
+    for (int i = 0; i < r->count; ++i) {
+        window_rect_t const *c = &r->rects[i];
+        if (c->w <= 0 || c->h <= 0) {
+            printf("\033[31m%s: empty rectangle at %d\033[0m\n", what, i);
+            return false;
+        }
+        if (i && c->y == r->rects[i - 1].y) {
+            window_rect_t const *p = &r->rects[i - 1];
+            if (c->h != p->h || c->x <= p->x + p->w) {
+                printf("\033[31m%s: band %d malformed at rect %d\033[0m\n", what, prev_band, i);
+                return false;
+            }
+        } else if (i) {
+            if (c->y < r->rects[i - 1].y + r->rects[i - 1].h) {
+                printf("\033[31m%s: bands overlap at rect %d\033[0m\n", what, i);
+                return false;
+            }
+            // Adjacent bands with identical spans must have been coalesced
+            int this_end = band_end(r, i);
+            int prev_cnt = i - prev_band;
+            if (c->y == r->rects[prev_band].y + r->rects[prev_band].h && this_end - i == prev_cnt) {
+                bool same = true;
+                for (int k = 0; k < prev_cnt; ++k) {
+                    if (r->rects[prev_band + k].x != r->rects[i + k].x ||
+                        r->rects[prev_band + k].w != r->rects[i + k].w) {
+                        same = false;
+                    }
+                }
+                if (same) {
+                    printf("\033[31m%s: uncoalesced band at rect %d\033[0m\n", what, i);
+                    return false;
+                }
+            }
+            prev_band = i;
+        } else {
+            prev_band = 0;
+        }
+    }
+    return true;
+}
+
+static bool check_region(region_t const *r, bitmap_t const *bm, char const *what) {
+    if (!check_canonical(r, what)) {
+        return false;
+    }
+
+    size_t count = 0;
+    for (int y = 0; y < GRID_H; ++y) {
+        for (int x = 0; x < GRID_W; ++x) {
+            if (region_contains_point(r, x, y) != (bool)bm->px[y][x]) {
+                printf("\033[31m%s: mismatch at %d,%d\033[0m\n", what, x, y);
+                return false;
+            }
+            count += bm->px[y][x];
+        }
+    }
+
+    if (region_area(r) != count) {
+        printf("\033[31m%s: area %zu, expected %zu\033[0m\n", what, region_area(r), count);
+        return false;
+    }
+
+    if (r->count) {
+        window_rect_t e = r->extents;
+        for (int i = 0; i < r->count; ++i) {
+            window_rect_t const *c = &r->rects[i];
+            if (c->x < e.x || c->y < e.y || c->x + c->w > e.x + e.w || c->y + c->h > e.y + e.h) {
+                printf("\033[31m%s: extents do not cover rect %d\033[0m\n", what, i);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Build a region from a bitmap one pixel run at a time, in a scrambled
+// order, to check that the output does not depend on construction order.
+static void region_from_bitmap(region_t *r, bitmap_t const *bm) {
+    region_clear(r);
+    for (int i = 0; i < GRID_H; ++i) {
+        int y = (i * 7) % GRID_H;
+        for (int x = 0; x < GRID_W;) {
+            if (!bm->px[y][x]) {
+                ++x;
+                continue;
+            }
+            int start = x;
+            while (x < GRID_W && bm->px[y][x]) {
+                ++x;
+            }
+            region_union_rect(r, r, (window_rect_t){start, y, x - start, 1});
+        }
+    }
+}
+
+int main() {
+    bool     error = false;
+    region_t a, b, c;
+    bitmap_t bm_a, bm_b, bm_c;
+
+    region_init(&a);
+    region_init(&b);
+    region_init(&c);
+
+    // The classic window-in-the-middle case must produce 4 rectangles
+    region_init_rect(&c, (window_rect_t){0, 0, 30, 30});
+    region_subtract_rect(&c, &c, (window_rect_t){10, 10, 10, 10});
+    if (c.count != 4) {
+        printf("\033[31mHole punch produced %d rectangles, expected 4\033[0m\n", c.count);
+        error = true;
+    }
+
+    // Disjoint side by side rectangles merge into one
+    region_init_rect(&a, (window_rect_t){0, 0, 10, 10});
+    region_union_rect(&a, &a, (window_rect_t){10, 0, 10, 10});
+    region_union_rect(&a, &a, (window_rect_t){0, 10, 20, 5});
+    if (a.count != 1 || a.rects[0].w != 20 || a.rects[0].h != 15) {
+        printf("\033[31mAdjacent rectangles were not merged (%d rects)\033[0m\n", a.count);
+        error = true;
+    }
+    region_fini(&a);
+    region_fini(&c);
+
+    for (int iter = 0; iter < ITERATIONS && !error; ++iter) {
+        memset(&bm_a, 0, sizeof(bm_a));
+        memset(&bm_b, 0, sizeof(bm_b));
+        region_clear(&a);
+        region_clear(&b);
+
+        int n = 1 + (int)(rng() % 6);
+        for (int i = 0; i < n; ++i) {
+            window_rect_t r = clip_to_grid(random_rect());
+            region_union_rect(&a, &a, r);
+            bitmap_rect(&bm_a, r, REGION_OP_UNION);
+        }
+
+        n = 1 + (int)(rng() % 6);
+        for (int i = 0; i < n; ++i) {
+            window_rect_t r  = clip_to_grid(random_rect());
+            region_op_t   op = (region_op_t)(rng() % 3);
+            if (op == REGION_OP_UNION) {
+                region_union_rect(&b, &b, r);
+            } else if (op == REGION_OP_SUBTRACT) {
+                region_subtract_rect(&b, &b, r);
+            } else {
+                region_intersect_rect(&b, &b, r);
+            }
+            bitmap_rect(&bm_b, r, op);
+        }
+
+        if (!check_region(&a, &bm_a, "build a") || !check_region(&b, &bm_b, "build b")) {
+            error = true;
+            break;
+        }
+
+        static char const *names[] = {"union", "subtract", "intersect"};
+        for (region_op_t op = REGION_OP_UNION; op <= REGION_OP_INTERSECT; ++op) {
+            bm_c = bm_a;
+            bitmap_op(&bm_c, &bm_b, op);
+
+            switch (op) {
+                case REGION_OP_UNION: region_union(&c, &a, &b); break;
+                case REGION_OP_SUBTRACT: region_subtract(&c, &a, &b); break;
+                case REGION_OP_INTERSECT: region_intersect(&c, &a, &b); break;
+            }
+
+            if (!check_region(&c, &bm_c, names[op])) {
+                error = true;
+                break;
+            }
+
+            region_t rebuilt;
+            region_init(&rebuilt);
+            region_from_bitmap(&rebuilt, &bm_c);
+            if (!region_equal(&rebuilt, &c)) {
+                printf("\033[31m%s: result is not canonical (%d vs %d rects)\033[0m\n", names[op], c.count, rebuilt.count);
+                error = true;
+            }
+            region_fini(&rebuilt);
+        }
+
+        // Aliased destination
+        bm_c = bm_a;
+        bitmap_op(&bm_c, &bm_b, REGION_OP_SUBTRACT);
+        region_subtract(&a, &a, &b);
+        if (!check_region(&a, &bm_c, "aliased subtract")) {
+            error = true;
+        }
+
+        // Translate out and back again
+        region_copy(&c, &a);
+        int dx = (int)(rng() % 100) - 50;
+        int dy = (int)(rng() % 100) - 50;
+        region_translate(&c, dx, dy);
+        if (c.count && (c.extents.x != a.extents.x + dx || c.extents.y != a.extents.y + dy)) {
+            printf("\033[31mtranslate: extents not moved\033[0m\n");
+            error = true;
+        }
+        region_translate(&c, -dx, -dy);
+        if (!region_equal(&a, &c)) {
+            printf("\033[31mtranslate: round trip changed the region\033[0m\n");
+            error = true;
+        }
+    }
+
+    region_fini(&a);
+    region_fini(&b);
+    region_fini(&c);
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
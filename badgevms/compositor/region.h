@@ -0,0 +1,61 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/compositor.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A region is a set of pixels stored as y-x banded rectangles, the same
+// representation X11 and pixman use. Rectangles are sorted by y and then x,
+// every rectangle in a band shares the same y and h, rectangles in a band
+// never touch, and vertically adjacent bands with identical spans are
+// coalesced. This makes the representation canonical: two regions covering
+// the same pixels have exactly the same rectangle list.
+//
+// All operations allow the destination to alias one of the sources. On
+// allocation failure they return false and leave the destination unchanged.
+
+typedef struct {
+    window_rect_t  extents;
+    int            count;
+    int            capacity;
+    window_rect_t *rects;
+} region_t;
+
+void region_init(region_t *region);
+void region_init_rect(region_t *region, window_rect_t rect);
+void region_fini(region_t *region);
+void region_clear(region_t *region);
+
+bool region_copy(region_t *dst, region_t const *src);
+bool region_union(region_t *dst, region_t const *a, region_t const *b);
+bool region_union_rect(region_t *dst, region_t const *a, window_rect_t rect);
+bool region_subtract(region_t *dst, region_t const *a, region_t const *b);
+bool region_subtract_rect(region_t *dst, region_t const *a, window_rect_t rect);
+bool region_intersect(region_t *dst, region_t const *a, region_t const *b);
+bool region_intersect_rect(region_t *dst, region_t const *a, window_rect_t rect);
+void region_translate(region_t *region, int dx, int dy);
+
+bool   region_equal(region_t const *a, region_t const *b);
+bool   region_contains_point(region_t const *region, int x, int y);
+size_t region_area(region_t const *region);
+
+__attribute__((always_inline)) static inline bool region_is_empty(region_t const *region) {
+    return region->count == 0;
+}
@@ -0,0 +1,277 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "window_transaction.h"
+
+#include <stdlib.h>
+
+#define TRANSACTION_MIN_CAPACITY 4
+
+window_transaction_t *transaction_create(void) {
+    return calloc(1, sizeof(window_transaction_t));
+}
+
+// Stage an operation. A change of the same kind directly following an earlier
+// one for the same window replaces it, so a UI that moves a window around
+// while building a transaction only sends the final position. Operations on
+// a window are otherwise kept in order, since flags change the geometry.
+bool transaction_stage(window_transaction_t *transaction, transaction_op_t const *op) {
+    if (transaction->failed) {
+        return false;
+    }
+
+    for (int i = transaction->count - 1; i >= 0; --i) {
+        transaction_op_t *prev = &transaction->ops[i];
+        if (prev->window != op->window) {
+            continue;
+        }
+
+        if (prev->type == op->type) {
+            if (prev->type == TRANSACTION_OP_TITLE) {
+                free(prev->title);
+            }
+            *prev = *op;
+            return true;
+        }
+        break;
+    }
+
+    if (transaction->count == transaction->capacity) {
+        int capacity = transaction->capacity ? transaction->capacity * 2 : TRANSACTION_MIN_CAPACITY;
+        transaction_op_t *ops = realloc(transaction->ops, capacity * sizeof(transaction_op_t));
+        if (!ops) {
+            // Never apply half a transaction
+            transaction->failed = true;
+            return false;
+        }
+        transaction->ops      = ops;
+        transaction->capacity = capacity;
+    }
+
+    transaction->ops[transaction->count++] = *op;
+    return true;
+}
+
+void transaction_apply(window_transaction_t *transaction, transaction_apply_cb_t cb, void *user_data) {
+    if (transaction->failed) {
+        return;
+    }
+
+    for (int i = 0; i < transaction->count; ++i) {
+        cb(&transaction->ops[i], user_data);
+    }
+}
+
+void transaction_free(window_transaction_t *transaction) {
+    if (!transaction) {
+        return;
+    }
+
+    for (int i = 0; i < transaction->count; ++i) {
+        if (transaction->ops[i].type == TRANSACTION_OP_TITLE) {
+            free(transaction->ops[i].title);
+        }
+    }
+
+    free(transaction->ops);
+    free(transaction);
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <string.h>
+
+struct window {
+    int             id;
+    window_coords_t coords;
+    window_size_t   size;
+    window_flag_t   flags;
+    char           *title;
+    int             presents;
+    int             applied;
+};
+
+typedef struct {
+    int           count;
+    struct window order[64];
+} apply_log_t;
+
+static void apply_cb(transaction_op_t *op, void *user_data) {
+    apply_log_t *log = user_data;
+    log->order[log->count++] = *op->window;
+
+    switch (op->type) {
+        case TRANSACTION_OP_MOVE: op->window->coords = op->coords; break;
+        case TRANSACTION_OP_RESIZE: op->window->size = op->size; break;
+        case TRANSACTION_OP_FLAGS: op->window->flags = op->flags; break;
+        case TRANSACTION_OP_TITLE:
+            // Take ownership like the compositor does
+            free(op->window->title);
+            op->window->title = op->title;
+            op->title         = NULL;
+            break;
+        case TRANSACTION_OP_PRESENT: op->window->presents++; break;
+    }
+    op->window->applied++;
+}
+
+static transaction_op_t move(struct window *w, int x, int y) {
+    return (transaction_op_t){.type = TRANSACTION_OP_MOVE, .window = w, .coords = {x, y}};
+}
+
+static transaction_op_t resize(struct window *w, int width, int height) {
+    return (transaction_op_t){.type = TRANSACTION_OP_RESIZE, .window = w, .size = {width, height}};
+}
+
+static transaction_op_t title(struct window *w, char const *t) {
+    return (transaction_op_t){.type = TRANSACTION_OP_TITLE, .window = w, .title = strdup(t)};
+}
+
+static transaction_op_t present(struct window *w) {
+    return (transaction_op_t){.type = TRANSACTION_OP_PRESENT, .window = w};
+}
+
+int main() {
+    bool          error = false;
+    struct window a     = {.id = 1};
+    struct window b     = {.id = 2};
+    apply_log_t   log   = {0};
+
+    window_transaction_t *t = transaction_create();
+
+    // Repeated moves of one window collapse into the last one
+    for (int i = 0; i < 10; ++i) {
+        transaction_op_t op = move(&a, i, i * 2);
+        transaction_stage(t, &op);
+    }
+    if (t->count != 1 || t->ops[0].coords.x != 9 || t->ops[0].coords.y != 18) {
+        printf("\033[31mRepeated moves were not coalesced (%d ops)\033[0m\n", t->count);
+        error = true;
+    }
+
+    // Interleaved windows keep their own coalescing
+    transaction_op_t op;
+    op = move(&b, 5, 5);
+    transaction_stage(t, &op);
+    op = move(&a, 100, 100);
+    transaction_stage(t, &op);
+    op = move(&b, 6, 6);
+    transaction_stage(t, &op);
+    if (t->count != 2 || t->ops[0].coords.x != 100 || t->ops[1].coords.x != 6) {
+        printf("\033[31mInterleaved moves were not coalesced per window (%d ops)\033[0m\n", t->count);
+        error = true;
+    }
+
+    // A different operation in between keeps ordering
+    op = resize(&a, 50, 60);
+    transaction_stage(t, &op);
+    op = move(&a, 1, 2);
+    transaction_stage(t, &op);
+    if (t->count != 4) {
+        printf("\033[31mOrdered operations were merged (%d ops)\033[0m\n", t->count);
+        error = true;
+    }
+
+    // Titles replace each other without leaking
+    op = title(&b, "first");
+    transaction_stage(t, &op);
+    op = title(&b, "second");
+    transaction_stage(t, &op);
+    op = present(&b);
+    transaction_stage(t, &op);
+    op = present(&b);
+    transaction_stage(t, &op);
+    if (t->count != 6) {
+        printf("\033[31mTitle or present coalescing failed (%d ops)\033[0m\n", t->count);
+        error = true;
+    }
+
+    transaction_apply(t, apply_cb, &log);
+    transaction_free(t);
+
+    if (log.count != 6) {
+        printf("\033[31mExpected 6 applied operations, got %d\033[0m\n", log.count);
+        error = true;
+    }
+
+    if (a.coords.x != 1 || a.coords.y != 2 || a.size.w != 50 || a.size.h != 60) {
+        printf("\033[31mWindow a ended up in the wrong state\033[0m\n");
+        error = true;
+    }
+
+    if (b.coords.x != 6 || !b.title || strcmp(b.title, "second") != 0 || b.presents != 1) {
+        printf("\033[31mWindow b ended up in the wrong state\033[0m\n");
+        error = true;
+    }
+
+    // Order of application must match staging order
+    int expect[] = {1, 2, 1, 1, 2, 2};
+    for (int i = 0; i < log.count && i < 6; ++i) {
+        if (log.order[i].id != expect[i]) {
+            printf("\033[31mOperation %d applied to window %d, expected %d\033[0m\n", i, log.order[i].id, expect[i]);
+            error = true;
+        }
+    }
+
+    // A failed transaction is never applied
+    t         = transaction_create();
+    op        = move(&a, 7, 7);
+    transaction_stage(t, &op);
+    t->failed = true;
+    op        = title(&a, "lost");
+    if (transaction_stage(t, &op)) {
+        printf("\033[31mStaging into a failed transaction succeeded\033[0m\n");
+        error = true;
+    }
+    free(op.title);
+    transaction_apply(t, apply_cb, &log);
+    transaction_free(t);
+    if (a.coords.x == 7) {
+        printf("\033[31mFailed transaction was applied\033[0m\n");
+        error = true;
+    }
+
+    // Growing well past the initial capacity
+    struct window many[20];
+    t = transaction_create();
+    for (int i = 0; i < 20; ++i) {
+        many[i] = (struct window){.id = 100 + i};
+        op      = resize(&many[i], i, i);
+        transaction_stage(t, &op);
+    }
+    log.count = 0;
+    transaction_apply(t, apply_cb, &log);
+    transaction_free(t);
+    if (log.count != 20 || many[19].size.w != 19) {
+        printf("\033[31mLarge transaction applied %d operations\033[0m\n", log.count);
+        error = true;
+    }
+
+    // Unapplied titles are freed with the transaction, checked by ASAN/valgrind builds
+    t  = transaction_create();
+    op = title(&a, "never applied");
+    transaction_stage(t, &op);
+    transaction_free(t);
+
+    free(b.title);
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
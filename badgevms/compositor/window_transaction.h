@@ -0,0 +1,57 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/compositor.h"
+
+#include <stdbool.h>
+
+typedef enum {
+    TRANSACTION_OP_MOVE,
+    TRANSACTION_OP_RESIZE,
+    TRANSACTION_OP_FLAGS,
+    TRANSACTION_OP_TITLE,
+    TRANSACTION_OP_PRESENT,
+} transaction_op_type_t;
+
+typedef struct {
+    transaction_op_type_t type;
+    struct window        *window;
+    union {
+        window_coords_t coords;
+        window_size_t   size;
+        window_flag_t   flags;
+        char           *title;
+    };
+} transaction_op_t;
+
+// Staged window changes, built by the application and applied by the
+// compositor in a single frame. Ownership of staged titles moves to the
+// compositor when it applies the transaction.
+typedef struct window_transaction {
+    int               count;
+    int               capacity;
+    bool              failed;
+    transaction_op_t *ops;
+} window_transaction_t;
+
+typedef void (*transaction_apply_cb_t)(transaction_op_t *op, void *user_data);
+
+window_transaction_t *transaction_create(void);
+bool                  transaction_stage(window_transaction_t *transaction, transaction_op_t const *op);
+void                  transaction_apply(window_transaction_t *transaction, transaction_apply_cb_t cb, void *user_data);
+void                  transaction_free(window_transaction_t *transaction);
@@ -0,0 +1,263 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "yuv.h"
+
+bool yuv_format_is_yuv(pixel_format_t format) {
+    return format == BADGEVMS_PIXELFORMAT_OUYY_EVYY || format == BADGEVMS_PIXELFORMAT_YUY2;
+}
+
+// Chroma is shared by 2x2 pixels in 4:2:0 and by 2x1 pixels in 4:2:2, the
+// PPA needs whole chroma blocks. Sizes are rounded down, returns false if
+// nothing is left.
+bool yuv_align_size(pixel_format_t format, uint32_t *w, uint32_t *h) {
+    switch (format) {
+        case BADGEVMS_PIXELFORMAT_OUYY_EVYY: *h &= ~1u; // Fallthrough
+        case BADGEVMS_PIXELFORMAT_YUY2: *w &= ~1u; break;
+        default:
+    }
+    return *w && *h;
+}
+
+size_t yuv_frame_size(pixel_format_t format, uint32_t w, uint32_t h) {
+    switch (format) {
+        case BADGEVMS_PIXELFORMAT_OUYY_EVYY: return (size_t)w * h * 3 / 2;
+        case BADGEVMS_PIXELFORMAT_YUY2: return (size_t)w * h * 2;
+        default: return 0;
+    }
+}
+
+__attribute__((always_inline)) static inline int clamp_u8(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+uint16_t yuv_to_rgb565(uint8_t y, uint8_t u, uint8_t v) {
+    int c = 298 * (y - 16);
+    int d = u - 128;
+    int e = v - 128;
+
+    int r = clamp_u8((c + 409 * e + 128) / 256);
+    int g = clamp_u8((c - 100 * d - 208 * e + 128) / 256);
+    int b = clamp_u8((c + 516 * d + 128) / 256);
+
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+// Lines come in pairs of U0 Y0 Y1 U2 Y2 Y3 ... and V0 Y0 Y1 V2 Y2 Y3 ...,
+// the layout the ESP32-P4 ISP and PPA call YUV420
+static void convert_ouyy_evyy(uint16_t *dst, uint8_t const *src, uint32_t w, uint32_t h) {
+    size_t stride = (size_t)w * 3 / 2;
+
+    for (uint32_t y = 0; y < h; y += 2) {
+        uint8_t const *u_line = src + y * stride;
+        uint8_t const *v_line = u_line + stride;
+        uint16_t      *out    = dst + y * w;
+
+        for (uint32_t x = 0; x < w; x += 2) {
+            uint8_t const *u_group = u_line + x / 2 * 3;
+            uint8_t const *v_group = v_line + x / 2 * 3;
+            uint8_t        u       = u_group[0];
+            uint8_t        v       = v_group[0];
+
+            out[x]         = yuv_to_rgb565(u_group[1], u, v);
+            out[x + 1]     = yuv_to_rgb565(u_group[2], u, v);
+            out[x + w]     = yuv_to_rgb565(v_group[1], u, v);
+            out[x + w + 1] = yuv_to_rgb565(v_group[2], u, v);
+        }
+    }
+}
+
+static void convert_yuy2(uint16_t *dst, uint8_t const *src, uint32_t w, uint32_t h) {
+    for (uint32_t y = 0; y < h; ++y) {
+        uint8_t const *line = src + (size_t)y * w * 2;
+        uint16_t      *out  = dst + (size_t)y * w;
+
+        for (uint32_t x = 0; x < w; x += 2) {
+            uint8_t const *group = line + x * 2;
+            out[x]               = yuv_to_rgb565(group[0], group[1], group[3]);
+            out[x + 1]           = yuv_to_rgb565(group[2], group[1], group[3]);
+        }
+    }
+}
+
+// Sizes must already be aligned with yuv_align_size()
+void yuv_reference_convert(uint16_t *dst, void const *src, pixel_format_t format, uint32_t w, uint32_t h) {
+    switch (format) {
+        case BADGEVMS_PIXELFORMAT_OUYY_EVYY: convert_ouyy_evyy(dst, src, w, h); break;
+        case BADGEVMS_PIXELFORMAT_YUY2: convert_yuy2(dst, src, w, h); break;
+        default:
+    }
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_RNG_SEED 0xBADC0DE
+#include "test_rng.h"
+
+typedef struct {
+    uint8_t y, u, v;
+} yuv_t;
+
+static yuv_t rgb_to_yuv(int r, int g, int b) {
+    return (yuv_t){
+        .y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16,
+        .u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128,
+        .v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128,
+    };
+}
+
+static bool close_to(uint16_t got, int r, int g, int b) {
+    int dr = abs(((got >> 11) & 0x1f) - (r >> 3));
+    int dg = abs(((got >> 5) & 0x3f) - (g >> 2));
+    int db = abs((got & 0x1f) - (b >> 3));
+    return dr <= 1 && dg <= 1 && db <= 1;
+}
+
+// Every chroma block gets its own color so any mix up of the layout shows
+static void encode(uint8_t *dst, pixel_format_t format, uint32_t w, uint32_t h, uint32_t const *colors) {
+    for (uint32_t y = 0; y < h; ++y) {
+        for (uint32_t x = 0; x < w; x += 2) {
+            uint32_t color = colors[(y / 2) * (w / 2) + x / 2];
+            yuv_t    yuv   = rgb_to_yuv(color >> 16, (color >> 8) & 0xff, color & 0xff);
+
+            if (format == BADGEVMS_PIXELFORMAT_YUY2) {
+                uint8_t *group = dst + (size_t)y * w * 2 + x * 2;
+                group[0]       = yuv.y;
+                group[1]       = yuv.u;
+                group[2]       = yuv.y;
+                group[3]       = yuv.v;
+            } else {
+                uint8_t *group = dst + (size_t)y * w * 3 / 2 + x / 2 * 3;
+                group[0]       = (y & 1) ? yuv.v : yuv.u;
+                group[1]       = yuv.y;
+                group[2]       = yuv.y;
+            }
+        }
+    }
+}
+
+static bool check_format(pixel_format_t format, char const *name, uint32_t w, uint32_t h) {
+    uint32_t *colors = malloc((w / 2) * ((h + 1) / 2) * sizeof(uint32_t));
+    uint8_t  *src    = malloc(yuv_frame_size(format, w, h));
+    uint16_t *dst    = malloc(w * h * sizeof(uint16_t));
+    bool      ok     = true;
+
+    for (uint32_t i = 0; i < (w / 2) * ((h + 1) / 2); ++i) {
+        colors[i] = rng() & 0xffffff;
+    }
+
+    encode(src, format, w, h, colors);
+    yuv_reference_convert(dst, src, format, w, h);
+
+    for (uint32_t y = 0; y < h && ok; ++y) {
+        for (uint32_t x = 0; x < w && ok; ++x) {
+            uint32_t color = colors[(y / 2) * (w / 2) + x / 2];
+            if (!close_to(dst[y * w + x], color >> 16, (color >> 8) & 0xff, color & 0xff)) {
+                printf(
+                    "\033[31m%s %ux%u: pixel %u,%u is %04x, expected about %06x\033[0m\n",
+                    name,
+                    w,
+                    h,
+                    x,
+                    y,
+                    dst[y * w + x],
+                    color
+                );
+                ok = false;
+            }
+        }
+    }
+
+    free(colors);
+    free(src);
+    free(dst);
+    return ok;
+}
+
+int main() {
+    bool error = false;
+
+    // Reference points of BT.601 limited range
+    if (yuv_to_rgb565(16, 128, 128) != 0x0000 || yuv_to_rgb565(235, 128, 128) != 0xffff) {
+        printf("\033[31mBlack or white level is off\033[0m\n");
+        error = true;
+    }
+    if (yuv_to_rgb565(0, 128, 128) != 0x0000 || yuv_to_rgb565(255, 128, 128) != 0xffff) {
+        printf("\033[31mOut of range luma is not clamped\033[0m\n");
+        error = true;
+    }
+    if (!close_to(yuv_to_rgb565(81, 90, 240), 255, 0, 0) || !close_to(yuv_to_rgb565(145, 54, 34), 0, 255, 0) ||
+        !close_to(yuv_to_rgb565(41, 240, 110), 0, 0, 255)) {
+        printf("\033[31mPrimaries do not convert correctly\033[0m\n");
+        error = true;
+    }
+
+    // Alignment
+    uint32_t w = 321, h = 241;
+    if (!yuv_align_size(BADGEVMS_PIXELFORMAT_OUYY_EVYY, &w, &h) || w != 320 || h != 240) {
+        printf("\033[31m4:2:0 sizes are not rounded to whole chroma blocks\033[0m\n");
+        error = true;
+    }
+    w = 321, h = 241;
+    if (!yuv_align_size(BADGEVMS_PIXELFORMAT_YUY2, &w, &h) || w != 320 || h != 241) {
+        printf("\033[31m4:2:2 sizes are not rounded to whole chroma blocks\033[0m\n");
+        error = true;
+    }
+    w = 1, h = 100;
+    if (yuv_align_size(BADGEVMS_PIXELFORMAT_YUY2, &w, &h)) {
+        printf("\033[31mA framebuffer without whole chroma blocks was accepted\033[0m\n");
+        error = true;
+    }
+    w = 321, h = 241;
+    if (!yuv_align_size(BADGEVMS_PIXELFORMAT_RGB565, &w, &h) || w != 321 || h != 241) {
+        printf("\033[31mRGB sizes were changed\033[0m\n");
+        error = true;
+    }
+
+    if (yuv_frame_size(BADGEVMS_PIXELFORMAT_OUYY_EVYY, 320, 240) != 320 * 240 * 3 / 2 ||
+        yuv_frame_size(BADGEVMS_PIXELFORMAT_YUY2, 320, 240) != 320 * 240 * 2) {
+        printf("\033[31mWrong frame sizes\033[0m\n");
+        error = true;
+    }
+
+    // Layouts, including sizes that are not a multiple of 4 or of the cache line
+    uint32_t sizes[][2] = {
+        {2, 2},
+        {6, 10},
+        {34, 66},
+        {320, 240},
+        {720, 720},
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        if (!check_format(BADGEVMS_PIXELFORMAT_OUYY_EVYY, "YUV420", sizes[i][0], sizes[i][1])) {
+            error = true;
+        }
+        if (!check_format(BADGEVMS_PIXELFORMAT_YUY2, "YUY2", sizes[i][0], sizes[i][1] | 1)) {
+            error = true;
+        }
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
@@ -0,0 +1,34 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/pixel_formats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// YUV framebuffers are converted by the PPA, BT.601 limited range. The
+// functions here describe the layouts and are the reference the hardware
+// setup is checked against.
+bool   yuv_format_is_yuv(pixel_format_t format);
+bool   yuv_align_size(pixel_format_t format, uint32_t *w, uint32_t *h);
+size_t yuv_frame_size(pixel_format_t format, uint32_t w, uint32_t h);
+
+uint16_t yuv_to_rgb565(uint8_t y, uint8_t u, uint8_t v);
+void     yuv_reference_convert(uint16_t *dst, void const *src, pixel_format_t format, uint32_t w, uint32_t h);
@@ -0,0 +1,387 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dir_merge.h"
+
+#include <string.h>
+
+static void filter_indices(char const *name, uint32_t indices[3]) {
+    uint32_t hash = 2166136261u;
+    for (char const *c = name; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+
+    // Double hashing, the step has to be odd to reach every bit
+    uint32_t step = (hash * 0x9E3779B1u) | 1;
+    for (int i = 0; i < 3; ++i) {
+        indices[i] = (hash + i * step) & (DIR_MERGE_FILTER_BITS - 1);
+    }
+}
+
+static void filter_add(dir_merge_t *merge, char const *name) {
+    uint32_t indices[3];
+    filter_indices(name, indices);
+    for (int i = 0; i < 3; ++i) {
+        merge->filter[indices[i] / 32] |= 1u << (indices[i] % 32);
+    }
+}
+
+static bool filter_maybe_contains(dir_merge_t const *merge, char const *name) {
+    uint32_t indices[3];
+    filter_indices(name, indices);
+    for (int i = 0; i < 3; ++i) {
+        if (!(merge->filter[indices[i] / 32] & (1u << (indices[i] % 32)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool shadowed(dir_merge_t *merge, char const *name) {
+    if (merge->location == 0 || !filter_maybe_contains(merge, name)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < merge->location; ++i) {
+        if (merge->ops->contains(merge->context, i, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool open_from(dir_merge_t *merge, size_t location) {
+    for (; location < merge->num_locations; ++location) {
+        void *handle = merge->ops->open(merge->context, location);
+        if (handle) {
+            merge->location = location;
+            merge->handle   = handle;
+            return true;
+        }
+    }
+
+    merge->location = merge->num_locations;
+    merge->handle   = NULL;
+    return false;
+}
+
+bool dir_merge_open(dir_merge_t *merge, dir_merge_ops_t const *ops, void *context, size_t num_locations) {
+    merge->ops           = ops;
+    merge->context       = context;
+    merge->num_locations = num_locations;
+    memset(merge->filter, 0, sizeof(merge->filter));
+    return open_from(merge, 0);
+}
+
+struct dirent *dir_merge_read(dir_merge_t *merge) {
+    while (merge->handle) {
+        struct dirent *entry = merge->ops->read(merge->context, merge->handle);
+        if (!entry) {
+            merge->ops->close(merge->context, merge->handle);
+            open_from(merge, merge->location + 1);
+            continue;
+        }
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (shadowed(merge, entry->d_name)) {
+            continue;
+        }
+
+        // The last location hides nothing
+        if (merge->location + 1 < merge->num_locations) {
+            filter_add(merge, entry->d_name);
+        }
+        return entry;
+    }
+
+    return NULL;
+}
+
+bool dir_merge_rewind(dir_merge_t *merge) {
+    dir_merge_close(merge);
+    memset(merge->filter, 0, sizeof(merge->filter));
+    return open_from(merge, 0);
+}
+
+void dir_merge_close(dir_merge_t *merge) {
+    if (merge->handle) {
+        merge->ops->close(merge->context, merge->handle);
+        merge->handle = NULL;
+    }
+    merge->location = merge->num_locations;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_LOCATIONS 4
+#define MAX_NAMES     2500
+
+typedef struct {
+    bool exists;
+    int  count;
+    int  names[MAX_NAMES]; // Negative numbers are "." and ".."
+    bool has[MAX_NAMES * 2];
+} location_t;
+
+typedef struct {
+    location_t    locations[MAX_LOCATIONS];
+    int           num_locations;
+    int           open_location;
+    int           position;
+    int           opens;
+    int           reads;
+    int           contains_calls;
+    struct dirent dirent;
+} fake_fs_t;
+
+#define TEST_RNG_SEED 0xD1B54A32
+#include "test_rng.h"
+
+static void name_of(int name, char *buffer, size_t size) {
+    if (name < 0) {
+        snprintf(buffer, size, "%s", name == -1 ? "." : "..");
+    } else {
+        snprintf(buffer, size, "FILE%d.TXT", name);
+    }
+}
+
+static void *fake_open(void *context, size_t location) {
+    fake_fs_t *fs = context;
+    fs->opens++;
+    if (fs->open_location >= 0) {
+        printf("\033[31mOpened location %zu while %d is still open\033[0m\n", location, fs->open_location);
+        exit(1);
+    }
+    if (!fs->locations[location].exists) {
+        return NULL;
+    }
+    fs->open_location = location;
+    fs->position      = 0;
+    return &fs->locations[location];
+}
+
+static struct dirent *fake_read(void *context, void *handle) {
+    fake_fs_t  *fs       = context;
+    location_t *location = handle;
+    fs->reads++;
+    if (fs->position == location->count) {
+        return NULL;
+    }
+    name_of(location->names[fs->position++], fs->dirent.d_name, sizeof(fs->dirent.d_name));
+    return &fs->dirent;
+}
+
+static void fake_close(void *context, void *handle) {
+    fake_fs_t *fs = context;
+    (void)handle;
+    fs->open_location = -1;
+}
+
+static bool fake_contains(void *context, size_t location, char const *name) {
+    fake_fs_t *fs = context;
+    int        number;
+    fs->contains_calls++;
+    if (!fs->locations[location].exists || sscanf(name, "FILE%d.TXT", &number) != 1) {
+        return false;
+    }
+    return fs->locations[location].has[number];
+}
+
+static dir_merge_ops_t const fake_ops = {
+    .open     = fake_open,
+    .read     = fake_read,
+    .close    = fake_close,
+    .contains = fake_contains,
+};
+
+static int compare_ints(void const *a, void const *b) {
+    return *(int const *)a - *(int const *)b;
+}
+
+// What opendir used to do: read everything, skipping names that were seen in
+// an earlier location. Returns -1 if no location could be read.
+static int eager_merge(fake_fs_t const *fs, int *names) {
+    static bool seen[MAX_NAMES * 2];
+    bool        found_any = false;
+    int         count     = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (int l = 0; l < fs->num_locations; ++l) {
+        if (!fs->locations[l].exists) {
+            continue;
+        }
+        found_any = true;
+        for (int i = 0; i < fs->locations[l].count; ++i) {
+            int name = fs->locations[l].names[i];
+            if (name >= 0 && !seen[name]) {
+                seen[name]      = true;
+                names[count++] = name;
+            }
+        }
+    }
+
+    qsort(names, count, sizeof(int), compare_ints);
+    return found_any ? count : -1;
+}
+
+static int streamed_merge(fake_fs_t *fs, dir_merge_t *merge, int *names, int max) {
+    struct dirent *entry;
+    int            count = 0;
+
+    while ((entry = dir_merge_read(merge))) {
+        if (count == max || sscanf(entry->d_name, "FILE%d.TXT", &names[count]) != 1) {
+            printf("\033[31mUnexpected entry %s\033[0m\n", entry->d_name);
+            return -1;
+        }
+        count++;
+    }
+
+    if (fs->open_location >= 0) {
+        printf("\033[31mLocation %d left open\033[0m\n", fs->open_location);
+        return -1;
+    }
+
+    qsort(names, count, sizeof(int), compare_ints);
+    return count;
+}
+
+static void random_fs(fake_fs_t *fs) {
+    int pool = 1 + rng() % (MAX_NAMES * 2);
+
+    memset(fs, 0, sizeof(*fs));
+    fs->open_location = -1;
+    fs->num_locations = 1 + rng() % MAX_LOCATIONS;
+
+    for (int l = 0; l < fs->num_locations; ++l) {
+        location_t *location = &fs->locations[l];
+        location->exists     = rng() % 8 != 0;
+
+        int want = rng() % 4 ? rng() % 50 : rng() % (MAX_NAMES - 2);
+        if (want > pool) {
+            want = pool;
+        }
+
+        if (rng() % 2) {
+            location->names[location->count++] = -1;
+            location->names[location->count++] = -2;
+        }
+        while (location->count < want) {
+            int name = rng() % pool;
+            if (!location->has[name]) {
+                location->has[name]                = true;
+                location->names[location->count++] = name;
+            }
+        }
+    }
+}
+
+int main() {
+    static fake_fs_t fs;
+    static int       expected[MAX_NAMES * 2];
+    static int       got[MAX_NAMES * 2];
+    int              error    = 0;
+    long             entries  = 0;
+    long             hidden   = 0;
+    long             contains = 0;
+
+    for (int iteration = 0; iteration < 1000 && !error; ++iteration) {
+        random_fs(&fs);
+
+        dir_merge_t merge;
+        int         expected_count = eager_merge(&fs, expected);
+        bool        opened         = dir_merge_open(&merge, &fake_ops, &fs, fs.num_locations);
+
+        if (opened != (expected_count >= 0)) {
+            printf("\033[31mIteration %d: open returned %d\033[0m\n", iteration, opened);
+            error = 1;
+            break;
+        }
+        if (!opened) {
+            continue;
+        }
+
+        // The first entry only costs opening the first readable location
+        int first_location = 0;
+        while (!fs.locations[first_location].exists) {
+            first_location++;
+        }
+        if (fs.locations[first_location].count > 2 && fs.locations[first_location].names[2] >= 0) {
+            dir_merge_read(&merge);
+            if (fs.opens != first_location + 1 || fs.reads > 3 || fs.contains_calls) {
+                printf(
+                    "\033[31mIteration %d: first entry took %d opens and %d reads\033[0m\n",
+                    iteration,
+                    fs.opens,
+                    fs.reads
+                );
+                error = 1;
+                break;
+            }
+
+            // Read a little more, then start over
+            for (int i = rng() % 100; i > 0; --i) {
+                dir_merge_read(&merge);
+            }
+            dir_merge_rewind(&merge);
+        }
+
+        fs.contains_calls = 0;
+        int got_count     = streamed_merge(&fs, &merge, got, MAX_NAMES * 2);
+        if (got_count != expected_count || memcmp(got, expected, got_count * sizeof(int))) {
+            printf(
+                "\033[31mIteration %d: streamed %d entries, expected %d\033[0m\n",
+                iteration,
+                got_count,
+                expected_count
+            );
+            error = 1;
+            break;
+        }
+
+        for (int l = 0; l < fs.num_locations; ++l) {
+            if (fs.locations[l].exists) {
+                hidden += fs.locations[l].count;
+            }
+        }
+        entries  += got_count;
+        hidden   -= got_count;
+        contains += fs.contains_calls;
+
+        // Closing halfway leaves nothing open
+        dir_merge_rewind(&merge);
+        dir_merge_read(&merge);
+        dir_merge_close(&merge);
+        if (fs.open_location >= 0) {
+            printf("\033[31mIteration %d: close left a location open\033[0m\n", iteration);
+            error = 1;
+        }
+    }
+
+    printf("%ld entries streamed, %ld hidden or dots, %ld filter hits checked\n", entries, hidden, contains);
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+    }
+
+    return error;
+}
+#endif
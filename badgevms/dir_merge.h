@@ -0,0 +1,56 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <dirent.h>
+
+// Bits in the filter of names from earlier search list elements, a power of two
+#define DIR_MERGE_FILTER_BITS 16384
+
+// How the merge reads the directory at each element of a search list. Only
+// one location is open at a time.
+typedef struct {
+    void          *(*open)(void *context, size_t location);
+    struct dirent *(*read)(void *context, void *handle);
+    void (*close)(void *context, void *handle);
+    // Whether name exists in the directory at location
+    bool (*contains)(void *context, size_t location, char const *name);
+} dir_merge_ops_t;
+
+// Streams the union of the directories at each location, in search list order.
+// A name in a later location is hidden by the same name in an earlier one. The
+// filter remembers which names earlier locations had, only its hits are
+// confirmed with contains().
+typedef struct {
+    dir_merge_ops_t const *ops;
+    void                  *context;
+    size_t                 num_locations;
+    size_t                 location; // Being read
+    void                  *handle;
+    uint32_t               filter[DIR_MERGE_FILTER_BITS / 32];
+} dir_merge_t;
+
+// Returns false if none of the locations could be opened
+bool           dir_merge_open(dir_merge_t *merge, dir_merge_ops_t const *ops, void *context, size_t num_locations);
+struct dirent *dir_merge_read(dir_merge_t *merge);
+bool           dir_merge_rewind(dir_merge_t *merge);
+void           dir_merge_close(dir_merge_t *merge);
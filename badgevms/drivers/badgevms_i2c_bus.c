@@ -18,7 +18,10 @@
 
 #include "badgevms_config.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "i2c_bus.h"
+#include "i2c_queue.h"
 #include "task.h"
 
 #include <stdbool.h>
@@ -45,11 +48,17 @@ static i2c_config_t why_config = {
 };
 
 typedef struct {
-    i2c_bus_device_t device;
-    i2c_bus_handle_t handle;
-    i2c_config_t     config;
-    bool             devices[255];
-    char const      *name;
+    i2c_bus_device_t  device;
+    i2c_bus_handle_t  handle;
+    i2c_config_t      config;
+    bool              devices[255];
+    char const       *name;
+    i2c_queue_t       queue;
+    SemaphoreHandle_t lock; // The queue, busy and draining
+    TaskHandle_t      task;
+    void             *busy;     // Device whose batch is running
+    void             *draining; // Device being destroyed while busy
+    SemaphoreHandle_t drained;  // Given once its batch has finished
 } badgevms_i2c_bus_device_t;
 
 typedef struct {
@@ -58,6 +67,9 @@ typedef struct {
     i2c_bus_device_handle_t    handle;
     uint8_t                    address;
     uint32_t                   clk_speed;
+    SemaphoreHandle_t          lock; // One blocking transfer at a time
+    SemaphoreHandle_t          done;
+    bool                       ok;
 } badgevms_i2c_device_t;
 
 i2c_device_t *badgevms_i2c_device_create(badgevms_i2c_bus_device_t *bus, uint8_t address, uint32_t clk_speed);
@@ -114,42 +126,118 @@ static int i2c_device_close(void *dev, int fd) {
     return -1;
 }
 
-static ssize_t i2c_device_write(void *dev, int fd, void const *buf, size_t count) {
-    badgevms_i2c_device_t *device = dev;
-    esp_err_t              err;
+// Runs queued batches one after another, highest priority first
+static void i2c_bus_task(void *pvParameters) {
+    badgevms_i2c_bus_device_t *bus = pvParameters;
+
+    while (true) {
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        i2c_batch_t *batch = i2c_queue_pop(&bus->queue);
+        bus->busy          = batch ? batch->device : NULL;
+        xSemaphoreGive(bus->lock);
 
-    if (count == 1) {
-        err = i2c_bus_write_byte(device->handle, fd, *((uint8_t *)buf));
-        if (err == ESP_OK) {
-            return 1;
+        if (!batch) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
         }
 
-        return 0;
+        badgevms_i2c_device_t *device = batch->device;
+        bool                   ok     = true;
+        for (int i = 0; i < batch->count && ok; ++i) {
+            i2c_transaction_t *t = &batch->transactions[i];
+            esp_err_t          err;
+            if (t->read) {
+                err = i2c_bus_read_bytes(device->handle, t->reg, t->len, t->data);
+            } else {
+                err = i2c_bus_write_bytes(device->handle, t->reg, t->len, t->data);
+            }
+            ok = err == ESP_OK;
+        }
+
+        if (batch->done) {
+            batch->done(batch->user_data, ok);
+        }
+        free(batch);
+
+        xSemaphoreTake(bus->lock, portMAX_DELAY);
+        bus->busy = NULL;
+        if (bus->draining == device) {
+            bus->draining = NULL;
+            xSemaphoreGive(bus->drained);
+        }
+        xSemaphoreGive(bus->lock);
     }
+}
 
-    err = i2c_bus_write_bytes(device->handle, fd, count, (uint8_t *)buf);
-    if (err == ESP_OK) {
-        return count;
+static bool i2c_device_submit(
+    void              *dev,
+    i2c_transaction_t *transactions,
+    int                count,
+    i2c_priority_t     priority,
+    void (*done)(void *user_data, bool ok),
+    void *user_data
+) {
+    badgevms_i2c_device_t *device = dev;
+
+    if (count <= 0 || priority < 0 || priority >= I2C_PRIORITY_COUNT) {
+        return false;
     }
 
-    return 0;
+    i2c_batch_t *batch = malloc(sizeof(i2c_batch_t));
+    if (!batch) {
+        return false;
+    }
+
+    batch->device       = device;
+    batch->transactions = transactions;
+    batch->count        = count;
+    batch->priority     = priority;
+    batch->done         = done;
+    batch->user_data    = user_data;
+
+    xSemaphoreTake(device->bus->lock, portMAX_DELAY);
+    i2c_queue_push(&device->bus->queue, batch);
+    xSemaphoreGive(device->bus->lock);
+
+    xTaskNotifyGive(device->bus->task);
+    return true;
 }
 
-static ssize_t i2c_device_read(void *dev, int fd, void *buf, size_t count) {
-    badgevms_i2c_device_t *device = dev;
-    esp_err_t              err;
+static void i2c_device_transfer_done(void *user_data, bool ok) {
+    badgevms_i2c_device_t *device = user_data;
+    device->ok                    = ok;
+    xSemaphoreGive(device->done);
+}
 
-    if (count == 1) {
-        err = i2c_bus_read_byte(device->handle, fd, ((uint8_t *)buf));
-        if (err == ESP_OK) {
-            return 1;
-        }
+// Blocking reads and writes queue like everything else, fd is the register
+static bool i2c_device_transfer(badgevms_i2c_device_t *device, int fd, bool read, void *buf, size_t count) {
+    i2c_transaction_t transaction = {.reg = fd, .read = read, .len = count, .data = buf};
+    bool              ok          = false;
 
-        return 0;
+    if (count > UINT16_MAX) {
+        return false;
     }
 
-    err = i2c_bus_read_bytes(device->handle, fd, count, (uint8_t *)buf);
-    if (err == ESP_OK) {
+    xSemaphoreTake(device->lock, portMAX_DELAY);
+    if (i2c_device_submit(device, &transaction, 1, I2C_PRIORITY_BULK, i2c_device_transfer_done, device)) {
+        xSemaphoreTake(device->done, portMAX_DELAY);
+        ok = device->ok;
+    }
+    xSemaphoreGive(device->lock);
+
+    return ok;
+}
+
+static ssize_t i2c_device_write(void *dev, int fd, void const *buf, size_t count) {
+    if (i2c_device_transfer(dev, fd, false, (void *)buf, count)) {
+        return count;
+    }
+
+    return 0;
+}
+
+static ssize_t i2c_device_read(void *dev, int fd, void *buf, size_t count) {
+    if (i2c_device_transfer(dev, fd, true, buf, count)) {
         return count;
     }
 
@@ -166,8 +254,31 @@ static uint8_t i2c_device_get_address(void *dev) {
 }
 
 static void i2c_device_destroy(void *dev) {
-    badgevms_i2c_device_t *device = dev;
+    badgevms_i2c_device_t     *device = dev;
+    badgevms_i2c_bus_device_t *bus    = device->bus;
     task_record_resource_free(RES_DEVICE, dev);
+
+    // Drop what is still queued and wait for a running batch to finish
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    i2c_batch_t *cancelled = i2c_queue_cancel(&bus->queue, dev);
+    bool         running   = bus->busy == dev;
+    if (running) {
+        bus->draining = dev;
+    }
+    xSemaphoreGive(bus->lock);
+
+    if (running) {
+        xSemaphoreTake(bus->drained, portMAX_DELAY);
+    }
+
+    while (cancelled) {
+        i2c_batch_t *next = cancelled->next;
+        free(cancelled);
+        cancelled = next;
+    }
+
+    vSemaphoreDelete(device->lock);
+    vSemaphoreDelete(device->done);
     i2c_bus_device_delete(device->handle);
     device->bus->devices[device->address] = false;
     free(dev);
@@ -189,18 +300,28 @@ i2c_device_t *badgevms_i2c_device_create(badgevms_i2c_bus_device_t *bus, uint8_t
     base_dev->_destroy = i2c_device_destroy;
 
     i2c_dev->_get_address = i2c_device_get_address;
+    i2c_dev->_submit      = i2c_device_submit;
 
     if (!dev) {
         ESP_LOGE(TAG, "Failed to allocate i2c device");
         return NULL;
     }
 
+    if (clk_speed > I2C_MAX_FREQ_HZ) {
+        ESP_LOGW(TAG, "Limiting device %u to %d Hz", address, I2C_MAX_FREQ_HZ);
+        clk_speed = I2C_MAX_FREQ_HZ;
+    }
+
     dev->bus       = bus;
     dev->clk_speed = clk_speed;
     dev->address   = address;
+    dev->lock      = xSemaphoreCreateMutex();
+    dev->done      = xSemaphoreCreateBinary();
     dev->handle    = i2c_bus_device_create(bus->handle, address, clk_speed);
     if (!dev->handle) {
         ESP_LOGE(TAG, "Failed to allocate i2c device");
+        vSemaphoreDelete(dev->lock);
+        vSemaphoreDelete(dev->done);
         free(dev);
         return NULL;
     }
@@ -245,5 +366,10 @@ device_t *badgevms_i2c_bus_create(char const *name, uint8_t port, uint32_t clk_s
         return NULL;
     }
 
+    i2c_queue_init(&dev->queue);
+    dev->lock    = xSemaphoreCreateMutex();
+    dev->drained = xSemaphoreCreateBinary();
+    create_kernel_task(i2c_bus_task, dev->name, 3072, dev, 18, &dev->task, 1);
+
     return (device_t *)dev;
 }
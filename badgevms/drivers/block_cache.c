@@ -0,0 +1,406 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "block_cache.h"
+
+#include <string.h>
+
+size_t block_cache_memory_size(uint32_t num_lines, uint32_t sector_size, uint32_t max_readahead) {
+    num_lines -= num_lines % BLOCK_CACHE_WAYS;
+    return (size_t)(max_readahead + num_lines) * sector_size + num_lines * sizeof(block_cache_line_t);
+}
+
+void block_cache_init(
+    block_cache_t           *cache,
+    block_cache_ops_t const *ops,
+    void                    *context,
+    uint32_t                 sector_size,
+    uint32_t                 num_sectors,
+    uint32_t                 num_lines,
+    uint32_t                 max_readahead,
+    void                    *memory
+) {
+    num_lines -= num_lines % BLOCK_CACHE_WAYS;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->ops           = ops;
+    cache->context       = context;
+    cache->sector_size   = sector_size;
+    cache->num_sectors   = num_sectors;
+    cache->num_sets      = num_lines / BLOCK_CACHE_WAYS;
+    cache->max_readahead = max_readahead;
+    cache->staging       = memory;
+    cache->data          = cache->staging + (size_t)max_readahead * sector_size;
+    cache->lines         = (block_cache_line_t *)(cache->data + (size_t)num_lines * sector_size);
+    cache->next_sector   = UINT32_MAX;
+
+    block_cache_invalidate(cache);
+}
+
+void block_cache_invalidate(block_cache_t *cache) {
+    memset(cache->lines, 0, cache->num_sets * BLOCK_CACHE_WAYS * sizeof(block_cache_line_t));
+}
+
+static inline uint8_t *line_data(block_cache_t *cache, block_cache_line_t *line) {
+    return cache->data + (size_t)(line - cache->lines) * cache->sector_size;
+}
+
+// Consecutive sectors go to consecutive sets
+static block_cache_line_t *lookup(block_cache_t *cache, uint32_t sector) {
+    if (!cache->num_sets)
+        return NULL;
+
+    block_cache_line_t *set = &cache->lines[(sector % cache->num_sets) * BLOCK_CACHE_WAYS];
+    for (int way = 0; way < BLOCK_CACHE_WAYS; ++way) {
+        if (set[way].valid && set[way].sector == sector)
+            return &set[way];
+    }
+    return NULL;
+}
+
+// Replaces the least recently used line of the set
+static void insert(block_cache_t *cache, uint32_t sector, uint8_t const *data, bool prefetched) {
+    if (!cache->num_sets)
+        return;
+
+    block_cache_line_t *set    = &cache->lines[(sector % cache->num_sets) * BLOCK_CACHE_WAYS];
+    block_cache_line_t *victim = &set[0];
+    for (int way = 0; way < BLOCK_CACHE_WAYS; ++way) {
+        if (set[way].valid && set[way].sector == sector) {
+            victim = &set[way];
+            break;
+        }
+        if (!set[way].valid) {
+            victim = &set[way];
+        } else if (victim->valid && set[way].last_used < victim->last_used) {
+            victim = &set[way];
+        }
+    }
+
+    // A line read ahead again keeps its place in the order
+    if (!victim->valid || victim->sector != sector) {
+        victim->last_used  = ++cache->clock;
+        victim->prefetched = prefetched;
+    }
+    victim->valid  = true;
+    victim->sector = sector;
+    memcpy(line_data(cache, victim), data, cache->sector_size);
+}
+
+bool block_cache_read(block_cache_t *cache, uint8_t *buf, uint32_t sector, uint32_t count) {
+    if (sector == cache->next_sector) {
+        uint32_t readahead = cache->readahead ? cache->readahead * 2 : count;
+        cache->readahead   = readahead < cache->max_readahead ? readahead : cache->max_readahead;
+    } else {
+        cache->readahead = 0;
+    }
+    cache->next_sector = sector + count;
+
+    uint32_t i = 0;
+    while (i < count) {
+        block_cache_line_t *line = lookup(cache, sector + i);
+        if (line) {
+            memcpy(buf + (size_t)i * cache->sector_size, line_data(cache, line), cache->sector_size);
+            line->last_used = ++cache->clock;
+            if (line->prefetched) {
+                line->prefetched = false;
+                cache->stats.prefetch_hits++;
+            }
+            cache->stats.hits++;
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && !lookup(cache, sector + i + run)) {
+            run++;
+        }
+
+        // Large reads are already efficient, and would only push everything
+        // else out of the cache
+        if (run >= cache->max_readahead) {
+            cache->stats.device_reads++;
+            if (!cache->ops->read(cache->context, buf + (size_t)i * cache->sector_size, sector + i, run))
+                return false;
+            cache->stats.bypassed += run;
+            i                     += run;
+            continue;
+        }
+
+        // Read ahead past the end of the request, in the same transfer
+        uint32_t total = run;
+        if (i + run == count) {
+            total += cache->readahead;
+            if (total > cache->max_readahead)
+                total = cache->max_readahead;
+            if (total > cache->num_sectors - (sector + i))
+                total = cache->num_sectors - (sector + i);
+        }
+
+        cache->stats.device_reads++;
+        if (!cache->ops->read(cache->context, cache->staging, sector + i, total))
+            return false;
+
+        memcpy(buf + (size_t)i * cache->sector_size, cache->staging, (size_t)run * cache->sector_size);
+        for (uint32_t j = 0; j < total; ++j) {
+            insert(cache, sector + i + j, cache->staging + (size_t)j * cache->sector_size, j >= run);
+        }
+        cache->stats.misses     += run;
+        cache->stats.prefetched += total - run;
+        i                       += run;
+    }
+
+    return true;
+}
+
+bool block_cache_write(block_cache_t *cache, uint8_t const *buf, uint32_t sector, uint32_t count) {
+    bool success = cache->ops->write(cache->context, buf, sector, count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        block_cache_line_t *line = lookup(cache, sector + i);
+        if (!line)
+            continue;
+
+        // After a failed write nobody knows what is on the medium
+        if (success) {
+            memcpy(line_data(cache, line), buf + (size_t)i * cache->sector_size, cache->sector_size);
+        } else {
+            line->valid = false;
+        }
+    }
+    return success;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE   512
+#define NUM_SECTORS   8192
+#define NUM_LINES     256
+#define MAX_READAHEAD 32
+
+// A block device backed by a temporary file
+typedef struct {
+    FILE    *file;
+    uint32_t reads;
+    uint32_t sectors_read;
+    bool     fail;
+    bool     out_of_range;
+} file_device_t;
+
+#include "test_rng.h"
+
+static bool file_transfer(file_device_t *device, uint8_t *buf, uint32_t sector, uint32_t count, bool write) {
+    if (device->fail)
+        return false;
+    if (!count || sector >= NUM_SECTORS || count > NUM_SECTORS - sector) {
+        device->out_of_range = true;
+        return false;
+    }
+
+    off_t   offset = (off_t)sector * SECTOR_SIZE;
+    size_t  len    = (size_t)count * SECTOR_SIZE;
+    ssize_t done   = write ? pwrite(fileno(device->file), buf, len, offset) : pread(fileno(device->file), buf, len, offset);
+    return done == (ssize_t)len;
+}
+
+static bool file_read(void *context, uint8_t *buf, uint32_t sector, uint32_t count) {
+    file_device_t *device = context;
+    device->reads++;
+    device->sectors_read += count;
+    return file_transfer(device, buf, sector, count, false);
+}
+
+static bool file_write(void *context, uint8_t const *buf, uint32_t sector, uint32_t count) {
+    return file_transfer(context, (uint8_t *)buf, sector, count, true);
+}
+
+static block_cache_ops_t const file_ops = {
+    .read  = file_read,
+    .write = file_write,
+};
+
+// What is really on the device
+static void device_contents(file_device_t *device, uint8_t *buf, uint32_t sector, uint32_t count) {
+    pread(fileno(device->file), buf, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE);
+}
+
+static void fill_random(uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = rng();
+    }
+}
+
+int main(void) {
+    int           errors = 0;
+    file_device_t device = {.file = tmpfile()};
+    block_cache_t cache;
+    void         *memory = malloc(block_cache_memory_size(NUM_LINES, SECTOR_SIZE, MAX_READAHEAD));
+    uint8_t      *buf    = malloc(256 * SECTOR_SIZE);
+    uint8_t      *expect = malloc(256 * SECTOR_SIZE);
+
+    for (int sector = 0; sector < NUM_SECTORS; ++sector) {
+        fill_random(buf, SECTOR_SIZE);
+        fwrite(buf, 1, SECTOR_SIZE, device.file);
+    }
+    fflush(device.file);
+
+    block_cache_init(&cache, &file_ops, &device, SECTOR_SIZE, NUM_SECTORS, NUM_LINES, MAX_READAHEAD, memory);
+
+    // Random mix of streams, random reads, large reads and writes always reads
+    // back what is on the device
+    uint32_t stream = 0;
+    for (int round = 0; round < 20000; ++round) {
+        uint32_t op = rng() % 100;
+        uint32_t sector, count;
+
+        if (op < 40) {
+            count  = 1 + rng() % 8;
+            sector = stream % (NUM_SECTORS - count);
+            stream = sector + count;
+        } else if (op < 70) {
+            count  = 1 + rng() % 4;
+            sector = rng() % 64; // A hot area, like the FAT
+        } else if (op < 80) {
+            count  = 1 + rng() % 4;
+            sector = rng() % (NUM_SECTORS - count);
+        } else if (op < 85) {
+            count  = MAX_READAHEAD + rng() % 200;
+            sector = rng() % (NUM_SECTORS - count);
+        } else {
+            count  = 1 + rng() % 8;
+            sector = rng() % 2 ? rng() % 64 : rng() % (NUM_SECTORS - count);
+            fill_random(buf, (size_t)count * SECTOR_SIZE);
+            if (!block_cache_write(&cache, buf, sector, count)) {
+                printf("\033[31mWrite of %u at %u failed\033[0m\n", count, sector);
+                errors++;
+            }
+            continue;
+        }
+
+        if (!block_cache_read(&cache, buf, sector, count)) {
+            printf("\033[31mRead of %u at %u failed\033[0m\n", count, sector);
+            errors++;
+            continue;
+        }
+        device_contents(&device, expect, sector, count);
+        if (memcmp(buf, expect, (size_t)count * SECTOR_SIZE)) {
+            printf("\033[31mStale data reading %u at %u in round %d\033[0m\n", count, sector, round);
+            errors++;
+            break;
+        }
+    }
+    if (device.out_of_range) {
+        printf("\033[31mRead past the end of the device\033[0m\n");
+        errors++;
+    }
+    printf(
+        "Mixed: %u hits, %u misses, %u bypassed, %u of %u prefetched used\n",
+        cache.stats.hits,
+        cache.stats.misses,
+        cache.stats.bypassed,
+        cache.stats.prefetch_hits,
+        cache.stats.prefetched
+    );
+
+    // Reading a file a sector at a time turns into large transfers
+    block_cache_invalidate(&cache);
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    device.reads = 0;
+    for (uint32_t sector = 1000; sector < 3000; ++sector) {
+        block_cache_read(&cache, buf, sector, 1);
+    }
+    if (device.reads > 2000 / MAX_READAHEAD + 8 || cache.stats.prefetch_hits < 1900) {
+        printf("\033[31mSequential reads took %u transfers\033[0m\n", device.reads);
+        errors++;
+    }
+
+    // Random reads do not read ahead
+    block_cache_invalidate(&cache);
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    device.sectors_read = 0;
+    for (int i = 0; i < 2000; ++i) {
+        block_cache_read(&cache, buf, rng() % NUM_SECTORS, 1);
+    }
+    if (cache.stats.prefetched > 20 || device.sectors_read > 2000 + 20) {
+        printf("\033[31mRandom reads prefetched %u sectors\033[0m\n", cache.stats.prefetched);
+        errors++;
+    }
+
+    // A working set that fits stays cached, large reads do not push it out
+    block_cache_invalidate(&cache);
+    for (int pass = 0; pass < 3; ++pass) {
+        if (pass == 2) {
+            memset(&cache.stats, 0, sizeof(cache.stats));
+            block_cache_read(&cache, buf, 4000, 256);
+        }
+        for (uint32_t sector = 0; sector < NUM_LINES / 2; sector += 2) {
+            block_cache_read(&cache, buf, sector, 1);
+        }
+    }
+    if (cache.stats.misses || cache.stats.hits != NUM_LINES / 4 || cache.stats.bypassed != 256) {
+        printf("\033[31mWorking set lost, %u misses\033[0m\n", cache.stats.misses);
+        errors++;
+    }
+
+    // Read ahead stops at the end of the device
+    block_cache_read(&cache, buf, NUM_SECTORS - 8, 4);
+    block_cache_read(&cache, buf, NUM_SECTORS - 4, 4);
+    if (device.out_of_range) {
+        printf("\033[31mRead ahead past the end of the device\033[0m\n");
+        errors++;
+    }
+
+    // Nothing is cached from a failed transfer
+    block_cache_invalidate(&cache);
+    device.fail = true;
+    if (block_cache_read(&cache, buf, 10, 2) || block_cache_write(&cache, buf, 10, 2)) {
+        printf("\033[31mDevice errors not reported\033[0m\n");
+        errors++;
+    }
+    device.fail = false;
+    block_cache_read(&cache, buf, 10, 2);
+    device_contents(&device, expect, 10, 2);
+    if (memcmp(buf, expect, 2 * SECTOR_SIZE)) {
+        printf("\033[31mFailed transfer got cached\033[0m\n");
+        errors++;
+    }
+    device.fail = true;
+    block_cache_write(&cache, buf, 10, 1);
+    device.fail     = false;
+    uint32_t misses = cache.stats.misses;
+    if (!block_cache_read(&cache, buf, 10, 1) || cache.stats.misses != misses + 1) {
+        printf("\033[31mLine kept after a failed write\033[0m\n");
+        errors++;
+    }
+
+    fclose(device.file);
+    free(memory);
+    free(buf);
+    free(expect);
+
+    if (errors) {
+        printf("\033[31m%d errors\033[0m\n", errors);
+        return 1;
+    }
+
+    printf("\033[32mAll tests passed\033[0m\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,87 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_WAYS 4
+
+// Transfers count whole sectors, false on error
+typedef struct {
+    bool (*read)(void *context, uint8_t *buf, uint32_t sector, uint32_t count);
+    bool (*write)(void *context, uint8_t const *buf, uint32_t sector, uint32_t count);
+} block_cache_ops_t;
+
+typedef struct {
+    uint32_t sector;
+    uint32_t last_used;
+    bool     valid;
+    bool     prefetched; // Read ahead and not used yet
+} block_cache_line_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t bypassed;      // Sectors of large reads that went around the cache
+    uint32_t prefetched;    // Sectors read ahead
+    uint32_t prefetch_hits; // Of those, sectors that were asked for later
+    uint32_t device_reads;  // Transfers, each of one or more sectors
+} block_cache_stats_t;
+
+// A set associative, write through cache of sectors under a filesystem. Reads
+// that continue where the previous one ended read ahead, by twice as much as
+// last time up to max_readahead sectors, in the same transfer as the miss.
+//
+// Not thread safe, FatFs locks each volume
+typedef struct {
+    block_cache_ops_t const *ops;
+    void                    *context;
+    uint32_t                 sector_size;
+    uint32_t                 num_sectors; // Of the device
+    uint32_t                 num_sets;
+    uint32_t                 max_readahead;
+    uint8_t                 *staging; // max_readahead sectors, for device transfers
+    uint8_t                 *data;    // One sector per line
+    block_cache_line_t      *lines;   // BLOCK_CACHE_WAYS per set
+    uint32_t                 clock;
+    uint32_t                 next_sector; // Where a sequential read would start
+    uint32_t                 readahead;
+    block_cache_stats_t      stats;
+} block_cache_t;
+
+// Size of the memory block_cache_init() needs, it starts with the transfer
+// buffers so it should be DMA capable and cache line aligned. The line data
+// follows at whole sectors from the start.
+size_t block_cache_memory_size(uint32_t num_lines, uint32_t sector_size, uint32_t max_readahead);
+
+// num_lines is rounded down to a multiple of BLOCK_CACHE_WAYS
+void block_cache_init(
+    block_cache_t           *cache,
+    block_cache_ops_t const *ops,
+    void                    *context,
+    uint32_t                 sector_size,
+    uint32_t                 num_sectors,
+    uint32_t                 num_lines,
+    uint32_t                 max_readahead,
+    void                    *memory
+);
+
+bool block_cache_read(block_cache_t *cache, uint8_t *buf, uint32_t sector, uint32_t count);
+bool block_cache_write(block_cache_t *cache, uint8_t const *buf, uint32_t sector, uint32_t count);
+void block_cache_invalidate(block_cache_t *cache);
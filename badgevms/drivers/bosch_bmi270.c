@@ -19,8 +19,13 @@
 #include "badgevms_config.h"
 #include "bmi270.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "imu_stream.h"
+#include "task.h"
 
 #include <stdatomic.h>
+#include <sys/time.h>
 
 #include <math.h>
 
@@ -42,18 +47,42 @@
 #define GYRO  UINT8_C(0x01)
 
 
+// The BMI270 FIFO is 2KB
+#define FIFO_BYTES 2048
+
 #define TAG "BMI270"
 
 static i2c_bus_handle_t i2c_bus;
 
-typedef struct {
+typedef struct bosch_bmi270_device bosch_bmi270_device_t;
+
+typedef struct imu_stream {
+    device_t               device;
+    bosch_bmi270_device_t *imu;
+    int                    rate_hz;
+    atomic_int             decimation;
+    imu_reader_t           reader;
+    struct imu_stream     *next;
+} imu_stream_t;
+
+struct bosch_bmi270_device {
     orientation_device_t device;
     bmi270_handle_t      sensor;
     atomic_flag          open;
     float                degrees;
-} bosch_bmi270_device_t;
-
-static int8_t set_accel_gyro_config(struct bmi2_dev *bmi);
+    SemaphoreHandle_t    lock; // Sensor access and the stream list
+    TaskHandle_t         stream_task;
+    i2c_device_t        *fifo_dev; // Fast path to the FIFO through the bus queue
+    SemaphoreHandle_t    fifo_done;
+    bool                 fifo_ok;
+    imu_stream_t        *streams;
+    int                  stream_odr; // 0 while not streaming
+    imu_ring_t           ring;
+    uint8_t              fifo[FIFO_BYTES];
+    imu_sample_t         samples[FIFO_BYTES / 13 + 1]; // Accel and gyro frames are 13 bytes
+};
+
+static int8_t set_accel_gyro_config(struct bmi2_dev *bmi, int odr_hz);
 static float  lsb_to_mps2(int16_t val, float g_range, uint8_t bit_width);
 static float  lsb_to_dps(int16_t val, float dps, uint8_t bit_width);
 void          why_bmi2_error_codes_print_result(int8_t rslt);
@@ -369,8 +398,24 @@ static int get_orientation_degrees(void *dev) {
         return (int)device->degrees;
     }
 
+    xSemaphoreTake(device->lock, portMAX_DELAY);
+
+    // The sensor is already running, use the newest streamed sample
+    if (device->stream_odr) {
+        unsigned int head = atomic_load(&device->ring.head);
+        if (head) {
+            imu_sample_t const *latest = &device->ring.samples[(head - 1) & (IMU_RING_SIZE - 1)];
+            acc_x                      = lsb_to_mps2(latest->acc[0], (float)2, device->sensor->resolution);
+            acc_y                      = lsb_to_mps2(latest->acc[1], (float)2, device->sensor->resolution);
+            device->degrees            = tilt_angle_deg(acc_x, acc_y);
+        }
+        xSemaphoreGive(device->lock);
+        atomic_flag_clear(&device->open);
+        return (int)device->degrees;
+    }
+
     /* Accel and gyro configuration settings. */
-    rslt = set_accel_gyro_config(device->sensor);
+    rslt = set_accel_gyro_config(device->sensor, 200);
     why_bmi2_error_codes_print_result(rslt);
 
     if (rslt == BMI2_OK) {
@@ -403,10 +448,214 @@ static int get_orientation_degrees(void *dev) {
         }
     }
     bmi270_sensor_disable(sensor_list, 2, device->sensor);
+    xSemaphoreGive(device->lock);
     atomic_flag_clear(&device->open);
     return (int)device->degrees;
 }
 
+// Streaming runs the sensors at the rate of the fastest subscriber with the
+// FIFO collecting accel and gyro frames. The stream task empties it in one
+// I2C burst every IMU_STREAM_POLL_MS, so the bus is not hit for every sample.
+static void stream_start(bosch_bmi270_device_t *device, int odr_hz) {
+    uint8_t sensor_list[2] = {BMI2_ACCEL, BMI2_GYRO};
+    int8_t  rslt;
+
+    rslt = set_accel_gyro_config(device->sensor, odr_hz);
+    if (rslt == BMI2_OK) {
+        rslt = bmi2_sensor_enable(sensor_list, 2, device->sensor);
+    }
+    if (rslt == BMI2_OK) {
+        rslt = bmi2_set_fifo_config(BMI2_FIFO_ALL_EN, BMI2_DISABLE, device->sensor);
+    }
+    if (rslt == BMI2_OK) {
+        rslt = bmi2_set_fifo_config(
+            BMI2_FIFO_ACC_EN | BMI2_FIFO_GYR_EN | BMI2_FIFO_HEADER_EN | BMI2_FIFO_TIME_EN,
+            BMI2_ENABLE,
+            device->sensor
+        );
+    }
+    if (rslt == BMI2_OK) {
+        rslt = bmi2_set_command_register(BMI2_FIFO_FLUSH_CMD, device->sensor);
+    }
+    why_bmi2_error_codes_print_result(rslt);
+
+    device->stream_odr = rslt == BMI2_OK ? odr_hz : 0;
+    ESP_LOGI(TAG, "Streaming at %dHz", device->stream_odr);
+}
+
+static void stream_stop(bosch_bmi270_device_t *device) {
+    uint8_t sensor_list[2] = {BMI2_ACCEL, BMI2_GYRO};
+
+    bmi2_set_fifo_config(BMI2_FIFO_ALL_EN | BMI2_FIFO_HEADER_EN | BMI2_FIFO_TIME_EN, BMI2_DISABLE, device->sensor);
+    bmi270_sensor_disable(sensor_list, 2, device->sensor);
+    device->stream_odr = 0;
+}
+
+static void fifo_read_done(void *user_data, bool ok) {
+    bosch_bmi270_device_t *device = user_data;
+    device->fifo_ok               = ok;
+    xSemaphoreGive(device->fifo_done);
+}
+
+static void stream_read_fifo(bosch_bmi270_device_t *device) {
+    uint16_t length;
+
+    if (bmi2_get_fifo_length(&length, device->sensor) != BMI2_OK || !length) {
+        return;
+    }
+    if (length > FIFO_BYTES) {
+        length = FIFO_BYTES;
+    }
+
+    // bmi2_get_regs() bounces through a 128 byte buffer, read the whole FIFO
+    // at once instead. Through the bus queue this runs at IMU_I2C_FREQ_HZ and
+    // behind keyboard traffic.
+    if (device->fifo_dev) {
+        i2c_transaction_t read = {.reg = BMI2_FIFO_DATA_ADDR, .read = true, .len = length, .data = device->fifo};
+        if (!device->fifo_dev->_submit(device->fifo_dev, &read, 1, I2C_PRIORITY_SENSOR, fifo_read_done, device)) {
+            return;
+        }
+        xSemaphoreTake(device->fifo_done, portMAX_DELAY);
+        if (!device->fifo_ok) {
+            return;
+        }
+    } else {
+        struct bmi2_dev *sensor = device->sensor;
+        if (sensor->read(BMI2_FIFO_DATA_ADDR, device->fifo, length, sensor->intf_ptr) != BMI2_INTF_RET_SUCCESS) {
+            return;
+        }
+    }
+
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+
+    bmi270_fifo_result_t result = bmi270_fifo_parse(
+        device->fifo,
+        length,
+        device->samples,
+        sizeof(device->samples) / sizeof(imu_sample_t),
+        (int64_t)tv_now.tv_sec * 1000000L + (int64_t)tv_now.tv_usec,
+        1000000 / device->stream_odr
+    );
+    if (result.skipped) {
+        ESP_LOGW(TAG, "FIFO overflowed, %d frames lost", result.skipped);
+    }
+
+    for (int i = 0; i < result.samples; ++i) {
+        imu_ring_push(&device->ring, &device->samples[i]);
+    }
+}
+
+static void bmi270_stream_task(void *pvParameters) {
+    bosch_bmi270_device_t *device = pvParameters;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, device->stream_odr ? pdMS_TO_TICKS(IMU_STREAM_POLL_MS) : portMAX_DELAY);
+
+        xSemaphoreTake(device->lock, portMAX_DELAY);
+
+        int odr = 0;
+        for (imu_stream_t *stream = device->streams; stream; stream = stream->next) {
+            int stream_odr = imu_odr_for_rate(stream->rate_hz);
+            odr            = stream_odr > odr ? stream_odr : odr;
+        }
+
+        if (odr != device->stream_odr) {
+            if (odr) {
+                stream_start(device, odr);
+            } else {
+                stream_stop(device);
+            }
+            for (imu_stream_t *stream = device->streams; stream; stream = stream->next) {
+                atomic_store(&stream->decimation, imu_decimation(odr, stream->rate_hz));
+            }
+        } else if (odr) {
+            stream_read_fifo(device);
+        }
+
+        xSemaphoreGive(device->lock);
+    }
+}
+
+static int imu_stream_open(void *dev, path_t *path, int flags, mode_t mode) {
+    return -1;
+}
+
+static int imu_stream_close(void *dev, int fd) {
+    return -1;
+}
+
+static ssize_t imu_stream_read(void *dev, int fd, void *buf, size_t count) {
+    imu_stream_t *stream = dev;
+
+    stream->reader.decimation = atomic_load(&stream->decimation);
+    int n = imu_reader_read(&stream->reader, &stream->imu->ring, buf, count / sizeof(imu_sample_t));
+    return n * sizeof(imu_sample_t);
+}
+
+static ssize_t imu_stream_write(void *dev, int fd, void const *buf, size_t count) {
+    return -1;
+}
+
+static ssize_t imu_stream_lseek(void *dev, int fd, off_t offset, int whence) {
+    return -1;
+}
+
+static void imu_stream_destroy(void *dev) {
+    imu_stream_t          *stream = dev;
+    bosch_bmi270_device_t *device = stream->imu;
+
+    task_record_resource_free(RES_DEVICE, dev);
+
+    xSemaphoreTake(device->lock, portMAX_DELAY);
+    for (imu_stream_t **s = &device->streams; *s; s = &(*s)->next) {
+        if (*s == stream) {
+            *s = stream->next;
+            break;
+        }
+    }
+    xSemaphoreGive(device->lock);
+
+    free(stream);
+    xTaskNotifyGive(device->stream_task);
+}
+
+static device_t *stream_create(void *dev, int rate_hz) {
+    bosch_bmi270_device_t *device = dev;
+
+    if (rate_hz <= 0) {
+        return NULL;
+    }
+
+    imu_stream_t *stream   = calloc(1, sizeof(imu_stream_t));
+    device_t     *base_dev = (device_t *)stream;
+    if (!stream) {
+        return NULL;
+    }
+
+    base_dev->type     = DEVICE_TYPE_ORIENTATION;
+    base_dev->_open    = imu_stream_open;
+    base_dev->_close   = imu_stream_close;
+    base_dev->_write   = imu_stream_write;
+    base_dev->_read    = imu_stream_read;
+    base_dev->_lseek   = imu_stream_lseek;
+    base_dev->_destroy = imu_stream_destroy;
+
+    stream->imu     = device;
+    stream->rate_hz = rate_hz > IMU_STREAM_MAX_HZ ? IMU_STREAM_MAX_HZ : rate_hz;
+
+    xSemaphoreTake(device->lock, portMAX_DELAY);
+    atomic_init(&stream->decimation, imu_decimation(device->stream_odr, stream->rate_hz));
+    imu_reader_init(&stream->reader, &device->ring, 1);
+    stream->next    = device->streams;
+    device->streams = stream;
+    xSemaphoreGive(device->lock);
+
+    task_record_resource_alloc(RES_DEVICE, stream);
+    xTaskNotifyGive(device->stream_task);
+    return base_dev;
+}
+
 static orientation_t get_orientation(void *dev) {
     int degrees = get_orientation_degrees(dev);
     if (degrees > 45 && degrees < 135) {
@@ -433,6 +682,7 @@ device_t *bosch_bmi270_sensor_create() {
 
     orientation_dev->_get_orientation         = get_orientation;
     orientation_dev->_get_orientation_degrees = get_orientation_degrees;
+    orientation_dev->_stream_create           = stream_create;
 
     i2c_config_t const i2c_bus_conf = {
         .mode             = I2C_MODE_MASTER,
@@ -464,6 +714,16 @@ device_t *bosch_bmi270_sensor_create() {
         return NULL;
     }
 
+    i2c_bus_device_t *bus = (i2c_bus_device_t *)device_get("I2CBUS0");
+    if (bus) {
+        dev->fifo_dev = bus->_device_create(bus, BMI270_I2C_ADDR, IMU_I2C_FREQ_HZ);
+    }
+
+    dev->lock      = xSemaphoreCreateMutex();
+    dev->fifo_done = xSemaphoreCreateBinary();
+    imu_ring_init(&dev->ring);
+    create_kernel_task(bmi270_stream_task, "IMU stream", 3072, dev, 18, &dev->stream_task, 1);
+
     ESP_LOGW(TAG, "BMI270 initialized");
 
     return (device_t *)dev;
@@ -472,7 +732,7 @@ device_t *bosch_bmi270_sensor_create() {
 /*!
  * @brief This internal API is used to set configurations for accel and gyro.
  */
-static int8_t set_accel_gyro_config(struct bmi2_dev *bmi) {
+static int8_t set_accel_gyro_config(struct bmi2_dev *bmi, int odr_hz) {
     /* Status of api are returned to this variable. */
     int8_t rslt;
 
@@ -491,10 +751,16 @@ static int8_t set_accel_gyro_config(struct bmi2_dev *bmi) {
     rslt = bmi2_map_data_int(BMI2_DRDY_INT, BMI2_INT1, bmi);
     why_bmi2_error_codes_print_result(rslt);
 
+    /* The ODR codes count up from 25Hz in powers of two for both sensors. */
+    uint8_t odr = BMI2_ACC_ODR_25HZ;
+    for (int hz = IMU_ODR_MIN_HZ; hz < odr_hz && odr < BMI2_ACC_ODR_1600HZ; hz *= 2) {
+        odr++;
+    }
+
     if (rslt == BMI2_OK) {
         /* NOTE: The user can change the following configuration parameters according to their requirement. */
         /* Set Output Data Rate */
-        config[ACCEL].cfg.acc.odr = BMI2_ACC_ODR_200HZ;
+        config[ACCEL].cfg.acc.odr = odr;
 
         /* Gravity range of the sensor (+/- 2G, 4G, 8G, 16G). */
         config[ACCEL].cfg.acc.range = BMI2_ACC_RANGE_2G;
@@ -519,7 +785,7 @@ static int8_t set_accel_gyro_config(struct bmi2_dev *bmi) {
 
         /* The user can change the following configuration parameters according to their requirement. */
         /* Set Output Data Rate */
-        config[GYRO].cfg.gyr.odr = BMI2_GYR_ODR_200HZ;
+        config[GYRO].cfg.gyr.odr = odr;
 
         /* Gyroscope Angular Rate Measurement Range.By default the range is 2000dps. */
         config[GYRO].cfg.gyr.range = BMI2_GYR_RANGE_2000;
@@ -0,0 +1,475 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dentry_cache.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+// FAT names are case insensitive, so is the cache
+static uint32_t path_hash(char const *path) {
+    uint32_t hash = 2166136261u;
+    for (char const *c = path; *c; ++c) {
+        hash = (hash ^ (uint8_t)tolower((uint8_t)*c)) * 16777619u;
+    }
+    return hash;
+}
+
+static bool being_written(dentry_cache_t const *cache, uint32_t hash) {
+    for (uint64_t writing = cache->writing; writing; writing &= writing - 1) {
+        if (cache->writer_hash[__builtin_ctzll(writing)] == hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void dentry_cache_init(dentry_cache_t *cache) {
+    memset(cache, 0, sizeof(dentry_cache_t));
+}
+
+dentry_result_t dentry_cache_lookup(dentry_cache_t *cache, char const *path, struct stat *st, uint32_t *generation) {
+    *generation = cache->generation;
+
+    if (!cache->disabled) {
+        uint32_t  hash  = path_hash(path);
+        dentry_t *entry = &cache->entries[hash & (DENTRY_CACHE_SLOTS - 1)];
+
+        if (entry->valid && entry->hash == hash && strcasecmp(entry->path, path) == 0) {
+            cache->hits++;
+            if (!entry->exists) {
+                return DENTRY_MISSING;
+            }
+            *st = entry->stat;
+            return DENTRY_FOUND;
+        }
+    }
+
+    cache->misses++;
+    return DENTRY_UNKNOWN;
+}
+
+void dentry_cache_insert(dentry_cache_t *cache, char const *path, struct stat const *st, uint32_t generation) {
+    if (cache->disabled || generation != cache->generation || strlen(path) >= DENTRY_CACHE_PATH_MAX) {
+        return;
+    }
+
+    uint32_t hash = path_hash(path);
+    if (being_written(cache, hash)) {
+        return;
+    }
+
+    dentry_t *entry = &cache->entries[hash & (DENTRY_CACHE_SLOTS - 1)];
+    entry->hash     = hash;
+    entry->valid    = true;
+    entry->exists   = st != NULL;
+    if (st) {
+        entry->stat = *st;
+    }
+    strcpy(entry->path, path);
+}
+
+void dentry_cache_invalidate(dentry_cache_t *cache, char const *path) {
+    cache->generation++;
+
+    size_t      len        = strlen(path);
+    char const *last_slash = strrchr(path, '/');
+    size_t      parent_len = last_slash ? last_slash - path : 0;
+    if (last_slash == path) {
+        parent_len = 1; // The root
+    }
+
+    for (int i = 0; i < DENTRY_CACHE_SLOTS; ++i) {
+        dentry_t *entry = &cache->entries[i];
+        if (!entry->valid) {
+            continue;
+        }
+
+        // The path itself or anything below it
+        if (strncasecmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/')) {
+            entry->valid = false;
+            continue;
+        }
+
+        // Its parent, whose modification time changes
+        if (parent_len && strncasecmp(entry->path, path, parent_len) == 0 && entry->path[parent_len] == '\0') {
+            entry->valid = false;
+        }
+    }
+}
+
+void dentry_cache_invalidate_all(dentry_cache_t *cache) {
+    cache->generation++;
+    for (int i = 0; i < DENTRY_CACHE_SLOTS; ++i) {
+        cache->entries[i].valid = false;
+    }
+}
+
+void dentry_cache_writer_open(dentry_cache_t *cache, char const *path, int fd) {
+    if (fd < 0) {
+        return;
+    }
+
+    if (fd >= DENTRY_CACHE_MAX_FDS) {
+        // We can't tell when this one is done with, stop caching altogether
+        cache->disabled = true;
+        dentry_cache_invalidate_all(cache);
+        return;
+    }
+
+    cache->writer_hash[fd]  = path_hash(path);
+    cache->writing         |= 1ull << fd;
+    dentry_cache_invalidate(cache, path);
+}
+
+void dentry_cache_writer_close(dentry_cache_t *cache, int fd) {
+    if (fd < 0 || fd >= DENTRY_CACHE_MAX_FDS || !(cache->writing & (1ull << fd))) {
+        return;
+    }
+
+    cache->writing &= ~(1ull << fd);
+    cache->generation++;
+
+    // Only the hash is known here, which is enough to find the entry
+    uint32_t  hash  = cache->writer_hash[fd];
+    dentry_t *entry = &cache->entries[hash & (DENTRY_CACHE_SLOTS - 1)];
+    if (entry->hash == hash) {
+        entry->valid = false;
+    }
+}
+
+#ifdef RUN_TEST
+#include <errno.h>
+#include <stdio.h>
+
+#define FAKE_NODES 64
+#define FAKE_FDS   8
+
+// A filesystem small enough that random operations keep hitting the same
+// names, with FAT's case insensitivity
+typedef struct {
+    bool  used;
+    bool  dir;
+    off_t size;
+    char  path[32];
+} fake_node_t;
+
+static fake_node_t fake_nodes[FAKE_NODES];
+static int         fake_fds[FAKE_FDS]; // Node index, -1 if closed
+static int         fake_lookups;
+
+static dentry_cache_t cache;
+
+#define TEST_RNG_SEED 0xC0FFEE11
+#include "test_rng.h"
+
+static fake_node_t *fake_find(char const *path) {
+    fake_lookups++;
+    for (int i = 0; i < FAKE_NODES; ++i) {
+        if (fake_nodes[i].used && strcasecmp(fake_nodes[i].path, path) == 0) {
+            return &fake_nodes[i];
+        }
+    }
+    return NULL;
+}
+
+static bool fake_parent_is_dir(char const *path) {
+    char parent[32];
+    strcpy(parent, path);
+    *strrchr(parent, '/') = '\0';
+    fake_node_t *node     = fake_find(parent);
+    return node && node->dir;
+}
+
+static bool fake_has_children(char const *path) {
+    size_t len = strlen(path);
+    for (int i = 0; i < FAKE_NODES; ++i) {
+        if (fake_nodes[i].used && strncasecmp(fake_nodes[i].path, path, len) == 0 && fake_nodes[i].path[len] == '/') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static fake_node_t *fake_add(char const *path, bool dir) {
+    for (int i = 0; i < FAKE_NODES; ++i) {
+        if (!fake_nodes[i].used) {
+            fake_nodes[i].used = true;
+            fake_nodes[i].dir  = dir;
+            fake_nodes[i].size = 0;
+            strcpy(fake_nodes[i].path, path);
+            return &fake_nodes[i];
+        }
+    }
+    return NULL;
+}
+
+static int fake_stat(char const *path, struct stat *st) {
+    fake_node_t *node = fake_find(path);
+    if (!node) {
+        errno = ENOENT;
+        return -1;
+    }
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = node->dir ? S_IFDIR : S_IFREG;
+    st->st_size = node->size;
+    return 0;
+}
+
+// These do what fatfs.c does around the real calls
+
+static int cached_stat(char const *path, struct stat *st) {
+    uint32_t        generation;
+    dentry_result_t result = dentry_cache_lookup(&cache, path, st, &generation);
+    if (result == DENTRY_FOUND) {
+        return 0;
+    }
+    if (result == DENTRY_MISSING) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int ret = fake_stat(path, st);
+    if (ret == 0 || errno == ENOENT) {
+        dentry_cache_insert(&cache, path, ret == 0 ? st : NULL, generation);
+    }
+    return ret;
+}
+
+static int cached_open_write(char const *path) {
+    int fd = 0;
+    while (fd < FAKE_FDS && fake_fds[fd] >= 0) {
+        fd++;
+    }
+    if (fd == FAKE_FDS || !fake_parent_is_dir(path)) {
+        return -1;
+    }
+
+    fake_node_t *node = fake_find(path);
+    if (!node) {
+        node = fake_add(path, false);
+    }
+    if (!node || node->dir) {
+        return -1;
+    }
+
+    fake_fds[fd] = node - fake_nodes;
+    dentry_cache_writer_open(&cache, path, fd);
+    return fd;
+}
+
+static void cached_close(int fd) {
+    fake_fds[fd] = -1;
+    dentry_cache_writer_close(&cache, fd);
+}
+
+static bool node_is_open(fake_node_t const *node) {
+    for (int fd = 0; fd < FAKE_FDS; ++fd) {
+        if (fake_fds[fd] == node - fake_nodes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cached_unlink(char const *path) {
+    fake_node_t *node = fake_find(path);
+    if (node && !node->dir && !node_is_open(node)) {
+        node->used = false;
+        dentry_cache_invalidate(&cache, path);
+    }
+}
+
+static void cached_mkdir(char const *path) {
+    if (!fake_find(path) && fake_parent_is_dir(path) && fake_add(path, true)) {
+        dentry_cache_invalidate(&cache, path);
+    }
+}
+
+static void cached_rmdir(char const *path) {
+    fake_node_t *node = fake_find(path);
+    if (node && node->dir && strcasecmp(path, "/SD0") != 0 && !fake_has_children(path)) {
+        node->used = false;
+        dentry_cache_invalidate(&cache, path);
+    }
+}
+
+static void cached_rename(char const *from, char const *to) {
+    fake_node_t *node   = fake_find(from);
+    size_t       length = strlen(from);
+
+    if (!node || node_is_open(node) || fake_find(to) || !fake_parent_is_dir(to) || strcasecmp(from, "/SD0") == 0 ||
+        (strncasecmp(to, from, length) == 0 && to[length] == '/')) {
+        return;
+    }
+
+    // Move the node and everything below it
+    for (int i = 0; i < FAKE_NODES; ++i) {
+        fake_node_t *n = &fake_nodes[i];
+        if (n->used && strncasecmp(n->path, from, length) == 0 && (n->path[length] == '\0' || n->path[length] == '/')) {
+            char moved[64];
+            snprintf(moved, sizeof(moved), "%s%s", to, n->path + length);
+            if (strlen(moved) >= sizeof(n->path)) {
+                return; // Too deep for the fake, leaves a half done rename
+            }
+            strcpy(n->path, moved);
+        }
+    }
+    dentry_cache_invalidate(&cache, from);
+    dentry_cache_invalidate(&cache, to);
+}
+
+static void random_path(char *path, size_t size) {
+    static char const *dirs[]  = {"/SD0", "/SD0/a", "/SD0/b", "/SD0/a/c"};
+    static char const *names[] = {"a", "b", "c", "x.txt", "y.bin", "app.elf"};
+
+    snprintf(path, size, "%s/%s", dirs[rng() % 4], names[rng() % 6]);
+
+    // FAT does not care about case, neither may the cache
+    for (char *c = path; *c; ++c) {
+        if (rng() % 4 == 0) {
+            *c = toupper((uint8_t)*c);
+        }
+    }
+}
+
+int main() {
+    int error = 0;
+
+    dentry_cache_init(&cache);
+    fake_add("/SD0", true);
+    for (int fd = 0; fd < FAKE_FDS; ++fd) {
+        fake_fds[fd] = -1;
+    }
+
+    // A search list miss on one device and hit on the next costs nothing the
+    // second time around
+    fake_add("/SD0/apps", true);
+    fake_add("/SD0/apps/app.elf", false);
+
+    struct stat st;
+    for (int pass = 0; pass < 2; ++pass) {
+        fake_lookups = 0;
+        if (cached_stat("/SD0/missing/app.elf", &st) == 0 || errno != ENOENT ||
+            cached_stat("/SD0/apps/app.elf", &st) != 0) {
+            printf("\033[31mSearch list stat returned the wrong result\033[0m\n");
+            error = 1;
+        }
+        if (pass == 1 && fake_lookups) {
+            printf("\033[31mCached search list stat still made %d lookups\033[0m\n", fake_lookups);
+            error = 1;
+        }
+    }
+
+    // A result that raced with a change is thrown away
+    uint32_t generation;
+    if (dentry_cache_lookup(&cache, "/SD0/apps/new.elf", &st, &generation) != DENTRY_UNKNOWN) {
+        printf("\033[31mUnknown path was cached\033[0m\n");
+        error = 1;
+    }
+    cached_close(cached_open_write("/SD0/apps/new.elf"));
+    dentry_cache_insert(&cache, "/SD0/apps/new.elf", NULL, generation);
+    if (cached_stat("/SD0/apps/new.elf", &st) != 0) {
+        printf("\033[31mStale negative entry was stored\033[0m\n");
+        error = 1;
+    }
+
+    // Random operations, every stat has to agree with the filesystem
+    long stats = 0;
+    cache.hits = cache.misses = 0;
+    for (int i = 0; i < 200000 && !error; ++i) {
+        char path[32], other[32];
+        random_path(path, sizeof(path));
+
+        uint32_t op = rng() % 100;
+        if (op < 70) {
+            struct stat expected;
+            int         expected_ret = fake_stat(path, &expected);
+            int         ret          = cached_stat(path, &st);
+            stats++;
+
+            if (ret != expected_ret ||
+                (ret == 0 && (st.st_mode != expected.st_mode || st.st_size != expected.st_size))) {
+                printf(
+                    "\033[31mOperation %d: stat %s gave %d size %ld, expected %d size %ld\033[0m\n",
+                    i,
+                    path,
+                    ret,
+                    ret == 0 ? (long)st.st_size : 0L,
+                    expected_ret,
+                    expected_ret == 0 ? (long)expected.st_size : 0L
+                );
+                error = 1;
+            }
+        } else if (op < 76) {
+            cached_open_write(path);
+        } else if (op < 82) {
+            int fd = rng() % FAKE_FDS;
+            if (fake_fds[fd] >= 0) {
+                fake_nodes[fake_fds[fd]].size += 1 + rng() % 512;
+            }
+        } else if (op < 87) {
+            int fd = rng() % FAKE_FDS;
+            if (fake_fds[fd] >= 0) {
+                cached_close(fd);
+            }
+        } else if (op < 90) {
+            cached_unlink(path);
+        } else if (op < 94) {
+            path[strlen(path) - 1] = 'd';
+            cached_mkdir(path);
+        } else if (op < 97) {
+            path[strlen(path) - 1] = 'd';
+            cached_rmdir(path);
+        } else {
+            random_path(other, sizeof(other));
+            if (rng() % 2) {
+                path[strlen(path) - 1]   = 'd';
+                other[strlen(other) - 1] = 'd';
+            }
+            cached_rename(path, other);
+        }
+    }
+    printf("%ld stats, %u served from the cache\n", stats, cache.hits);
+
+    // Unmounting forgets everything
+    dentry_cache_invalidate_all(&cache);
+    fake_lookups = 0;
+    cached_stat("/SD0/apps/app.elf", &st);
+    if (!fake_lookups) {
+        printf("\033[31mStat after invalidating everything did not reach the filesystem\033[0m\n");
+        error = 1;
+    }
+
+    // Descriptors the cache can't track turn it off
+    dentry_cache_writer_open(&cache, "/SD0/apps/app.elf", DENTRY_CACHE_MAX_FDS);
+    cached_stat("/SD0/apps/app.elf", &st);
+    fake_lookups = 0;
+    cached_stat("/SD0/apps/app.elf", &st);
+    if (!fake_lookups) {
+        printf("\033[31mThe cache kept working with an untracked writer\033[0m\n");
+        error = 1;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+    }
+
+    return error;
+}
+#endif
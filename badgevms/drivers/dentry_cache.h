@@ -0,0 +1,75 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+#define DENTRY_CACHE_SLOTS    128 // Must be a power of two
+#define DENTRY_CACHE_PATH_MAX 96  // Longer paths are never cached
+
+// Descriptors at or above this disable the cache, VFS descriptors stay below
+// FD_SETSIZE
+#define DENTRY_CACHE_MAX_FDS 64
+
+typedef enum {
+    DENTRY_UNKNOWN, // Not cached, ask the filesystem
+    DENTRY_MISSING, // The path does not exist
+    DENTRY_FOUND,   // The stat result is filled in
+} dentry_result_t;
+
+typedef struct {
+    uint32_t    hash;
+    bool        valid;
+    bool        exists;
+    struct stat stat;
+    char        path[DENTRY_CACHE_PATH_MAX];
+} dentry_t;
+
+// Caches stat() results, and their absence, by unix path. Files that are open
+// for writing are not cached until they are closed.
+//
+// Not thread safe, the filesystem driver locks around it
+typedef struct {
+    dentry_t entries[DENTRY_CACHE_SLOTS];
+    uint32_t generation; // Bumped by every invalidation
+    uint64_t writing;    // Descriptors open for writing
+    uint32_t writer_hash[DENTRY_CACHE_MAX_FDS];
+    bool     disabled;
+    uint32_t hits;
+    uint32_t misses;
+} dentry_cache_t;
+
+void dentry_cache_init(dentry_cache_t *cache);
+
+// generation is filled in for the insert that follows a miss
+dentry_result_t dentry_cache_lookup(dentry_cache_t *cache, char const *path, struct stat *st, uint32_t *generation);
+
+// Stores what the filesystem said, st is NULL if the path does not exist. Does
+// nothing if the cache was invalidated since the lookup that returned
+// generation.
+void dentry_cache_insert(dentry_cache_t *cache, char const *path, struct stat const *st, uint32_t generation);
+
+// Forgets path, everything below it and its parent directory
+void dentry_cache_invalidate(dentry_cache_t *cache, char const *path);
+void dentry_cache_invalidate_all(dentry_cache_t *cache);
+
+void dentry_cache_writer_open(dentry_cache_t *cache, char const *path, int fd);
+void dentry_cache_writer_close(dentry_cache_t *cache, int fd);
@@ -16,19 +16,33 @@
 
 #include "fatfs.h"
 
+#include "badgevms_config.h"
+#include "block_cache.h"
+#include "dentry_cache.h"
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include "diskio_wl.h"
 #include "driver/sdmmc_host.h"
+#include "esp_cache.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "pathfuncs_private.h"
 #include "sd_test_io.h"
 #include "sdkconfig.h"
 #include "sdmmc_cmd.h"
+#include "task.h"
+#include "wear_levelling.h"
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -60,29 +74,131 @@
 
 #define IS_UHS1 (SDCARD_SDMMC_SPEED_UHS_I_SDR50 || SDCARD_SDMMC_SPEED_UHS_I_DDR50)
 
+#define MAX_FLUSH_DEVICES 4
+
 typedef struct {
     filesystem_device_t  filesystem;
     wl_handle_t          wl_handle;
     sdmmc_card_t        *sdmmc_handle;
     sd_pwr_ctrl_handle_t pwr_ctrl_handle;
     char                *base_path;
+    SemaphoreHandle_t    dentry_lock;
+    dentry_cache_t       dentries;
+    SemaphoreHandle_t    writeback_lock; // Held while syncing, so descriptors are not closed underneath
+    writeback_t          writeback;
+    uint8_t              pdrv;
+    void                *cache_memory; // NULL when running uncached
+    block_cache_t        cache;
 } fatfs_device_t;
 
+// FatFs calls the disk functions by drive number
+static fatfs_device_t *cached_drives[FF_VOLUMES];
+
+// One task syncs the files of every device with a deferred policy
+static TaskHandle_t      flush_task;
+static SemaphoreHandle_t flush_lock;
+static fatfs_device_t   *flush_devices[MAX_FLUSH_DEVICES];
+
+static void dentry_invalidate(fatfs_device_t *device, char const *unixpath) {
+    if (!unixpath) {
+        return;
+    }
+
+    xSemaphoreTake(device->dentry_lock, portMAX_DELAY);
+    dentry_cache_invalidate(&device->dentries, unixpath);
+    xSemaphoreGive(device->dentry_lock);
+}
+
+static dentry_result_t dentry_lookup(
+    fatfs_device_t *device, char const *unixpath, struct stat *st, uint32_t *generation
+) {
+    xSemaphoreTake(device->dentry_lock, portMAX_DELAY);
+    dentry_result_t result = dentry_cache_lookup(&device->dentries, unixpath, st, generation);
+    xSemaphoreGive(device->dentry_lock);
+    return result;
+}
+
+static void dentry_insert(fatfs_device_t *device, char const *unixpath, struct stat const *st, uint32_t generation) {
+    xSemaphoreTake(device->dentry_lock, portMAX_DELAY);
+    dentry_cache_insert(&device->dentries, unixpath, st, generation);
+    xSemaphoreGive(device->dentry_lock);
+}
+
 static int fatfs_open(void *dev, path_t *path, int flags, mode_t mode) {
     fatfs_device_t *device   = dev;
     char           *unixpath = path_to_unix(path);
+    bool            writes   = (flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC | O_APPEND));
+    uint32_t        generation;
+    struct stat     st;
+
+    if (!unixpath) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Search lists try every device in turn, skip the ones known not to have it
+    if (!writes && dentry_lookup(device, unixpath, &st, &generation) == DENTRY_MISSING) {
+        errno = ENOENT;
+        return -1;
+    }
 
     int ret = open(unixpath, flags, mode);
+
+    if (writes) {
+        xSemaphoreTake(device->dentry_lock, portMAX_DELAY);
+        dentry_cache_writer_open(&device->dentries, unixpath, ret);
+        xSemaphoreGive(device->dentry_lock);
+    } else if (ret < 0 && errno == ENOENT) {
+        dentry_insert(device, unixpath, NULL, generation);
+    }
     return ret;
 }
 
 static int fatfs_close(void *dev, int fd) {
-    fsync(fd);
-    return close(fd);
+    fatfs_device_t *device = dev;
+
+    xSemaphoreTake(device->writeback_lock, portMAX_DELAY);
+    if (writeback_close(&device->writeback, fd)) {
+        fsync(fd);
+    }
+    int ret = close(fd);
+    xSemaphoreGive(device->writeback_lock);
+
+    xSemaphoreTake(device->dentry_lock, portMAX_DELAY);
+    dentry_cache_writer_close(&device->dentries, fd);
+    xSemaphoreGive(device->dentry_lock);
+    return ret;
 }
 
 static ssize_t fatfs_write(void *dev, int fd, void const *buf, size_t count) {
-    return write(fd, buf, count);
+    fatfs_device_t *device = dev;
+    ssize_t         ret    = write(fd, buf, count);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    xSemaphoreTake(device->writeback_lock, portMAX_DELAY);
+    writeback_action_t action = writeback_write(&device->writeback, fd, esp_timer_get_time());
+    if (action == WRITEBACK_SYNC_NOW) {
+        fsync(fd);
+    }
+    xSemaphoreGive(device->writeback_lock);
+
+    if (action == WRITEBACK_ARMED) {
+        xTaskNotifyGive(flush_task);
+    }
+    return ret;
+}
+
+static int fatfs_fsync(void *dev, int fd) {
+    fatfs_device_t *device = dev;
+
+    xSemaphoreTake(device->writeback_lock, portMAX_DELAY);
+    int ret = fsync(fd);
+    writeback_synced(&device->writeback, fd);
+    xSemaphoreGive(device->writeback_lock);
+    return ret;
 }
 
 static ssize_t fatfs_read(void *dev, int fd, void *buf, size_t count) {
@@ -96,7 +212,24 @@ static ssize_t fatfs_lseek(void *dev, int fd, off_t offset, int whence) {
 static int fatfs_stat(void *dev, path_t *path, struct stat *restrict statbuf) {
     fatfs_device_t *device   = dev;
     char           *unixpath = path_to_unix(path);
-    return stat(unixpath, statbuf);
+    uint32_t        generation;
+
+    if (!unixpath) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    switch (dentry_lookup(device, unixpath, statbuf, &generation)) {
+        case DENTRY_FOUND: return 0;
+        case DENTRY_MISSING: errno = ENOENT; return -1;
+        case DENTRY_UNKNOWN: break;
+    }
+
+    int ret = stat(unixpath, statbuf);
+    if (ret == 0 || errno == ENOENT) {
+        dentry_insert(device, unixpath, ret == 0 ? statbuf : NULL, generation);
+    }
+    return ret;
 }
 
 static int fatfs_fstat(void *dev, int fd, struct stat *restrict statbuf) {
@@ -106,26 +239,35 @@ static int fatfs_fstat(void *dev, int fd, struct stat *restrict statbuf) {
 static int fatfs_unlink(void *dev, path_t *path) {
     fatfs_device_t *device   = dev;
     char           *unixpath = path_to_unix(path);
-    return unlink(unixpath);
+    int             ret      = unlink(unixpath);
+    dentry_invalidate(device, unixpath);
+    return ret;
 }
 
 static int fatfs_rename(void *dev, path_t *oldpath, path_t *newpath) {
     fatfs_device_t *device       = dev;
     char           *old_unixpath = path_to_unix(oldpath);
     char           *new_unixpath = path_to_unix(newpath);
-    return rename(old_unixpath, new_unixpath);
+    int             ret          = rename(old_unixpath, new_unixpath);
+    dentry_invalidate(device, old_unixpath);
+    dentry_invalidate(device, new_unixpath);
+    return ret;
 }
 
 static int fatfs_mkdir(void *dev, path_t *path, mode_t mode) {
     fatfs_device_t *device   = dev;
     char           *unixpath = path_to_unix(path);
-    return mkdir(unixpath, mode);
+    int             ret      = mkdir(unixpath, mode);
+    dentry_invalidate(device, unixpath);
+    return ret;
 }
 
 static int fatfs_rmdir(void *dev, path_t *path) {
     fatfs_device_t *device   = dev;
     char           *unixpath = path_to_unix(path);
-    return rmdir(unixpath);
+    int             ret      = rmdir(unixpath);
+    dentry_invalidate(device, unixpath);
+    return ret;
 }
 
 static DIR *fatfs_opendir(void *dev, path_t *path) {
@@ -144,7 +286,247 @@ static int fatfs_closedir(void *dev, DIR *dirp) {
     return closedir(dirp);
 }
 
-device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
+// Syncs the files whose window ran out, returns when the next one is due or -1
+static int64_t flush_device(fatfs_device_t *device, bool all) {
+    int fds[WRITEBACK_MAX_DIRTY];
+
+    xSemaphoreTake(device->writeback_lock, portMAX_DELAY);
+    int count = all ? writeback_all(&device->writeback, fds, WRITEBACK_MAX_DIRTY)
+                    : writeback_due(&device->writeback, esp_timer_get_time(), fds, WRITEBACK_MAX_DIRTY);
+    for (int i = 0; i < count; ++i) {
+        fsync(fds[i]);
+    }
+    int64_t deadline = writeback_deadline(&device->writeback);
+    xSemaphoreGive(device->writeback_lock);
+
+    return deadline;
+}
+
+static void fatfs_flush_task(void *ignored) {
+    while (true) {
+        int64_t next = -1;
+
+        xSemaphoreTake(flush_lock, portMAX_DELAY);
+        for (int i = 0; i < MAX_FLUSH_DEVICES; ++i) {
+            if (flush_devices[i]) {
+                int64_t deadline = flush_device(flush_devices[i], false);
+                if (deadline >= 0 && (next < 0 || deadline < next)) {
+                    next = deadline;
+                }
+            }
+        }
+        xSemaphoreGive(flush_lock);
+
+        // Woken early by the first write after everything was synced
+        TickType_t wait = portMAX_DELAY;
+        if (next >= 0) {
+            int64_t delay_us = next - esp_timer_get_time();
+            wait             = delay_us > 0 ? pdMS_TO_TICKS((delay_us + 999) / 1000) + 1 : 0;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+static bool fatfs_init_writeback(fatfs_device_t *dev, writeback_policy_t policy) {
+    dev->writeback_lock = xSemaphoreCreateMutex();
+    if (!dev->writeback_lock) {
+        return false;
+    }
+    writeback_init(&dev->writeback, policy, FATFS_WRITEBACK_WINDOW_MS);
+    return true;
+}
+
+// Hands a mounted device with a deferred policy to the flush task
+static void fatfs_start_flushing(fatfs_device_t *dev) {
+    if (dev->writeback.policy != WRITEBACK_DEFERRED) {
+        return;
+    }
+
+    if (!flush_task) {
+        flush_lock = xSemaphoreCreateMutex();
+        if (!flush_lock ||
+            create_kernel_task(fatfs_flush_task, "FAT flush", 3072, NULL, 5, &flush_task, 1) != pdTRUE) {
+            ESP_LOGE("fatfs", "Unable to start the flush task, syncing on close");
+            dev->writeback.policy = WRITEBACK_IMMEDIATE;
+            return;
+        }
+    }
+
+    xSemaphoreTake(flush_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_FLUSH_DEVICES; ++i) {
+        if (!flush_devices[i]) {
+            flush_devices[i] = dev;
+            xSemaphoreGive(flush_lock);
+            return;
+        }
+    }
+    xSemaphoreGive(flush_lock);
+
+    dev->writeback.policy = WRITEBACK_IMMEDIATE;
+}
+
+static bool sdmmc_cache_read(void *context, uint8_t *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device = context;
+    return sdmmc_read_sectors(device->sdmmc_handle, buf, sector, count) == ESP_OK;
+}
+
+static bool sdmmc_cache_write(void *context, uint8_t const *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device = context;
+    return sdmmc_write_sectors(device->sdmmc_handle, buf, sector, count) == ESP_OK;
+}
+
+static bool wl_cache_read(void *context, uint8_t *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device      = context;
+    size_t          sector_size = device->cache.sector_size;
+    return wl_read(device->wl_handle, sector * sector_size, buf, count * sector_size) == ESP_OK;
+}
+
+static bool wl_cache_write(void *context, uint8_t const *buf, uint32_t sector, uint32_t count) {
+    fatfs_device_t *device      = context;
+    size_t          sector_size = device->cache.sector_size;
+    return wl_erase_range(device->wl_handle, sector * sector_size, count * sector_size) == ESP_OK &&
+           wl_write(device->wl_handle, sector * sector_size, buf, count * sector_size) == ESP_OK;
+}
+
+static block_cache_ops_t const sdmmc_cache_ops = {
+    .read  = sdmmc_cache_read,
+    .write = sdmmc_cache_write,
+};
+
+static block_cache_ops_t const wl_cache_ops = {
+    .read  = wl_cache_read,
+    .write = wl_cache_write,
+};
+
+// The card was initialized by mounting it
+static DSTATUS cached_disk_initialize(unsigned char pdrv) {
+    return 0;
+}
+
+static DSTATUS cached_disk_status(unsigned char pdrv) {
+    return 0;
+}
+
+static DRESULT cached_disk_read(unsigned char pdrv, unsigned char *buff, uint32_t sector, unsigned count) {
+    return block_cache_read(&cached_drives[pdrv]->cache, buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cached_disk_write(unsigned char pdrv, unsigned char const *buff, uint32_t sector, unsigned count) {
+    return block_cache_write(&cached_drives[pdrv]->cache, buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cached_disk_ioctl(unsigned char pdrv, unsigned char cmd, void *buff) {
+    block_cache_t *cache = &cached_drives[pdrv]->cache;
+
+    switch (cmd) {
+        case CTRL_SYNC: return RES_OK; // Writes go straight through
+        case GET_SECTOR_COUNT: *(DWORD *)buff = cache->num_sectors; return RES_OK;
+        case GET_SECTOR_SIZE: *(WORD *)buff = cache->sector_size; return RES_OK;
+        default: return RES_ERROR;
+    }
+}
+
+static ff_diskio_impl_t const cached_disk = {
+    .init   = cached_disk_initialize,
+    .status = cached_disk_status,
+    .read   = cached_disk_read,
+    .write  = cached_disk_write,
+    .ioctl  = cached_disk_ioctl,
+};
+
+// Puts a PSRAM sector cache between a mounted volume and its medium
+static void fatfs_init_cache(
+    fatfs_device_t *dev, uint8_t pdrv, block_cache_ops_t const *ops, uint32_t sector_size, uint32_t num_sectors
+) {
+    uint32_t num_lines = FATFS_CACHE_BYTES / sector_size;
+    uint32_t readahead = FATFS_READAHEAD_BYTES / sector_size;
+
+    if (pdrv >= FF_VOLUMES) {
+        return;
+    }
+
+    // The medium DMAs straight into the staging area only when it is cache
+    // line aligned, otherwise the driver goes through a bounce buffer. Staging
+    // and line data are whole sectors from the start of the block.
+    size_t alignment = 0;
+    esp_cache_get_alignment(MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA, &alignment);
+    if (alignment && sector_size % alignment) {
+        ESP_LOGW("fatfs", "%s sectors are not cache line multiples, running uncached", dev->base_path);
+        return;
+    }
+
+    dev->cache_memory = heap_caps_aligned_calloc(
+        alignment ? alignment : sizeof(void *),
+        1,
+        block_cache_memory_size(num_lines, sector_size, readahead),
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA
+    );
+    if (!dev->cache_memory) {
+        ESP_LOGW("fatfs", "No memory for the %s cache, running uncached", dev->base_path);
+        return;
+    }
+
+    block_cache_init(&dev->cache, ops, dev, sector_size, num_sectors, num_lines, readahead, dev->cache_memory);
+    dev->pdrv           = pdrv;
+    cached_drives[pdrv] = dev;
+    ff_diskio_register(pdrv, &cached_disk);
+}
+
+// Unmounting syncs whatever is still open and takes the cached entries with it
+static void fatfs_destroy(void *dev) {
+    fatfs_device_t *device = dev;
+
+    if (flush_lock) {
+        xSemaphoreTake(flush_lock, portMAX_DELAY);
+        for (int i = 0; i < MAX_FLUSH_DEVICES; ++i) {
+            if (flush_devices[i] == device) {
+                flush_devices[i] = NULL;
+            }
+        }
+        xSemaphoreGive(flush_lock);
+    }
+    flush_device(device, true);
+
+    if (device->sdmmc_handle) {
+        esp_vfs_fat_sdcard_unmount(device->base_path, device->sdmmc_handle);
+#if SDCARD_PWR_CTRL_LDO_INTERNAL_IO
+        sd_pwr_ctrl_del_on_chip_ldo(device->pwr_ctrl_handle);
+#endif
+    } else {
+        esp_vfs_fat_spiflash_unmount_rw_wl(device->base_path, device->wl_handle);
+    }
+
+    if (device->cache_memory) {
+        block_cache_stats_t const *stats = &device->cache.stats;
+        ESP_LOGI(
+            "fatfs",
+            "%s cache: %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " of %" PRIu32 " read ahead used",
+            device->base_path,
+            stats->hits,
+            stats->misses,
+            stats->prefetch_hits,
+            stats->prefetched
+        );
+        cached_drives[device->pdrv] = NULL;
+        heap_caps_free(device->cache_memory);
+    }
+
+    vSemaphoreDelete(device->dentry_lock);
+    vSemaphoreDelete(device->writeback_lock);
+    free(device->base_path);
+    free(device);
+}
+
+static bool fatfs_init_dentries(fatfs_device_t *dev) {
+    dev->dentry_lock = xSemaphoreCreateMutex();
+    if (!dev->dentry_lock) {
+        return false;
+    }
+    dentry_cache_init(&dev->dentries);
+    return true;
+}
+
+device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw, writeback_policy_t writeback) {
     esp_vfs_fat_mount_config_t const mount_config = {
         .max_files              = 256,
         .format_if_mount_failed = false,
@@ -152,14 +534,25 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
         .use_one_fat            = false,
     };
 
-    fatfs_device_t *dev = malloc(sizeof(fatfs_device_t));
+    fatfs_device_t *dev = calloc(1, sizeof(fatfs_device_t));
     dev->base_path      = malloc(strlen(devname) + 2);
     dev->base_path[0]   = '/';
     strcpy(dev->base_path + 1, devname);
 
+    if (!fatfs_init_dentries(dev)) {
+        goto error;
+    }
+
+    if (!fatfs_init_writeback(dev, writeback)) {
+        vSemaphoreDelete(dev->dentry_lock);
+        goto error;
+    }
+
     esp_err_t err = esp_vfs_fat_spiflash_mount_rw_wl(dev->base_path, partname, &mount_config, &dev->wl_handle);
     if (err != ESP_OK) {
         ESP_LOGE("fatfs-spi", "Failed to mount partition");
+        vSemaphoreDelete(dev->dentry_lock);
+        vSemaphoreDelete(dev->writeback_lock);
         goto error;
     }
 
@@ -171,6 +564,7 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
     base_dev->_write   = fatfs_write;
     base_dev->_read    = fatfs_read;
     base_dev->_lseek   = fatfs_lseek;
+    base_dev->_destroy = fatfs_destroy;
 
     // Initialize filesystem-specific functions
     filesystem_device_t *fs_dev = &dev->filesystem;
@@ -183,7 +577,17 @@ device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw) {
     fs_dev->_opendir            = fatfs_opendir;
     fs_dev->_readdir            = fatfs_readdir;
     fs_dev->_closedir           = fatfs_closedir;
-
+    fs_dev->_fsync              = fatfs_fsync;
+
+    size_t sector_size = wl_sector_size(dev->wl_handle);
+    fatfs_init_cache(
+        dev,
+        ff_diskio_get_pdrv_wl(dev->wl_handle),
+        &wl_cache_ops,
+        sector_size,
+        wl_size(dev->wl_handle) / sector_size
+    );
+    fatfs_start_flushing(dev);
     return (device_t *)dev;
 
 error:
@@ -192,7 +596,7 @@ error:
     return NULL;
 }
 
-device_t *fatfs_create_sd(char const *devname, bool rw) {
+device_t *fatfs_create_sd(char const *devname, bool rw, writeback_policy_t writeback) {
     esp_vfs_fat_mount_config_t const mount_config = {
         .max_files              = 256,
         .format_if_mount_failed = false,
@@ -200,7 +604,7 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
         .use_one_fat            = false,
     };
 
-    fatfs_device_t *dev = malloc(sizeof(fatfs_device_t));
+    fatfs_device_t *dev = calloc(1, sizeof(fatfs_device_t));
     dev->base_path      = malloc(strlen(devname) + 2);
     dev->base_path[0]   = '/';
     strcpy(dev->base_path + 1, devname);
@@ -213,6 +617,7 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
     base_dev->_write   = fatfs_write;
     base_dev->_read    = fatfs_read;
     base_dev->_lseek   = fatfs_lseek;
+    base_dev->_destroy = fatfs_destroy;
 
     esp_err_t    err;
     sdmmc_host_t host = SDMMC_HOST_DEFAULT();
@@ -258,8 +663,19 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
 #endif
     slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
 
+    if (!fatfs_init_dentries(dev)) {
+        goto error;
+    }
+
+    if (!fatfs_init_writeback(dev, writeback)) {
+        vSemaphoreDelete(dev->dentry_lock);
+        goto error;
+    }
+
     err = esp_vfs_fat_sdmmc_mount(dev->base_path, &host, &slot_config, &mount_config, &dev->sdmmc_handle);
     if (err != ESP_OK) {
+        vSemaphoreDelete(dev->dentry_lock);
+        vSemaphoreDelete(dev->writeback_lock);
 #if SDCARD_PWR_CTRL_LDO_INTERNAL_IO
         // Deinitialize the power control driver if it was used
         err = sd_pwr_ctrl_del_on_chip_ldo(host.pwr_ctrl_handle);
@@ -283,7 +699,16 @@ device_t *fatfs_create_sd(char const *devname, bool rw) {
     fs_dev->_opendir            = fatfs_opendir;
     fs_dev->_readdir            = fatfs_readdir;
     fs_dev->_closedir           = fatfs_closedir;
-
+    fs_dev->_fsync              = fatfs_fsync;
+
+    fatfs_init_cache(
+        dev,
+        ff_diskio_get_pdrv_card(dev->sdmmc_handle),
+        &sdmmc_cache_ops,
+        dev->sdmmc_handle->csd.sector_size,
+        dev->sdmmc_handle->csd.capacity
+    );
+    fatfs_start_flushing(dev);
     sdmmc_card_print_info(stdout, dev->sdmmc_handle);
 
     return (device_t *)dev;
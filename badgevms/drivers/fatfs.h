@@ -17,6 +17,7 @@
 #pragma once
 
 #include "badgevms/device.h"
+#include "writeback.h"
 
-device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw);
-device_t *fatfs_create_sd(char const *devname, bool rw);
+device_t *fatfs_create_spi(char const *devname, char const *partname, bool rw, writeback_policy_t writeback);
+device_t *fatfs_create_sd(char const *devname, bool rw, writeback_policy_t writeback);
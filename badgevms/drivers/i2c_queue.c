@@ -0,0 +1,399 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "i2c_queue.h"
+
+#include <string.h>
+
+void i2c_queue_init(i2c_queue_t *queue) {
+    memset(queue, 0, sizeof(i2c_queue_t));
+}
+
+void i2c_queue_push(i2c_queue_t *queue, i2c_batch_t *batch) {
+    i2c_priority_t priority = batch->priority;
+
+    batch->next = NULL;
+    if (queue->tail[priority]) {
+        queue->tail[priority]->next = batch;
+    } else {
+        queue->head[priority] = batch;
+    }
+    queue->tail[priority] = batch;
+}
+
+static i2c_batch_t *take_head(i2c_queue_t *queue, int priority) {
+    i2c_batch_t *batch = queue->head[priority];
+
+    queue->head[priority] = batch->next;
+    if (!queue->head[priority]) {
+        queue->tail[priority] = NULL;
+    }
+    queue->passed_over[priority] = 0;
+    batch->next                  = NULL;
+    return batch;
+}
+
+// The highest priority batch goes first, unless a lower priority one has
+// already been passed over I2C_QUEUE_MAX_PASSES times
+i2c_batch_t *i2c_queue_pop(i2c_queue_t *queue) {
+    int first = -1;
+
+    for (int p = 0; p < I2C_PRIORITY_COUNT; ++p) {
+        if (!queue->head[p]) {
+            continue;
+        }
+        if (first < 0) {
+            first = p;
+        } else if (queue->passed_over[p] >= I2C_QUEUE_MAX_PASSES) {
+            return take_head(queue, p);
+        }
+    }
+
+    if (first < 0) {
+        return NULL;
+    }
+
+    for (int p = first + 1; p < I2C_PRIORITY_COUNT; ++p) {
+        if (queue->head[p]) {
+            queue->passed_over[p]++;
+        }
+    }
+    return take_head(queue, first);
+}
+
+// Removes every queued batch of device and returns them as a list
+i2c_batch_t *i2c_queue_cancel(i2c_queue_t *queue, void *device) {
+    i2c_batch_t  *cancelled = NULL;
+    i2c_batch_t **last      = &cancelled;
+
+    for (int p = 0; p < I2C_PRIORITY_COUNT; ++p) {
+        i2c_batch_t **link = &queue->head[p];
+        i2c_batch_t  *prev = NULL;
+
+        while (*link) {
+            i2c_batch_t *batch = *link;
+            if (batch->device == device) {
+                *link       = batch->next;
+                batch->next = NULL;
+                *last       = batch;
+                last        = &batch->next;
+            } else {
+                prev = batch;
+                link = &batch->next;
+            }
+        }
+        queue->tail[p] = prev;
+        if (!queue->head[p]) {
+            queue->passed_over[p] = 0;
+        }
+    }
+
+    return cancelled;
+}
+
+bool i2c_queue_empty(i2c_queue_t const *queue) {
+    for (int p = 0; p < I2C_PRIORITY_COUNT; ++p) {
+        if (queue->head[p]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef RUN_TEST
+#include <stdint.h>
+#include <stdio.h>
+
+// A simulated bus shared by a keyboard polled every 10ms at 100kHz, an IMU
+// FIFO read every 20ms at 400kHz and an application that keeps the bus busy
+// with bulk writes at 100kHz
+
+#define SIM_US        (10 * 1000 * 1000)
+#define SIM_CLIENTS   3
+#define SIM_OVERHEAD  50
+#define MAX_BATCHES   8
+#define NO_EVENT      INT64_MAX
+
+typedef struct {
+    char const       *name;
+    i2c_priority_t    priority;
+    uint32_t          clk_speed;
+    int64_t           period;      // 0 to submit again as soon as the last one finished
+    i2c_transaction_t transactions[2];
+    int               count;
+    i2c_batch_t       batches[MAX_BATCHES];
+    int64_t           submitted[MAX_BATCHES];
+    int               sequence[MAX_BATCHES];
+    int               next_batch;
+    int               next_sequence;
+    int               last_done;
+    int               in_flight;
+    int               completed;
+    int64_t           next_submit;
+    int64_t           max_latency;
+} sim_client_t;
+
+static uint8_t scratch[256];
+
+#define TEST_RNG_SEED 0xB16B00B5
+#include "test_rng.h"
+
+static int64_t batch_duration(sim_client_t const *client, i2c_batch_t const *batch) {
+    int64_t bits = 0;
+    for (int i = 0; i < batch->count; ++i) {
+        // Address, register and the data, 9 clocks per byte
+        bits += (2 + batch->transactions[i].len) * 9;
+    }
+    return SIM_OVERHEAD * batch->count + bits * 1000000 / client->clk_speed;
+}
+
+static void sim_done(void *user_data, bool ok) {
+    (void)user_data;
+    (void)ok;
+}
+
+static bool submit(i2c_queue_t *queue, sim_client_t *client, int64_t now) {
+    if (client->in_flight == MAX_BATCHES) {
+        return false;
+    }
+
+    int          slot  = client->next_batch++ % MAX_BATCHES;
+    i2c_batch_t *batch = &client->batches[slot];
+
+    batch->device            = client;
+    batch->transactions      = client->transactions;
+    batch->count             = client->count;
+    batch->priority          = client->priority;
+    batch->done              = sim_done;
+    batch->user_data         = client;
+    client->submitted[slot]  = now;
+    client->sequence[slot]   = client->next_sequence++;
+    client->in_flight++;
+    i2c_queue_push(queue, batch);
+    return true;
+}
+
+static bool run_simulation(bool priorities, int64_t *keyboard_latency, int64_t *bulk_latency) {
+    i2c_queue_t  queue;
+    sim_client_t clients[SIM_CLIENTS] = {
+        {.name         = "keyboard",
+         .priority     = I2C_PRIORITY_INPUT,
+         .clk_speed    = 100000,
+         .period       = 10000,
+         .transactions = {{.reg = 0x03, .read = true, .len = 1, .data = scratch},
+                          {.reg = 0x04, .read = true, .len = 1, .data = scratch}},
+         .count        = 2},
+        {.name         = "imu",
+         .priority     = I2C_PRIORITY_SENSOR,
+         .clk_speed    = 400000,
+         .period       = 20000,
+         .transactions = {{.reg = 0x26, .read = true, .len = 208, .data = scratch}},
+         .count        = 1},
+        {.name         = "bulk",
+         .priority     = I2C_PRIORITY_BULK,
+         .clk_speed    = 100000,
+         .period       = 0,
+         .transactions = {{.reg = I2C_NO_REGISTER, .read = false, .len = 64, .data = scratch}},
+         .count        = 1},
+    };
+    bool    error    = false;
+    int64_t now      = 0;
+    int64_t bus_free = 0;
+
+    if (!priorities) {
+        for (int i = 0; i < SIM_CLIENTS; ++i) {
+            clients[i].priority = I2C_PRIORITY_SENSOR;
+        }
+    }
+
+    i2c_queue_init(&queue);
+    for (int i = 0; i < SIM_CLIENTS; ++i) {
+        clients[i].last_done   = -1;
+        clients[i].next_submit = rng() % 10000;
+    }
+
+    while (now < SIM_US && !error) {
+        // Submissions due by now
+        for (int i = 0; i < SIM_CLIENTS; ++i) {
+            sim_client_t *client = &clients[i];
+            if (client->period && client->next_submit <= now) {
+                submit(&queue, client, client->next_submit);
+                client->next_submit += client->period;
+            } else if (!client->period && !client->in_flight) {
+                submit(&queue, client, now);
+            }
+        }
+
+        if (bus_free > now) {
+            now = bus_free;
+            continue;
+        }
+
+        i2c_batch_t *batch = i2c_queue_pop(&queue);
+        if (!batch) {
+            // Idle until the next periodic submission
+            int64_t next = NO_EVENT;
+            for (int i = 0; i < SIM_CLIENTS; ++i) {
+                if (clients[i].period && clients[i].next_submit < next) {
+                    next = clients[i].next_submit;
+                }
+            }
+            now = next;
+            continue;
+        }
+
+        sim_client_t *client = batch->device;
+        int           slot   = batch - client->batches;
+
+        if (batch->count != client->count || batch->transactions != client->transactions) {
+            printf("\033[31m%s batch came back changed\033[0m\n", client->name);
+            error = true;
+        }
+        if (client->sequence[slot] != client->last_done + 1) {
+            printf("\033[31m%s batches ran out of order\033[0m\n", client->name);
+            error = true;
+        }
+
+        bus_free        = now + batch_duration(client, batch);
+        int64_t latency = bus_free - client->submitted[slot];
+        if (latency > client->max_latency) {
+            client->max_latency = latency;
+        }
+        client->last_done = client->sequence[slot];
+        client->in_flight--;
+        client->completed++;
+        batch->done(batch->user_data, true);
+    }
+
+    // Periodic clients must all be served in full
+    for (int i = 0; i < SIM_CLIENTS; ++i) {
+        if (clients[i].period && clients[i].completed < SIM_US / clients[i].period - 1) {
+            printf("\033[31m%s only completed %d batches\033[0m\n", clients[i].name, clients[i].completed);
+            error = true;
+        }
+    }
+    if (clients[2].completed < 100) {
+        printf("\033[31mBulk transfers starved\033[0m\n");
+        error = true;
+    }
+
+    *keyboard_latency = clients[0].max_latency;
+    *bulk_latency     = clients[2].max_latency;
+    return !error;
+}
+
+int main() {
+    bool         error = false;
+    i2c_queue_t  queue;
+    i2c_batch_t  batches[16];
+    i2c_batch_t *b;
+
+    // Priority order, FIFO within a priority
+    i2c_queue_init(&queue);
+    int order[] = {I2C_PRIORITY_BULK, I2C_PRIORITY_SENSOR, I2C_PRIORITY_INPUT, I2C_PRIORITY_SENSOR, I2C_PRIORITY_INPUT};
+    for (int i = 0; i < 5; ++i) {
+        batches[i] = (i2c_batch_t){.priority = order[i], .device = &batches[i % 2]};
+        i2c_queue_push(&queue, &batches[i]);
+    }
+    int expected[] = {2, 4, 1, 3, 0};
+    for (int i = 0; i < 5; ++i) {
+        b = i2c_queue_pop(&queue);
+        if (b != &batches[expected[i]]) {
+            printf("\033[31mPop %d returned batch %d, expected %d\033[0m\n", i, (int)(b - batches), expected[i]);
+            error = true;
+        }
+    }
+    if (i2c_queue_pop(&queue) || !i2c_queue_empty(&queue)) {
+        printf("\033[31mQueue not empty\033[0m\n");
+        error = true;
+    }
+
+    // A bulk batch waiting behind a stream of input goes after a few passes
+    i2c_queue_init(&queue);
+    batches[0] = (i2c_batch_t){.priority = I2C_PRIORITY_BULK};
+    i2c_queue_push(&queue, &batches[0]);
+    int passes = 0;
+    for (int i = 0; i < 10; ++i) {
+        batches[1 + i] = (i2c_batch_t){.priority = I2C_PRIORITY_INPUT};
+        i2c_queue_push(&queue, &batches[1 + i]);
+        if (i2c_queue_pop(&queue) == &batches[0]) {
+            break;
+        }
+        passes++;
+    }
+    if (passes != I2C_QUEUE_MAX_PASSES) {
+        printf("\033[31mBulk batch was passed over %d times\033[0m\n", passes);
+        error = true;
+    }
+
+    // Cancelling removes exactly one device's batches and keeps the rest usable
+    i2c_queue_init(&queue);
+    int devices[2];
+    for (int i = 0; i < 12; ++i) {
+        batches[i] = (i2c_batch_t){.priority = i % 3, .device = &devices[(i / 3) % 2]};
+        i2c_queue_push(&queue, &batches[i]);
+    }
+    int cancelled = 0;
+    for (b = i2c_queue_cancel(&queue, &devices[1]); b; b = b->next) {
+        if (b->device != &devices[1]) {
+            error = true;
+        }
+        cancelled++;
+    }
+    batches[12] = (i2c_batch_t){.priority = I2C_PRIORITY_BULK, .device = &devices[0]};
+    i2c_queue_push(&queue, &batches[12]);
+    int remaining = 0;
+    while ((b = i2c_queue_pop(&queue))) {
+        if (b->device != &devices[0]) {
+            error = true;
+        }
+        remaining++;
+    }
+    if (error || cancelled != 6 || remaining != 7) {
+        printf("\033[31mCancel removed %d and left %d batches\033[0m\n", cancelled, remaining);
+        error = true;
+    }
+
+    // Simulated bus, with and without priorities
+    int64_t keyboard_latency, bulk_latency, fifo_keyboard_latency, fifo_bulk_latency;
+    if (!run_simulation(true, &keyboard_latency, &bulk_latency) ||
+        !run_simulation(false, &fifo_keyboard_latency, &fifo_bulk_latency)) {
+        error = true;
+    }
+
+    // Input waits for at most the batch in flight and the aged ones, never
+    // for the whole backlog
+    if (keyboard_latency > 10000 || keyboard_latency >= fifo_keyboard_latency) {
+        printf(
+            "\033[31mKeyboard latency %lldus with priorities, %lldus without\033[0m\n",
+            (long long)keyboard_latency,
+            (long long)fifo_keyboard_latency
+        );
+        error = true;
+    }
+    if (bulk_latency > 100000) {
+        printf("\033[31mBulk latency %lldus\033[0m\n", (long long)bulk_latency);
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
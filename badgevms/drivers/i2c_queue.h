@@ -0,0 +1,48 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stdbool.h>
+
+// How often a waiting batch can be overtaken by higher priorities before it goes first
+#define I2C_QUEUE_MAX_PASSES 4
+
+typedef struct i2c_batch {
+    void              *device; // Not used by the queue
+    i2c_transaction_t *transactions;
+    int                count;
+    i2c_priority_t     priority;
+    void (*done)(void *user_data, bool ok);
+    void             *user_data;
+    struct i2c_batch *next;
+} i2c_batch_t;
+
+// Not thread safe, the bus driver locks around it
+typedef struct {
+    i2c_batch_t *head[I2C_PRIORITY_COUNT];
+    i2c_batch_t *tail[I2C_PRIORITY_COUNT];
+    int          passed_over[I2C_PRIORITY_COUNT];
+} i2c_queue_t;
+
+void         i2c_queue_init(i2c_queue_t *queue);
+void         i2c_queue_push(i2c_queue_t *queue, i2c_batch_t *batch);
+i2c_batch_t *i2c_queue_pop(i2c_queue_t *queue);
+i2c_batch_t *i2c_queue_cancel(i2c_queue_t *queue, void *device);
+bool         i2c_queue_empty(i2c_queue_t const *queue);
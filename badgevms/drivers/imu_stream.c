@@ -0,0 +1,310 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "imu_stream.h"
+
+#include <string.h>
+
+// Header mode FIFO frames, see the BMI270 datasheet section 4.7
+#define FIFO_HEADER_MODE_MASK  0xC0
+#define FIFO_HEADER_REGULAR    0x80
+#define FIFO_HEADER_ACC        0x04
+#define FIFO_HEADER_GYR        0x08
+#define FIFO_HEADER_AUX        0x10
+#define FIFO_HEADER_SKIP       0x40
+#define FIFO_HEADER_SENSORTIME 0x44
+#define FIFO_HEADER_CONFIG     0x48
+#define FIFO_OVERREAD          0x80
+
+static int16_t le16(uint8_t const *p) {
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+// Samples get timestamps counting back from end_time_us, the time the FIFO
+// was read, so the newest one is stamped with end_time_us.
+bmi270_fifo_result_t bmi270_fifo_parse(
+    uint8_t const *data, size_t len, imu_sample_t *samples, int max_samples, int64_t end_time_us, int period_us
+) {
+    bmi270_fifo_result_t result = {0};
+    imu_sample_t         last   = {0};
+    size_t               pos    = 0;
+
+    while (pos < len && result.samples < max_samples) {
+        uint8_t header = data[pos];
+        size_t  size;
+
+        if (header == FIFO_OVERREAD) {
+            // Read past the end of the FIFO
+            pos = len;
+            break;
+        }
+
+        if ((header & FIFO_HEADER_MODE_MASK) == FIFO_HEADER_REGULAR && !(header & 0x23)) {
+            size = 1 + (header & FIFO_HEADER_AUX ? 8 : 0) + (header & FIFO_HEADER_GYR ? 6 : 0) +
+                   (header & FIFO_HEADER_ACC ? 6 : 0);
+            if (pos + size > len) {
+                break;
+            }
+
+            // Aux data comes first, then gyro, then accel. A sensor missing
+            // from this frame keeps its previous value.
+            uint8_t const *p = &data[pos + 1];
+            if (header & FIFO_HEADER_AUX) {
+                p += 8;
+            }
+            if (header & FIFO_HEADER_GYR) {
+                for (int i = 0; i < 3; ++i) {
+                    last.gyr[i] = le16(p + i * 2);
+                }
+                p += 6;
+            }
+            if (header & FIFO_HEADER_ACC) {
+                for (int i = 0; i < 3; ++i) {
+                    last.acc[i] = le16(p + i * 2);
+                }
+            }
+            if (header & (FIFO_HEADER_GYR | FIFO_HEADER_ACC)) {
+                samples[result.samples++] = last;
+            }
+        } else if (header == FIFO_HEADER_SKIP) {
+            size = 2;
+            if (pos + size > len) {
+                break;
+            }
+            result.skipped += data[pos + 1];
+        } else if (header == FIFO_HEADER_SENSORTIME) {
+            size = 4;
+            if (pos + size > len) {
+                break;
+            }
+            result.has_sensortime = true;
+            result.sensortime     = data[pos + 1] | (data[pos + 2] << 8) | ((uint32_t)data[pos + 3] << 16);
+        } else if (header == FIFO_HEADER_CONFIG) {
+            size = 5;
+            if (pos + size > len) {
+                break;
+            }
+        } else {
+            // Lost sync, nothing after this can be trusted
+            pos = len;
+            break;
+        }
+
+        pos += size;
+    }
+
+    for (int i = 0; i < result.samples; ++i) {
+        samples[i].timestamp = end_time_us - (int64_t)(result.samples - 1 - i) * period_us;
+    }
+
+    result.consumed = pos;
+    return result;
+}
+
+// The sensor rate needed to deliver rate_hz, the BMI270 only does 25Hz times a power of two
+int imu_odr_for_rate(int rate_hz) {
+    int odr = IMU_ODR_MIN_HZ;
+    while (odr < rate_hz && odr < IMU_ODR_MAX_HZ) {
+        odr *= 2;
+    }
+    return odr;
+}
+
+int imu_decimation(int odr_hz, int rate_hz) {
+    if (rate_hz <= 0 || rate_hz >= odr_hz) {
+        return 1;
+    }
+    return odr_hz / rate_hz;
+}
+
+void imu_ring_init(imu_ring_t *ring) {
+    memset(ring->samples, 0, sizeof(ring->samples));
+    atomic_init(&ring->head, 0);
+}
+
+void imu_ring_push(imu_ring_t *ring, imu_sample_t const *sample) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->samples[head & (IMU_RING_SIZE - 1)] = *sample;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// A new reader only sees samples pushed after it was created
+void imu_reader_init(imu_reader_t *reader, imu_ring_t *ring, int decimation) {
+    reader->cursor     = atomic_load(&ring->head);
+    reader->decimation = decimation < 1 ? 1 : decimation;
+    reader->countdown  = 0;
+    reader->dropped    = 0;
+}
+
+int imu_reader_read(imu_reader_t *reader, imu_ring_t *ring, imu_sample_t *samples, int max_samples) {
+    int n = 0;
+
+    while (n < max_samples) {
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (reader->cursor == head) {
+            break;
+        }
+
+        // Overrun, skip to the oldest sample that is still there
+        if (head - reader->cursor > IMU_RING_SIZE - 1) {
+            reader->dropped += head - reader->cursor - (IMU_RING_SIZE - 1);
+            reader->cursor   = head - (IMU_RING_SIZE - 1);
+        }
+
+        imu_sample_t sample = ring->samples[reader->cursor & (IMU_RING_SIZE - 1)];
+
+        // The producer may have lapped us while we copied
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) - reader->cursor > IMU_RING_SIZE - 1) {
+            continue;
+        }
+
+        ++reader->cursor;
+        if (reader->countdown-- > 0) {
+            continue;
+        }
+        reader->countdown = reader->decimation - 1;
+        samples[n++]      = sample;
+    }
+
+    return n;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+// Captured from a BMI270 at 200Hz with acc, gyro, header and time enabled:
+// three accel+gyro frames, a skip frame, one more frame, then the sensortime
+// frame and the 0x80 the sensor returns when reading past the end.
+static uint8_t const capture[] = {
+    0x8C, 0x03, 0x00, 0xFE, 0xFF, 0x01, 0x00, 0x10, 0x00, 0xF0, 0xFF, 0x00, 0x40, // 1
+    0x8C, 0x04, 0x00, 0xFD, 0xFF, 0x02, 0x00, 0x12, 0x00, 0xEE, 0xFF, 0x08, 0x40, // 2
+    0x8C, 0x05, 0x00, 0xFC, 0xFF, 0x03, 0x00, 0x14, 0x00, 0xEC, 0xFF, 0x10, 0x40, // 3
+    0x40, 0x02,                                                                   // Skipped 2
+    0x8C, 0x06, 0x00, 0xFB, 0xFF, 0x04, 0x00, 0x16, 0x00, 0xEA, 0xFF, 0x18, 0x40, // 4
+    0x44, 0x34, 0x12, 0x09,                                                       // Sensortime
+    0x80, 0x00,
+};
+
+#define TEST_RNG_SEED 0x1A2B3C
+#include "test_rng.h"
+
+int main() {
+    bool                 error = false;
+    imu_sample_t         samples[IMU_RING_SIZE];
+    bmi270_fifo_result_t r;
+
+    r = bmi270_fifo_parse(capture, sizeof(capture), samples, 16, 1000000, 5000);
+    if (r.samples != 4 || r.skipped != 2 || !r.has_sensortime || r.sensortime != 0x091234 ||
+        r.consumed != sizeof(capture)) {
+        printf("\033[31mCapture parsed into %d samples, %d skipped, consumed %zu\033[0m\n", r.samples, r.skipped, r.consumed);
+        error = true;
+    }
+    if (samples[0].gyr[0] != 3 || samples[0].gyr[1] != -2 || samples[0].gyr[2] != 1 || samples[0].acc[0] != 16 ||
+        samples[0].acc[1] != -16 || samples[0].acc[2] != 16384 || samples[3].acc[2] != 16408) {
+        printf("\033[31mSample values are wrong\033[0m\n");
+        error = true;
+    }
+    if (samples[3].timestamp != 1000000 || samples[0].timestamp != 985000) {
+        printf("\033[31mTimestamps are wrong\033[0m\n");
+        error = true;
+    }
+
+    // A frame cut off at the end of a read is left for next time
+    for (size_t cut = 1; cut < 13; ++cut) {
+        r = bmi270_fifo_parse(capture, 13 + cut, samples, 16, 0, 5000);
+        if (r.samples != 1 || r.consumed != 13) {
+            printf("\033[31mPartial frame of %zu bytes was not left over\033[0m\n", cut);
+            error = true;
+        }
+    }
+
+    // Accel only frames keep the last gyro value
+    uint8_t const mixed[] = {
+        0x8C, 1, 0, 2, 0, 3, 0, 4, 0, 5, 0, 6, 0, 0x84, 7, 0, 8, 0, 9, 0,
+    };
+    r = bmi270_fifo_parse(mixed, sizeof(mixed), samples, 16, 0, 5000);
+    if (r.samples != 2 || samples[1].gyr[2] != 3 || samples[1].acc[0] != 7) {
+        printf("\033[31mMixed frames parsed wrong\033[0m\n");
+        error = true;
+    }
+
+    // Garbage stops the parser rather than producing junk samples
+    uint8_t const garbage[] = {0x8C, 1, 0, 2, 0, 3, 0, 4, 0, 5, 0, 6, 0, 0x13, 0x8C};
+    r = bmi270_fifo_parse(garbage, sizeof(garbage), samples, 16, 0, 5000);
+    if (r.samples != 1 || r.consumed != sizeof(garbage)) {
+        printf("\033[31mGarbage was not skipped\033[0m\n");
+        error = true;
+    }
+
+    // Rates
+    if (imu_odr_for_rate(1) != 25 || imu_odr_for_rate(100) != 100 || imu_odr_for_rate(120) != 200 ||
+        imu_odr_for_rate(5000) != 1600 || imu_decimation(200, 50) != 4 || imu_decimation(200, 400) != 1) {
+        printf("\033[31mRate selection is wrong\033[0m\n");
+        error = true;
+    }
+
+    // Ring with a fast and a decimating reader
+    imu_ring_t   ring;
+    imu_reader_t fast, slow;
+    imu_ring_init(&ring);
+    imu_reader_init(&fast, &ring, 1);
+    imu_reader_init(&slow, &ring, 4);
+    int64_t expect_fast = 0, expect_slow = 0;
+    for (int64_t i = 0; i < 100000 && !error; ++i) {
+        imu_sample_t s = {.timestamp = i};
+        imu_ring_push(&ring, &s);
+        if (rng() % 8 == 0) {
+            int n = imu_reader_read(&fast, &ring, samples, 1 + rng() % 64);
+            for (int j = 0; j < n; ++j) {
+                if (samples[j].timestamp < expect_fast) {
+                    printf("\033[31mFast reader went backwards\033[0m\n");
+                    error = true;
+                }
+                expect_fast = samples[j].timestamp + 1;
+            }
+        }
+        if (i % 1000 == 999) {
+            unsigned int dropped = slow.dropped;
+            int          n       = imu_reader_read(&slow, &ring, samples, IMU_RING_SIZE);
+            for (int j = 0; j < n; ++j) {
+                // An overrun restarts the decimation at the oldest sample left
+                if (j == 0 && slow.dropped != dropped) {
+                    expect_slow = samples[0].timestamp;
+                }
+                if (samples[j].timestamp != expect_slow) {
+                    printf("\033[31mSlow reader got sample %lld\033[0m\n", (long long)samples[j].timestamp);
+                    error = true;
+                    break;
+                }
+                expect_slow = samples[j].timestamp + 4;
+            }
+        }
+    }
+    if (!slow.dropped || fast.dropped > slow.dropped) {
+        printf("\033[31mOverruns were not counted (%u fast, %u slow)\033[0m\n", fast.dropped, slow.dropped);
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
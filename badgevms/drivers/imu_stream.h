@@ -0,0 +1,67 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Output data rates the BMI270 supports for both sensors
+#define IMU_ODR_MIN_HZ 25
+#define IMU_ODR_MAX_HZ 1600
+
+// Must be a power of two
+#define IMU_RING_SIZE 256
+
+typedef struct {
+    int      samples;        // Samples stored
+    int      skipped;        // Frames the sensor dropped because its FIFO was full
+    bool     has_sensortime; // The FIFO ran empty and reported its time
+    uint32_t sensortime;     // 24 bits, 39.0625us per tick
+    size_t   consumed;       // Bytes parsed, an incomplete frame at the end is left
+} bmi270_fifo_result_t;
+
+// Samples written by one producer and read by any number of readers. The
+// producer never waits, readers that fall too far behind lose the oldest
+// samples.
+typedef struct {
+    imu_sample_t samples[IMU_RING_SIZE];
+    atomic_uint  head;
+} imu_ring_t;
+
+typedef struct {
+    unsigned int cursor;
+    int          decimation; // Deliver every n-th sample
+    int          countdown;
+    unsigned int dropped;
+} imu_reader_t;
+
+bmi270_fifo_result_t bmi270_fifo_parse(
+    uint8_t const *data, size_t len, imu_sample_t *samples, int max_samples, int64_t end_time_us, int period_us
+);
+
+int imu_odr_for_rate(int rate_hz);
+int imu_decimation(int odr_hz, int rate_hz);
+
+void imu_ring_init(imu_ring_t *ring);
+void imu_ring_push(imu_ring_t *ring, imu_sample_t const *sample);
+void imu_reader_init(imu_reader_t *reader, imu_ring_t *ring, int decimation);
+int  imu_reader_read(imu_reader_t *reader, imu_ring_t *ring, imu_sample_t *samples, int max_samples);
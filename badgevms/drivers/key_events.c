@@ -0,0 +1,229 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "key_events.h"
+
+#include <string.h>
+
+void key_ring_init(key_ring_t *ring) {
+    memset(ring->entries, 0, sizeof(ring->entries));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+}
+
+// Never blocks, a full ring drops the new event and counts it
+bool key_ring_push(key_ring_t *ring, key_ring_entry_t const *entry) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= KEY_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    ring->entries[head & (KEY_RING_SIZE - 1)] = *entry;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool key_ring_pop(key_ring_t *ring, key_ring_entry_t *entry) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *entry = ring->entries[tail & (KEY_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void key_repeat_init(key_repeat_t *repeat, int64_t delay_us, int64_t interval_us) {
+    memset(repeat, 0, sizeof(key_repeat_t));
+    repeat->delay_us    = delay_us;
+    repeat->interval_us = interval_us;
+}
+
+// Feed every key event through here. Pressing a repeatable key starts
+// repeating it instead of whatever repeated before, releasing it stops.
+// Modifiers are not repeatable and leave the repeat alone.
+void key_repeat_key(key_repeat_t *repeat, uint8_t code, bool repeatable, int64_t now) {
+    bool    down = code & 0x80;
+    uint8_t key  = code & 0x7F;
+
+    if (down && repeatable) {
+        repeat->code    = key;
+        repeat->next_us = now + repeat->delay_us;
+        repeat->armed   = true;
+    } else if (!down && repeat->armed && key == repeat->code) {
+        repeat->armed = false;
+    }
+}
+
+// When the next repeat is due, -1 if none
+int64_t key_repeat_deadline(key_repeat_t const *repeat) {
+    return repeat->armed ? repeat->next_us : -1;
+}
+
+// Produces at most one repeat per call. Repeats we were too late for are
+// skipped rather than delivered in a burst.
+bool key_repeat_poll(key_repeat_t *repeat, int64_t now, key_ring_entry_t *entry) {
+    if (!repeat->armed || now < repeat->next_us) {
+        return false;
+    }
+
+    entry->timestamp  = repeat->next_us;
+    entry->code       = repeat->code | 0x80;
+    entry->repeat     = true;
+    repeat->next_us  += repeat->interval_us;
+    if (repeat->next_us <= now) {
+        repeat->next_us = now + repeat->interval_us;
+    }
+    return true;
+}
+
+#ifdef RUN_TEST
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define STRESS_EVENTS 200000
+
+static key_ring_t stress_ring;
+
+static void *producer(void *ignored) {
+    (void)ignored;
+    for (unsigned int i = 0; i < STRESS_EVENTS; ++i) {
+        key_ring_entry_t entry = {.timestamp = i, .code = i & 0xFF};
+        while (!key_ring_push(&stress_ring, &entry)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    bool             error = false;
+    key_ring_t       ring;
+    key_ring_entry_t entry;
+
+    key_ring_init(&ring);
+    if (key_ring_pop(&ring, &entry)) {
+        printf("\033[31mEmpty ring returned an event\033[0m\n");
+        error = true;
+    }
+
+    // Fill it up, the overflow is dropped and counted
+    for (int i = 0; i < KEY_RING_SIZE + 3; ++i) {
+        entry = (key_ring_entry_t){.timestamp = i, .code = i};
+        bool pushed = key_ring_push(&ring, &entry);
+        if (pushed != (i < KEY_RING_SIZE)) {
+            printf("\033[31mPush %d into a ring of %d returned %d\033[0m\n", i, KEY_RING_SIZE, pushed);
+            error = true;
+        }
+    }
+    if (atomic_load(&ring.dropped) != 3) {
+        printf("\033[31mExpected 3 dropped events, got %u\033[0m\n", atomic_load(&ring.dropped));
+        error = true;
+    }
+    for (int i = 0; i < KEY_RING_SIZE; ++i) {
+        if (!key_ring_pop(&ring, &entry) || entry.timestamp != i) {
+            printf("\033[31mEvent %d came out of order\033[0m\n", i);
+            error = true;
+            break;
+        }
+    }
+
+    // One thread pushing while another pops, nothing lost or reordered
+    key_ring_init(&stress_ring);
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer, NULL);
+    for (unsigned int i = 0; i < STRESS_EVENTS && !error;) {
+        if (key_ring_pop(&stress_ring, &entry)) {
+            if (entry.timestamp != i || entry.code != (i & 0xFF)) {
+                printf("\033[31mStress: expected event %u, got %lld\033[0m\n", i, (long long)entry.timestamp);
+                error = true;
+            }
+            ++i;
+        } else {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+
+    // Key repeat: 500ms delay, then every 50ms
+    key_repeat_t repeat;
+    key_repeat_init(&repeat, 500000, 50000);
+    key_repeat_key(&repeat, 0x80 | 0x16, true, 1000000);
+    if (key_repeat_poll(&repeat, 1499999, &entry)) {
+        printf("\033[31mRepeated before the delay\033[0m\n");
+        error = true;
+    }
+    if (!key_repeat_poll(&repeat, 1500000, &entry) || entry.code != (0x80 | 0x16) || !entry.repeat ||
+        entry.timestamp != 1500000) {
+        printf("\033[31mFirst repeat is wrong\033[0m\n");
+        error = true;
+    }
+    if (key_repeat_deadline(&repeat) != 1550000) {
+        printf("\033[31mNext repeat due at %lld\033[0m\n", (long long)key_repeat_deadline(&repeat));
+        error = true;
+    }
+
+    // Way too late: one repeat, the missed ones are skipped
+    int repeats = 0;
+    while (key_repeat_poll(&repeat, 2000000, &entry)) {
+        ++repeats;
+    }
+    if (repeats != 1 || key_repeat_deadline(&repeat) != 2050000) {
+        printf("\033[31mLate poll produced %d repeats\033[0m\n", repeats);
+        error = true;
+    }
+
+    // Releasing another key keeps repeating, releasing this one stops
+    key_repeat_key(&repeat, 0x17, true, 2010000);
+    if (key_repeat_deadline(&repeat) < 0) {
+        printf("\033[31mReleasing another key stopped the repeat\033[0m\n");
+        error = true;
+    }
+    key_repeat_key(&repeat, 0x16, true, 2020000);
+    if (key_repeat_deadline(&repeat) >= 0) {
+        printf("\033[31mReleasing the key did not stop the repeat\033[0m\n");
+        error = true;
+    }
+
+    // Holding shift keeps repeating the letter, the newest key wins
+    key_repeat_key(&repeat, 0x80 | 0x16, true, 3000000);
+    key_repeat_key(&repeat, 0x80 | 0x29, false, 3100000);
+    if (!key_repeat_poll(&repeat, 3500000, &entry) || (entry.code & 0x7F) != 0x16) {
+        printf("\033[31mPressing a modifier stopped the repeat\033[0m\n");
+        error = true;
+    }
+    key_repeat_key(&repeat, 0x80 | 0x17, true, 3600000);
+    if (!key_repeat_poll(&repeat, 4100000, &entry) || (entry.code & 0x7F) != 0x17) {
+        printf("\033[31mThe most recently pressed key does not repeat\033[0m\n");
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
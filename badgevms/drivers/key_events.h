@@ -0,0 +1,57 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two
+#define KEY_RING_SIZE 64
+
+typedef struct {
+    int64_t timestamp; // esp_timer time the key changed, as close as we can tell
+    uint8_t code;      // Raw TCA8418 event, bit 7 set for pressed
+    bool    repeat;
+} key_ring_entry_t;
+
+// Single producer (the keyboard task) single consumer (the compositor)
+typedef struct {
+    key_ring_entry_t entries[KEY_RING_SIZE];
+    atomic_uint      head;
+    atomic_uint      tail;
+    atomic_uint      dropped;
+} key_ring_t;
+
+// Typematic repeat for the most recently pressed key
+typedef struct {
+    int64_t delay_us;
+    int64_t interval_us;
+    int64_t next_us;
+    uint8_t code;
+    bool    armed;
+} key_repeat_t;
+
+void key_ring_init(key_ring_t *ring);
+bool key_ring_push(key_ring_t *ring, key_ring_entry_t const *entry);
+bool key_ring_pop(key_ring_t *ring, key_ring_entry_t *entry);
+
+void    key_repeat_init(key_repeat_t *repeat, int64_t delay_us, int64_t interval_us);
+void    key_repeat_key(key_repeat_t *repeat, uint8_t code, bool repeatable, int64_t now);
+int64_t key_repeat_deadline(key_repeat_t const *repeat);
+bool    key_repeat_poll(key_repeat_t *repeat, int64_t now, key_ring_entry_t *entry);
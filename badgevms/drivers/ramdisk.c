@@ -0,0 +1,1484 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ramdisk.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef RUN_TEST
+#include <pthread.h>
+typedef pthread_mutex_t ramdisk_lock_t;
+#else
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "memory.h"
+typedef SemaphoreHandle_t ramdisk_lock_t;
+#endif
+
+#define NO_PAGE          SIZE_MAX
+#define RAMDISK_NAME_MAX (sizeof(((struct dirent *)0)->d_name) - 1)
+
+typedef struct ramdisk_node {
+    char                *name;
+    struct ramdisk_node *parent;
+    struct ramdisk_node *children; // Directories only
+    struct ramdisk_node *next;     // In the parent
+    bool                 directory;
+    bool                 unlinked; // Removed while open, freed on the last close
+    uint32_t             users;    // Open files and directory listings
+    size_t               size;
+    uint32_t            *blocks;
+    size_t               num_blocks;
+    size_t               blocks_capacity;
+    time_t               mtime;
+} ramdisk_node_t;
+
+typedef struct {
+    ramdisk_node_t *node; // NULL when the descriptor is free
+    off_t           offset;
+    int             flags;
+} ramdisk_file_t;
+
+typedef struct {
+    uintptr_t page; // 0 when the slot is free
+    uint32_t  used; // One bit per block
+} ramdisk_page_t;
+
+typedef struct {
+    ramdisk_node_t *dir;
+    size_t          position;
+    struct dirent   dirent;
+} ramdisk_dir_t;
+
+typedef struct {
+    filesystem_device_t  filesystem;
+    ramdisk_ops_t const *ops;
+    void                *context;
+    ramdisk_lock_t       lock;
+    size_t               page_size;
+    uint32_t             blocks_per_page;
+    ramdisk_page_t      *pages;
+    size_t               max_pages;
+    size_t               num_pages;   // Taken from the allocator
+    size_t               used_blocks; // Over all pages
+    size_t               mapped;      // Slot of the page that is mapped, NO_PAGE for none
+    uint8_t             *window;
+    ramdisk_node_t       root;
+    ramdisk_file_t       files[RAMDISK_MAX_FILES];
+} ramdisk_t;
+
+#ifdef RUN_TEST
+static bool lock_init(ramdisk_t *rd) {
+    return pthread_mutex_init(&rd->lock, NULL) == 0;
+}
+
+static void lock_destroy(ramdisk_t *rd) {
+    pthread_mutex_destroy(&rd->lock);
+}
+
+static void lock(ramdisk_t *rd) {
+    pthread_mutex_lock(&rd->lock);
+}
+
+static void unlock(ramdisk_t *rd) {
+    pthread_mutex_unlock(&rd->lock);
+}
+#else
+static bool lock_init(ramdisk_t *rd) {
+    rd->lock = xSemaphoreCreateMutex();
+    return rd->lock != NULL;
+}
+
+static void lock_destroy(ramdisk_t *rd) {
+    vSemaphoreDelete(rd->lock);
+}
+
+static void lock(ramdisk_t *rd) {
+    xSemaphoreTake(rd->lock, portMAX_DELAY);
+}
+
+static void unlock(ramdisk_t *rd) {
+    xSemaphoreGive(rd->lock);
+}
+#endif
+
+static void window_close(ramdisk_t *rd) {
+    if (rd->mapped != NO_PAGE) {
+        rd->ops->page_unmap(rd->context, rd->pages[rd->mapped].page);
+        rd->mapped = NO_PAGE;
+    }
+}
+
+// The page stays mapped after the call, consecutive blocks are mostly in the
+// same page
+static uint8_t *block_data(ramdisk_t *rd, uint32_t block) {
+    size_t slot = block / rd->blocks_per_page;
+
+    if (rd->mapped != slot) {
+        window_close(rd);
+        rd->window = rd->ops->page_map(rd->context, rd->pages[slot].page);
+        rd->mapped = slot;
+    }
+    return rd->window + (block % rd->blocks_per_page) * RAMDISK_BLOCK_SIZE;
+}
+
+// New blocks are zeroed, so whatever a file has past its size reads as zero
+// when the file grows over it
+static bool block_allocate(ramdisk_t *rd, uint32_t *block) {
+    uint32_t full = (rd->blocks_per_page == 32) ? UINT32_MAX : (1u << rd->blocks_per_page) - 1;
+    size_t   slot = NO_PAGE;
+
+    for (size_t i = 0; i < rd->max_pages; ++i) {
+        if (rd->pages[i].page && rd->pages[i].used != full) {
+            slot = i;
+            break;
+        }
+        if (!rd->pages[i].page && slot == NO_PAGE) {
+            slot = i;
+        }
+    }
+
+    if (slot == NO_PAGE) {
+        return false;
+    }
+
+    if (!rd->pages[slot].page) {
+        uintptr_t page = rd->ops->page_allocate(rd->context);
+        if (!page) {
+            return false;
+        }
+        rd->pages[slot].page = page;
+        rd->pages[slot].used = 0;
+        rd->num_pages++;
+    }
+
+    uint32_t bit           = __builtin_ctz(~rd->pages[slot].used);
+    rd->pages[slot].used  |= 1u << bit;
+    rd->used_blocks++;
+
+    *block = slot * rd->blocks_per_page + bit;
+    memset(block_data(rd, *block), 0, RAMDISK_BLOCK_SIZE);
+    return true;
+}
+
+static void block_free(ramdisk_t *rd, uint32_t block) {
+    size_t slot           = block / rd->blocks_per_page;
+    rd->pages[slot].used &= ~(1u << (block % rd->blocks_per_page));
+    rd->used_blocks--;
+
+    if (!rd->pages[slot].used) {
+        if (rd->mapped == slot) {
+            window_close(rd);
+        }
+        rd->ops->page_free(rd->context, rd->pages[slot].page);
+        rd->pages[slot].page = 0;
+        rd->num_pages--;
+    }
+}
+
+static void node_truncate(ramdisk_t *rd, ramdisk_node_t *node) {
+    for (size_t i = 0; i < node->num_blocks; ++i) {
+        block_free(rd, node->blocks[i]);
+    }
+    node->num_blocks = 0;
+    node->size       = 0;
+}
+
+// Gives the file count blocks if it can, returns how many it has
+static size_t node_grow(ramdisk_t *rd, ramdisk_node_t *node, size_t count) {
+    if (count > node->blocks_capacity) {
+        size_t capacity = node->blocks_capacity ? node->blocks_capacity : 4;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        uint32_t *blocks = realloc(node->blocks, capacity * sizeof(uint32_t));
+        if (!blocks) {
+            return node->num_blocks;
+        }
+        node->blocks          = blocks;
+        node->blocks_capacity = capacity;
+    }
+
+    while (node->num_blocks < count && block_allocate(rd, &node->blocks[node->num_blocks])) {
+        node->num_blocks++;
+    }
+    return node->num_blocks;
+}
+
+static void node_free(ramdisk_t *rd, ramdisk_node_t *node) {
+    node_truncate(rd, node);
+    free(node->blocks);
+    free(node->name);
+    free(node);
+}
+
+static ramdisk_node_t *node_create(ramdisk_node_t *parent, char const *name, size_t name_len, bool directory) {
+    ramdisk_node_t *node = calloc(1, sizeof(ramdisk_node_t));
+    if (!node) {
+        return NULL;
+    }
+
+    node->name = strndup(name, name_len);
+    if (!node->name) {
+        free(node);
+        return NULL;
+    }
+
+    node->directory  = directory;
+    node->mtime      = time(NULL);
+    node->parent     = parent;
+    node->next       = parent->children;
+    parent->children = node;
+    parent->mtime    = node->mtime;
+    return node;
+}
+
+static void node_detach(ramdisk_node_t *node) {
+    ramdisk_node_t **link = &node->parent->children;
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link               = node->next;
+    node->parent->mtime = time(NULL);
+    node->parent        = NULL;
+    node->next          = NULL;
+}
+
+// Open files keep their data until they are closed
+static void node_remove(ramdisk_t *rd, ramdisk_node_t *node) {
+    node_detach(node);
+    if (node->users) {
+        node->unlinked = true;
+    } else {
+        node_free(rd, node);
+    }
+}
+
+static ramdisk_node_t *node_find(ramdisk_node_t *dir, char const *name, size_t name_len) {
+    for (ramdisk_node_t *node = dir->children; node; node = node->next) {
+        if (strncasecmp(node->name, name, name_len) == 0 && node->name[name_len] == '\0') {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    ramdisk_node_t *parent; // NULL for the root
+    ramdisk_node_t *node;   // NULL when the last name does not exist
+    char const     *name;
+    size_t          name_len;
+} lookup_t;
+
+// Walks the names in the directory and then the filename. Only the last one
+// may be missing, so [A.B] and [A]B both name B in A.
+static bool lookup(ramdisk_t *rd, path_t const *path, lookup_t *result) {
+    char const *directory     = path->directory;
+    size_t      directory_len = directory ? strlen(directory) : 0;
+    bool        filename      = path->filename && *path->filename;
+
+    result->parent   = NULL;
+    result->node     = &rd->root;
+    result->name     = "";
+    result->name_len = 0;
+
+    while (directory_len || filename) {
+        char const *name;
+        size_t      name_len;
+
+        if (directory_len) {
+            char const *dot = memchr(directory, '.', directory_len);
+            name            = directory;
+            name_len        = dot ? (size_t)(dot - directory) : directory_len;
+            directory      += dot ? name_len + 1 : name_len;
+            directory_len  -= dot ? name_len + 1 : name_len;
+        } else {
+            name     = path->filename;
+            name_len = strlen(path->filename);
+            filename = false;
+        }
+
+        if (!name_len) {
+            continue;
+        }
+        if (!result->node) {
+            errno = ENOENT;
+            return false;
+        }
+        if (!result->node->directory) {
+            errno = ENOTDIR;
+            return false;
+        }
+        if (name_len > RAMDISK_NAME_MAX) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+
+        result->parent   = result->node;
+        result->node     = node_find(result->parent, name, name_len);
+        result->name     = name;
+        result->name_len = name_len;
+    }
+    return true;
+}
+
+static ramdisk_file_t *file_get(ramdisk_t *rd, int fd) {
+    if (fd < 0 || fd >= RAMDISK_MAX_FILES || !rd->files[fd].node) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &rd->files[fd];
+}
+
+static void node_stat(ramdisk_node_t *node, struct stat *restrict statbuf) {
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode    = node->directory ? (S_IFDIR | 0777) : (S_IFREG | 0666);
+    statbuf->st_nlink   = 1;
+    statbuf->st_size    = node->size;
+    statbuf->st_blksize = RAMDISK_BLOCK_SIZE;
+    statbuf->st_blocks  = node->num_blocks * (RAMDISK_BLOCK_SIZE / 512);
+    statbuf->st_mtime   = node->mtime;
+    statbuf->st_atime   = node->mtime;
+    statbuf->st_ctime   = node->mtime;
+}
+
+static int ramdisk_open(void *dev, path_t *path, int flags, mode_t mode) {
+    ramdisk_t *rd = dev;
+    lookup_t   found;
+    int        fd = -1;
+    (void)mode;
+
+    lock(rd);
+    if (!lookup(rd, path, &found)) {
+        goto out;
+    }
+
+    ramdisk_node_t *node = found.node;
+    if (node && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        goto out;
+    }
+    if (!node && !(flags & O_CREAT)) {
+        errno = ENOENT;
+        goto out;
+    }
+    if (node && node->directory) {
+        errno = EISDIR;
+        goto out;
+    }
+
+    for (int i = 0; i < RAMDISK_MAX_FILES; ++i) {
+        if (!rd->files[i].node) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd < 0) {
+        errno = ENFILE;
+        goto out;
+    }
+
+    if (!node) {
+        node = node_create(found.parent, found.name, found.name_len, false);
+        if (!node) {
+            errno = ENOMEM;
+            fd    = -1;
+            goto out;
+        }
+    } else if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        node_truncate(rd, node);
+        node->mtime = time(NULL);
+    }
+
+    node->users++;
+    rd->files[fd].node   = node;
+    rd->files[fd].offset = 0;
+    rd->files[fd].flags  = flags;
+
+out:
+    unlock(rd);
+    return fd;
+}
+
+static int ramdisk_close(void *dev, int fd) {
+    ramdisk_t *rd = dev;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    if (file) {
+        ramdisk_node_t *node = file->node;
+        file->node           = NULL;
+        if (--node->users == 0 && node->unlinked) {
+            node_free(rd, node);
+        }
+    }
+    unlock(rd);
+    return file ? 0 : -1;
+}
+
+static ssize_t ramdisk_write(void *dev, int fd, void const *buf, size_t count) {
+    ramdisk_t *rd     = dev;
+    ssize_t    result = -1;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    if (!file) {
+        goto out;
+    }
+    if ((file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        goto out;
+    }
+
+    if (!count) {
+        result = 0;
+        goto out;
+    }
+
+    ramdisk_node_t *node = file->node;
+    if (file->flags & O_APPEND) {
+        file->offset = node->size;
+    }
+
+    size_t offset = file->offset;
+    size_t end    = offset + count;
+    size_t room   = node_grow(rd, node, (end + RAMDISK_BLOCK_SIZE - 1) / RAMDISK_BLOCK_SIZE) * RAMDISK_BLOCK_SIZE;
+    if (end > room) {
+        end = room > offset ? room : offset;
+    }
+    if (count && end == offset) {
+        errno = ENOSPC;
+        goto out;
+    }
+
+    uint8_t const *src = buf;
+    for (size_t pos = offset; pos < end;) {
+        size_t in_block = pos % RAMDISK_BLOCK_SIZE;
+        size_t len      = RAMDISK_BLOCK_SIZE - in_block;
+        if (len > end - pos) {
+            len = end - pos;
+        }
+        memcpy(block_data(rd, node->blocks[pos / RAMDISK_BLOCK_SIZE]) + in_block, src, len);
+        src += len;
+        pos += len;
+    }
+
+    if (end > node->size) {
+        node->size = end;
+    }
+    node->mtime  = time(NULL);
+    file->offset = end;
+    result       = end - offset;
+
+out:
+    unlock(rd);
+    return result;
+}
+
+static ssize_t ramdisk_read(void *dev, int fd, void *buf, size_t count) {
+    ramdisk_t *rd     = dev;
+    ssize_t    result = -1;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    if (!file) {
+        goto out;
+    }
+    if ((file->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        goto out;
+    }
+
+    ramdisk_node_t *node   = file->node;
+    size_t          offset = file->offset;
+    size_t          end    = offset;
+    if (offset < node->size) {
+        end = count < node->size - offset ? offset + count : node->size;
+    }
+
+    uint8_t *dst = buf;
+    for (size_t pos = offset; pos < end;) {
+        size_t in_block = pos % RAMDISK_BLOCK_SIZE;
+        size_t len      = RAMDISK_BLOCK_SIZE - in_block;
+        if (len > end - pos) {
+            len = end - pos;
+        }
+        memcpy(dst, block_data(rd, node->blocks[pos / RAMDISK_BLOCK_SIZE]) + in_block, len);
+        dst += len;
+        pos += len;
+    }
+
+    file->offset = end;
+    result       = end - offset;
+
+out:
+    unlock(rd);
+    return result;
+}
+
+static ssize_t ramdisk_lseek(void *dev, int fd, off_t offset, int whence) {
+    ramdisk_t *rd     = dev;
+    off_t      result = -1;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    if (file) {
+        switch (whence) {
+            case SEEK_SET: result = offset; break;
+            case SEEK_CUR: result = file->offset + offset; break;
+            case SEEK_END: result = file->node->size + offset; break;
+            default: result = -1;
+        }
+        if (result < 0) {
+            errno  = EINVAL;
+            result = -1;
+        } else {
+            file->offset = result;
+        }
+    }
+    unlock(rd);
+    return result;
+}
+
+static int ramdisk_stat(void *dev, path_t *path, struct stat *restrict statbuf) {
+    ramdisk_t *rd     = dev;
+    int        result = -1;
+    lookup_t   found;
+
+    lock(rd);
+    if (lookup(rd, path, &found)) {
+        if (found.node) {
+            node_stat(found.node, statbuf);
+            result = 0;
+        } else {
+            errno = ENOENT;
+        }
+    }
+    unlock(rd);
+    return result;
+}
+
+static int ramdisk_fstat(void *dev, int fd, struct stat *restrict statbuf) {
+    ramdisk_t *rd = dev;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    if (file) {
+        node_stat(file->node, statbuf);
+    }
+    unlock(rd);
+    return file ? 0 : -1;
+}
+
+static int ramdisk_fsync(void *dev, int fd) {
+    ramdisk_t *rd = dev;
+
+    lock(rd);
+    ramdisk_file_t *file = file_get(rd, fd);
+    unlock(rd);
+    return file ? 0 : -1;
+}
+
+static int ramdisk_unlink(void *dev, path_t *path) {
+    ramdisk_t *rd     = dev;
+    int        result = -1;
+    lookup_t   found;
+
+    lock(rd);
+    if (lookup(rd, path, &found)) {
+        if (!found.node) {
+            errno = ENOENT;
+        } else if (found.node->directory) {
+            errno = EISDIR;
+        } else {
+            node_remove(rd, found.node);
+            result = 0;
+        }
+    }
+    unlock(rd);
+    return result;
+}
+
+// Replacing an existing name follows rename(2)
+static int ramdisk_rename(void *dev, path_t *oldpath, path_t *newpath) {
+    ramdisk_t *rd     = dev;
+    int        result = -1;
+    lookup_t   from;
+    lookup_t   to;
+
+    lock(rd);
+    if (!lookup(rd, oldpath, &from) || !lookup(rd, newpath, &to)) {
+        goto out;
+    }
+
+    ramdisk_node_t *node = from.node;
+    if (!node) {
+        errno = ENOENT;
+        goto out;
+    }
+    if (!from.parent || !to.parent) {
+        errno = EBUSY;
+        goto out;
+    }
+
+    for (ramdisk_node_t *dir = to.parent; dir; dir = dir->parent) {
+        if (dir == node) {
+            errno = EINVAL;
+            goto out;
+        }
+    }
+
+    ramdisk_node_t *target = to.node;
+    if (target && target != node) {
+        if (node->directory && !target->directory) {
+            errno = ENOTDIR;
+            goto out;
+        }
+        if (!node->directory && target->directory) {
+            errno = EISDIR;
+            goto out;
+        }
+        if (target->directory && (target->children || target->users)) {
+            errno = target->children ? ENOTEMPTY : EBUSY;
+            goto out;
+        }
+    }
+
+    char *name = strndup(to.name, to.name_len);
+    if (!name) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if (target && target != node) {
+        node_remove(rd, target);
+    }
+
+    node_detach(node);
+    free(node->name);
+    node->name          = name;
+    node->parent        = to.parent;
+    node->next          = to.parent->children;
+    to.parent->children = node;
+    to.parent->mtime    = time(NULL);
+    result              = 0;
+
+out:
+    unlock(rd);
+    return result;
+}
+
+static int ramdisk_mkdir(void *dev, path_t *path, mode_t mode) {
+    ramdisk_t *rd     = dev;
+    int        result = -1;
+    lookup_t   found;
+    (void)mode;
+
+    lock(rd);
+    if (lookup(rd, path, &found)) {
+        if (found.node) {
+            errno = EEXIST;
+        } else if (!node_create(found.parent, found.name, found.name_len, true)) {
+            errno = ENOMEM;
+        } else {
+            result = 0;
+        }
+    }
+    unlock(rd);
+    return result;
+}
+
+static int ramdisk_rmdir(void *dev, path_t *path) {
+    ramdisk_t *rd     = dev;
+    int        result = -1;
+    lookup_t   found;
+
+    lock(rd);
+    if (lookup(rd, path, &found)) {
+        if (!found.node) {
+            errno = ENOENT;
+        } else if (!found.node->directory) {
+            errno = ENOTDIR;
+        } else if (!found.parent || found.node->users) {
+            errno = EBUSY;
+        } else if (found.node->children) {
+            errno = ENOTEMPTY;
+        } else {
+            node_remove(rd, found.node);
+            result = 0;
+        }
+    }
+    unlock(rd);
+    return result;
+}
+
+static DIR *ramdisk_opendir(void *dev, path_t *path) {
+    ramdisk_t     *rd  = dev;
+    ramdisk_dir_t *dir = NULL;
+    lookup_t       found;
+
+    lock(rd);
+    if (!lookup(rd, path, &found)) {
+        goto out;
+    }
+    if (!found.node) {
+        errno = ENOENT;
+        goto out;
+    }
+    if (!found.node->directory) {
+        errno = ENOTDIR;
+        goto out;
+    }
+
+    dir = calloc(1, sizeof(ramdisk_dir_t));
+    if (!dir) {
+        errno = ENOMEM;
+        goto out;
+    }
+    dir->dir = found.node;
+    found.node->users++;
+
+out:
+    unlock(rd);
+    return (DIR *)dir;
+}
+
+// Counts entries instead of keeping a pointer, so removing entries while
+// listing can skip one but never reads a freed node
+static struct dirent *ramdisk_readdir(void *dev, DIR *dirp) {
+    ramdisk_t      *rd   = dev;
+    ramdisk_dir_t  *dir  = (ramdisk_dir_t *)dirp;
+    ramdisk_node_t *node = NULL;
+
+    lock(rd);
+    node = dir->dir->children;
+    for (size_t i = 0; node && i < dir->position; ++i) {
+        node = node->next;
+    }
+    if (node) {
+        dir->position++;
+        dir->dirent.d_type = node->directory ? DT_DIR : DT_REG;
+        strncpy(dir->dirent.d_name, node->name, sizeof(dir->dirent.d_name) - 1);
+        dir->dirent.d_name[sizeof(dir->dirent.d_name) - 1] = '\0';
+    }
+    unlock(rd);
+    return node ? &dir->dirent : NULL;
+}
+
+static int ramdisk_closedir(void *dev, DIR *dirp) {
+    ramdisk_t     *rd  = dev;
+    ramdisk_dir_t *dir = (ramdisk_dir_t *)dirp;
+
+    lock(rd);
+    dir->dir->users--;
+    unlock(rd);
+    free(dir);
+    return 0;
+}
+
+static void tree_free(ramdisk_t *rd, ramdisk_node_t *dir) {
+    while (dir->children) {
+        ramdisk_node_t *node = dir->children;
+        dir->children        = node->next;
+        tree_free(rd, node);
+        node_free(rd, node);
+    }
+}
+
+static void ramdisk_destroy(void *dev) {
+    ramdisk_t *rd = dev;
+
+    // Files that were removed while open are only referenced from here
+    for (int i = 0; i < RAMDISK_MAX_FILES; ++i) {
+        ramdisk_node_t *node = rd->files[i].node;
+        if (node && node->unlinked && --node->users == 0) {
+            node_free(rd, node);
+        }
+    }
+    tree_free(rd, &rd->root);
+    window_close(rd);
+
+    lock_destroy(rd);
+    free(rd->pages);
+    free(rd);
+}
+
+void ramdisk_stats(device_t *dev, ramdisk_stats_t *stats) {
+    ramdisk_t *rd = (ramdisk_t *)dev;
+
+    lock(rd);
+    stats->pages       = rd->num_pages;
+    stats->used_blocks = rd->used_blocks;
+    stats->max_blocks  = rd->max_pages * rd->blocks_per_page;
+    unlock(rd);
+}
+
+device_t *ramdisk_create(size_t max_bytes, size_t page_size, ramdisk_ops_t const *ops, void *context) {
+    size_t blocks_per_page = page_size / RAMDISK_BLOCK_SIZE;
+    if (!blocks_per_page || blocks_per_page > 32 || page_size % RAMDISK_BLOCK_SIZE) {
+        return NULL;
+    }
+
+    ramdisk_t *rd = calloc(1, sizeof(ramdisk_t));
+    if (!rd) {
+        return NULL;
+    }
+
+    rd->ops             = ops;
+    rd->context         = context;
+    rd->page_size       = page_size;
+    rd->blocks_per_page = blocks_per_page;
+    rd->max_pages       = max_bytes / page_size;
+    rd->mapped          = NO_PAGE;
+    rd->root.name       = "";
+    rd->root.directory  = true;
+    rd->root.mtime      = time(NULL);
+
+    rd->pages = calloc(rd->max_pages ? rd->max_pages : 1, sizeof(ramdisk_page_t));
+    if (!rd->pages || !lock_init(rd)) {
+        free(rd->pages);
+        free(rd);
+        return NULL;
+    }
+
+    device_t *base_dev = &rd->filesystem.device;
+    base_dev->type     = DEVICE_TYPE_FILESYSTEM;
+    base_dev->_open    = ramdisk_open;
+    base_dev->_close   = ramdisk_close;
+    base_dev->_write   = ramdisk_write;
+    base_dev->_read    = ramdisk_read;
+    base_dev->_lseek   = ramdisk_lseek;
+    base_dev->_destroy = ramdisk_destroy;
+
+    filesystem_device_t *fs_dev = &rd->filesystem;
+    fs_dev->_stat               = ramdisk_stat;
+    fs_dev->_fstat              = ramdisk_fstat;
+    fs_dev->_unlink             = ramdisk_unlink;
+    fs_dev->_rename             = ramdisk_rename;
+    fs_dev->_mkdir              = ramdisk_mkdir;
+    fs_dev->_rmdir              = ramdisk_rmdir;
+    fs_dev->_opendir            = ramdisk_opendir;
+    fs_dev->_readdir            = ramdisk_readdir;
+    fs_dev->_closedir           = ramdisk_closedir;
+    fs_dev->_fsync              = ramdisk_fsync;
+
+    return base_dev;
+}
+
+#ifndef RUN_TEST
+static uintptr_t psram_page_allocate(void *context) {
+    return page_allocate(SOC_MMU_PAGE_SIZE);
+}
+
+static void psram_page_free(void *context, uintptr_t page) {
+    page_deallocate(page);
+}
+
+static void *psram_page_map(void *context, uintptr_t page) {
+    return page_window_map(RAMDISK_WINDOW, page);
+}
+
+static void psram_page_unmap(void *context, uintptr_t page) {
+    page_window_unmap(RAMDISK_WINDOW);
+}
+
+static ramdisk_ops_t const psram_ops = {
+    .page_allocate = psram_page_allocate,
+    .page_free     = psram_page_free,
+    .page_map      = psram_page_map,
+    .page_unmap    = psram_page_unmap,
+};
+
+device_t *ramdisk_create_psram(size_t max_bytes) {
+    return ramdisk_create(max_bytes, SOC_MMU_PAGE_SIZE, &psram_ops, NULL);
+}
+#endif
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define TEST_PAGE_SIZE (64 * 1024)
+#define TEST_MAX_PAGES 8
+#define MODEL_FILES    6
+#define MODEL_MAX_SIZE (96 * 1024)
+
+// Pages come from malloc, and only one of them may be mapped at a time
+static uintptr_t mapped_page;
+static int       pages_allocated;
+static bool      fail_pages;
+static int       errors;
+
+#include "test_rng.h"
+
+static void fail(char const *what) {
+    printf("\033[31m%s\033[0m\n", what);
+    errors++;
+}
+
+static uintptr_t test_page_allocate(void *context) {
+    (void)context;
+    if (fail_pages) {
+        return 0;
+    }
+    void *page = malloc(TEST_PAGE_SIZE);
+    if (page) {
+        memset(page, 0xA5, TEST_PAGE_SIZE);
+        pages_allocated++;
+    }
+    return (uintptr_t)page;
+}
+
+static void test_page_free(void *context, uintptr_t page) {
+    (void)context;
+    if (page == mapped_page) {
+        fail("Freed the mapped page");
+    }
+    pages_allocated--;
+    free((void *)page);
+}
+
+static void *test_page_map(void *context, uintptr_t page) {
+    (void)context;
+    if (mapped_page) {
+        fail("Mapped a page over another one");
+    }
+    mapped_page = page;
+    return (void *)page;
+}
+
+static void test_page_unmap(void *context, uintptr_t page) {
+    (void)context;
+    if (page != mapped_page) {
+        fail("Unmapped a page that was not mapped");
+    }
+    mapped_page = 0;
+}
+
+static ramdisk_ops_t const test_ops = {
+    .page_allocate = test_page_allocate,
+    .page_free     = test_page_free,
+    .page_map      = test_page_map,
+    .page_unmap    = test_page_unmap,
+};
+
+// What parse_path() would make of RAM0:[directory]filename
+static path_t *make_path(path_t *path, char *directory, char *filename) {
+    memset(path, 0, sizeof(path_t));
+    path->directory = directory;
+    path->filename  = filename;
+    return path;
+}
+
+static int test_open(filesystem_device_t *fs, char *directory, char *filename, int flags) {
+    path_t path;
+    return fs->device._open(fs, make_path(&path, directory, filename), flags, 0666);
+}
+
+static int test_stat(filesystem_device_t *fs, char *directory, char *filename, struct stat *st) {
+    path_t path;
+    return fs->_stat(fs, make_path(&path, directory, filename), st);
+}
+
+static int test_mkdir(filesystem_device_t *fs, char *directory, char *filename) {
+    path_t path;
+    return fs->_mkdir(fs, make_path(&path, directory, filename), 0777);
+}
+
+static int test_rmdir(filesystem_device_t *fs, char *directory, char *filename) {
+    path_t path;
+    return fs->_rmdir(fs, make_path(&path, directory, filename));
+}
+
+static int test_unlink(filesystem_device_t *fs, char *directory, char *filename) {
+    path_t path;
+    return fs->_unlink(fs, make_path(&path, directory, filename));
+}
+
+static int test_rename(filesystem_device_t *fs, char *old_dir, char *old_file, char *new_dir, char *new_file) {
+    path_t oldpath, newpath;
+    return fs->_rename(fs, make_path(&oldpath, old_dir, old_file), make_path(&newpath, new_dir, new_file));
+}
+
+static bool write_file(filesystem_device_t *fs, char *directory, char *filename, void const *data, size_t len) {
+    int fd = test_open(fs, directory, filename, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fs->device._write(fs, fd, data, len) == (ssize_t)len;
+    return fs->device._close(fs, fd) == 0 && ok;
+}
+
+// Each call reads into its own buffer, the writer threads check files at the
+// same time
+static bool file_equals(filesystem_device_t *fs, char *directory, char *filename, void const *data, size_t len) {
+    size_t const chunk = 3001; // Odd sized reads cross block boundaries
+    uint8_t     *buf   = malloc(len + chunk);
+    if (!buf) {
+        return false;
+    }
+
+    int fd = test_open(fs, directory, filename, O_RDONLY);
+    if (fd < 0) {
+        free(buf);
+        return false;
+    }
+
+    size_t  done = 0;
+    ssize_t r;
+    while ((r = fs->device._read(fs, fd, buf + done, chunk)) > 0) {
+        done += r;
+        if (done > len) {
+            break;
+        }
+    }
+    fs->device._close(fs, fd);
+
+    bool equal = r == 0 && done == len && memcmp(buf, data, len) == 0;
+    free(buf);
+    return equal;
+}
+
+static bool listing(filesystem_device_t *fs, char *directory, char const *expect) {
+    path_t path;
+    char   names[256] = "";
+    DIR   *dir        = fs->_opendir(fs, make_path(&path, directory, NULL));
+    if (!dir) {
+        return false;
+    }
+
+    // Entries come newest first
+    struct dirent *entry;
+    while ((entry = fs->_readdir(fs, dir))) {
+        char const *kind = entry->d_type == DT_DIR ? "/" : "";
+        snprintf(names + strlen(names), sizeof(names) - strlen(names), "%s%s ", entry->d_name, kind);
+    }
+    fs->_closedir(fs, dir);
+
+    if (strcmp(names, expect) != 0) {
+        printf("\033[31mListed '%s', expected '%s'\033[0m\n", names, expect);
+        return false;
+    }
+    return true;
+}
+
+static void test_files(void) {
+    filesystem_device_t *fs = (filesystem_device_t *)ramdisk_create(1024 * 1024, TEST_PAGE_SIZE, &test_ops, NULL);
+    struct stat          st;
+    char                 buf[16];
+
+    if (!write_file(fs, NULL, "HELLO.TXT", "hello", 5) || !file_equals(fs, NULL, "hello.txt", "hello", 5)) {
+        fail("Could not read back a file under another case");
+    }
+    if (test_stat(fs, NULL, "HELLO.TXT", &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != 5) {
+        fail("Wrong stat of a file");
+    }
+    if (test_open(fs, NULL, "MISSING", O_RDONLY) >= 0 || errno != ENOENT) {
+        fail("Opened a missing file");
+    }
+    if (test_open(fs, NULL, "HELLO.TXT", O_RDWR | O_CREAT | O_EXCL) >= 0 || errno != EEXIST) {
+        fail("O_EXCL opened an existing file");
+    }
+    write_file(fs, NULL, "PLAIN", "", 0);
+    if (test_open(fs, "PLAIN", "X", O_RDWR | O_CREAT) >= 0 || errno != ENOTDIR) {
+        fail("Created a file inside a file");
+    }
+    if (test_open(fs, "NODIR", "X", O_RDWR | O_CREAT) >= 0 || errno != ENOENT) {
+        fail("Created a file in a missing directory");
+    }
+
+    int fd = test_open(fs, NULL, "HELLO.TXT", O_RDONLY);
+    if (fs->device._write(fs, fd, "x", 1) != -1 || errno != EBADF) {
+        fail("Wrote to a read only file");
+    }
+    fs->device._close(fs, fd);
+    if (fs->device._close(fs, fd) != -1 || errno != EBADF) {
+        fail("Closed a file twice");
+    }
+
+    fd = test_open(fs, NULL, "HELLO.TXT", O_WRONLY | O_APPEND);
+    fs->device._lseek(fs, fd, 0, SEEK_SET);
+    fs->device._write(fs, fd, " world", 6);
+    if (fs->device._read(fs, fd, buf, 1) != -1 || errno != EBADF) {
+        fail("Read from a write only file");
+    }
+    fs->device._close(fs, fd);
+    if (!file_equals(fs, NULL, "HELLO.TXT", "hello world", 11)) {
+        fail("O_APPEND did not write at the end");
+    }
+
+    // The hole reads as zeros, even though the page was dirty when it came
+    static uint8_t expect[3 * RAMDISK_BLOCK_SIZE + 1];
+    fd = test_open(fs, NULL, "SPARSE", O_RDWR | O_CREAT);
+    fs->device._write(fs, fd, "a", 1);
+    if (fs->device._lseek(fs, fd, 3 * RAMDISK_BLOCK_SIZE, SEEK_SET) != 3 * RAMDISK_BLOCK_SIZE) {
+        fail("Could not seek past the end");
+    }
+    fs->device._write(fs, fd, "b", 1);
+    if (fs->device._lseek(fs, fd, -1, SEEK_END) != 3 * RAMDISK_BLOCK_SIZE || fs->device._read(fs, fd, buf, 16) != 1 ||
+        buf[0] != 'b') {
+        fail("SEEK_END went wrong");
+    }
+    if (fs->device._lseek(fs, fd, -5, SEEK_SET) != -1 || errno != EINVAL) {
+        fail("Seeked before the start");
+    }
+    fs->_fstat(fs, fd, &st);
+    fs->device._close(fs, fd);
+    expect[0]                      = 'a';
+    expect[3 * RAMDISK_BLOCK_SIZE] = 'b';
+    if (st.st_size != sizeof(expect) || !file_equals(fs, NULL, "SPARSE", expect, sizeof(expect))) {
+        fail("Hole did not read as zeros");
+    }
+
+    fd = test_open(fs, NULL, "SPARSE", O_RDWR | O_TRUNC);
+    fs->_fstat(fs, fd, &st);
+    fs->device._close(fs, fd);
+    if (st.st_size != 0 || st.st_blocks != 0) {
+        fail("O_TRUNC kept the data");
+    }
+
+    // Removed while open, the data stays until the close
+    write_file(fs, NULL, "OPEN", "still here", 10);
+    fd = test_open(fs, NULL, "OPEN", O_RDONLY);
+    if (test_unlink(fs, NULL, "OPEN") != 0 || test_stat(fs, NULL, "OPEN", &st) != -1 || errno != ENOENT) {
+        fail("Unlinked file still has a name");
+    }
+    if (fs->device._read(fs, fd, buf, 16) != 10 || memcmp(buf, "still here", 10) != 0) {
+        fail("Unlinked open file lost its data");
+    }
+    fs->device._close(fs, fd);
+
+    int fds[RAMDISK_MAX_FILES];
+    for (int i = 0; i < RAMDISK_MAX_FILES; ++i) {
+        fds[i] = test_open(fs, NULL, "HELLO.TXT", O_RDONLY);
+    }
+    if (test_open(fs, NULL, "HELLO.TXT", O_RDONLY) != -1 || errno != ENFILE) {
+        fail("Opened more files than there are descriptors");
+    }
+    for (int i = 0; i < RAMDISK_MAX_FILES; ++i) {
+        fs->device._close(fs, fds[i]);
+    }
+
+    test_unlink(fs, NULL, "HELLO.TXT");
+    test_unlink(fs, NULL, "SPARSE");
+    test_unlink(fs, NULL, "PLAIN");
+
+    ramdisk_stats_t stats;
+    ramdisk_stats(&fs->device, &stats);
+    if (stats.pages || stats.used_blocks || pages_allocated) {
+        fail("Deleting every file kept pages");
+    }
+    fs->device._destroy(fs);
+}
+
+static void test_directories(void) {
+    filesystem_device_t *fs = (filesystem_device_t *)ramdisk_create(1024 * 1024, TEST_PAGE_SIZE, &test_ops, NULL);
+    struct stat          st;
+
+    // [A.B] and [A]B are the same directory
+    if (test_mkdir(fs, "A", NULL) != 0 || test_mkdir(fs, "A", "B") != 0 || test_mkdir(fs, "A.B", NULL) != -1 ||
+        errno != EEXIST) {
+        fail("mkdir went wrong");
+    }
+    if (test_mkdir(fs, "X.Y", NULL) != -1 || errno != ENOENT) {
+        fail("mkdir created missing parents");
+    }
+    if (test_stat(fs, "A.B", NULL, &st) != 0 || !S_ISDIR(st.st_mode) || test_stat(fs, NULL, NULL, &st) != 0 ||
+        !S_ISDIR(st.st_mode)) {
+        fail("Directories do not stat as directories");
+    }
+    if (test_open(fs, "A", "B", O_RDONLY) != -1 || errno != EISDIR) {
+        fail("Opened a directory as a file");
+    }
+
+    write_file(fs, "A.B", "FILE", "data", 4);
+    write_file(fs, "A", "OTHER", "more", 4);
+    if (!listing(fs, "A", "OTHER B/ ") || !listing(fs, NULL, "A/ ") || !listing(fs, "a.b", "FILE ")) {
+        fail("Wrong directory listing");
+    }
+    path_t path;
+    if (fs->_opendir(fs, make_path(&path, "A", "OTHER")) || errno != ENOTDIR) {
+        fail("Listed a file");
+    }
+
+    if (test_rmdir(fs, "A", NULL) != -1 || errno != ENOTEMPTY) {
+        fail("Removed a directory that was not empty");
+    }
+    if (test_unlink(fs, "A", "B") != -1 || errno != EISDIR) {
+        fail("Unlinked a directory");
+    }
+    if (test_rmdir(fs, "A", "OTHER") != -1 || errno != ENOTDIR) {
+        fail("rmdir removed a file");
+    }
+    if (test_rmdir(fs, NULL, NULL) != -1 || errno != EBUSY) {
+        fail("Removed the root");
+    }
+
+    DIR *dir = fs->_opendir(fs, make_path(&path, "A.B", NULL));
+    test_unlink(fs, "A.B", "FILE");
+    if (test_rmdir(fs, "A.B", NULL) != -1 || errno != EBUSY) {
+        fail("Removed a directory that is being listed");
+    }
+    if (fs->_readdir(fs, dir)) {
+        fail("Listed a removed file");
+    }
+    fs->_closedir(fs, dir);
+
+    if (test_rmdir(fs, "A", "B") != 0 || test_stat(fs, "A.B", NULL, &st) != -1) {
+        fail("rmdir went wrong");
+    }
+
+    // Renames
+    test_mkdir(fs, "A", "B");
+    write_file(fs, "A.B", "F1", "one", 3);
+    write_file(fs, NULL, "F2", "two", 3);
+    if (test_rename(fs, "A.B", "F1", NULL, "F2") != 0 || !file_equals(fs, NULL, "F2", "one", 3) ||
+        test_stat(fs, "A.B", "F1", &st) != -1) {
+        fail("Renaming over a file went wrong");
+    }
+    if (test_rename(fs, NULL, "F2", NULL, "f2") != 0 || !listing(fs, NULL, "f2 A/ ")) {
+        fail("Renaming to another case went wrong");
+    }
+    if (test_rename(fs, "A", NULL, "A.B", "C") != -1 || errno != EINVAL) {
+        fail("Moved a directory into itself");
+    }
+    if (test_rename(fs, NULL, "F2", "A", "B") != -1 || errno != EISDIR) {
+        fail("Renamed a file over a directory");
+    }
+    if (test_rename(fs, "A", "B", NULL, "F2") != -1 || errno != ENOTDIR) {
+        fail("Renamed a directory over a file");
+    }
+    test_mkdir(fs, NULL, "D");
+    write_file(fs, "A.B", "F3", "three", 5);
+    if (test_rename(fs, "D", NULL, "A", "B") != -1 || errno != ENOTEMPTY) {
+        fail("Renamed over a directory that was not empty");
+    }
+    if (test_rename(fs, "A", "B", "D", NULL) != 0 || !file_equals(fs, "D", "F3", "three", 5) || !listing(fs, "A", "OTHER ")) {
+        fail("Renaming over an empty directory went wrong");
+    }
+    if (test_rename(fs, "NOPE", NULL, "A", "NOPE") != -1 || errno != ENOENT) {
+        fail("Renamed something missing");
+    }
+
+    // Destroying with files still around and open gives back everything
+    int fd = test_open(fs, "D", "F3", O_RDONLY);
+    test_unlink(fs, "D", "F3");
+    test_open(fs, NULL, "f2", O_RDONLY);
+    fs->device._destroy(fs);
+    if (pages_allocated) {
+        fail("Destroy leaked pages");
+    }
+    (void)fd;
+}
+
+static void test_limit(void) {
+    filesystem_device_t *fs =
+        (filesystem_device_t *)ramdisk_create(TEST_MAX_PAGES * TEST_PAGE_SIZE, TEST_PAGE_SIZE, &test_ops, NULL);
+    static uint8_t  chunk[10000];
+    ramdisk_stats_t stats;
+
+    memset(chunk, 'x', sizeof(chunk));
+    int     fd      = test_open(fs, NULL, "BIG", O_WRONLY | O_CREAT);
+    size_t  written = 0;
+    ssize_t r;
+    while ((r = fs->device._write(fs, fd, chunk, sizeof(chunk))) > 0) {
+        written += r;
+    }
+    if (r != -1 || errno != ENOSPC || written != TEST_MAX_PAGES * TEST_PAGE_SIZE) {
+        printf("\033[31mWrote %zu bytes before running out\033[0m\n", written);
+        errors++;
+    }
+    if (pages_allocated != TEST_MAX_PAGES) {
+        fail("Went over the size limit");
+    }
+    if (write_file(fs, NULL, "SMALL", "x", 1)) {
+        fail("Wrote to a full disk");
+    }
+    fs->device._close(fs, fd);
+
+    // Full pages go back when the file goes
+    test_unlink(fs, NULL, "BIG");
+    test_unlink(fs, NULL, "SMALL");
+    ramdisk_stats(&fs->device, &stats);
+    if (pages_allocated || stats.pages || stats.used_blocks) {
+        fail("Pages kept after deleting a full disk");
+    }
+
+    // An allocator that runs dry before the limit is the same as being full
+    fail_pages = true;
+    if (write_file(fs, NULL, "SMALL", "x", 1) || errno != ENOSPC) {
+        fail("Wrote without pages");
+    }
+    fail_pages = false;
+    fs->device._destroy(fs);
+
+    if (ramdisk_create(1024 * 1024, 33 * RAMDISK_BLOCK_SIZE, &test_ops, NULL)) {
+        fail("Created a disk with too many blocks per page");
+    }
+}
+
+// Random writes, truncates and deletes, checked against copies in memory
+static void test_model(void) {
+    filesystem_device_t *fs =
+        (filesystem_device_t *)ramdisk_create(TEST_MAX_PAGES * TEST_PAGE_SIZE, TEST_PAGE_SIZE, &test_ops, NULL);
+    static uint8_t  model[MODEL_FILES][MODEL_MAX_SIZE];
+    static uint8_t  data[MODEL_MAX_SIZE];
+    size_t          sizes[MODEL_FILES] = {0};
+    bool            exists[MODEL_FILES] = {0};
+    char            names[MODEL_FILES][8];
+    ramdisk_stats_t stats;
+
+    test_mkdir(fs, "SUB", NULL);
+    for (int i = 0; i < MODEL_FILES; ++i) {
+        snprintf(names[i], sizeof(names[i]), "F%d", i);
+    }
+
+    for (int round = 0; round < 4000 && !errors; ++round) {
+        int   i   = rng() % MODEL_FILES;
+        char *dir = (i & 1) ? "SUB" : NULL;
+
+        switch (rng() % 8) {
+            case 0:
+                if (test_unlink(fs, dir, names[i]) != (exists[i] ? 0 : -1)) {
+                    fail("unlink disagrees with the model");
+                }
+                exists[i] = false;
+                sizes[i]  = 0;
+                break;
+            case 1: {
+                int fd = test_open(fs, dir, names[i], O_WRONLY | O_CREAT | O_TRUNC);
+                fs->device._close(fs, fd);
+                exists[i] = fd >= 0;
+                sizes[i]  = 0;
+                break;
+            }
+            default: {
+                size_t offset = rng() % MODEL_MAX_SIZE;
+                size_t len    = rng() % (MODEL_MAX_SIZE - offset);
+                for (size_t j = 0; j < len; ++j) {
+                    data[j] = rng();
+                }
+
+                int fd = test_open(fs, dir, names[i], O_RDWR | O_CREAT);
+                if (fd < 0) {
+                    fail("Could not open a model file");
+                    break;
+                }
+                exists[i] = true;
+                fs->device._lseek(fs, fd, offset, SEEK_SET);
+                ssize_t done = fs->device._write(fs, fd, data, len);
+                fs->device._close(fs, fd);
+
+                if (done < 0 && errno != ENOSPC) {
+                    fail("Write failed other than for space");
+                }
+                if (done <= 0) {
+                    break;
+                }
+                if (offset > sizes[i]) {
+                    memset(model[i] + sizes[i], 0, offset - sizes[i]);
+                }
+                memcpy(model[i] + offset, data, done);
+                if (offset + done > sizes[i]) {
+                    sizes[i] = offset + done;
+                }
+            }
+        }
+
+        if (exists[i] && !file_equals(fs, dir, names[i], model[i], sizes[i])) {
+            printf("\033[31mFile %d differs from the model in round %d\033[0m\n", i, round);
+            errors++;
+        }
+
+        ramdisk_stats(&fs->device, &stats);
+        if (stats.pages != (size_t)pages_allocated || stats.pages > TEST_MAX_PAGES ||
+            stats.used_blocks > stats.pages * (TEST_PAGE_SIZE / RAMDISK_BLOCK_SIZE)) {
+            fail("Page accounting is off");
+        }
+    }
+
+    for (int i = 0; i < MODEL_FILES; ++i) {
+        test_unlink(fs, (i & 1) ? "SUB" : NULL, names[i]);
+    }
+    if (pages_allocated) {
+        fail("Model files kept pages after being deleted");
+    }
+    fs->device._destroy(fs);
+}
+
+typedef struct {
+    filesystem_device_t *fs;
+    char                 name[8];
+    bool                 ok;
+} writer_t;
+
+static void *writer_thread(void *arg) {
+    writer_t *writer = arg;
+    uint8_t   data[5000];
+
+    writer->ok = true;
+    for (int round = 0; round < 200 && writer->ok; ++round) {
+        memset(data, writer->name[0] + round, sizeof(data));
+        writer->ok = write_file(writer->fs, NULL, writer->name, data, sizeof(data)) &&
+                     file_equals(writer->fs, NULL, writer->name, data, sizeof(data));
+    }
+    return NULL;
+}
+
+static void test_threads(void) {
+    filesystem_device_t *fs = (filesystem_device_t *)ramdisk_create(1024 * 1024, TEST_PAGE_SIZE, &test_ops, NULL);
+    pthread_t            threads[4];
+    writer_t             writers[4];
+
+    for (int i = 0; i < 4; ++i) {
+        writers[i].fs = fs;
+        snprintf(writers[i].name, sizeof(writers[i].name), "%c", 'A' + i * 10);
+        pthread_create(&threads[i], NULL, writer_thread, &writers[i]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+        if (!writers[i].ok) {
+            fail("Concurrent writers saw each other's data");
+        }
+    }
+    fs->device._destroy(fs);
+}
+
+int main(void) {
+    test_files();
+    test_directories();
+    test_limit();
+    test_model();
+    test_threads();
+
+    if (errors) {
+        printf("\033[31m%d errors\033[0m\n", errors);
+        return 1;
+    }
+
+    printf("\033[32mAll tests passed\033[0m\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,52 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "badgevms/device.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAMDISK_BLOCK_SIZE 4096
+#define RAMDISK_MAX_FILES  32
+
+// Where a RAM disk gets its memory. Pages are page_size bytes and only
+// addressable between page_map() and page_unmap(), one page at a time.
+typedef struct {
+    uintptr_t (*page_allocate)(void *context); // 0 when out of memory
+    void (*page_free)(void *context, uintptr_t page);
+    void *(*page_map)(void *context, uintptr_t page);
+    void (*page_unmap)(void *context, uintptr_t page);
+} ramdisk_ops_t;
+
+typedef struct {
+    size_t pages;       // Taken from the allocator right now
+    size_t used_blocks; // Of RAMDISK_BLOCK_SIZE, out of max_blocks
+    size_t max_blocks;
+} ramdisk_stats_t;
+
+// A filesystem of up to max_bytes that lives in memory. Files are stored in
+// blocks, which are carved out of pages taken as they are needed. A page goes
+// back to the allocator as soon as none of its blocks are in use, so deleting
+// files returns their memory. Names are case insensitive, like on FAT.
+device_t *ramdisk_create(size_t max_bytes, size_t page_size, ramdisk_ops_t const *ops, void *context);
+void      ramdisk_stats(device_t *dev, ramdisk_stats_t *stats);
+
+#ifndef RUN_TEST
+// Backed by PSRAM pages, reached through RAMDISK_WINDOW
+device_t *ramdisk_create_psram(size_t max_bytes);
+#endif
@@ -23,6 +23,8 @@
 #include "esp_lcd_st7703.h"
 #include "esp_ldo_regulator.h"
 #include "esp_log.h"
+#include "hal/mipi_dsi_brg_ll.h"
+#include "hal/mipi_dsi_host_ll.h"
 
 #define TAG "st7703"
 
@@ -46,8 +48,25 @@ static void (*refresh_cb)(void *user_data);
 typedef struct {
     lcd_device_t           device;
     esp_lcd_panel_handle_t disp_panel;
+    esp_lcd_video_timing_t timing;
+    uint32_t               dpi_clock_hz;
+    int                    refresh_hz; // Last rate asked for
+    int                    actual_hz;  // What the programmed timing gives
+    int                    num_fbs;
 } st7703_device_t;
 
+// Two buffers leave a whole frame of PSRAM to applications, three let the
+// compositor start the next frame before the panel picked up the last one.
+// The DPI driver allocates them with the panel, so this only changes on boot.
+static int supported_framebuffers(int num_fbs) {
+    if (num_fbs < 2 || num_fbs > 3) {
+        ESP_LOGW(TAG, "Ignoring unsupported number of framebuffers %i", num_fbs);
+        return DISPLAY_FRAMEBUFFERS;
+    }
+
+    return num_fbs;
+}
+
 IRAM_ATTR static bool
     on_refresh_done(esp_lcd_panel_handle_t panel, esp_lcd_dpi_panel_event_data_t *edata, void *user_ctx) {
     ESP_DRAM_LOGV(DRAM_STR("st7703"), "on_refresh_done");
@@ -76,6 +95,16 @@ static esp_err_t enable_dsi_phy_power(void) {
     return ESP_OK;
 }
 
+// Frames per second the DPI clock gives with this vertical front porch
+static int timing_refresh_hz(st7703_device_t const *device, uint32_t vfp) {
+    esp_lcd_video_timing_t const *timing = &device->timing;
+
+    uint32_t h_blank = timing->hsync_pulse_width + timing->hsync_back_porch + timing->hsync_front_porch;
+    uint32_t h_total = timing->h_size + h_blank;
+    uint32_t v_total = timing->v_size + timing->vsync_pulse_width + timing->vsync_back_porch + vfp;
+    return device->dpi_clock_hz / (h_total * v_total);
+}
+
 static void panel_init(st7703_device_t *device) {
     ESP_LOGI(TAG, "Enable MIPI DSI PHY power");
     ESP_ERROR_CHECK(enable_dsi_phy_power());
@@ -102,6 +131,12 @@ static void panel_init(st7703_device_t *device) {
 
     ESP_LOGI(TAG, "Install ST7703 LCD control panel");
     esp_lcd_dpi_panel_config_t dpi_config = ST7703_720_720_PANEL_60HZ_DPI_CONFIG();
+    device->timing                        = dpi_config.video_timing;
+    device->dpi_clock_hz                  = dpi_config.dpi_clock_freq_mhz * 1000000;
+    device->refresh_hz                    = FRAMEBUFFER_MAX_REFRESH;
+    device->actual_hz                     = timing_refresh_hz(device, device->timing.vsync_front_porch);
+    dpi_config.num_fbs                    = device->num_fbs;
+    ESP_LOGI(TAG, "Using %i framebuffers", device->num_fbs);
 
     st7703_vendor_config_t vendor_config = {
         .mipi_config =
@@ -151,33 +186,18 @@ void draw(void *dev, int x, int y, int w, int h, void *pixels) {
     esp_lcd_panel_draw_bitmap(device->disp_panel, x, y, w, h, pixels);
 }
 
+// Returns NULL past the last framebuffer
 void get_framebuffer(void *dev, int num, void **pixels) {
-    void *fb0;
-#if DISPLAY_FRAMEBUFFERS > 1
-    void *fb1;
-#endif
-#if DISPLAY_FRAMEBUFFERS > 2
-    void *fb2;
-#endif
     st7703_device_t *device = dev;
-#if DISPLAY_FRAMEBUFFERS == 1
-    esp_lcd_dpi_panel_get_frame_buffer(device->disp_panel, DISPLAY_FRAMEBUFFERS, &fb0);
-#elif DISPLAY_FRAMEBUFFERS == 2
-    esp_lcd_dpi_panel_get_frame_buffer(device->disp_panel, DISPLAY_FRAMEBUFFERS, &fb0, &fb1);
-#elif DISPLAY_FRAMEBUFFERS == 3
-    esp_lcd_dpi_panel_get_frame_buffer(device->disp_panel, DISPLAY_FRAMEBUFFERS, &fb0, &fb1, &fb2);
-#endif
+    void            *fbs[3] = {NULL};
 
-    if (num == 0)
-        *pixels = fb0;
-#if DISPLAY_FRAMEBUFFERS > 1
-    if (num == 1)
-        *pixels = fb1;
-#endif
-#if DISPLAY_FRAMEBUFFERS > 2
-    if (num == 2)
-        *pixels = fb2;
-#endif
+    if (device->num_fbs == 2) {
+        esp_lcd_dpi_panel_get_frame_buffer(device->disp_panel, 2, &fbs[0], &fbs[1]);
+    } else {
+        esp_lcd_dpi_panel_get_frame_buffer(device->disp_panel, 3, &fbs[0], &fbs[1], &fbs[2]);
+    }
+
+    *pixels = num >= 0 && num < device->num_fbs ? fbs[num] : NULL;
 }
 
 void set_refresh_cb(void *dev, void *user_data, void (*callback)(void *user_data)) {
@@ -192,15 +212,71 @@ void set_refresh_cb(void *dev, void *user_data, void (*callback)(void *user_data
     esp_lcd_dpi_panel_register_event_callbacks(device->disp_panel, &cbs, user_data);
 }
 
-device_t *st7703_create() {
+// Lower refresh rates stretch the vertical front porch. The pixel clock and
+// everything the panel was initialised with stay the same, the DPI DMA just
+// reads the framebuffer less often. Returns the rate actually configured.
+int set_refresh_rate(void *dev, int hz) {
+    st7703_device_t        *device = dev;
+    esp_lcd_video_timing_t *timing = &device->timing;
+
+    if (hz <= 0 || hz > FRAMEBUFFER_MAX_REFRESH) {
+        hz = FRAMEBUFFER_MAX_REFRESH;
+    }
+
+    if (hz == device->refresh_hz) {
+        return device->actual_hz;
+    }
+
+    uint32_t h_blank = timing->hsync_pulse_width + timing->hsync_back_porch + timing->hsync_front_porch;
+    uint32_t h_total = timing->h_size + h_blank;
+    uint32_t v_fixed = timing->v_size + timing->vsync_pulse_width + timing->vsync_back_porch;
+    uint32_t v_total = device->dpi_clock_hz / (h_total * hz);
+    uint32_t vfp     = timing->vsync_front_porch;
+
+    // The full rate always uses the porch the panel was tuned for
+    if (hz != FRAMEBUFFER_MAX_REFRESH && v_total > v_fixed + vfp) {
+        vfp = v_total - v_fixed;
+    }
+
+    dsi_brg_dev_t  *bridge = MIPI_DSI_LL_GET_BRG(LCD_MIPI_DSI_BUS_ID);
+    dsi_host_dev_t *host   = MIPI_DSI_LL_GET_HOST(LCD_MIPI_DSI_BUS_ID);
+
+    mipi_dsi_brg_ll_set_vertical_timing(
+        bridge,
+        timing->vsync_pulse_width,
+        timing->vsync_back_porch,
+        timing->v_size,
+        vfp
+    );
+    mipi_dsi_host_ll_dpi_set_vertical_timing(
+        host,
+        timing->vsync_pulse_width,
+        timing->vsync_back_porch,
+        timing->v_size,
+        vfp
+    );
+    // Takes effect at the start of the next frame
+    mipi_dsi_brg_ll_update_dpi_config(bridge);
+
+    device->refresh_hz = hz;
+    device->actual_hz  = timing_refresh_hz(device, vfp);
+    ESP_LOGI(TAG, "Refresh rate now %i Hz (front porch %i lines)", device->actual_hz, (int)vfp);
+
+    return device->actual_hz;
+}
+
+device_t *st7703_create(int num_fbs) {
     ESP_LOGI(TAG, "Initializing");
     st7703_device_t *dev      = calloc(1, sizeof(st7703_device_t));
     device_t        *base_dev = (device_t *)dev;
     lcd_device_t    *lcd_dev  = (lcd_device_t *)dev;
 
-    lcd_dev->_draw           = draw;
-    lcd_dev->_getfb          = get_framebuffer;
-    lcd_dev->_set_refresh_cb = set_refresh_cb;
+    dev->num_fbs = supported_framebuffers(num_fbs);
+
+    lcd_dev->_draw             = draw;
+    lcd_dev->_getfb            = get_framebuffer;
+    lcd_dev->_set_refresh_cb   = set_refresh_cb;
+    lcd_dev->_set_refresh_rate = set_refresh_rate;
 
     base_dev->type   = DEVICE_TYPE_LCD;
     base_dev->_open  = NULL;
@@ -186,7 +186,8 @@ extern "C" {
 
 #endif
 
-device_t *st7703_create();
+// num_fbs panel framebuffers, 2 or 3
+device_t *st7703_create(int num_fbs);
 
 #ifdef __cplusplus
 }
@@ -17,23 +17,62 @@
 #include "tca8418.h"
 
 #include "badgevms/event.h"
+#include "badgevms_config.h"
+#include "driver/gpio.h"
 #include "esp_log.h"
-#include "esp_tca8418.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "key_events.h"
+#include "task.h"
 
 #include <sys/time.h>
 
-#define SDA_PIN           18
-#define SCL_PIN           20
-#define I2C_MASTER_SDA_IO SDA_PIN
-#define I2C_MASTER_SCL_IO SCL_PIN
-
 #define TAG "TCA8418"
 
+#define TCA8418_I2C_ADDR 0x34
+#define TCA8418_FIFO     10 // Key events the chip holds
+
+#define REG_CFG                 0x01
+#define REG_INTERRUPT_STATUS    0x02
+#define REG_KEY_LOCK_EVT_COUNT  0x03
+#define REG_KEY_EVENT_A         0x04
+#define REG_GPIO_INT_STAT1      0x11
+#define REG_GPIO_INT_STAT2      0x12
+#define REG_GPIO_INT_STAT3      0x13
+#define REG_GPIO_INT_EN1        0x1A
+#define REG_GPIO_INT_EN2        0x1B
+#define REG_GPIO_INT_EN3        0x1C
+#define REG_KEY_PRESS_GPIO1     0x1D
+#define REG_KEY_PRESS_GPIO2     0x1E
+#define REG_KEY_PRESS_GPIO3     0x1F
+#define REG_GPI_EM1             0x20
+#define REG_GPI_EM2             0x21
+#define REG_GPI_EM3             0x22
+#define REG_GPIO_DIRECTION_1    0x23
+#define REG_GPIO_DIRECTION_2    0x24
+#define REG_GPIO_DIRECTION_3    0x25
+#define REG_GPIO_INTERRUPT_LVL1 0x26
+#define REG_GPIO_INTERRUPT_LVL2 0x27
+#define REG_GPIO_INTERRUPT_LVL3 0x28
+#define REG_DEBOUNCE_DIS1       0x29
+#define REG_DEBOUNCE_DIS2       0x2A
+#define REG_DEBOUNCE_DIS3       0x2B
+
+#define CFG_KE_IEN  0x01 // Key event interrupts
+#define CFG_INT_CFG 0x10 // Pulse INT again while events remain after clearing it
+
 typedef struct {
-    device_t       device;
-    key_mod_t      mod_state;
-    tca8418_dev_t *keyboard;
+    keyboard_device_t device;
+    key_mod_t         mod_state;
+    i2c_device_t     *i2c;
+    SemaphoreHandle_t done;
+    bool              ok;
+    key_ring_t        ring;
+    key_repeat_t      repeat;
+    TaskHandle_t      task;
+    void             *event_cb_data;
+    void (*event_cb)(void *user_data);
 } tca8418_device_t;
 
 static keyboard_scancode_t const keymap[80] = {
@@ -124,16 +163,35 @@ static keyboard_scancode_t const keymap[80] = {
     KEY_SCANCODE_RIGHTBRACKET, // 0x50
 };
 
-event_t scancode_to_event(tca8418_device_t *device, uint8_t scancode) {
+static keyboard_scancode_t raw_to_scancode(uint8_t code) {
+    uint8_t key = code & 0x7F;
+    if (key == 0 || key > 0x50) {
+        return KEY_SCANCODE_UNKNOWN;
+    }
+    return keymap[key - 1];
+}
+
+static bool scancode_repeats(keyboard_scancode_t s) {
+    switch (s) {
+        case KEY_SCANCODE_UNKNOWN:
+        case KEY_SCANCODE_FN:
+        case KEY_SCANCODE_LSHIFT:
+        case KEY_SCANCODE_RSHIFT:
+        case KEY_SCANCODE_LCTRL:
+        case KEY_SCANCODE_RCTRL:
+        case KEY_SCANCODE_LALT:
+        case KEY_SCANCODE_RALT:
+        case KEY_SCANCODE_LGUI: return false;
+        default: return true;
+    }
+}
+
+static event_t key_to_event(tca8418_device_t *device, key_ring_entry_t const *entry) {
     struct timeval tv_now;
     gettimeofday(&tv_now, NULL);
 
-    uint8_t             key = scancode & 0x7F;
-    keyboard_scancode_t s   = KEY_SCANCODE_UNKNOWN;
-
-    if (key <= 0x50) {
-        s = keymap[key - 1];
-    }
+    uint8_t             scancode = entry->code;
+    keyboard_scancode_t s        = raw_to_scancode(scancode);
 
     event_t event;
     event.keyboard.down = scancode >> 7; // high bit set means pressed
@@ -164,10 +222,12 @@ event_t scancode_to_event(tca8418_device_t *device, uint8_t scancode) {
         event.type = EVENT_KEY_UP;
     }
 
-    event.keyboard.timestamp = (int64_t)tv_now.tv_sec * 1000000L + (int64_t)tv_now.tv_usec;
+    // The ring has esp_timer time, events carry wall clock time
+    int64_t age              = esp_timer_get_time() - entry->timestamp;
+    event.keyboard.timestamp = (int64_t)tv_now.tv_sec * 1000000L + (int64_t)tv_now.tv_usec - age;
     event.keyboard.scancode  = s;
     event.keyboard.key       = BADGEVMS_SCANCODE_TO_KEYCODE(s);
-    event.keyboard.repeat    = false;
+    event.keyboard.repeat    = entry->repeat;
     event.keyboard.mod       = device->mod_state;
     event.keyboard.text      = keyboard_get_ascii(s, device->mod_state);
 
@@ -188,55 +248,210 @@ static ssize_t tca8418_write(void *dev, int fd, void const *buf, size_t count) {
     return -1;
 }
 
+static void keyboard_transfer_done(void *user_data, bool ok) {
+    tca8418_device_t *device = user_data;
+    device->ok               = ok;
+    xSemaphoreGive(device->done);
+}
+
+// Goes through the I2CBUS0 queue ahead of sensor traffic. Only the keyboard
+// task and creation talk to the chip, so one transfer runs at a time.
+static bool keyboard_transfer(tca8418_device_t *device, i2c_transaction_t *transactions, int count) {
+    if (!device->i2c->_submit(device->i2c, transactions, count, I2C_PRIORITY_INPUT, keyboard_transfer_done, device)) {
+        return false;
+    }
+    xSemaphoreTake(device->done, portMAX_DELAY);
+    return device->ok;
+}
+
+static bool keyboard_write(tca8418_device_t *device, uint8_t const (*writes)[2], int count) {
+    i2c_transaction_t transactions[count];
+    uint8_t           values[count];
+
+    for (int i = 0; i < count; ++i) {
+        values[i]       = writes[i][1];
+        transactions[i] = (i2c_transaction_t){.reg = writes[i][0], .read = false, .len = 1, .data = &values[i]};
+    }
+    return keyboard_transfer(device, transactions, count);
+}
+
+// Takes what is in the FIFO now, returns how many codes were read or -1
+static int keyboard_read_events(tca8418_device_t *device, uint8_t *codes) {
+    uint8_t           count = 0;
+    i2c_transaction_t read  = {.reg = REG_KEY_LOCK_EVT_COUNT, .read = true, .len = 1, .data = &count};
+    if (!keyboard_transfer(device, &read, 1)) {
+        return -1;
+    }
+
+    count &= 0x0F;
+    if (count > TCA8418_FIFO) {
+        count = TCA8418_FIFO;
+    }
+    if (!count) {
+        return 0;
+    }
+
+    // Every read of KEY_EVENT_A pops one event, in a single batch
+    i2c_transaction_t reads[TCA8418_FIFO];
+    for (int i = 0; i < count; ++i) {
+        reads[i] = (i2c_transaction_t){.reg = REG_KEY_EVENT_A, .read = true, .len = 1, .data = &codes[i]};
+    }
+    return keyboard_transfer(device, reads, count) ? count : -1;
+}
+
+static bool keyboard_clear_interrupt(tca8418_device_t *device) {
+    static uint8_t const clear[][2] = {{REG_INTERRUPT_STATUS, 0x03}};
+    return keyboard_write(device, clear, 1);
+}
+
+// All 8 rows and 10 columns are keys, with key event interrupts when INT is wired up
+static bool keyboard_configure(tca8418_device_t *device) {
+    static uint8_t const config[][2] = {
+        {REG_GPIO_DIRECTION_1, 0x00},
+        {REG_GPIO_DIRECTION_2, 0x00},
+        {REG_GPIO_DIRECTION_3, 0x00},
+        {REG_GPI_EM1, 0xFF},
+        {REG_GPI_EM2, 0xFF},
+        {REG_GPI_EM3, 0xFF},
+        {REG_GPIO_INTERRUPT_LVL1, 0x00},
+        {REG_GPIO_INTERRUPT_LVL2, 0x00},
+        {REG_GPIO_INTERRUPT_LVL3, 0x00},
+        {REG_GPIO_INT_EN1, 0xFF},
+        {REG_GPIO_INT_EN2, 0xFF},
+        {REG_GPIO_INT_EN3, 0xFF},
+        {REG_KEY_PRESS_GPIO1, 0xFF},
+        {REG_KEY_PRESS_GPIO2, 0xFF},
+        {REG_KEY_PRESS_GPIO3, 0x03},
+        {REG_DEBOUNCE_DIS1, 0x00},
+        {REG_DEBOUNCE_DIS2, 0x00},
+        {REG_DEBOUNCE_DIS3, 0x00},
+#if KEYBOARD_INT_PIN >= 0
+        {REG_CFG, CFG_KE_IEN | CFG_INT_CFG},
+#endif
+    };
+
+    return keyboard_write(device, config, sizeof(config) / sizeof(config[0]));
+}
+
+// Drops events and interrupts left over from before we started
+static void keyboard_flush(tca8418_device_t *device) {
+    uint8_t codes[TCA8418_FIFO];
+    while (keyboard_read_events(device, codes) > 0) {
+    }
+
+    uint8_t           stat[3];
+    i2c_transaction_t reads[] = {
+        {.reg = REG_GPIO_INT_STAT1, .read = true, .len = 1, .data = &stat[0]},
+        {.reg = REG_GPIO_INT_STAT2, .read = true, .len = 1, .data = &stat[1]},
+        {.reg = REG_GPIO_INT_STAT3, .read = true, .len = 1, .data = &stat[2]},
+    };
+    keyboard_transfer(device, reads, 3);
+    keyboard_clear_interrupt(device);
+}
+
+#if KEYBOARD_INT_PIN >= 0
+IRAM_ATTR static void tca8418_isr(void *arg) {
+    tca8418_device_t *device = arg;
+    BaseType_t        woken  = pdFALSE;
+
+    // Only the low 32 bits fit, the task works out the rest
+    xTaskNotifyFromISR(device->task, (uint32_t)esp_timer_get_time(), eSetValueWithOverwrite, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+#endif
+
+// Drains the TCA8418 FIFO into the ring as soon as the INT line fires, or
+// every KEYBOARD_POLL_INTERVAL_MS without one, and produces key repeats.
 static void tca8418_keyboard_task(void *pvParameters) {
     tca8418_device_t *device = pvParameters;
-    // poll keyboard for keypresses
+
     while (true) {
-        while (tca8418_get_event_count(device->keyboard) > 0) {
-            sKeyAndChar test = tca8418_get_char(device->keyboard);
+        TickType_t wait     = KEYBOARD_INT_PIN >= 0 ? portMAX_DELAY : pdMS_TO_TICKS(KEYBOARD_POLL_INTERVAL_MS);
+        int64_t    deadline = key_repeat_deadline(&device->repeat);
+        if (deadline >= 0) {
+            int64_t    until_repeat = deadline - esp_timer_get_time();
+            TickType_t repeat_wait  = until_repeat > 0 ? pdMS_TO_TICKS((until_repeat + 999) / 1000) : 0;
+            wait                    = repeat_wait < wait ? repeat_wait : wait;
+        }
+
+        uint32_t irq_time;
+        bool     irq = xTaskNotifyWait(0, 0, &irq_time, wait) == pdTRUE;
+        int64_t  now = esp_timer_get_time();
+
+        // Without an interrupt the best we know is that it happened since the last poll
+        int64_t timestamp = irq ? now - (uint32_t)((uint32_t)now - irq_time) : now;
+        bool    queued    = false;
+
+        if (irq || KEYBOARD_INT_PIN < 0) {
+            uint8_t codes[TCA8418_FIFO];
+            int     count = keyboard_read_events(device, codes);
+
+            // Events that came in meanwhile pulse INT again, or wait for the next poll
+            for (int i = 0; i < count; ++i) {
+                uint8_t code = codes[i];
+                if (raw_to_scancode(code) == KEY_SCANCODE_UNKNOWN) {
+                    ESP_LOGD(TAG, "Illegal scancode 0x%02x, skipping", code);
+                    continue;
+                }
+
+                key_ring_entry_t entry = {.timestamp = timestamp, .code = code};
+                if (!key_ring_push(&device->ring, &entry)) {
+                    ESP_LOGW(TAG, "Keyboard ring full, dropping scancode 0x%02x", code);
+                }
+                key_repeat_key(&device->repeat, code, scancode_repeats(raw_to_scancode(code)), timestamp);
+                queued = true;
+            }
+
+            if (irq) {
+                keyboard_clear_interrupt(device);
+            }
+        }
+
+        key_ring_entry_t repeat;
+        if (key_repeat_poll(&device->repeat, now, &repeat)) {
+            key_ring_push(&device->ring, &repeat);
+            queued = true;
+        }
+
+        if (queued && device->event_cb) {
+            device->event_cb(device->event_cb_data);
         }
-        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
-    // If ever exits, cleanup
-    vTaskDelete(NULL);
 }
 
+// Only takes events out of the ring, never touches the I2C bus
 static ssize_t tca8418_read(void *dev, int fd, void *buf, size_t count) {
     tca8418_device_t *device = dev;
     if (fd)
         return -1;
 
-    size_t written = 0;
-    while (written <= count) {
-        if (tca8418_get_event_count(device->keyboard)) {
-            char    c   = tca8418_get_key(device->keyboard);
-            uint8_t key = c & 0x7F;
-            if (key > 0x50) {
-                ESP_LOGD(TAG, "Illegal scancode 0x%02x, skipping", c);
-                continue;
-            }
-            event_t event = scancode_to_event(dev, c);
-            ESP_LOGW(TAG, "Got keyboard event raw 0x%02x scancode 0x%02x", c, event.keyboard.scancode);
-            if (written + sizeof(event_t) > count) {
-                break;
-            }
-            memcpy(buf, &event, sizeof(event_t));
-            written += sizeof(event_t);
-        } else {
-            break;
-        }
+    size_t           written = 0;
+    key_ring_entry_t entry;
+    while (written + sizeof(event_t) <= count && key_ring_pop(&device->ring, &entry)) {
+        event_t event = key_to_event(device, &entry);
+        ESP_LOGV(TAG, "Got keyboard event raw 0x%02x scancode 0x%02x", entry.code, event.keyboard.scancode);
+        memcpy((uint8_t *)buf + written, &event, sizeof(event_t));
+        written += sizeof(event_t);
     }
 
     return written;
 }
 
+// Called from the keyboard task whenever new events are in the ring
+static void tca8418_set_event_cb(void *dev, void *user_data, void (*callback)(void *user_data)) {
+    tca8418_device_t *device = dev;
+    device->event_cb_data    = user_data;
+    device->event_cb         = callback;
+}
+
 static ssize_t tca8418_lseek(void *dev, int fd, off_t offset, int whence) {
     return -1;
 }
 
 device_t *tca8418_keyboard_create() {
-    tca8418_device_t *dev      = calloc(1, sizeof(tca8418_device_t));
-    device_t         *base_dev = (device_t *)dev;
+    tca8418_device_t  *dev          = calloc(1, sizeof(tca8418_device_t));
+    device_t          *base_dev     = (device_t *)dev;
+    keyboard_device_t *keyboard_dev = (keyboard_device_t *)dev;
 
     base_dev->type   = DEVICE_TYPE_KEYBOARD;
     base_dev->_open  = tca8418_open;
@@ -245,27 +460,55 @@ device_t *tca8418_keyboard_create() {
     base_dev->_read  = tca8418_read;
     base_dev->_lseek = tca8418_lseek;
 
-    // https://github.com/espressif/esp-iot-solution/discussions/494
-    ESP_LOGE(TAG, "Connect to keyboard, this message and the follow error are cosmetic. There is no error");
-    dev->keyboard = tca8418_create(
-        I2C_MASTER_SCL_IO,
-        I2C_MASTER_SDA_IO,
-        0,           // Default address
-        GPIO_NUM_NC, // Notify pin is not connected
-        0,           // Max
-        0            // Max
-    );
-
-    if (!dev->keyboard) {
+    keyboard_dev->_set_event_cb = tca8418_set_event_cb;
+
+    key_ring_init(&dev->ring);
+    key_repeat_init(&dev->repeat, KEYBOARD_REPEAT_DELAY_MS * 1000, KEYBOARD_REPEAT_RATE_MS * 1000);
+
+    // Shares the bus with the sensors, key reads go first
+    i2c_bus_device_t *bus = (i2c_bus_device_t *)device_get("I2CBUS0");
+    if (!bus) {
+        ESP_LOGE(TAG, "keyboard needs I2CBUS0");
+        free(dev);
+        return NULL;
+    }
+
+    dev->done = xSemaphoreCreateBinary();
+    dev->i2c  = bus->_device_create(bus, TCA8418_I2C_ADDR, 0);
+    if (!dev->done || !dev->i2c || !keyboard_configure(dev)) {
         ESP_LOGE(TAG, "keyboard initialization failed");
+        if (dev->i2c) {
+            dev->i2c->device._destroy(dev->i2c);
+        }
+        if (dev->done) {
+            vSemaphoreDelete(dev->done);
+        }
         free(dev);
         return NULL;
     }
 
-    tca8418_flush(dev->keyboard);
+#if KEYBOARD_INT_PIN >= 0
+    gpio_config_t cfg = {
+        .pin_bit_mask = 1ULL << KEYBOARD_INT_PIN,
+        .mode         = GPIO_MODE_INPUT,
+        .pull_up_en   = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_NEGEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&cfg));
+#endif
+
+    keyboard_flush(dev);
 
     ESP_LOGE(TAG, "keyboard initialization success");
-    // xTaskCreate(tca8418_keyboard_task, "tca8418_keyboard_task", 4096, dev, tskIDLE_PRIORITY, NULL);
+    create_kernel_task(tca8418_keyboard_task, "Keyboard", 3072, dev, 19, &dev->task, 1);
+
+#if KEYBOARD_INT_PIN >= 0
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(KEYBOARD_INT_PIN, tca8418_isr, dev);
+    // INT may already be low, in which case no edge will ever come
+    xTaskNotify(dev->task, (uint32_t)esp_timer_get_time(), eSetValueWithOverwrite);
+#endif
 
     return (device_t *)dev;
 }
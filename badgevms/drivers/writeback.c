@@ -0,0 +1,342 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "writeback.h"
+
+#include <string.h>
+
+static int find_dirty(writeback_t const *writeback, int fd) {
+    for (int i = 0; i < writeback->num_dirty; ++i) {
+        if (writeback->dirty[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+// Keeps the rest in the order they got dirty, so the first is due first
+static void remove_dirty(writeback_t *writeback, int i) {
+    memmove(
+        &writeback->dirty[i],
+        &writeback->dirty[i + 1],
+        (writeback->num_dirty - i - 1) * sizeof(writeback_file_t)
+    );
+    writeback->num_dirty--;
+}
+
+void writeback_init(writeback_t *writeback, writeback_policy_t policy, uint32_t window_ms) {
+    memset(writeback, 0, sizeof(*writeback));
+    writeback->policy = policy;
+    writeback->window = (int64_t)window_ms * 1000;
+}
+
+writeback_action_t writeback_write(writeback_t *writeback, int fd, int64_t now) {
+    writeback->writes++;
+    if (find_dirty(writeback, fd) >= 0)
+        return WRITEBACK_NONE;
+
+    // Every policy keeps track, unmounting syncs whatever is still dirty
+    if (writeback->num_dirty == WRITEBACK_MAX_DIRTY) {
+        writeback->syncs++;
+        return WRITEBACK_SYNC_NOW;
+    }
+
+    writeback->dirty[writeback->num_dirty++] = (writeback_file_t){.fd = fd, .dirty_since = now};
+    if (writeback->policy == WRITEBACK_DEFERRED && writeback->num_dirty == 1)
+        return WRITEBACK_ARMED;
+    return WRITEBACK_NONE;
+}
+
+bool writeback_close(writeback_t *writeback, int fd) {
+    int i = find_dirty(writeback, fd);
+    if (i >= 0)
+        remove_dirty(writeback, i);
+
+    if (writeback->policy != WRITEBACK_IMMEDIATE)
+        return false;
+
+    writeback->syncs++;
+    return true;
+}
+
+void writeback_synced(writeback_t *writeback, int fd) {
+    int i = find_dirty(writeback, fd);
+    if (i >= 0)
+        remove_dirty(writeback, i);
+    writeback->syncs++;
+}
+
+int writeback_due(writeback_t *writeback, int64_t now, int *fds, int max) {
+    int count = 0;
+    if (writeback->policy != WRITEBACK_DEFERRED)
+        return 0;
+
+    while (count < max && writeback->num_dirty && writeback->dirty[0].dirty_since + writeback->window <= now) {
+        fds[count++] = writeback->dirty[0].fd;
+        remove_dirty(writeback, 0);
+    }
+    writeback->syncs += count;
+    return count;
+}
+
+int writeback_all(writeback_t *writeback, int *fds, int max) {
+    int count = 0;
+    while (count < max && writeback->num_dirty) {
+        fds[count++] = writeback->dirty[0].fd;
+        remove_dirty(writeback, 0);
+    }
+    writeback->syncs += count;
+    return count;
+}
+
+int64_t writeback_deadline(writeback_t const *writeback) {
+    if (writeback->policy != WRITEBACK_DEFERRED || !writeback->num_dirty)
+        return -1;
+    return writeback->dirty[0].dirty_since + writeback->window;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FAKE_FDS     48 // More than WRITEBACK_MAX_DIRTY
+#define BUSY_FDS     16 // What the workload keeps open
+#define WINDOW_MS    1000
+#define FAKE_SECONDS 600
+
+// A block device that remembers which writes would survive a power cut, with
+// the glue fatfs.c puts around the policy
+typedef struct {
+    writeback_t writeback;
+    bool        open[FAKE_FDS];
+    int         unsynced[FAKE_FDS]; // Writes not on the medium yet
+    int64_t     oldest[FAKE_FDS];   // Time of the oldest of those
+    int         armed;
+    int         device_syncs;
+    int         writes;
+} fake_device_t;
+
+#define TEST_RNG_SEED 0x2545F491
+#include "test_rng.h"
+
+static void fake_sync(fake_device_t *device, int fd) {
+    device->unsynced[fd] = 0;
+    device->device_syncs++;
+}
+
+static void fake_write(fake_device_t *device, int fd, int64_t now) {
+    if (!device->unsynced[fd]++)
+        device->oldest[fd] = now;
+    device->writes++;
+
+    switch (writeback_write(&device->writeback, fd, now)) {
+        case WRITEBACK_SYNC_NOW: fake_sync(device, fd); break;
+        case WRITEBACK_ARMED: device->armed++; break;
+        case WRITEBACK_NONE: break;
+    }
+}
+
+static void fake_close(fake_device_t *device, int fd) {
+    if (writeback_close(&device->writeback, fd))
+        fake_sync(device, fd);
+
+    // Closing a FAT file writes it out
+    device->unsynced[fd] = 0;
+    device->open[fd]     = false;
+}
+
+// The flush task
+static void fake_flush(fake_device_t *device, int64_t now) {
+    int fds[FAKE_FDS];
+    int count = writeback_due(&device->writeback, now, fds, FAKE_FDS);
+    for (int i = 0; i < count; ++i) {
+        fake_sync(device, fds[i]);
+    }
+}
+
+static void fake_unmount(fake_device_t *device) {
+    int fds[FAKE_FDS];
+    int count = writeback_all(&device->writeback, fds, FAKE_FDS);
+    for (int i = 0; i < count; ++i) {
+        fake_sync(device, fds[i]);
+    }
+}
+
+static int unsynced_files(fake_device_t *device) {
+    int count = 0;
+    for (int fd = 0; fd < FAKE_FDS; ++fd) {
+        count += device->unsynced[fd] != 0;
+    }
+    return count;
+}
+
+// Many small writes to many files, some left open for a long time. Returns
+// the number of errors.
+static int run_workload(fake_device_t *device, writeback_policy_t policy) {
+    int     errors = 0;
+    int64_t now    = 0;
+
+    memset(device, 0, sizeof(*device));
+    writeback_init(&device->writeback, policy, WINDOW_MS);
+
+    while (now < FAKE_SECONDS * 1000000LL) {
+        int64_t next = now + rng() % 5000;
+
+        // The flush task wakes up at the deadline
+        int64_t deadline;
+        while ((deadline = writeback_deadline(&device->writeback)) >= 0 && deadline <= next) {
+            if (deadline < now) {
+                printf("\033[31mDeadline %lld in the past at %lld\033[0m\n", (long long)deadline, (long long)now);
+                return errors + 1;
+            }
+            now = deadline;
+            fake_flush(device, now);
+            if (writeback_deadline(&device->writeback) == deadline) {
+                printf("\033[31mNothing due at the deadline %lld\033[0m\n", (long long)deadline);
+                return errors + 1;
+            }
+        }
+        now = next;
+
+        if (policy == WRITEBACK_DEFERRED) {
+            for (int fd = 0; fd < FAKE_FDS; ++fd) {
+                if (device->unsynced[fd] && device->oldest[fd] + WINDOW_MS * 1000 <= now) {
+                    printf("\033[31mfd %d kept writes for %lldus\033[0m\n", fd, (long long)(now - device->oldest[fd]));
+                    return errors + 1;
+                }
+            }
+        }
+
+        // Mostly a few busy files
+        int      fd = rng() % 20 ? rng() % 4 : rng() % BUSY_FDS;
+        uint32_t op = rng() % 100;
+        if (!device->open[fd]) {
+            device->open[fd] = true;
+        } else if (op < 80) {
+            fake_write(device, fd, now);
+        } else if (op < 83) {
+            // The application calls fsync()
+            fake_sync(device, fd);
+            writeback_synced(&device->writeback, fd);
+        } else if (op < 90) {
+            fake_close(device, fd);
+        }
+    }
+
+    fake_unmount(device);
+    if (unsynced_files(device)) {
+        printf("\033[31m%d files lost writes on unmount\033[0m\n", unsynced_files(device));
+        errors++;
+    }
+    if (device->writeback.num_dirty) {
+        printf("\033[31mStill tracking %d files after unmount\033[0m\n", device->writeback.num_dirty);
+        errors++;
+    }
+    if ((int)device->writeback.syncs != device->device_syncs) {
+        printf("\033[31mCounted %u syncs, did %d\033[0m\n", device->writeback.syncs, device->device_syncs);
+        errors++;
+    }
+    return errors;
+}
+
+int main(void) {
+    int           errors = 0;
+    fake_device_t immediate, deferred, explicit;
+
+    errors += run_workload(&immediate, WRITEBACK_IMMEDIATE);
+    errors += run_workload(&deferred, WRITEBACK_DEFERRED);
+    errors += run_workload(&explicit, WRITEBACK_EXPLICIT);
+
+    printf(
+        "%d writes: %d syncs immediate, %d deferred, %d explicit\n",
+        deferred.writes,
+        immediate.device_syncs,
+        deferred.device_syncs,
+        explicit.device_syncs
+    );
+
+    if (!deferred.armed || immediate.armed || explicit.armed) {
+        printf("\033[31mFlush task woken without deferred writes\033[0m\n");
+        errors++;
+    }
+    if (deferred.device_syncs * 4 > deferred.writes) {
+        printf("\033[31mDeferred syncs not coalesced\033[0m\n");
+        errors++;
+    }
+    if (explicit.device_syncs >= deferred.device_syncs || immediate.device_syncs <= explicit.device_syncs) {
+        printf("\033[31mPolicies sync in the wrong order\033[0m\n");
+        errors++;
+    }
+
+    // Writes that arrive within a window share one sync, the first one wakes
+    // the flush task
+    fake_device_t device = {0};
+    writeback_init(&device.writeback, WRITEBACK_DEFERRED, WINDOW_MS);
+    for (int i = 0; i < 100; ++i) {
+        fake_write(&device, 3, i * 5000);
+        fake_write(&device, 4, i * 5000 + 1);
+    }
+    if (device.armed != 1) {
+        printf("\033[31mFlush task woken %d times\033[0m\n", device.armed);
+        errors++;
+    }
+    fake_close(&device, 4);
+    fake_flush(&device, WINDOW_MS * 1000 - 1);
+    if (device.device_syncs || writeback_deadline(&device.writeback) != WINDOW_MS * 1000) {
+        printf("\033[31mSynced before the window ran out\033[0m\n");
+        errors++;
+    }
+    fake_flush(&device, WINDOW_MS * 1000);
+    if (device.device_syncs != 1 || device.unsynced[3] || writeback_deadline(&device.writeback) != -1) {
+        printf("\033[31mWindow did not end in one sync\033[0m\n");
+        errors++;
+    }
+    fake_write(&device, 3, WINDOW_MS * 1000);
+    if (device.armed != 2) {
+        printf("\033[31mFlush task not woken after going idle\033[0m\n");
+        errors++;
+    }
+
+    // Only explicit syncs and closing make writes durable
+    writeback_init(&device.writeback, WRITEBACK_EXPLICIT, WINDOW_MS);
+    device.device_syncs = 0;
+    fake_write(&device, 5, 0);
+    fake_flush(&device, 3600 * 1000000LL);
+    if (device.device_syncs || !device.unsynced[5] || writeback_close(&device.writeback, 5)) {
+        printf("\033[31mExplicit policy synced by itself\033[0m\n");
+        errors++;
+    }
+
+    // Running out of slots syncs instead of losing track
+    writeback_init(&device.writeback, WRITEBACK_DEFERRED, WINDOW_MS);
+    device.device_syncs = 0;
+    for (int fd = 0; fd < FAKE_FDS; ++fd) {
+        fake_write(&device, fd, 0);
+    }
+    if (device.device_syncs != FAKE_FDS - WRITEBACK_MAX_DIRTY) {
+        printf("\033[31m%d overflow syncs\033[0m\n", device.device_syncs);
+        errors++;
+    }
+
+    if (errors) {
+        printf("\033[31m%d errors\033[0m\n", errors);
+        return 1;
+    }
+
+    printf("\033[32mAll tests passed\033[0m\n");
+    return 0;
+}
+#endif
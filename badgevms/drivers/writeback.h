@@ -0,0 +1,70 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Files with unsynced writes tracked at once, more are synced right away
+#define WRITEBACK_MAX_DIRTY 32
+
+typedef enum {
+    WRITEBACK_IMMEDIATE, // Sync every file as it is closed
+    WRITEBACK_DEFERRED,  // Sync files left open once their writes are a window old
+    WRITEBACK_EXPLICIT,  // Only fsync(), close and unmount sync
+} writeback_policy_t;
+
+typedef enum {
+    WRITEBACK_NONE,
+    WRITEBACK_SYNC_NOW, // Sync the file before returning
+    WRITEBACK_ARMED,    // The first dirty file, wake the flush task
+} writeback_action_t;
+
+typedef struct {
+    int     fd;
+    int64_t dirty_since; // Time of the first write after the last sync
+} writeback_file_t;
+
+// Decides when a filesystem syncs the files written through it, the caller
+// does the actual syncing. Times are in microseconds.
+//
+// Not thread safe, the filesystem driver locks around it
+typedef struct {
+    writeback_policy_t policy;
+    int64_t            window;
+    int                num_dirty;
+    writeback_file_t   dirty[WRITEBACK_MAX_DIRTY];
+    uint32_t           writes;
+    uint32_t           syncs;
+} writeback_t;
+
+void writeback_init(writeback_t *writeback, writeback_policy_t policy, uint32_t window_ms);
+
+writeback_action_t writeback_write(writeback_t *writeback, int fd, int64_t now);
+// Whether to sync the file before closing it. Closing a FAT file writes its
+// directory entry, that does not need a separate sync.
+bool               writeback_close(writeback_t *writeback, int fd);
+// The caller synced fd, because the application asked for it
+void               writeback_synced(writeback_t *writeback, int fd);
+
+// Fills fds with up to max files whose window ran out and forgets about them,
+// returns how many
+int     writeback_due(writeback_t *writeback, int64_t now, int *fds, int max);
+// Every dirty file, for unmounting
+int     writeback_all(writeback_t *writeback, int *fds, int max);
+// When writeback_due() has work next, -1 if never
+int64_t writeback_deadline(writeback_t const *writeback);
@@ -0,0 +1,180 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "badgevms/file_map.h"
+
+#include "badgevms_config.h"
+#include "esp_log.h"
+#include "file_map_private.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "logical_names.h"
+#include "memory.h"
+#include "page_cache.h"
+#include "task.h"
+#include "why_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char const       *TAG = "file_map";
+static page_cache_t      page_cache;
+static SemaphoreHandle_t page_cache_lock; // Also serializes the fill window
+
+static uintptr_t cache_page_allocate(void *context) {
+    return page_allocate(SOC_MMU_PAGE_SIZE);
+}
+
+static void cache_page_free(void *context, uintptr_t page) {
+    page_deallocate(page);
+}
+
+// Reads through the kernel window, the calling task has the file open
+static bool cache_fill(void *source, uintptr_t page, size_t offset, size_t len) {
+    int      fd   = *(int *)source;
+    uint8_t *data = page_window_map(PAGE_CACHE_WINDOW, page);
+    bool     ok   = why_lseek(fd, offset, SEEK_SET) == (off_t)offset;
+    size_t   done = 0;
+
+    while (ok && done < len) {
+        ssize_t r = why_read(fd, data + done, len - done);
+        ok        = r > 0;
+        done     += ok ? r : 0;
+    }
+
+    // What the page held before is nobody's business
+    memset(data + done, 0, SOC_MMU_PAGE_SIZE - done);
+    page_window_unmap(PAGE_CACHE_WINDOW);
+    return ok;
+}
+
+static page_cache_ops_t const cache_ops = {
+    .page_allocate = cache_page_allocate,
+    .page_free     = cache_page_free,
+    .fill          = cache_fill,
+};
+
+bool file_map_init() {
+    page_cache_lock = xSemaphoreCreateMutex();
+    if (!page_cache_lock) {
+        return false;
+    }
+
+    page_cache_init(&page_cache, &cache_ops, NULL, SOC_MMU_PAGE_SIZE);
+    return true;
+}
+
+static void release(page_cache_file_t *file) {
+    xSemaphoreTake(page_cache_lock, portMAX_DELAY);
+    page_cache_release(&page_cache, file);
+    xSemaphoreGive(page_cache_lock);
+}
+
+void const *file_map(char const *path, size_t *size) {
+    task_info_t *task_info = get_task_info();
+    void const  *ret       = NULL;
+    int          fd        = -1;
+    struct stat  st;
+
+    // The kernel has no address space of its own to map into
+    if (!task_info->pid) {
+        task_info->_errno = EPERM;
+        return NULL;
+    }
+
+    // The resolved path identifies the file in the page cache
+    logical_name_result_t lname        = logical_name_resolve_const(path, 0);
+    size_t                result_count = lname.result_count;
+    for (size_t i = 0; i < result_count; ++i) {
+        fd = why_open(lname.result, O_RDONLY, 0);
+        if (fd >= 0) {
+            break;
+        }
+
+        logical_name_result_free(lname);
+        lname = logical_name_resolve_const(path, i + 1);
+    }
+
+    if (fd < 0) {
+        task_info->_errno = ENOENT;
+        goto out;
+    }
+
+    if (why_fstat(fd, &st) != 0) {
+        why_close(fd);
+        goto out;
+    }
+
+    if (!st.st_size) {
+        why_close(fd);
+        task_info->_errno = EINVAL;
+        goto out;
+    }
+
+    xSemaphoreTake(page_cache_lock, portMAX_DELAY);
+    page_cache_file_t *file = page_cache_acquire(&page_cache, lname.result, st.st_size, st.st_mtime, &fd);
+    xSemaphoreGive(page_cache_lock);
+    why_close(fd);
+
+    if (!file) {
+        ESP_LOGW(TAG, "Could not read %s into the page cache", lname.result);
+        task_info->_errno = ENOMEM;
+        goto out;
+    }
+
+    uintptr_t vaddr = file_pages_map(task_info, file);
+    if (!vaddr) {
+        ESP_LOGW(TAG, "No room to map %s in task %i", lname.result, task_info->pid);
+        release(file);
+        task_info->_errno = ENOMEM;
+        goto out;
+    }
+
+    *size = file->size;
+    ret   = (void const *)vaddr;
+
+out:
+    logical_name_result_free(lname);
+    return ret;
+}
+
+int file_unmap(void const *addr) {
+    task_info_t       *task_info = get_task_info();
+    page_cache_file_t *file      = task_info->pid ? file_pages_unmap(task_info, (uintptr_t)addr) : NULL;
+
+    if (!file) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    release(file);
+    return 0;
+}
+
+void file_map_release_all(task_thread_t *thread) {
+    page_cache_space_t *space = &thread->mappings;
+
+    xSemaphoreTake(page_cache_lock, portMAX_DELAY);
+    for (size_t i = 0; i < space->count; ++i) {
+        page_cache_release(&page_cache, space->mappings[i].file);
+    }
+    space->count = 0;
+    xSemaphoreGive(page_cache_lock);
+}
@@ -21,6 +21,7 @@
 #include "pixel_formats.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum {
     WINDOW_FLAG_NONE            = 0,
@@ -34,6 +35,7 @@ typedef enum {
     WINDOW_FLAG_LOW_PRIORITY    = (1 << 7), // Don't elevate my priority, even if I'm fullscreen
     WINDOW_FLAG_FLIP_HORIZONTAL = (1 << 8), // Flip my window horizontally
     WINDOW_FLAG_FLIP_VERTICAL   = (1 << 9), // Flip my window vertically
+    WINDOW_FLAG_TRIPLE_BUFFERED = (1 << 10), // Mailbox mode, presenting never waits and stale frames are dropped
 } window_flag_t;
 
 typedef struct {
@@ -51,7 +53,51 @@ typedef struct {
     int w, h;
 } window_rect_t;
 
-typedef struct window *window_handle_t;
+typedef struct window             *window_handle_t;
+typedef struct window_transaction *window_transaction_handle_t;
+
+// Histogram buckets 0-3 count durations of 0-3us exactly, after that every
+// power of two is split into four equally sized buckets. The last bucket
+// also collects everything that does not fit.
+#define COMPOSITOR_HISTOGRAM_BUCKETS 64
+
+typedef enum {
+    COMPOSITOR_STAGE_COMMANDS,    // Window commands and keyboard input
+    COMPOSITOR_STAGE_REGIONS,     // Visible and background region computation
+    COMPOSITOR_STAGE_PPA,         // Waiting for PPA blits
+    COMPOSITOR_STAGE_DECORATIONS, // Drawing window decorations
+    COMPOSITOR_STAGE_CACHE_SYNC,  // Cache write back and invalidation
+    COMPOSITOR_STAGE_CONVERT,     // Converting 8 bit and YUV framebuffers
+    COMPOSITOR_STAGE_FRAME,       // The whole frame
+    COMPOSITOR_STAGE_COUNT,
+} compositor_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t mean_us;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t buckets[COMPOSITOR_HISTOGRAM_BUCKETS];
+} compositor_histogram_t;
+
+typedef struct {
+    uint32_t               frames;           // Frames composited since boot
+    uint32_t               missed_refreshes; // Panel refreshes that passed while we were still composing
+    uint32_t               refresh_rate;     // Current panel refresh rate, lower while nothing changes
+    uint32_t               ppa_ops;          // PPA operations since boot
+    float                  fps;              // Frames composited during the last second
+    compositor_histogram_t stage[COMPOSITOR_STAGE_COUNT]; // Over the most recent frames only
+    compositor_histogram_t ppa_ops_per_frame;             // Counts, not microseconds
+} compositor_stats_t;
+
+typedef struct {
+    uint32_t presents;     // Calls to window_present
+    uint32_t drops;        // Presents that replaced a frame the compositor had not picked up yet
+    uint32_t composited;   // Frames the compositor actually picked up
+    float    present_rate; // Presents during the last second
+} window_stats_t;
 
 window_handle_t window_create(char const *title, window_size_t size, window_flag_t flags);
 framebuffer_t  *window_framebuffer_create(window_handle_t window, window_size_t size, pixel_format_t pixel_format);
@@ -70,13 +116,48 @@ window_size_t window_size_set(window_handle_t window, window_size_t size);
 window_flag_t window_flags_get(window_handle_t window);
 window_flag_t window_flags_set(window_handle_t window, window_flag_t flags);
 
+// Resizing keeps the framebuffer_t, but pixels may move, read it again afterwards
 window_size_t  window_framebuffer_size_get(window_handle_t window);
 window_size_t  window_framebuffer_size_set(window_handle_t window, window_size_t size);
 pixel_format_t window_framebuffer_format_get(window_handle_t window);
 
+// YUY2 and OUYY_EVYY framebuffers are BT.601 limited range and are converted by
+// the PPA, their sizes are rounded down to whole chroma blocks
+//
+// INDEX8 framebuffers start out with the RGB332 palette, colors are 0x00RRGGBB
+bool window_palette_set(window_handle_t window, int first, int count, uint32_t const *colors);
+
 framebuffer_t *window_framebuffer_get(window_handle_t window);
 void           window_present(window_handle_t window, bool block, window_rect_t *rects, int num_rects);
 
 event_t window_event_poll(window_handle_t window, bool block, uint32_t timeout_msec);
 
+// Fetches up to max_events at once, waiting like window_event_poll() only if
+// there are none. Returns how many were stored. Resize and quit events are
+// merged with ones still pending and come first. When the queue is full new
+// key events are dropped, key repeats are merged.
+int  window_event_poll_many(window_handle_t window, event_t *events, int max_events, bool block, uint32_t timeout_msec);
+bool window_event_queue_depth_set(window_handle_t window, int depth);
+
+// Transactions stage changes to any number of windows and hand them to the
+// compositor in one go, so they all become visible in the same frame. The
+// transaction is consumed by commit or abort. Without block commit returns
+// right away; a staged present of a double buffered window only swaps the
+// buffers once the transaction is applied, so commit those with block set.
+window_transaction_handle_t window_transaction_begin(void);
+
+bool window_transaction_position_set(
+    window_transaction_handle_t transaction, window_handle_t window, window_coords_t coords
+);
+bool window_transaction_size_set(window_transaction_handle_t transaction, window_handle_t window, window_size_t size);
+bool window_transaction_flags_set(window_transaction_handle_t transaction, window_handle_t window, window_flag_t flags);
+bool window_transaction_title_set(window_transaction_handle_t transaction, window_handle_t window, char const *title);
+bool window_transaction_present(window_transaction_handle_t transaction, window_handle_t window);
+bool window_transaction_commit(window_transaction_handle_t transaction, bool block);
+void window_transaction_abort(window_transaction_handle_t transaction);
+
 void get_screen_info(int *width, int *height, pixel_format_t *format, float *refresh_rate);
+
+bool compositor_stats_get(compositor_stats_t *stats);
+bool window_stats_get(window_handle_t window, window_stats_t *stats);
+void compositor_fps_overlay_set(bool enable);
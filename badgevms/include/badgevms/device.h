@@ -19,6 +19,7 @@
 #include "keyboard.h"
 #include "pathfuncs.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -60,6 +61,8 @@ typedef struct filesystem {
     DIR *(*_opendir)(void *dev, path_t *path);
     struct dirent *(*_readdir)(void *dev, DIR *dirp);
     int (*_closedir)(void *dev, DIR *dirp);
+    // Added last so the earlier members keep their offsets
+    int (*_fsync)(void *dev, int fd);
 } filesystem_device_t;
 
 typedef struct lcd_device {
@@ -67,24 +70,58 @@ typedef struct lcd_device {
     void (*_draw)(void *dev, int x, int y, int w, int h, void *pixels);
     void (*_getfb)(void *dev, int num, void **pixels);
     void (*_set_refresh_cb)(void *dev, void *user_data, void (*callback)(void *user_data));
+    int (*_set_refresh_rate)(void *dev, int hz);
 } lcd_device_t;
 
 typedef struct keyboard_device {
     device_t device;
+    void (*_set_event_cb)(void *dev, void *user_data, void (*callback)(void *user_data));
 } keyboard_device_t;
 
 typedef struct {
     uint8_t address;
 } i2c_scanresult_t;
 
+// Queued I2C transfers run in priority order, a transfer waiting behind
+// higher priorities is only passed over a few times
+typedef enum {
+    I2C_PRIORITY_INPUT,  // Keyboards and other things people wait for
+    I2C_PRIORITY_SENSOR, // Periodic sensor reads
+    I2C_PRIORITY_BULK,   // Everything else
+    I2C_PRIORITY_COUNT,
+} i2c_priority_t;
+
+#define I2C_NO_REGISTER 0xFF
+
+typedef struct {
+    uint8_t  reg; // Register to read or write, I2C_NO_REGISTER for none
+    bool     read;
+    uint16_t len;
+    uint8_t *data;
+} i2c_transaction_t;
+
 typedef struct {
     device_t device;
     uint8_t (*_get_address)(void *dev);
+    // Queues count transactions that run back to back without other queued
+    // transfers in between, and returns right away. The transactions must
+    // stay valid until done is called from the bus task, done must not
+    // block. Destroying the device drops its queued transactions without
+    // calling done.
+    bool (*_submit)(
+        void              *dev,
+        i2c_transaction_t *transactions,
+        int                count,
+        i2c_priority_t     priority,
+        void (*done)(void *user_data, bool ok),
+        void *user_data
+    );
 } i2c_device_t;
 
 typedef struct {
     device_t device;
     int (*_scan)(void *dev, i2c_scanresult_t *results, int num);
+    // clk_speed 0 uses the bus speed, devices can go up to 400kHz
     i2c_device_t *(*_device_create)(void *dev, uint8_t address, uint32_t clk_speed);
 } i2c_bus_device_t;
 
@@ -96,10 +133,22 @@ typedef struct {
     device_t device;
 } socket_device_t;
 
+// Accelerations are in 1/16384 g (+-2 g), rotation rates in 1/16.4 degrees
+// per second (+-2000 dps), both along the sensor's axes
+typedef struct {
+    int64_t timestamp; // Microseconds, the same clock as gettimeofday
+    int16_t acc[3];
+    int16_t gyr[3];
+} imu_sample_t;
+
 typedef struct {
     device_t device;
     orientation_t (*_get_orientation)(void *dev);
     int (*_get_orientation_degrees)(void *dev);
+    // Subscribes to samples at about rate_hz. _read whole imu_sample_t from
+    // the returned device, it never waits and returns 0 if there are no new
+    // ones. _destroy it to unsubscribe.
+    device_t *(*_stream_create)(void *dev, int rate_hz);
 } orientation_device_t;
 
 device_t *device_get(char const *name);
@@ -0,0 +1,36 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+// Maps a whole file into the address space of the process, and stores its
+// size in *size. Processes mapping the same file share one copy of it in a
+// page cache, so a mapping takes none of the process heap. The mapping shows
+// the file as it was when it was mapped. Returns NULL and sets errno on
+// failure.
+//
+// The PSRAM MMU has no read only pages, so nothing stops a write to the
+// mapping. A write changes the shared copy for every process that has the
+// file mapped at the time, and never reaches the file itself. The copy is
+// dropped with the last mapping, so later mappings read the file again. Only
+// ever read through the const pointer.
+void const *file_map(char const *path, size_t *size);
+
+// Unmaps a file mapped by file_map()
+int file_unmap(void const *addr);
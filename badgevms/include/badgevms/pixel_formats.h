@@ -84,6 +84,7 @@ typedef enum {
     BADGEVMS_PIXELFORMAT_NV12         = 0x3231564eu, /**< Planar mode: Y + U/V interleaved  (2 planes) */
     BADGEVMS_PIXELFORMAT_NV21         = 0x3132564eu, /**< Planar mode: Y + V/U interleaved  (2 planes) */
     BADGEVMS_PIXELFORMAT_P010         = 0x30313050u, /**< Planar mode: Y + U/V interleaved  (2 planes) */
+    BADGEVMS_PIXELFORMAT_OUYY_EVYY    = 0x5959554fu, /**< Packed 4:2:0: U0+Y0+Y1 line, V0+Y0+Y1 line (1 plane) */
     BADGEVMS_PIXELFORMAT_EXTERNAL_OES = 0x2053454fu, /**< Android video texture format */
     BADGEVMS_PIXELFORMAT_MJPG         = 0x47504a4du, /**< Motion JPEG */
 } pixel_format_t;
@@ -16,6 +16,7 @@
 
 
 #include "badgevms/process.h"
+#include "badgevms_config.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_system.h"
@@ -217,6 +218,37 @@ int load_config(char const *filename, startup_config_t *config) {
     return 0;
 }
 
+// Leaves *num_fbs alone when the file does not set it
+static void load_display_config(char const *filename, int *num_fbs) {
+    FILE *fp = why_fopen(filename, "r");
+    if (!fp) {
+        return;
+    }
+
+    toml_result_t result = toml_parse_file(fp);
+    why_fclose(fp);
+
+    if (!result.ok) {
+        ESP_LOGW(TAG, "Error parsing %s: %s", filename, result.errmsg);
+        return;
+    }
+
+    toml_datum_t framebuffers = toml_seek(result.toptab, "display.framebuffers");
+    if (framebuffers.type == TOML_INT64) {
+        *num_fbs = (int)framebuffers.u.int64;
+    }
+
+    toml_free(result);
+}
+
+int init_display_framebuffers(void) {
+    int num_fbs = DISPLAY_FRAMEBUFFERS;
+
+    load_display_config("FLASH0:init.toml", &num_fbs);
+    load_display_config("SD0:init.toml", &num_fbs);
+    return num_fbs;
+}
+
 void print_config(startup_config_t const *config) {
     printf("\nStartup Configuration:\n");
     for (size_t i = 0; i < config->count; i++) {
@@ -16,4 +16,9 @@
 
 #pragma once
 
+// Number of panel framebuffers from framebuffers in the [display] table of
+// init.toml, SD0: overriding FLASH0: as for apps. DISPLAY_FRAMEBUFFERS when
+// neither sets it.
+int init_display_framebuffers(void);
+
 void run_init(void);
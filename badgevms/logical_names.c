@@ -39,13 +39,32 @@
 #include "logical_names.h"
 #include "thirdparty/khash.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 
 #include <ctype.h>
 
+#ifdef RUN_TEST
+#include <sched.h>
+#define reader_wait() sched_yield()
+#else
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#define reader_wait() vTaskDelay(1)
+#endif
+
 #define MAX_DIR_DEPTH     25
 #define RESOLVE_MAX_DEPTH 15
 
+// Resolved names are cached per input and search list index. Names or
+// results that don't fit are never cached.
+#define CACHE_SLOTS      64 // Must be a power of two
+#define CACHE_NAME_MAX   64
+#define CACHE_RESULT_MAX 128
+
+// Names looked up while resolving are copied to the stack if they fit
+#define LOOKUP_KEY_MAX 64
+
 typedef struct {
     char  *pointer;
     size_t len;
@@ -78,7 +97,37 @@ static parsed_components_t const parsed_components_null = {
 };
 
 KHASH_MAP_INIT_STR(lnametable, logical_name_target_t);
-static khash_t(lnametable) * logical_name_table;
+typedef khash_t(lnametable) lname_table_t;
+
+// Readers use whatever table is current when they start without taking any
+// lock. Tables are never modified once published; writers publish a modified
+// copy and only free the old table, and the names they removed from it, once
+// every reader that may still be using it has left. Keys and targets that did
+// not change are shared between tables.
+static _Atomic(lname_table_t *) logical_name_table;
+
+// Readers count themselves in the slot of the current phase. A writer moves
+// to the next phase and waits for the old slot to drain, after which nobody
+// can hold a table that was replaced before the phase change.
+static atomic_uint reader_phase;
+static atomic_uint readers[2];
+static atomic_flag writer_busy = ATOMIC_FLAG_INIT;
+
+typedef struct {
+    atomic_flag  busy; // Lookups and stores skip a busy slot rather than wait
+    unsigned int generation;
+    size_t       idx;
+    size_t       result_count;
+    bool         has_result;
+    char         name[CACHE_NAME_MAX];
+    char         result[CACHE_RESULT_MAX];
+} cache_entry_t;
+
+static cache_entry_t cache[CACHE_SLOTS];
+
+// Bumped by every change to the table, which invalidates the whole cache.
+// Starts at 1 so empty slots never match.
+static atomic_uint generation = 1;
 
 static inline bool raw_cmp(raw_string_t *l, raw_string_t *r) {
     if (l->pointer != r->pointer)
@@ -318,7 +367,54 @@ static inline parsed_components_t parse_cstring(char *cstr) {
     return parse_string(str);
 }
 
-static raw_string_t resolve_string(raw_string_t string, size_t idx, int depth) {
+// The string is not NUL terminated, look it up through a terminated copy. Devices
+// are looked up with a ':' appended.
+static logical_name_target_t *table_lookup(lname_table_t *table, raw_string_t string, bool device) {
+    char   stack_key[LOOKUP_KEY_MAX];
+    size_t key_len = string.len + (device ? 1 : 0);
+    char  *key     = stack_key;
+
+    if (key_len >= LOOKUP_KEY_MAX) {
+        key = malloc(key_len + 1);
+        if (!key) {
+            return NULL;
+        }
+    }
+
+    memcpy(key, string.pointer, string.len);
+    if (device) {
+        key[string.len] = ':';
+    }
+    key[key_len] = '\0';
+
+    khint_t k = kh_get(lnametable, table, key);
+    if (key != stack_key) {
+        free(key);
+    }
+
+    if (k == kh_end(table)) {
+        return NULL;
+    }
+    return &kh_val(table, k);
+}
+
+static raw_string_t resolve_string(lname_table_t *table, raw_string_t string, size_t idx, int depth);
+
+static raw_string_t resolve_target(lname_table_t *table, logical_name_target_t *name, size_t idx, int depth) {
+    raw_string_t new_string;
+    if (name->target_count > 1) {
+        // If we see an invalid index just get the first one
+        size_t i         = idx > name->target_count - 1 ? 0 : idx;
+        new_string       = raw_from_cstr((char *)name->target[i], name->terminal);
+        new_string.count = name->target_count;
+        new_string.idx   = idx;
+    } else {
+        new_string = raw_from_cstr((char *)name->target[0], name->terminal);
+    }
+    return resolve_string(table, new_string, idx, ++depth);
+}
+
+static raw_string_t resolve_string(lname_table_t *table, raw_string_t string, size_t idx, int depth) {
     if (string.terminal)
         return string;
 
@@ -326,34 +422,14 @@ static raw_string_t resolve_string(raw_string_t string, size_t idx, int depth) {
         return raw_null;
     }
 
-    // This is safe because we are always pointing into a cstr
-    // the next character is, at worst, already a '\0'
-    char char_bak              = string.pointer[string.len];
-    string.pointer[string.len] = '\0';
-
-    logical_name_target_t *name;
-    khint_t                k = kh_get(lnametable, logical_name_table, string.pointer);
-    if (k == kh_end(logical_name_table)) {
-        string.pointer[string.len] = char_bak; // Restore character
+    logical_name_target_t *name = table_lookup(table, string, false);
+    if (!name) {
         return string;
-    } else {
-        string.pointer[string.len] = char_bak; // Restore character
-        name                       = &kh_val(logical_name_table, k);
-        raw_string_t new_string;
-        if (name->target_count > 1) {
-            // If we see an invalid index just get the first one
-            size_t i         = idx > name->target_count - 1 ? 0 : idx;
-            new_string       = raw_from_cstr((char *)name->target[i], name->terminal);
-            new_string.count = name->target_count;
-            new_string.idx   = idx;
-        } else {
-            new_string = raw_from_cstr((char *)name->target[0], name->terminal);
-        }
-        return resolve_string(new_string, idx, ++depth);
     }
+    return resolve_target(table, name, idx, depth);
 }
 
-static raw_string_t resolve_device_string(raw_string_t string, size_t idx, int depth) {
+static raw_string_t resolve_device_string(lname_table_t *table, raw_string_t string, size_t idx, int depth) {
     if (string.terminal)
         return string;
 
@@ -363,41 +439,34 @@ static raw_string_t resolve_device_string(raw_string_t string, size_t idx, int d
 
     // Special case for devices. Once we have a valid device path we don't
     // actually know whether the logical name is for DEVICE or DEVICE:
-    // so we need to try both. We can rely on the fact that the input string
-    // must have contained a ':' at some point, so there is definitely enough
-    // space.
-
-    char char_bak               = string.pointer[string.len];
-    string.pointer[string.len]  = ':';
-    string.len                 += 1;
-
-    raw_string_t new_string = resolve_string(string, idx, depth);
-
-    if (raw_cmp(&string, &new_string)) {
-        // This didn't work. Try without the ':'
-        string.len                 -= 1;
-        string.pointer[string.len]  = char_bak;
-        return resolve_string(string, idx, depth);
-    }
-
+    // so we need to try both.
+    //
     // Don't strip any trailing ':', this avoids trouble if both DEVICE
     // and DEVICE: are defined
-    return new_string;
+    logical_name_target_t *name = table_lookup(table, string, true);
+    if (name) {
+        return resolve_target(table, name, idx, depth);
+    }
+
+    // This didn't work. Try without the ':'
+    return resolve_string(table, string, idx, depth);
 }
 
-static parsed_components_t _logical_name_resolve(parsed_components_t path, size_t list_idx, int depth) {
+static parsed_components_t _logical_name_resolve(
+    lname_table_t *table, parsed_components_t path, size_t list_idx, int depth
+) {
     if (depth > RESOLVE_MAX_DEPTH) {
         return parsed_components_null;
     }
 
     if (path.unparsable.len) {
         // Just a string
-        raw_string_t res = resolve_string(path.unparsable, 0, depth + 1);
+        raw_string_t res = resolve_string(table, path.unparsable, 0, depth + 1);
         if (res.count > 1) {
             if (path.count == 1) {
                 // Set the result count to our first list
                 path.count = res.count;
-                res        = resolve_string(path.unparsable, list_idx, depth + 1);
+                res        = resolve_string(table, path.unparsable, list_idx, depth + 1);
             }
         }
 
@@ -410,19 +479,19 @@ static parsed_components_t _logical_name_resolve(parsed_components_t path, size_
         parsed_components_t new_path = parse_string(res);
         // Make sure we don't lose our result count
         new_path.count               = path.count;
-        return (_logical_name_resolve(new_path, 0, depth + 1));
+        return (_logical_name_resolve(table, new_path, 0, depth + 1));
     }
 
     parsed_components_t orig_path = path;
 
     // Actual path of some kind
-    raw_string_t new_device = resolve_device_string(path.device, 0, depth + 1);
+    raw_string_t new_device = resolve_device_string(table, path.device, 0, depth + 1);
     if (new_device.count > 1) {
         if (path.count == 1) {
             // Set the result count to our first list
             path.count = new_device.count;
             // Re-resolve using the first list, only the first time
-            new_device = resolve_device_string(path.device, list_idx, depth + 1);
+            new_device = resolve_device_string(table, path.device, list_idx, depth + 1);
         }
     }
 
@@ -460,21 +529,176 @@ static parsed_components_t _logical_name_resolve(parsed_components_t path, size_
         }
     }
 
-    path.filename = resolve_string(path.filename, 0, depth + 1);
+    path.filename = resolve_string(table, path.filename, 0, depth + 1);
     for (int i = 0; i < path.dir_count; ++i) {
-        path.dir_components[i] = resolve_string(path.dir_components[i], 0, depth + 1);
+        path.dir_components[i] = resolve_string(table, path.dir_components[i], 0, depth + 1);
     }
 
     if (path_cmp(&orig_path, &path)) {
         return path;
     }
 
-    return _logical_name_resolve(path, list_idx, depth + 1);
+    return _logical_name_resolve(table, path, list_idx, depth + 1);
+}
+
+static cache_entry_t *cache_slot(char const *name, size_t idx) {
+    uint32_t hash = 2166136261u;
+    for (char const *c = name; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    hash ^= idx * 0x9E3779B1u;
+    return &cache[hash & (CACHE_SLOTS - 1)];
+}
+
+static bool cache_lookup(char const *name, size_t idx, logical_name_result_t *result) {
+    cache_entry_t *entry = cache_slot(name, idx);
+    char           buffer[CACHE_RESULT_MAX];
+    bool           hit = false;
+
+    if (atomic_flag_test_and_set_explicit(&entry->busy, memory_order_acquire)) {
+        return false;
+    }
+    if (entry->generation == atomic_load(&generation) && entry->idx == idx && strcmp(entry->name, name) == 0) {
+        hit                  = true;
+        result->result_count = entry->result_count;
+        if (entry->has_result) {
+            strcpy(buffer, entry->result);
+        }
+    }
+    bool has_result = entry->has_result;
+    atomic_flag_clear_explicit(&entry->busy, memory_order_release);
+
+    if (hit) {
+        result->result = has_result ? strdup(buffer) : NULL;
+    }
+    return hit;
+}
+
+// resolved_generation is the generation from before resolving, so a result
+// that raced with a change to the table is never used
+static void cache_store(
+    char const *name, size_t idx, unsigned int resolved_generation, logical_name_result_t const *result
+) {
+    if (strlen(name) >= CACHE_NAME_MAX || (result->result && strlen(result->result) >= CACHE_RESULT_MAX)) {
+        return;
+    }
+
+    cache_entry_t *entry = cache_slot(name, idx);
+    if (atomic_flag_test_and_set_explicit(&entry->busy, memory_order_acquire)) {
+        return;
+    }
+    entry->generation   = resolved_generation;
+    entry->idx          = idx;
+    entry->result_count = result->result_count;
+    entry->has_result   = result->result != NULL;
+    strcpy(entry->name, name);
+    if (result->result) {
+        strcpy(entry->result, result->result);
+    }
+    atomic_flag_clear_explicit(&entry->busy, memory_order_release);
+}
+
+// Returns the phase to hand to read_unlock()
+static unsigned int read_lock() {
+    while (true) {
+        unsigned int phase = atomic_load(&reader_phase);
+        atomic_fetch_add(&readers[phase & 1], 1);
+        if (atomic_load(&reader_phase) == phase) {
+            return phase;
+        }
+        // A writer moved on in between and may not be waiting for this slot
+        atomic_fetch_sub(&readers[phase & 1], 1);
+    }
+}
+
+static void read_unlock(unsigned int phase) {
+    atomic_fetch_sub(&readers[phase & 1], 1);
+}
+
+static void write_lock() {
+    while (atomic_flag_test_and_set(&writer_busy)) {
+        reader_wait();
+    }
+}
+
+static void write_unlock() {
+    atomic_flag_clear(&writer_busy);
+}
+
+// Returns once no reader can still be using a table that was replaced before
+// the call
+static void wait_for_readers() {
+    unsigned int phase = atomic_fetch_add(&reader_phase, 1);
+    while (atomic_load(&readers[phase & 1])) {
+        reader_wait();
+    }
+}
+
+static void target_free(logical_name_target_t target) {
+    for (size_t i = 0; i < target.target_count; ++i) {
+        free(target.target[i]);
+    }
+    free(target.target);
+}
+
+// Publishes a copy of the table with logical_name set to target, or removed if
+// target is NULL. Returns false if there was nothing to remove.
+static bool table_replace(char const *logical_name, logical_name_target_t const *target) {
+    char *key = NULL;
+    if (target) {
+        key = strdup(logical_name);
+        if (!key) {
+            return false;
+        }
+    }
+
+    write_lock();
+
+    lname_table_t        *old_table  = atomic_load(&logical_name_table);
+    lname_table_t        *new_table  = kh_init(lnametable);
+    char const           *old_key    = NULL;
+    logical_name_target_t old_target = {NULL, 0, false};
+
+    kh_resize(lnametable, new_table, kh_size(old_table) + 1);
+    for (khint_t i = kh_begin(old_table); i != kh_end(old_table); ++i) {
+        if (!kh_exist(old_table, i)) {
+            continue;
+        }
+
+        char const           *name  = kh_key(old_table, i);
+        logical_name_target_t value = kh_val(old_table, i);
+        if (strcmp(name, logical_name) == 0) {
+            old_key    = name;
+            old_target = value;
+            continue;
+        }
+        khash_insert_str(lnametable, new_table, name, value, char const *);
+    }
+
+    if (!target && !old_key) {
+        write_unlock();
+        kh_destroy(lnametable, new_table);
+        return false;
+    }
+
+    if (target) {
+        khash_insert_str(lnametable, new_table, key, *target, char const *);
+    }
+
+    atomic_store(&logical_name_table, new_table);
+    atomic_fetch_add(&generation, 1);
+    wait_for_readers();
+    write_unlock();
+
+    kh_destroy(lnametable, old_table);
+    free((char *)old_key);
+    target_free(old_target);
+    return true;
 }
 
 bool logical_names_system_init() {
     ESP_LOGI(TAG, "Initializing");
-    logical_name_table = kh_init(lnametable);
+    atomic_store(&logical_name_table, kh_init(lnametable));
     return true;
 }
 
@@ -519,8 +743,7 @@ int logical_name_set(char const *logical_name, char const *target, bool is_termi
             size_t component_size = end - last_name;
             if (component_size && component_size <= name_size) {
                 // Copy the string so we won't have to copy it later when resolving
-                // and add 1 more byte because we might need to resolve it as a device
-                char *t = malloc(component_size + 2);
+                char *t = malloc(component_size + 1);
                 memcpy(t, target + last_name, component_size);
                 t[component_size]              = '\0';
                 name.target[name.target_count] = t;
@@ -532,27 +755,32 @@ int logical_name_set(char const *logical_name, char const *target, bool is_termi
 
     name.terminal = is_terminal;
 
-    if (name.target_count) {
-        khash_insert_str(lnametable, logical_name_table, logical_name, name, char const *);
+    if (name.target_count && table_replace(logical_name, &name)) {
         return 0;
     }
 
-    free(name.target);
+    target_free(name);
     return 1;
 }
 
 logical_name_target_t logical_name_get(char const *logical_name) {
-    khint_t k = kh_get(lnametable, logical_name_table, logical_name);
-    if (k == kh_end(logical_name_table)) {
-        logical_name_target_t res = {NULL, 0, false};
-        return res;
-    } else {
-        return kh_val(logical_name_table, k);
+    logical_name_target_t res   = {NULL, 0, false};
+    unsigned int          phase = read_lock();
+    lname_table_t        *table = atomic_load(&logical_name_table);
+
+    khint_t k = kh_get(lnametable, table, logical_name);
+    if (k != kh_end(table)) {
+        res = kh_val(table, k);
     }
+
+    read_unlock(phase);
+    return res;
 }
 
 void logical_name_del(char const *logical_name) {
-    khash_del_str(lnametable, logical_name_table, logical_name, "Logical name did not exist");
+    if (!table_replace(logical_name, NULL)) {
+        ESP_LOGE(TAG, "Logical name did not exist: %s", logical_name);
+    }
 }
 
 logical_name_result_t logical_name_resolve(char *logical_name, size_t idx) {
@@ -563,19 +791,29 @@ logical_name_result_t logical_name_resolve(char *logical_name, size_t idx) {
         result.result       = NULL;
         goto out;
     }
-    parsed_components_t parsed = _logical_name_resolve(parse_cstring(logical_name), idx, 0);
-    result.result              = parsed_components_serialize(parsed);
-    result.result_count        = parsed.count;
+
+    if (cache_lookup(logical_name, idx, &result)) {
+        goto out;
+    }
+
+    // The results point into the table until they are serialized
+    unsigned int        resolved_generation = atomic_load(&generation);
+    unsigned int        phase               = read_lock();
+    lname_table_t      *table               = atomic_load(&logical_name_table);
+    parsed_components_t parsed              = _logical_name_resolve(table, parse_cstring(logical_name), idx, 0);
+    result.result                           = parsed_components_serialize(parsed);
+    result.result_count                     = parsed.count;
+    read_unlock(phase);
+
+    cache_store(logical_name, idx, resolved_generation, &result);
 
 out:
     return result;
 }
 
 logical_name_result_t logical_name_resolve_const(char const *logical_name, size_t idx) {
-    char                 *tmp    = strdup(logical_name);
-    logical_name_result_t result = logical_name_resolve(tmp, idx);
-    free(tmp);
-    return result;
+    // Resolving never writes to the name
+    return logical_name_resolve((char *)logical_name, idx);
 }
 
 void logical_name_result_free(logical_name_result_t result) {
@@ -583,6 +821,8 @@ void logical_name_result_free(logical_name_result_t result) {
 }
 
 #ifdef RUN_TEST
+#include <pthread.h>
+#include <time.h>
 
 typedef struct {
     char const *in;
@@ -657,6 +897,77 @@ test_t tests[] = {
     {NULL, NULL, 0, 0},
 };
 
+#define STRESS_READERS 3
+#define STRESS_WRITES  2000
+
+static atomic_bool stress_done;
+static atomic_uint stress_errors;
+static atomic_uint stress_resolves;
+
+// Every result must come from one consistent version of STRESS
+static void *stress_reader(void *arg) {
+    (void)arg;
+    char name[64];
+    char expect[3][64];
+
+    for (unsigned int i = 0; !atomic_load(&stress_done); ++i) {
+        snprintf(name, sizeof(name), "STRESS:[sub]file%u.txt", i % 100);
+        snprintf(expect[0], sizeof(expect[0]), "SD0:[a.sub]file%u.txt", i % 100);
+        snprintf(expect[1], sizeof(expect[1]), "SD0:[b.sub]file%u.txt", i % 100);
+        snprintf(expect[2], sizeof(expect[2]), "%s", name);
+
+        logical_name_result_t res = logical_name_resolve_const(name, 0);
+        bool                  ok  = res.result && ((res.result_count == 1 && strcmp(res.result, expect[0]) == 0) ||
+                                     (res.result_count == 2 && strcmp(res.result, expect[1]) == 0) ||
+                                     (res.result_count == 1 && strcmp(res.result, expect[2]) == 0));
+        if (!ok) {
+            printf("\033[31m%s resolved to '%s' (%zu)\033[0m\n", name, res.result, res.result_count);
+            atomic_fetch_add(&stress_errors, 1);
+        }
+        free(res.result);
+        atomic_fetch_add(&stress_resolves, 1);
+
+        if (i % 16 == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *stress_writer(void *arg) {
+    int id = *(int *)arg;
+
+    for (int i = 0; i < STRESS_WRITES; ++i) {
+        if (id == 0) {
+            switch (i % 3) {
+                case 0: logical_name_set("STRESS", "SD0:[a]", false); break;
+                case 1: logical_name_set("STRESS", "SD0:[b], FLASH0:[c]", false); break;
+                default: logical_name_del("STRESS"); break;
+            }
+        } else {
+            // Unrelated names, which still make every other one move to a new table
+            char noise[16];
+            snprintf(noise, sizeof(noise), "NOISE%d", i % 8);
+            if (i % 16 < 8) {
+                logical_name_set(noise, "SD0:[noise]", false);
+            } else {
+                logical_name_del(noise);
+            }
+        }
+        sched_yield();
+    }
+    return NULL;
+}
+
+static atomic_bool held_write_done;
+
+static void *held_writer(void *arg) {
+    (void)arg;
+    logical_name_set("HELD", "SD0:[new]", false);
+    atomic_store(&held_write_done, true);
+    return NULL;
+}
+
 int main() {
     logical_names_system_init();
 
@@ -753,18 +1064,154 @@ int main() {
         ++test;
     }
 
+    // Resolving again comes from the cache and gives the same results
+    for (int pass = 0; pass < 2; ++pass) {
+        for (test = tests; test->in; ++test) {
+            res = logical_name_resolve_const(test->in, test->idx);
+            if (res.result_count != test->expect_count ||
+                (test->expect && (!res.result || strcmp(test->expect, res.result) != 0))) {
+                printf("\033[31mCached result for '%s' is '%s'\033[0m\n", test->in, res.result);
+                error = true;
+            }
+            free(res.result);
+        }
+    }
+    res = logical_name_resolve_const("USER:file.txt", 0);
+    free(res.result);
+    cache_entry_t *entry = cache_slot("USER:file.txt", 0);
+    if (entry->generation != atomic_load(&generation) || strcmp(entry->name, "USER:file.txt") != 0) {
+        printf("\033[31mUSER:file.txt was not cached\033[0m\n");
+        error = true;
+    }
+
+    // Changing any name invalidates results that went through it
+    char const *invalidation[][3] = {
+        // Name, new target (NULL to delete), expected result for USER:file.txt
+        {"FLASH0", "OTHERFLASH", "OTHERFLASH:[dira]file.txt"},
+        {"USER", "FLASH0:[dirb.dirc]", "OTHERFLASH:[dirb.dirc]file.txt"},
+        {"OTHERFLASH", "SD0:", "SD0:[dirb.dirc]file.txt"},
+        {"OTHERFLASH", NULL, "OTHERFLASH:[dirb.dirc]file.txt"},
+        {"USER", NULL, "USER:file.txt"},
+    };
+    for (size_t i = 0; i < sizeof(invalidation) / sizeof(invalidation[0]); ++i) {
+        res = logical_name_resolve_const("USER:file.txt", 0);
+        free(res.result);
+        if (invalidation[i][1]) {
+            logical_name_set(invalidation[i][0], invalidation[i][1], false);
+        } else {
+            logical_name_del(invalidation[i][0]);
+        }
+        res = logical_name_resolve_const("USER:file.txt", 0);
+        if (!res.result || strcmp(res.result, invalidation[i][2]) != 0) {
+            printf(
+                "\033[31mAfter changing %s got '%s', expected '%s'\033[0m\n",
+                invalidation[i][0],
+                res.result,
+                invalidation[i][2]
+            );
+            error = true;
+        }
+        free(res.result);
+    }
+
+    // Search lists resolve per index
+    logical_name_set("APPS:", "SD0:[BADGEVMS.APPS], FLASH0:[BADGEVMS.APPS]", false);
+    char const *apps[] = {"SD0:[BADGEVMS.APPS]HELLO.ELF", "OTHERFLASH:[BADGEVMS.APPS]HELLO.ELF"};
+    for (int i = 0; i < 4; ++i) {
+        res = logical_name_resolve_const("APPS:HELLO.ELF", i % 2);
+        if (res.result_count != 2 || !res.result || strcmp(res.result, apps[i % 2]) != 0) {
+            printf("\033[31mAPPS:HELLO.ELF[%d] is '%s'\033[0m\n", i % 2, res.result);
+            error = true;
+        }
+        free(res.result);
+    }
+
+    // A writer does not free a table while a reader still holds it
+    logical_name_set("HELD", "SD0:[old]", false);
+
+    pthread_t      held_thread;
+    unsigned int   phase     = read_lock();
+    lname_table_t *held      = atomic_load(&logical_name_table);
+    khint_t        held_name = kh_get(lnametable, held, "HELD");
+
+    pthread_create(&held_thread, NULL, held_writer, NULL);
+    for (int i = 0; i < 1000; ++i) {
+        sched_yield();
+    }
+    if (atomic_load(&held_write_done) || strcmp(kh_val(held, held_name).target[0], "SD0:[old]") != 0) {
+        printf("\033[31mThe table was replaced under a reader\033[0m\n");
+        error = true;
+    }
+    read_unlock(phase);
+    pthread_join(held_thread, NULL);
+
+    res = logical_name_resolve_const("HELD:", 0);
+    if (!res.result || strcmp(res.result, "SD0:[new]") != 0) {
+        printf("\033[31mHELD: resolved to '%s' after the writer finished\033[0m\n", res.result);
+        error = true;
+    }
+    free(res.result);
+
+    // Concurrent readers and writers
+    pthread_t readers_threads[STRESS_READERS];
+    pthread_t writer_threads[2];
+    int       writer_ids[2] = {0, 1};
+
+    logical_name_del("FLASH0");
+    for (int i = 0; i < STRESS_READERS; ++i) {
+        pthread_create(&readers_threads[i], NULL, stress_reader, NULL);
+    }
+    for (int i = 0; i < 2; ++i) {
+        pthread_create(&writer_threads[i], NULL, stress_writer, &writer_ids[i]);
+    }
+    for (int i = 0; i < 2; ++i) {
+        pthread_join(writer_threads[i], NULL);
+    }
+    atomic_store(&stress_done, true);
+    for (int i = 0; i < STRESS_READERS; ++i) {
+        pthread_join(readers_threads[i], NULL);
+    }
+    printf(
+        "%u resolves during %d table changes, %u wrong\n",
+        atomic_load(&stress_resolves),
+        STRESS_WRITES * 2,
+        atomic_load(&stress_errors)
+    );
+    if (atomic_load(&stress_errors) || atomic_load(&readers[0]) || atomic_load(&readers[1])) {
+        error = true;
+    }
+    logical_name_set("FLASH0", "OTHERFLASH", false);
+
+    // Benchmark resolving both elements of a search list, cached and not
+    struct timespec start, end;
+    int const       iterations = 100000;
+    double          ns[2];
+    for (int cached = 0; cached < 2; ++cached) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < iterations; ++i) {
+            if (!cached) {
+                atomic_fetch_add(&generation, 1);
+            }
+            res = logical_name_resolve_const("APPS:HELLO.ELF", i & 1);
+            free(res.result);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[cached] = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+    }
+    printf("Resolving APPS:HELLO.ELF takes %.0fns, %.0fns cached\n", ns[0], ns[1]);
+
     if (!error) {
         printf("\033[32mAll tests passed\033[0m\n");
     }
 
+    lname_table_t        *table = atomic_load(&logical_name_table);
+    char const           *key;
     logical_name_target_t x;
-    kh_foreach_value(logical_name_table, x, {
-        for (size_t i = 0; i < x.target_count; ++i) {
-            free((void *)x.target[i]);
-        }
-        free((void *)x.target);
+    kh_foreach(table, key, x, {
+        free((char *)key);
+        target_free(x);
     });
-    kh_destroy(lnametable, logical_name_table);
+    kh_destroy(lnametable, table);
 
     if (error)
         return 1;
@@ -31,6 +31,8 @@ typedef struct {
     bool   terminal;
 } logical_name_target_t;
 
+// Resolving is safe from any task while names change. The targets returned by
+// logical_name_get() stay valid until that name is set again or deleted.
 bool                  logical_names_system_init();
 int                   logical_name_set(char const *logical_name, char const *target, bool is_terminal);
 logical_name_target_t logical_name_get(char const *logical_name);
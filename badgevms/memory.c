@@ -214,6 +214,22 @@ __attribute__((always_inline)) static inline void
     }
 }
 
+// Overwrite the entries of an already mapped region, no unmap pass needed
+__attribute__((always_inline)) static inline void
+    why_mmu_hal_remap_region(uint32_t mmu_id, uint32_t vaddr, uint32_t paddr, uint32_t len) {
+    uint32_t page_size_in_bytes = why_mmu_hal_pages_to_bytes(mmu_id, 1);
+    uint32_t page_num           = (len + page_size_in_bytes - 1) / page_size_in_bytes;
+    uint32_t mmu_val            = mmu_ll_format_paddr(mmu_id, paddr, MMU_TARGET_PSRAM0);
+
+    while (page_num) {
+        mmu_ll_write_entry(mmu_id, mmu_ll_get_entry_id(mmu_id, vaddr), mmu_val, MMU_TARGET_PSRAM0);
+
+        vaddr += page_size_in_bytes;
+        mmu_val++;
+        page_num--;
+    }
+}
+
 __attribute__((always_inline)) static inline void
     map_regions(allocation_range_t *head_range, allocation_range_t *tail_range) {
     uint32_t            mmu_id     = mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
@@ -243,6 +259,28 @@ __attribute__((always_inline)) static inline void
     invalidate_caches(start, total_size);
 }
 
+// A process can write to its file pages like any other page, unmap_file_pages()
+// writes those lines back, so mapping only needs the stale lines dropped
+__attribute__((always_inline)) static inline void
+    map_file_pages(uint32_t mmu_id, page_cache_mapping_t const *mapping) {
+    for (size_t i = 0; i < mapping->file->num_pages; ++i) {
+        why_mmu_hal_map_region(
+            mmu_id,
+            MMU_TARGET_PSRAM0,
+            mapping->vaddr + i * SOC_MMU_PAGE_SIZE,
+            mapping->file->pages[i],
+            SOC_MMU_PAGE_SIZE
+        );
+    }
+    invalidate_caches(mapping->vaddr, mapping->file->num_pages * SOC_MMU_PAGE_SIZE);
+}
+
+__attribute__((always_inline)) static inline void
+    unmap_file_pages(uint32_t mmu_id, page_cache_mapping_t const *mapping) {
+    writeback_caches(mapping->vaddr, mapping->file->num_pages * SOC_MMU_PAGE_SIZE);
+    why_mmu_hal_unmap_region(mmu_id, mapping->vaddr, mapping->file->num_pages * SOC_MMU_PAGE_SIZE);
+}
+
 IRAM_ATTR void remap_task(task_info_t *task_info) {
     if (current_mapped_task) {
         ESP_DRAM_LOGE(DRAM_STR("map_task"), "Expected task %u but actual current task is %u", 0, current_mapped_task);
@@ -260,6 +298,11 @@ IRAM_ATTR void remap_task(task_info_t *task_info) {
 
     // Invalidate all caches at once
     invalidate_caches(task_info->thread->start, task_info->thread->size);
+
+    page_cache_space_t const *space = &task_info->thread->mappings;
+    for (size_t i = 0; i < space->count; ++i) {
+        map_file_pages(mmu_id, &space->mappings[i]);
+    }
     current_mapped_task = task_info->pid;
     critical_exit();
 }
@@ -276,8 +319,9 @@ void IRAM_ATTR unmap_task(task_info_t *task_info) {
     }
 
     // esp_rom_printf("Unmappingg %u\n", task_info->pid);
-    allocation_range_t *r = task_info->thread->pages;
-    if (!r) {
+    allocation_range_t       *r     = task_info->thread->pages;
+    page_cache_space_t const *space = &task_info->thread->mappings;
+    if (!r && !space->count) {
         // Nothing to do, whatever is in ram is still in ram
         goto out;
     }
@@ -291,6 +335,10 @@ void IRAM_ATTR unmap_task(task_info_t *task_info) {
         why_mmu_hal_unmap_region(mmu_id, r->vaddr_start, r->size);
         r = r->next;
     }
+
+    for (size_t i = 0; i < space->count; ++i) {
+        unmap_file_pages(mmu_id, &space->mappings[i]);
+    }
     critical_exit();
 out:
     current_mapped_task = 0;
@@ -433,6 +481,87 @@ void IRAM_ATTR framebuffer_unmap_pages(allocation_range_t *head_range) {
     critical_exit();
 }
 
+// Exchange the pages behind two framebuffers of the same size. The caller has
+// already swapped the vaddr_start of both range lists, every entry involved is
+// mapped before and after, so both lists are rewritten in place in a single
+// critical section instead of an unmap and map pass per framebuffer.
+void IRAM_ATTR framebuffer_swap_pages(allocation_range_t *head_a, allocation_range_t *head_b) {
+    uint32_t            mmu_id = why_mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
+    allocation_range_t *r;
+
+    critical_enter();
+    for (r = head_a; r; r = r->next) {
+        why_mmu_hal_remap_region(mmu_id, r->vaddr_start, r->paddr_start, r->size);
+    }
+    for (r = head_b; r; r = r->next) {
+        why_mmu_hal_remap_region(mmu_id, r->vaddr_start, r->paddr_start, r->size);
+    }
+    critical_exit();
+}
+
+// Maps a page at one of the kernel windows, PAGE_CACHE_WINDOW or
+// RAMDISK_WINDOW. Each window has one user that serializes its use.
+void *page_window_map(uintptr_t window, uintptr_t paddr) {
+    uint32_t mmu_id = why_mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
+
+    critical_enter();
+    why_mmu_hal_map_region(mmu_id, MMU_TARGET_PSRAM0, window, paddr, SOC_MMU_PAGE_SIZE);
+    invalidate_caches(window, SOC_MMU_PAGE_SIZE);
+    critical_exit();
+
+    return (void *)window;
+}
+
+void page_window_unmap(uintptr_t window) {
+    uint32_t mmu_id = why_mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
+
+    critical_enter();
+    writeback_caches(window, SOC_MMU_PAGE_SIZE);
+    why_mmu_hal_unmap_region(mmu_id, window, SOC_MMU_PAGE_SIZE);
+    critical_exit();
+}
+
+// Maps a file below the ones the task already has mapped, a guard page above
+// the heap. Returns the vaddr, 0 if there is no room.
+uintptr_t file_pages_map(task_info_t *task_info, page_cache_file_t *file) {
+    task_thread_t *thread = task_info->thread;
+    uint32_t       mmu_id = why_mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
+
+    // Finding the room and taking it in one go keeps sbrk() out of it
+    critical_enter();
+    uintptr_t vaddr = page_cache_space_find(
+        &thread->mappings,
+        SOC_MMU_PAGE_SIZE,
+        file->num_pages,
+        thread->end + SOC_MMU_PAGE_SIZE,
+        SOC_EXTRAM_HIGH
+    );
+    if (vaddr && page_cache_space_insert(&thread->mappings, vaddr, file)) {
+        page_cache_mapping_t mapping = {.vaddr = vaddr, .file = file};
+        map_file_pages(mmu_id, &mapping);
+    } else {
+        vaddr = 0;
+    }
+    critical_exit();
+
+    return vaddr;
+}
+
+// Returns the file that was mapped at vaddr, NULL if none was
+page_cache_file_t *file_pages_unmap(task_info_t *task_info, uintptr_t vaddr) {
+    uint32_t mmu_id = why_mmu_hal_get_id_from_target(MMU_TARGET_PSRAM0);
+
+    critical_enter();
+    page_cache_file_t *file = page_cache_space_remove(&task_info->thread->mappings, vaddr);
+    if (file) {
+        page_cache_mapping_t mapping = {.vaddr = vaddr, .file = file};
+        unmap_file_pages(mmu_id, &mapping);
+    }
+    critical_exit();
+
+    return file;
+}
+
 void IRAM_ATTR NOINLINE_ATTR *why_sbrk(intptr_t increment) {
     task_info_t *task_info = get_task_info();
     uintptr_t    old       = task_info->thread->end;
@@ -445,7 +574,13 @@ void IRAM_ATTR NOINLINE_ATTR *why_sbrk(intptr_t increment) {
         // Allocating new pages
         uintptr_t vaddr_start = task_info->thread->end;
 
-        if (vaddr_start + increment > SOC_EXTRAM_HIGH) {
+        // Mapped files start a guard page above the heap
+        uintptr_t limit = SOC_EXTRAM_HIGH;
+        if (task_info->thread->mappings.count) {
+            limit = page_cache_space_lowest(&task_info->thread->mappings, limit) - SOC_MMU_PAGE_SIZE;
+        }
+
+        if (vaddr_start + increment > limit) {
             goto error;
         }
 
@@ -16,8 +16,10 @@
 
 #pragma once
 
+#include "allocation_range.h"
 #include "buddy_alloc.h"
 #include "esp_log.h"
+#include "page_cache.h"
 #include "soc/soc.h"
 #include "thirdparty/dlmalloc.h"
 
@@ -30,11 +32,16 @@
  * SOC_EXTRAM_LOW + 5MB
  * ...                      Framebuffers
  * SOC_EXTRAM_LOW + 30MB
+ * ...                      Page cache fill window
+ * SOC_EXTRAM_LOW + 30MB + 1 page
+ * ...                      RAM disk window
+ * SOC_EXTRAM_LOW + 30MB + 2 pages
  * ...                      Unused
  * SOC_EXTRAM_LOW + 32MB - 1 page
  * ...                      Guard page
  * SOC_EXTRAM_LOW + 32MB
- * ...                      User applications
+ * ...                      User applications, heap from the bottom up and
+ *                          mapped files from the top down
  * SOC_EXTRAM_HIGH
  */
 
@@ -50,6 +57,10 @@
 #define FRAMEBUFFER_HEAP_START ((SOC_EXTRAM_LOW + (1024 * 1024 * 5)) & ~(SOC_MMU_PAGE_SIZE - 1))
 #define FRAMEBUFFERS_START     FRAMEBUFFFER_HEAP_START + SOC_MMU_PAGE_SIZE
 
+// Pages the kernel maps physical pages at to reach them, one page each
+#define PAGE_CACHE_WINDOW ((SOC_EXTRAM_LOW + (1024 * 1024 * 30)) & ~(SOC_MMU_PAGE_SIZE - 1))
+#define RAMDISK_WINDOW    (PAGE_CACHE_WINDOW + SOC_MMU_PAGE_SIZE)
+
 #define ADDR_TO_PADDR(a) (a - VADDR_START)
 #define PADDR_TO_ADDR(a) (a + VADDR_START)
 
@@ -57,13 +68,6 @@
 #error "Kernel Heap overlaps with largest possible user program"
 #endif
 
-typedef struct allocation_range_s {
-    uintptr_t                  vaddr_start;
-    uintptr_t                  paddr_start;
-    size_t                     size;
-    struct allocation_range_s *next;
-} allocation_range_t;
-
 typedef struct task_info task_info_t;
 
 void     *why_sbrk(intptr_t increment);
@@ -79,10 +83,17 @@ uintptr_t framebuffer_vaddr_allocate(size_t size, size_t *out_pages);
 void      framebuffer_vaddr_deallocate(uintptr_t start_address);
 void      framebuffer_map_pages(allocation_range_t *head_range, allocation_range_t *tail_range);
 void      framebuffer_unmap_pages(allocation_range_t *head_range);
+void      framebuffer_swap_pages(allocation_range_t *head_a, allocation_range_t *head_b);
 size_t    get_free_psram_pages();
 size_t    get_total_psram_pages();
 size_t    get_free_framebuffer_pages();
 size_t    get_total_framebuffer_pages();
 
+// Page cache pages, filled through a kernel window and mapped into the current task
+void              *page_window_map(uintptr_t window, uintptr_t paddr);
+void               page_window_unmap(uintptr_t window);
+uintptr_t          file_pages_map(task_info_t *task_info, page_cache_file_t *file);
+page_cache_file_t *file_pages_unmap(task_info_t *task_info, uintptr_t vaddr);
+
 void memory_init();
 void dump_mmu();
@@ -195,8 +195,10 @@ IRAM_ATTR void __wrap_heap_caps_aligned_free(void *ptr) {
 
 IRAM_ATTR void *__wrap_heap_caps_aligned_calloc(size_t alignment, size_t n, size_t size, uint32_t caps) {
     if (caps & MALLOC_CAP_SPIRAM) {
+        if (size && n > SIZE_MAX / size)
+            return NULL;
         xSemaphoreTake(heap_caps_lock, portMAX_DELAY);
-        void *ptr = dlmemalign(alignment, size);
+        void *ptr = dlmemalign(alignment, n * size);
         xSemaphoreGive(heap_caps_lock);
         if (ptr)
             memset(ptr, 0, n * size);
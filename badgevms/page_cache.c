@@ -0,0 +1,548 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "page_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void page_cache_init(page_cache_t *cache, page_cache_ops_t const *ops, void *context, size_t page_size) {
+    memset(cache, 0, sizeof(page_cache_t));
+    cache->ops       = ops;
+    cache->context   = context;
+    cache->page_size = page_size;
+}
+
+static void free_file(page_cache_t *cache, page_cache_file_t *file) {
+    for (size_t i = 0; i < file->num_pages; ++i) {
+        if (file->pages[i]) {
+            cache->ops->page_free(cache->context, file->pages[i]);
+        }
+    }
+    free(file->pages);
+    free(file->path);
+    free(file);
+}
+
+static void remove_at(page_cache_t *cache, size_t i) {
+    --cache->count;
+    memmove(&cache->files[i], &cache->files[i + 1], (cache->count - i) * sizeof(page_cache_file_t *));
+}
+
+void page_cache_clear(page_cache_t *cache) {
+    for (size_t i = 0; i < cache->count; ++i) {
+        free_file(cache, cache->files[i]);
+    }
+    free(cache->files);
+    cache->files    = NULL;
+    cache->count    = 0;
+    cache->capacity = 0;
+}
+
+static page_cache_file_t *read_file(page_cache_t *cache, char const *path, size_t size, int64_t mtime, void *source) {
+    page_cache_file_t *file = calloc(1, sizeof(page_cache_file_t));
+    if (!file) {
+        return NULL;
+    }
+
+    file->size      = size;
+    file->mtime     = mtime;
+    file->num_pages = (size + cache->page_size - 1) / cache->page_size;
+    file->path      = strdup(path);
+    file->pages     = calloc(file->num_pages, sizeof(uintptr_t));
+    if (!file->path || !file->pages) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < file->num_pages; ++i) {
+        size_t offset = i * cache->page_size;
+        size_t len    = size - offset < cache->page_size ? size - offset : cache->page_size;
+
+        file->pages[i] = cache->ops->page_allocate(cache->context);
+        if (!file->pages[i] || !cache->ops->fill(source, file->pages[i], offset, len)) {
+            goto error;
+        }
+    }
+    return file;
+
+error:
+    free_file(cache, file);
+    return NULL;
+}
+
+page_cache_file_t *page_cache_acquire(page_cache_t *cache, char const *path, size_t size, int64_t mtime, void *source) {
+    for (size_t i = 0; i < cache->count; ++i) {
+        page_cache_file_t *file = cache->files[i];
+        if (strcmp(file->path, path)) {
+            continue;
+        }
+
+        if (file->size == size && file->mtime == mtime) {
+            ++file->users;
+            ++cache->stats.hits;
+            return file;
+        }
+
+        // Whoever still maps the old contents keeps them
+        remove_at(cache, i);
+        file->stale = true;
+        break;
+    }
+
+    if (!size) {
+        return NULL;
+    }
+
+    if (cache->count == cache->capacity) {
+        size_t              capacity = cache->capacity ? cache->capacity * 2 : 8;
+        page_cache_file_t **files    = realloc(cache->files, capacity * sizeof(page_cache_file_t *));
+        if (!files) {
+            return NULL;
+        }
+        cache->files    = files;
+        cache->capacity = capacity;
+    }
+
+    page_cache_file_t *file = read_file(cache, path, size, mtime, source);
+    if (!file) {
+        return NULL;
+    }
+
+    file->users                  = 1;
+    cache->files[cache->count++] = file;
+    ++cache->stats.misses;
+    return file;
+}
+
+void page_cache_release(page_cache_t *cache, page_cache_file_t *file) {
+    if (--file->users) {
+        return;
+    }
+
+    for (size_t i = 0; !file->stale && i < cache->count; ++i) {
+        if (cache->files[i] == file) {
+            remove_at(cache, i);
+            break;
+        }
+    }
+    free_file(cache, file);
+}
+
+void page_cache_space_init(page_cache_space_t *space) {
+    memset(space, 0, sizeof(page_cache_space_t));
+}
+
+uintptr_t page_cache_space_find(
+    page_cache_space_t const *space, size_t page_size, size_t pages, uintptr_t bottom, uintptr_t top
+) {
+    size_t    size = pages * page_size;
+    uintptr_t end  = top;
+
+    // The gaps above, in between and below the mappings, from the top down
+    for (size_t i = 0; i <= space->count; ++i) {
+        uintptr_t start = bottom;
+        if (i < space->count) {
+            page_cache_mapping_t const *m = &space->mappings[i];
+            start                         = m->vaddr + m->file->num_pages * page_size;
+        }
+
+        if (start < bottom) {
+            start = bottom;
+        }
+        if (end >= start && end - start >= size) {
+            return end - size;
+        }
+        if (i < space->count && space->mappings[i].vaddr < end) {
+            end = space->mappings[i].vaddr;
+        }
+    }
+    return 0;
+}
+
+uintptr_t page_cache_space_lowest(page_cache_space_t const *space, uintptr_t top) {
+    return space->count ? space->mappings[space->count - 1].vaddr : top;
+}
+
+bool page_cache_space_insert(page_cache_space_t *space, uintptr_t vaddr, page_cache_file_t *file) {
+    if (space->count == PAGE_CACHE_MAX_MAPPINGS) {
+        return false;
+    }
+
+    size_t i = 0;
+    while (i < space->count && space->mappings[i].vaddr > vaddr) {
+        ++i;
+    }
+
+    memmove(&space->mappings[i + 1], &space->mappings[i], (space->count - i) * sizeof(page_cache_mapping_t));
+    space->mappings[i].vaddr = vaddr;
+    space->mappings[i].file  = file;
+    ++space->count;
+    return true;
+}
+
+page_cache_file_t *page_cache_space_remove(page_cache_space_t *space, uintptr_t vaddr) {
+    for (size_t i = 0; i < space->count; ++i) {
+        if (space->mappings[i].vaddr == vaddr) {
+            page_cache_file_t *file = space->mappings[i].file;
+            --space->count;
+            memmove(&space->mappings[i], &space->mappings[i + 1], (space->count - i) * sizeof(page_cache_mapping_t));
+            return file;
+        }
+    }
+    return NULL;
+}
+
+#ifdef RUN_TEST
+#include <stdio.h>
+
+#define TEST_PAGE_SIZE  64
+#define TEST_PHYS_PAGES 48
+#define TEST_FILES      8
+#define TEST_MAX_SIZE   (10 * TEST_PAGE_SIZE)
+#define TEST_PROCESSES  3
+#define TEST_BOTTOM     0x100000
+#define TEST_TOP        (TEST_BOTTOM + 40 * TEST_PAGE_SIZE)
+
+typedef struct {
+    char    path[16];
+    uint8_t data[TEST_MAX_SIZE];
+    size_t  size;
+    int64_t mtime;
+} fake_file_t;
+
+// What a process expects to find at one of its mappings
+typedef struct {
+    uintptr_t          vaddr;
+    page_cache_file_t *file;
+    uint8_t            data[TEST_MAX_SIZE];
+    size_t             size;
+} expected_t;
+
+typedef struct {
+    page_cache_space_t space;
+    expected_t         expected[PAGE_CACHE_MAX_MAPPINGS];
+    int                num_expected;
+} fake_process_t;
+
+static uint8_t phys[TEST_PHYS_PAGES][TEST_PAGE_SIZE];
+static bool    phys_used[TEST_PHYS_PAGES];
+static int     pages_allocated;
+static int     fills;
+static bool    fail_fill;
+
+#define TEST_RNG_SEED 0x5F3759DF
+#include "test_rng.h"
+
+static uintptr_t fake_page_allocate(void *context) {
+    (void)context;
+    for (int i = 0; i < TEST_PHYS_PAGES; ++i) {
+        if (!phys_used[i]) {
+            phys_used[i] = true;
+            pages_allocated++;
+            // Whatever was there before
+            memset(phys[i], 0xEE, TEST_PAGE_SIZE);
+            return (uintptr_t)phys[i];
+        }
+    }
+    return 0;
+}
+
+static void fake_page_free(void *context, uintptr_t page) {
+    (void)context;
+    int i = ((uint8_t(*)[TEST_PAGE_SIZE])page) - phys;
+    if (!phys_used[i]) {
+        printf("\033[31mDouble free of page %d\033[0m\n", i);
+        exit(1);
+    }
+    phys_used[i] = false;
+    pages_allocated--;
+}
+
+static bool fake_fill(void *source, uintptr_t page, size_t offset, size_t len) {
+    fake_file_t *file = source;
+    fills++;
+    if (fail_fill) {
+        return false;
+    }
+    memcpy((void *)page, file->data + offset, len);
+    return true;
+}
+
+static page_cache_ops_t const fake_ops = {
+    .page_allocate = fake_page_allocate,
+    .page_free     = fake_page_free,
+    .fill          = fake_fill,
+};
+
+static bool pages_hold(page_cache_file_t const *file, uint8_t const *data, size_t size) {
+    for (size_t offset = 0; offset < size; offset += TEST_PAGE_SIZE) {
+        size_t len = size - offset < TEST_PAGE_SIZE ? size - offset : TEST_PAGE_SIZE;
+        if (memcmp((void *)file->pages[offset / TEST_PAGE_SIZE], data + offset, len)) {
+            return false;
+        }
+    }
+    return file->size == size;
+}
+
+static void random_contents(fake_file_t *file) {
+    file->size = 1 + rng() % TEST_MAX_SIZE;
+    for (size_t i = 0; i < file->size; ++i) {
+        file->data[i] = rng();
+    }
+    file->mtime++;
+}
+
+static page_cache_file_t *map(page_cache_t *cache, fake_process_t *process, fake_file_t *file) {
+    page_cache_file_t *mapped = page_cache_acquire(cache, file->path, file->size, file->mtime, file);
+    if (!mapped) {
+        return NULL;
+    }
+
+    uintptr_t vaddr =
+        page_cache_space_find(&process->space, TEST_PAGE_SIZE, mapped->num_pages, TEST_BOTTOM, TEST_TOP);
+    if (!vaddr || !page_cache_space_insert(&process->space, vaddr, mapped)) {
+        page_cache_release(cache, mapped);
+        return NULL;
+    }
+
+    expected_t *e = &process->expected[process->num_expected++];
+    e->vaddr      = vaddr;
+    e->file       = mapped;
+    e->size       = file->size;
+    memcpy(e->data, file->data, file->size);
+    return mapped;
+}
+
+static bool unmap(page_cache_t *cache, fake_process_t *process, int i) {
+    expected_t         e    = process->expected[i];
+    page_cache_file_t *file = page_cache_space_remove(&process->space, e.vaddr);
+
+    process->expected[i] = process->expected[--process->num_expected];
+    if (file) {
+        page_cache_release(cache, file);
+    }
+    return file == e.file;
+}
+
+static bool consistent(page_cache_t *cache, fake_process_t *processes) {
+    page_cache_file_t *live[TEST_PHYS_PAGES + PAGE_CACHE_MAX_MAPPINGS * TEST_PROCESSES];
+    int                num_live   = 0;
+    int                live_pages = 0;
+
+    for (size_t i = 0; i < cache->count; ++i) {
+        page_cache_file_t *file = cache->files[i];
+        live[num_live++]        = file;
+        live_pages             += file->num_pages;
+        if (!file->users || file->stale) {
+            return false;
+        }
+    }
+
+    for (int p = 0; p < TEST_PROCESSES; ++p) {
+        page_cache_space_t const *space = &processes[p].space;
+        if (space->count != (size_t)processes[p].num_expected) {
+            return false;
+        }
+
+        for (size_t m = 0; m < space->count; ++m) {
+            page_cache_mapping_t const *mapping = &space->mappings[m];
+            uintptr_t                   end     = mapping->vaddr + mapping->file->num_pages * TEST_PAGE_SIZE;
+            if (mapping->vaddr < TEST_BOTTOM || end > TEST_TOP || (m && end > space->mappings[m - 1].vaddr)) {
+                return false;
+            }
+        }
+
+        for (int e = 0; e < processes[p].num_expected; ++e) {
+            expected_t const *expected = &processes[p].expected[e];
+            if (!pages_hold(expected->file, expected->data, expected->size)) {
+                return false;
+            }
+
+            bool known = false;
+            for (int i = 0; i < num_live; ++i) {
+                known |= live[i] == expected->file;
+            }
+            if (!known) {
+                live[num_live++]  = expected->file;
+                live_pages       += expected->file->num_pages;
+            }
+        }
+    }
+
+    // Every live file is used exactly as often as it is mapped
+    for (int i = 0; i < num_live; ++i) {
+        uint32_t users = 0;
+        for (int p = 0; p < TEST_PROCESSES; ++p) {
+            for (int e = 0; e < processes[p].num_expected; ++e) {
+                users += processes[p].expected[e].file == live[i];
+            }
+        }
+        if (users != live[i]->users) {
+            return false;
+        }
+    }
+
+    return live_pages == pages_allocated;
+}
+
+int main(void) {
+    int errors = 0;
+
+    static fake_file_t    files[TEST_FILES];
+    static fake_process_t processes[TEST_PROCESSES];
+    page_cache_t          cache;
+
+    for (int i = 0; i < TEST_FILES; ++i) {
+        snprintf(files[i].path, sizeof(files[i].path), "FLASH0:f%d", i);
+        random_contents(&files[i]);
+    }
+    for (int p = 0; p < TEST_PROCESSES; ++p) {
+        page_cache_space_init(&processes[p].space);
+    }
+    page_cache_init(&cache, &fake_ops, NULL, TEST_PAGE_SIZE);
+
+    // Processes mapping the same file share its pages, read once
+    files[0].size                   = 3 * TEST_PAGE_SIZE + 5;
+    page_cache_file_t *first        = map(&cache, &processes[0], &files[0]);
+    page_cache_file_t *second       = map(&cache, &processes[1], &files[0]);
+    if (!first || first != second || fills != 4 || pages_allocated != 4 || !consistent(&cache, processes)) {
+        printf("\033[31mShared mapping read the file %d times\033[0m\n", fills);
+        errors++;
+    }
+
+    // Mappings go top down
+    if (processes[0].expected[0].vaddr != TEST_TOP - 4 * TEST_PAGE_SIZE) {
+        printf("\033[31mFirst mapping at 0x%lx\033[0m\n", (unsigned long)processes[0].expected[0].vaddr);
+        errors++;
+    }
+
+    // A write through one mapping is not served to the next process once the
+    // last mapping is gone
+    memset((void *)first->pages[0], 0xAA, TEST_PAGE_SIZE);
+    unmap(&cache, &processes[0], 0);
+    unmap(&cache, &processes[1], 0);
+    if (pages_allocated || cache.count) {
+        printf("\033[31mPages kept after the last unmap\033[0m\n");
+        errors++;
+    }
+    first = map(&cache, &processes[2], &files[0]);
+    if (!first || fills != 8 || !consistent(&cache, processes)) {
+        printf("\033[31mWritten pages served to a later mapping\033[0m\n");
+        errors++;
+    }
+
+    // A changed file is read again, the old mapping keeps the old contents
+    random_contents(&files[0]);
+    page_cache_file_t *changed = map(&cache, &processes[0], &files[0]);
+    if (!changed || changed == first || !first->stale || !consistent(&cache, processes)) {
+        printf("\033[31mChanged file served from the cache\033[0m\n");
+        errors++;
+    }
+    int before = pages_allocated;
+    unmap(&cache, &processes[2], 0);
+    if (pages_allocated != before - 4 || !consistent(&cache, processes)) {
+        printf("\033[31mStale pages not freed with their last mapping\033[0m\n");
+        errors++;
+    }
+    unmap(&cache, &processes[0], 0);
+
+    // A failed read leaves nothing behind
+    before    = pages_allocated;
+    fail_fill = true;
+    random_contents(&files[1]);
+    if (map(&cache, &processes[0], &files[1]) || pages_allocated != before || !consistent(&cache, processes)) {
+        printf("\033[31mFailed read leaked pages\033[0m\n");
+        errors++;
+    }
+    fail_fill = false;
+
+    // Model test, the page pool is small enough to run out
+    for (int round = 0; round < 50000; ++round) {
+        uint32_t        op      = rng() % 8;
+        fake_process_t *process = &processes[rng() % TEST_PROCESSES];
+        fake_file_t    *file    = &files[rng() % TEST_FILES];
+
+        size_t needed = (file->size + TEST_PAGE_SIZE - 1) / TEST_PAGE_SIZE;
+        bool   room   = process->num_expected < PAGE_CACHE_MAX_MAPPINGS &&
+                    page_cache_space_find(&process->space, TEST_PAGE_SIZE, needed, TEST_BOTTOM, TEST_TOP);
+
+        if (op < 3 && room) {
+            uint32_t hits = cache.stats.hits;
+            if (!map(&cache, process, file) && cache.stats.hits == hits &&
+                pages_allocated + needed <= TEST_PHYS_PAGES) {
+                printf("\033[31mMapping failed with memory left in round %d\033[0m\n", round);
+                errors++;
+                break;
+            }
+        } else if (op < 6 && process->num_expected) {
+            if (!unmap(&cache, process, rng() % process->num_expected)) {
+                printf("\033[31mUnmapped the wrong file in round %d\033[0m\n", round);
+                errors++;
+                break;
+            }
+        } else if (op >= 6) {
+            random_contents(file);
+        }
+
+        if (!consistent(&cache, processes)) {
+            printf("\033[31mCache inconsistent in round %d\033[0m\n", round);
+            errors++;
+            break;
+        }
+    }
+
+    // The free gaps of an address space are used top down
+    page_cache_space_t space;
+    page_cache_file_t  one = {.num_pages = 1};
+    page_cache_file_t  two = {.num_pages = 2};
+    page_cache_space_init(&space);
+    page_cache_space_insert(&space, 0x9000, &one);
+    page_cache_space_insert(&space, 0x5000, &two);
+    page_cache_space_insert(&space, 0x7000, &one);
+    if (page_cache_space_lowest(&space, 0xA000) != 0x5000 || space.mappings[1].vaddr != 0x7000 ||
+        page_cache_space_find(&space, 0x1000, 1, 0x1000, 0xA000) != 0x8000 ||
+        page_cache_space_find(&space, 0x1000, 2, 0x1000, 0xA000) != 0x3000 ||
+        page_cache_space_find(&space, 0x1000, 4, 0x1000, 0xA000) != 0x1000 ||
+        page_cache_space_find(&space, 0x1000, 5, 0x1000, 0xA000) ||
+        page_cache_space_find(&space, 0x1000, 1, 0x6000, 0x7000)) {
+        printf("\033[31mAddress space gaps not found\033[0m\n");
+        errors++;
+    }
+    if (page_cache_space_remove(&space, 0x8000) || page_cache_space_remove(&space, 0x7000) != &one ||
+        page_cache_space_find(&space, 0x1000, 2, 0x1000, 0xA000) != 0x7000) {
+        printf("\033[31mRemoving a mapping failed\033[0m\n");
+        errors++;
+    }
+
+    for (int p = 0; p < TEST_PROCESSES; ++p) {
+        while (processes[p].num_expected) {
+            unmap(&cache, &processes[p], 0);
+        }
+    }
+    page_cache_clear(&cache);
+    if (pages_allocated) {
+        printf("\033[31m%d pages leaked\033[0m\n", pages_allocated);
+        errors++;
+    }
+
+    if (!errors) {
+        printf("\033[32mAll tests passed\033[0m\n");
+    }
+
+    return errors ? 1 : 0;
+}
+#endif
@@ -0,0 +1,98 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_CACHE_MAX_MAPPINGS 16 // Per process
+
+// How the cache gets at physical pages and file contents. Page addresses are
+// whatever the allocator hands out, 0 is never a valid page.
+typedef struct {
+    uintptr_t (*page_allocate)(void *context);
+    void (*page_free)(void *context, uintptr_t page);
+    // Copies len bytes of the file at offset to the start of the page and clears
+    // the rest of it, the page may have belonged to another process before
+    bool (*fill)(void *source, uintptr_t page, size_t offset, size_t len);
+} page_cache_ops_t;
+
+// The pages holding the contents of one file, as it was when it was read
+typedef struct {
+    char      *path;
+    size_t     size;
+    int64_t    mtime;
+    size_t     num_pages;
+    uintptr_t *pages;
+    uint32_t   users; // Mappings of these pages, they are freed with the last one
+    bool       stale; // The file changed, no longer served to new mappings
+} page_cache_file_t;
+
+typedef struct {
+    uint32_t hits;   // Mappings served from pages already in memory
+    uint32_t misses; // Mappings that read the file
+} page_cache_stats_t;
+
+// Files mapped by any process. A file is identified by path, size and mtime,
+// processes mapping the same file share its pages. Nothing keeps a process
+// from writing to its mapping, so pages nobody maps are freed rather than
+// handed to the next process as the contents of the file.
+//
+// Not thread safe, the caller locks around it.
+typedef struct {
+    page_cache_ops_t const *ops;
+    void                   *context;
+    size_t                  page_size;
+    page_cache_file_t     **files;
+    size_t                  count;
+    size_t                  capacity;
+    page_cache_stats_t      stats;
+} page_cache_t;
+
+// Where one process has files mapped. Mappings are sorted by vaddr, highest
+// first, and each takes the pages of its file with no gap in between.
+typedef struct {
+    uintptr_t          vaddr;
+    page_cache_file_t *file;
+} page_cache_mapping_t;
+
+typedef struct {
+    page_cache_mapping_t mappings[PAGE_CACHE_MAX_MAPPINGS];
+    size_t               count;
+} page_cache_space_t;
+
+void page_cache_init(page_cache_t *cache, page_cache_ops_t const *ops, void *context, size_t page_size);
+// Frees every page, no file may be in use
+void page_cache_clear(page_cache_t *cache);
+
+// Takes a reference to the pages of a file, reading it from source unless a
+// process has an unchanged copy mapped
+page_cache_file_t *page_cache_acquire(page_cache_t *cache, char const *path, size_t size, int64_t mtime, void *source);
+// Drops a reference, freeing the pages with the last one
+void page_cache_release(page_cache_t *cache, page_cache_file_t *file);
+
+void page_cache_space_init(page_cache_space_t *space);
+// Highest vaddr in [bottom, top) with room for pages, 0 if there is none
+uintptr_t page_cache_space_find(
+    page_cache_space_t const *space, size_t page_size, size_t pages, uintptr_t bottom, uintptr_t top
+);
+// Lowest mapped vaddr, top if nothing is mapped
+uintptr_t          page_cache_space_lowest(page_cache_space_t const *space, uintptr_t top);
+bool               page_cache_space_insert(page_cache_space_t *space, uintptr_t vaddr, page_cache_file_t *file);
+page_cache_file_t *page_cache_space_remove(page_cache_space_t *space, uintptr_t vaddr);
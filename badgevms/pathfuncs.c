@@ -16,6 +16,11 @@
 
 #include "badgevms/pathfuncs.h"
 
+#ifdef RUN_TEST
+#define _Nullable
+#endif
+
+#include "pathfuncs_private.h"
 #include "why_io.h"
 
 #include <stdbool.h>
@@ -24,6 +29,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static inline bool is_valid_device_char(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-' ||
@@ -34,45 +40,77 @@ static inline bool is_valid_path_char(char c) {
     return is_valid_device_char(c) || c == '.';
 }
 
-// Parse a path in the form of DEVICE:[DIR.SUBDIR]FILENAME.EXT
-path_parse_result_t parse_path(char const *path, path_t *result) {
-    if (!path || !*path) {
-        return PATH_PARSE_EMPTY_PATH;
+static path_parse_result_t parse_error(path_t *result, char *storage, path_parse_result_t error) {
+    if (result->buffer != storage) {
+        why_free(result->buffer);
     }
 
+    result->buffer    = NULL;
+    result->device    = NULL;
+    result->directory = NULL;
+    result->filename  = NULL;
+    return error;
+}
+
+// Parse a path in the form of DEVICE:[DIR.SUBDIR]FILENAME.EXT
+//
+// The components are split in a copy of the path, which goes in storage if
+// there is any and the path is shorter than PATH_INLINE_MAX, or on the heap.
+static path_parse_result_t split_path(
+    char const *path,
+    path_t     *result,
+    char       *storage,
+    size_t     *device_len,
+    size_t     *directory_len,
+    size_t     *filename_len
+) {
     result->buffer    = NULL;
     result->device    = NULL;
     result->directory = NULL;
     result->filename  = NULL;
     result->unixpath  = NULL;
-    result->len       = strlen(path);
+    result->len       = 0;
+    *device_len       = 0;
+    *directory_len    = 0;
+    *filename_len     = 0;
 
-    result->buffer = why_strdup(path);
-    if (!result->buffer) {
+    if (!path || !*path) {
         return PATH_PARSE_EMPTY_PATH;
     }
 
+    result->len = strlen(path);
+    if (storage && result->len < PATH_INLINE_MAX) {
+        result->buffer = storage;
+    } else {
+        result->buffer = why_malloc(result->len + 1);
+        if (!result->buffer) {
+            return PATH_PARSE_EMPTY_PATH;
+        }
+    }
+    memcpy(result->buffer, path, result->len + 1);
+
     char *p     = result->buffer;
     char *start = p;
 
     // Everything up to the ':' is the device part
     while (*p && *p != ':') {
         if (!is_valid_device_char(*p)) {
-            return PATH_PARSE_INVALID_DEVICE_CHAR;
+            return parse_error(result, storage, PATH_PARSE_INVALID_DEVICE_CHAR);
         }
         p++;
     }
 
     if (*p != ':') {
-        return PATH_PARSE_NO_DEVICE;
+        return parse_error(result, storage, PATH_PARSE_NO_DEVICE);
     }
 
     if (p == start) {
-        return PATH_PARSE_EMPTY_DEVICE;
+        return parse_error(result, storage, PATH_PARSE_EMPTY_DEVICE);
     }
 
     *p             = '\0';
     result->device = start;
+    *device_len    = p - start;
     p++; // Skip ':'
 
     // Directory comes next [dir.name]
@@ -83,18 +121,19 @@ path_parse_result_t parse_path(char const *path, path_t *result) {
         // Find closing ']'
         while (*p && *p != ']') {
             if (!is_valid_path_char(*p)) {
-                return PATH_PARSE_INVALID_DIR_CHAR;
+                return parse_error(result, storage, PATH_PARSE_INVALID_DIR_CHAR);
             }
             p++;
         }
 
         if (*p != ']') {
-            return PATH_PARSE_UNCLOSED_DIRECTORY;
+            return parse_error(result, storage, PATH_PARSE_UNCLOSED_DIRECTORY);
         }
 
         if (p > start) {
             *p                = '\0';
             result->directory = start;
+            *directory_len    = p - start;
         }
 
         p++; // Skip ']'
@@ -104,43 +143,58 @@ path_parse_result_t parse_path(char const *path, path_t *result) {
         start = p;
         while (*p) {
             if (!is_valid_path_char(*p)) {
-                return PATH_PARSE_INVALID_FILE_CHAR;
+                return parse_error(result, storage, PATH_PARSE_INVALID_FILE_CHAR);
             }
             p++;
         }
         result->filename = start;
+        *filename_len    = p - start;
     }
 
     return PATH_PARSE_OK;
 }
 
+path_parse_result_t parse_path(char const *path, path_t *result) {
+    size_t device_len, directory_len, filename_len;
+    return split_path(path, result, NULL, &device_len, &directory_len, &filename_len);
+}
+
+path_parse_result_t parse_path_buffer(char const *path, path_buffer_t *result) {
+    return split_path(
+        path,
+        &result->path,
+        result->storage,
+        &result->device_len,
+        &result->directory_len,
+        &result->filename_len
+    );
+}
+
 char *path_to_unix(path_t *path) {
+    path_buffer_t *buffer = (path_buffer_t *)path;
+
     if (path->unixpath) {
         return path->unixpath;
     }
 
-    // Most unix paths are shorter than BadgeVMS paths except for directory-less paths.
-    char  *unixpath      = malloc(path->len + 3);
-    size_t device_len    = strlen(path->device);
-    size_t directory_len = 0;
-    size_t filename_len  = 0;
-
-    if (path->directory) {
-        directory_len = strlen(path->directory);
-    }
-
-    if (path->filename) {
-        filename_len = strlen(path->filename);
+    // Most unix paths are shorter than BadgeVMS paths except for directory-less
+    // paths, which gain at most two characters.
+    char *unixpath = buffer->unix_storage;
+    if (path->len >= PATH_INLINE_MAX) {
+        unixpath = malloc(path->len + 3);
+        if (!unixpath) {
+            return NULL;
+        }
     }
 
     size_t o      = 0;
     unixpath[o++] = '/';
-    memcpy(&unixpath[o], path->device, device_len);
-    o             += device_len;
+    memcpy(&unixpath[o], path->device, buffer->device_len);
+    o             += buffer->device_len;
     unixpath[o++]  = '/';
 
-    if (directory_len) {
-        for (size_t i = 0; i < directory_len; ++i) {
+    if (buffer->directory_len) {
+        for (size_t i = 0; i < buffer->directory_len; ++i) {
             char c = path->directory[i];
             if (c == '.')
                 c = '/';
@@ -149,9 +203,9 @@ char *path_to_unix(path_t *path) {
         unixpath[o++] = '/';
     }
 
-    if (filename_len) {
-        memcpy(&unixpath[o], path->filename, filename_len);
-        o += filename_len;
+    if (buffer->filename_len) {
+        memcpy(&unixpath[o], path->filename, buffer->filename_len);
+        o += buffer->filename_len;
     }
 
     unixpath[o]    = 0;
@@ -162,6 +216,19 @@ char *path_to_unix(path_t *path) {
 void path_free(path_t *path) {
     why_free(path->buffer);
     free(path->unixpath);
+    path->buffer   = NULL;
+    path->unixpath = NULL;
+}
+
+void path_buffer_free(path_buffer_t *path) {
+    if (path->path.buffer != path->storage) {
+        why_free(path->path.buffer);
+    }
+    if (path->path.unixpath != path->unix_storage) {
+        free(path->path.unixpath);
+    }
+    path->path.buffer   = NULL;
+    path->path.unixpath = NULL;
 }
 
 bool mkdir_p(char const *path) {
@@ -563,3 +630,421 @@ char *path_concat(char const *base_path, char const *append_path) {
 
     return result_str;
 }
+
+#ifdef RUN_TEST
+#include <stdarg.h>
+#include <stdint.h>
+
+static size_t heap_allocations;
+
+void *why_malloc(size_t size) {
+    heap_allocations++;
+    return malloc(size);
+}
+
+void why_free(void *ptr) {
+    free(ptr);
+}
+
+char *why_strdup(char const *s) {
+    heap_allocations++;
+    return strdup(s);
+}
+
+int why_asprintf(char **restrict strp, char const *restrict fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    *strp = malloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(*strp, len + 1, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+int why_stat(char const *restrict pathname, struct stat *restrict statbuf) {
+    (void)pathname;
+    (void)statbuf;
+    return -1;
+}
+
+int why_unlink(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+int why_mkdir(char const *pathname, mode_t mode) {
+    (void)pathname;
+    (void)mode;
+    return -1;
+}
+
+int why_rmdir(char const *pathname) {
+    (void)pathname;
+    return -1;
+}
+
+DIR *why_opendir(char const *name) {
+    (void)name;
+    return NULL;
+}
+
+struct dirent *why_readdir(DIR *dirp) {
+    (void)dirp;
+    return NULL;
+}
+
+int why_closedir(DIR *dirp) {
+    (void)dirp;
+    return -1;
+}
+
+// The strdup based parser and translation this file used to have, kept as the
+// reference the current ones are checked against
+typedef struct {
+    char  *buffer;
+    char  *device;
+    char  *directory;
+    char  *filename;
+    size_t len;
+} reference_path_t;
+
+static path_parse_result_t reference_parse_path(char const *path, reference_path_t *result) {
+    if (!path || !*path) {
+        return PATH_PARSE_EMPTY_PATH;
+    }
+
+    result->device    = NULL;
+    result->directory = NULL;
+    result->filename  = NULL;
+    result->len       = strlen(path);
+    result->buffer    = strdup(path);
+
+    char *p     = result->buffer;
+    char *start = p;
+
+    while (*p && *p != ':') {
+        if (!is_valid_device_char(*p)) {
+            return PATH_PARSE_INVALID_DEVICE_CHAR;
+        }
+        p++;
+    }
+
+    if (*p != ':') {
+        return PATH_PARSE_NO_DEVICE;
+    }
+
+    if (p == start) {
+        return PATH_PARSE_EMPTY_DEVICE;
+    }
+
+    *p             = '\0';
+    result->device = start;
+    p++;
+
+    if (*p == '[') {
+        p++;
+        start = p;
+
+        while (*p && *p != ']') {
+            if (!is_valid_path_char(*p)) {
+                return PATH_PARSE_INVALID_DIR_CHAR;
+            }
+            p++;
+        }
+
+        if (*p != ']') {
+            return PATH_PARSE_UNCLOSED_DIRECTORY;
+        }
+
+        if (p > start) {
+            *p                = '\0';
+            result->directory = start;
+        }
+
+        p++;
+    }
+
+    if (*p != '\0') {
+        start = p;
+        while (*p) {
+            if (!is_valid_path_char(*p)) {
+                return PATH_PARSE_INVALID_FILE_CHAR;
+            }
+            p++;
+        }
+        result->filename = start;
+    }
+
+    return PATH_PARSE_OK;
+}
+
+static char *reference_path_to_unix(reference_path_t *path) {
+    char  *unixpath = malloc(path->len + 3);
+    size_t o        = 0;
+
+    unixpath[o++] = '/';
+    memcpy(&unixpath[o], path->device, strlen(path->device));
+    o             += strlen(path->device);
+    unixpath[o++]  = '/';
+
+    if (path->directory) {
+        for (size_t i = 0; path->directory[i]; ++i) {
+            unixpath[o++] = path->directory[i] == '.' ? '/' : path->directory[i];
+        }
+        unixpath[o++] = '/';
+    }
+
+    if (path->filename) {
+        memcpy(&unixpath[o], path->filename, strlen(path->filename));
+        o += strlen(path->filename);
+    }
+
+    unixpath[o] = 0;
+    return unixpath;
+}
+
+#define TEST_RNG_SEED 0x12345678
+#include "test_rng.h"
+
+static bool component_matches(char const *name, char const *got, size_t got_len, char const *expected) {
+    if (!got != !expected) {
+        printf("\033[31m%s: %s where %s was expected\033[0m\n", name, got ? got : "NULL", expected ? expected : "NULL");
+        return false;
+    }
+
+    if (got && (strcmp(got, expected) || strlen(got) != got_len)) {
+        printf("\033[31m%s: %s (%zu) where %s was expected\033[0m\n", name, got, got_len, expected);
+        return false;
+    }
+
+    return true;
+}
+
+// path_t has no lengths, they are only checked for path_buffer_t
+static size_t length_of(char const *component) {
+    return component ? strlen(component) : 0;
+}
+
+static int check_path(char const *path) {
+    reference_path_t    reference        = {0};
+    path_parse_result_t reference_result = reference_parse_path(path, &reference);
+
+    path_t              exported;
+    path_parse_result_t exported_result = parse_path(path, &exported);
+    int                 error           = 0;
+
+    if (exported_result != reference_result) {
+        printf("\033[31m\"%s\": parse_path returned %i, expected %i\033[0m\n", path, exported_result, reference_result);
+        error = 1;
+    } else if (exported_result == PATH_PARSE_OK) {
+        if (!component_matches("device", exported.device, length_of(exported.device), reference.device) ||
+            !component_matches("directory", exported.directory, length_of(exported.directory), reference.directory) ||
+            !component_matches("filename", exported.filename, length_of(exported.filename), reference.filename)) {
+            printf("\033[31m  while parsing \"%s\" into a path_t\033[0m\n", path);
+            error = 1;
+        }
+    }
+    path_free(&exported);
+    path_free(&exported);
+
+    path_buffer_t       parsed;
+    size_t              allocations = heap_allocations;
+    path_parse_result_t result      = parse_path_buffer(path, &parsed);
+
+    if (result != reference_result) {
+        printf("\033[31m\"%s\": parse_path_buffer returned %i, expected %i\033[0m\n", path, result, reference_result);
+        error = 1;
+    } else if (result == PATH_PARSE_OK) {
+        if (!component_matches("device", parsed.path.device, parsed.device_len, reference.device) ||
+            !component_matches("directory", parsed.path.directory, parsed.directory_len, reference.directory) ||
+            !component_matches("filename", parsed.path.filename, parsed.filename_len, reference.filename)) {
+            printf("\033[31m  while parsing \"%s\"\033[0m\n", path);
+            error = 1;
+        }
+
+        char *unixpath           = path_to_unix(&parsed.path);
+        char *reference_unixpath = reference_path_to_unix(&reference);
+        if (!unixpath || strcmp(unixpath, reference_unixpath)) {
+            printf(
+                "\033[31m\"%s\": translated to %s, expected %s\033[0m\n",
+                path,
+                unixpath ? unixpath : "NULL",
+                reference_unixpath
+            );
+            error = 1;
+        } else if (path_to_unix(&parsed.path) != unixpath) {
+            printf("\033[31m\"%s\": translation was not kept\033[0m\n", path);
+            error = 1;
+        }
+        free(reference_unixpath);
+    }
+
+    if (path && strlen(path) < PATH_INLINE_MAX && heap_allocations != allocations) {
+        printf("\033[31m\"%s\": parsing and translating allocated memory\033[0m\n", path);
+        error = 1;
+    }
+
+    path_buffer_free(&parsed);
+    path_buffer_free(&parsed);
+    free(reference.buffer);
+    return error;
+}
+
+int main() {
+    int error = 0;
+
+    char const *paths[] = {
+        NULL,
+        "",
+        ":",
+        "::",
+        "SD0:",
+        "SD0",
+        ":file.txt",
+        "SD0:file.txt",
+        "SD0:[]",
+        "SD0:[]file.txt",
+        "SD0:[dir]",
+        "SD0:[dir]file.txt",
+        "SD0:[dir.sub.subsub]file.txt",
+        "SD0:[dir.sub.]file",
+        "SD0:[.dir]file",
+        "SD0:[...]",
+        "SD0:[dir",
+        "SD0:[dir.sub",
+        "SD0:[",
+        "SD0:[dir]]",
+        "SD0:[dir][sub]",
+        "SD0:[dir]file[",
+        "SD0:file]",
+        "SD0:[d:r]file",
+        "SD0:[dir]fi:le",
+        "SD0:file:stream",
+        "SD0:[d/r]",
+        "SD0:[dir]fi/le",
+        "SD0:[dir]fi le",
+        "SD0:[dir\\sub]",
+        "S D0:file",
+        "S.D0:file",
+        "S[D0:file",
+        "S/D0:file",
+        "$SYS_DEV-1:[$dir-x_y.z9]$F-_.e.x.t",
+        "a:b",
+        "A:[B]",
+        "A:[B].",
+        "A:.",
+        "A:..",
+        "SD0:[dir]\x7f",
+        "SD0:[\xc3\xa9]",
+        "\xc3\xa9:file",
+        "SD0:\xc3\xa9",
+        "SD0:[dir] ",
+        " SD0:",
+    };
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        error |= check_path(paths[i]);
+    }
+
+    // Every short string over an alphabet with each kind of character
+    char const alphabet[]   = "Az9_-$.:[]/ ";
+    size_t     alphabet_len = sizeof(alphabet) - 1;
+    char       path[PATH_INLINE_MAX * 3];
+
+    for (size_t len = 1; len <= 5; len++) {
+        size_t combinations = 1;
+        for (size_t i = 0; i < len; i++) {
+            combinations *= alphabet_len;
+        }
+
+        for (size_t n = 0; n < combinations && !error; n++) {
+            size_t v = n;
+            for (size_t i = 0; i < len; i++) {
+                path[i]  = alphabet[v % alphabet_len];
+                v       /= alphabet_len;
+            }
+            path[len]  = '\0';
+            error     |= check_path(path);
+        }
+    }
+
+    // Longer well formed and nearly well formed paths, around and past the inline
+    // storage size
+    for (int i = 0; i < 100000 && !error; i++) {
+        size_t len = 1 + rng() % (sizeof(path) - 1);
+        size_t o   = 0;
+
+        size_t device_len = rng() % 12;
+        for (size_t j = 0; j < device_len && o < len; j++) {
+            path[o++] = alphabet[rng() % 6];
+        }
+        if (o < len && rng() % 16) {
+            path[o++] = ':';
+        }
+        if (o < len && rng() % 2) {
+            path[o++] = '[';
+        }
+        while (o < len) {
+            uint32_t r = rng() % 64;
+            if (r == 0) {
+                path[o++] = alphabet[rng() % alphabet_len];
+            } else if (r < 8) {
+                path[o++] = '.';
+            } else if (r == 8) {
+                path[o++] = ']';
+            } else {
+                path[o++] = alphabet[rng() % 6];
+            }
+        }
+        path[o]  = '\0';
+        error   |= check_path(path);
+    }
+
+    // Make sure the long paths actually took the heap path
+    memset(path, 'a', sizeof(path));
+    memcpy(path, "SD0:[", 5);
+    path[PATH_INLINE_MAX * 2]     = ']';
+    path[PATH_INLINE_MAX * 2 + 1] = '\0';
+
+    path_buffer_t parsed;
+    size_t        allocations = heap_allocations;
+    if (parse_path_buffer(path, &parsed) != PATH_PARSE_OK || parsed.path.buffer == parsed.storage ||
+        heap_allocations != allocations + 1) {
+        printf("\033[31mLong path did not use the heap\033[0m\n");
+        error = 1;
+    } else if (!path_to_unix(&parsed.path) || parsed.path.unixpath == parsed.unix_storage) {
+        printf("\033[31mLong path was not translated on the heap\033[0m\n");
+        error = 1;
+    }
+    path_buffer_free(&parsed);
+
+    // Applications are built against this layout
+    if (sizeof(path_t) != 5 * sizeof(char *) + sizeof(size_t)) {
+        printf("\033[31mpath_t changed size\033[0m\n");
+        error = 1;
+    }
+
+    char *concatenated = path_concat("SD0:[dir]", "[sub]file.txt");
+    if (!concatenated || strcmp(concatenated, "SD0:[dir.sub]file.txt")) {
+        printf("\033[31mpath_concat returned %s\033[0m\n", concatenated ? concatenated : "NULL");
+        error = 1;
+    }
+    free(concatenated);
+
+    char *dirname = path_dirname("SD0:[dir.sub]file.txt");
+    if (!dirname || strcmp(dirname, "SD0:[dir.sub]")) {
+        printf("\033[31mpath_dirname returned %s\033[0m\n", dirname ? dirname : "NULL");
+        error = 1;
+    }
+    free(dirname);
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+    }
+
+    return error;
+}
+#endif
@@ -18,4 +18,25 @@
 
 #include "badgevms/pathfuncs.h"
 
+// Paths shorter than this are parsed into the path_buffer_t itself, only
+// longer ones need the heap
+#define PATH_INLINE_MAX 128
+
+// What the kernel parses paths into before handing them to a device. The
+// exported path_t stays as it is, the lengths and inline copies live around
+// it. Components point into the path_buffer_t, so it must not be copied or
+// moved. path_buffer_free() is safe to call whether parsing succeeded or not.
+typedef struct {
+    path_t path;
+    size_t device_len;
+    size_t directory_len;
+    size_t filename_len;
+    char   storage[PATH_INLINE_MAX];
+    char   unix_storage[PATH_INLINE_MAX + 3];
+} path_buffer_t;
+
+path_parse_result_t parse_path_buffer(char const *path, path_buffer_t *result);
+void                path_buffer_free(path_buffer_t *path);
+
+// Only for the path of a path_buffer_t, which is what devices get passed
 char *path_to_unix(path_t *path);
@@ -0,0 +1,169 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sched_class.h"
+
+sched_class_t sched_class_for_window(sched_window_t const *window) {
+    if (!window->visible) {
+        return SCHED_CLASS_OCCLUDED;
+    }
+    if (window->focused && !window->low_priority) {
+        return SCHED_CLASS_FOREGROUND;
+    }
+    return SCHED_CLASS_VISIBLE;
+}
+
+// A process with several windows gets the best class of any of them
+static sched_class_t better(sched_class_t a, sched_class_t b) {
+    if (a == SCHED_CLASS_BACKGROUND) {
+        return b;
+    }
+    if (b == SCHED_CLASS_BACKGROUND) {
+        return a;
+    }
+    return a < b ? a : b;
+}
+
+// Classifies every process from the current windows. classes holds the
+// previous class of each pid and is updated, the processes that changed
+// are stored in changes, which needs room for num_pids entries.
+int sched_class_update(
+    sched_class_t *classes, int num_pids, sched_window_t const *windows, int num_windows, sched_change_t *changes
+) {
+    int num_changes = 0;
+
+    for (pid_t pid = 0; pid < num_pids; ++pid) {
+        sched_class_t sched_class = SCHED_CLASS_BACKGROUND;
+        for (int i = 0; i < num_windows; ++i) {
+            if (windows[i].pid == pid) {
+                sched_class = better(sched_class, sched_class_for_window(&windows[i]));
+            }
+        }
+
+        if (sched_class != classes[pid]) {
+            changes[num_changes++] = (sched_change_t){.pid = pid, .from = classes[pid], .to = sched_class};
+            classes[pid]           = sched_class;
+        }
+    }
+
+    return num_changes;
+}
+
+// Relative to the normal task priority. A process that lowered its own
+// priority stays low whatever its class.
+int sched_class_priority_offset(sched_class_t sched_class, bool lowered, bool throttle_occluded) {
+    if (lowered) {
+        return -1;
+    }
+
+    switch (sched_class) {
+        case SCHED_CLASS_FOREGROUND: return 1;
+        case SCHED_CLASS_OCCLUDED: return throttle_occluded ? -1 : 0;
+        default: return 0;
+    }
+}
+
+#ifdef RUN_TEST
+#include <stdarg.h>
+#include <stdio.h>
+
+#define TEST_PIDS 16
+
+static sched_class_t  classes[TEST_PIDS];
+static sched_change_t changes[TEST_PIDS];
+
+static bool expect(char const *what, sched_window_t const *windows, int num_windows, int num_changes, ...) {
+    int n = sched_class_update(classes, TEST_PIDS, windows, num_windows, changes);
+    if (n != num_changes) {
+        printf("\033[31m%s: %d changes, expected %d\033[0m\n", what, n, num_changes);
+        return false;
+    }
+
+    va_list ap;
+    va_start(ap, num_changes);
+    for (int i = 0; i < n; ++i) {
+        pid_t         pid = va_arg(ap, int);
+        sched_class_t to  = va_arg(ap, int);
+        if (changes[i].pid != pid || changes[i].to != to) {
+            printf(
+                "\033[31m%s: change %d is pid %d to %d, expected pid %d to %d\033[0m\n",
+                what,
+                i,
+                changes[i].pid,
+                changes[i].to,
+                pid,
+                to
+            );
+            va_end(ap);
+            return false;
+        }
+    }
+    va_end(ap);
+    return true;
+}
+
+int main() {
+    bool error = false;
+
+    // One app opens a window and gets focus
+    sched_window_t one[] = {{.pid = 3, .focused = true, .visible = true}};
+    error |= !expect("open", one, 1, 1, 3, SCHED_CLASS_FOREGROUND);
+
+    // Nothing changed, nothing to do
+    error |= !expect("steady", one, 1, 0);
+
+    // A second app takes focus, the first stays visible next to it
+    sched_window_t two[] = {{.pid = 5, .focused = true, .visible = true}, {.pid = 3, .visible = true}};
+    error |= !expect("second", two, 2, 2, 3, SCHED_CLASS_VISIBLE, 5, SCHED_CLASS_FOREGROUND);
+
+    // The second goes fullscreen and covers the first
+    two[1].visible = false;
+    error |= !expect("cover", two, 2, 1, 3, SCHED_CLASS_OCCLUDED);
+
+    // A process with a covered and a visible window counts as visible
+    sched_window_t three[] = {
+        {.pid = 5, .focused = true, .visible = true},
+        {.pid = 3, .visible = false},
+        {.pid = 3, .visible = true},
+    };
+    error |= !expect("multi", three, 3, 1, 3, SCHED_CLASS_VISIBLE);
+
+    // Low priority windows are never foreground
+    three[0].low_priority = true;
+    error |= !expect("low priority", three, 3, 1, 5, SCHED_CLASS_VISIBLE);
+
+    // Closing all windows makes both background processes
+    error |= !expect("close", NULL, 0, 2, 3, SCHED_CLASS_BACKGROUND, 5, SCHED_CLASS_BACKGROUND);
+
+    // Priorities
+    if (sched_class_priority_offset(SCHED_CLASS_FOREGROUND, false, true) != 1 ||
+        sched_class_priority_offset(SCHED_CLASS_VISIBLE, false, true) != 0 ||
+        sched_class_priority_offset(SCHED_CLASS_BACKGROUND, false, true) != 0 ||
+        sched_class_priority_offset(SCHED_CLASS_OCCLUDED, false, true) != -1 ||
+        sched_class_priority_offset(SCHED_CLASS_OCCLUDED, false, false) != 0 ||
+        sched_class_priority_offset(SCHED_CLASS_FOREGROUND, true, false) != -1) {
+        printf("\033[31mWrong priority offsets\033[0m\n");
+        error = true;
+    }
+
+    if (!error) {
+        printf("\033[32mAll tests passed\033[0m\n");
+        return 0;
+    }
+    return 1;
+}
+#endif
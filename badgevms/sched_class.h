@@ -0,0 +1,51 @@
+/* This file is part of BadgeVMS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+// How the kernel treats a process, derived from its windows. Only changes in
+// class touch task priorities.
+typedef enum {
+    SCHED_CLASS_BACKGROUND, // No windows
+    SCHED_CLASS_FOREGROUND, // Owns the focused window
+    SCHED_CLASS_VISIBLE,    // Has a window on screen
+    SCHED_CLASS_OCCLUDED,   // All its windows are covered
+} sched_class_t;
+
+typedef struct {
+    pid_t pid;
+    bool  focused;
+    bool  visible;
+    bool  low_priority; // WINDOW_FLAG_LOW_PRIORITY, never foreground
+} sched_window_t;
+
+typedef struct {
+    pid_t         pid;
+    sched_class_t from;
+    sched_class_t to;
+} sched_change_t;
+
+sched_class_t sched_class_for_window(sched_window_t const *window);
+int           sched_class_priority_offset(sched_class_t sched_class, bool lowered, bool throttle_occluded);
+
+int sched_class_update(
+    sched_class_t *classes, int num_pids, sched_window_t const *windows, int num_windows, sched_change_t *changes
+);
@@ -18,12 +18,14 @@
 
 #include "badgevms/event.h"
 #include "badgevms/ota.h"
+#include "badgevms_config.h"
 #include "compositor/compositor_private.h"
 #include "curl/curl.h"
 #include "elf_symbols.h"
 #include "esp_elf.h"
 #include "esp_log.h"
 #include "esp_tls.h"
+#include "file_map_private.h"
 #include "hash_helper.h"
 #include "memory.h"
 #include "thirdparty/khash.h"
@@ -64,6 +66,7 @@ typedef struct {
 static uint32_t num_tasks = 0;
 
 static task_info_t      *process_table[NUM_PIDS];
+static sched_class_t     sched_classes[NUM_PIDS]; // Also under process_table_lock
 static SemaphoreHandle_t process_table_lock = NULL;
 
 static TaskHandle_t  hades_handle;
@@ -134,6 +137,7 @@ static void process_table_add_task(task_info_t *task_info) {
     }
 
     process_table[task_info->pid] = task_info;
+    sched_classes[task_info->pid] = SCHED_CLASS_BACKGROUND;
 
     xSemaphoreGive(process_table_lock);
 }
@@ -263,6 +267,7 @@ static void task_thread_destroy(task_thread_t *thread) {
         kh_destroy(restable, thread->resources[i]);
     }
 
+    file_map_release_all(thread);
     pages_deallocate(thread->pages);
 
     free(thread);
@@ -782,18 +787,50 @@ BaseType_t create_kernel_task(
     return ret;
 }
 
-void task_priority_lower() {
-    task_info_t *task_info = get_task_info();
+// Called with process_table_lock held
+static void task_apply_priority(task_info_t *task_info) {
     if (eTaskGetState(task_info->handle) != eDeleted) {
-        vTaskPrioritySet(task_info->handle, TASK_PRIORITY_LOW);
+        int offset = sched_class_priority_offset(
+            sched_classes[task_info->pid],
+            task_info->priority_lowered,
+            SCHED_THROTTLE_OCCLUDED
+        );
+        // TASK_PRIORITY_LOW, TASK_PRIORITY or TASK_PRIORITY_FOREGROUND
+        vTaskPrioritySet(task_info->handle, TASK_PRIORITY + offset);
     }
 }
 
-void task_priority_restore() {
+static void task_set_priority_lowered(bool lowered) {
     task_info_t *task_info = get_task_info();
-    if (eTaskGetState(task_info->handle) != eDeleted) {
-        vTaskPrioritySet(task_info->handle, TASK_PRIORITY);
+
+    xSemaphoreTake(process_table_lock, portMAX_DELAY);
+    task_info->priority_lowered = lowered;
+    task_apply_priority(task_info);
+    xSemaphoreGive(process_table_lock);
+}
+
+void task_priority_lower() {
+    task_set_priority_lowered(true);
+}
+
+void task_priority_restore() {
+    task_set_priority_lowered(false);
+}
+
+// The compositor calls this whenever focus or what is visible changed,
+// priorities are only touched for processes whose class changed
+void task_sched_classes_update(sched_window_t const *windows, int num_windows) {
+    static sched_change_t changes[NUM_PIDS];
+
+    xSemaphoreTake(process_table_lock, portMAX_DELAY);
+    int num_changes = sched_class_update(sched_classes, NUM_PIDS, windows, num_windows, changes);
+    for (int i = 0; i < num_changes; ++i) {
+        task_info_t *task_info = process_table[changes[i].pid];
+        if (task_info) {
+            task_apply_priority(task_info);
+        }
     }
+    xSemaphoreGive(process_table_lock);
 }
 
 void task_set_application_uid(pid_t pid, char const *unique_id) {
@@ -20,6 +20,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "memory.h"
+#include "sched_class.h"
 #include "thirdparty/dlmalloc.h"
 
 #include <stdatomic.h>
@@ -74,6 +75,7 @@ typedef struct {
     struct malloc_state  malloc_state;
     struct malloc_params malloc_params;
     kh_restable_t       *resources[RES_RESOURCE_TYPE_MAX];
+    page_cache_space_t   mappings; // Files mapped with file_map()
 } task_thread_t;
 
 typedef struct task_info {
@@ -94,6 +96,7 @@ typedef struct task_info {
     // Small variables
     pid_t        pid;
     pid_t        parent;
+    bool         priority_lowered; // See task_priority_lower()
     int          argc;
     int          _errno;
     task_type_t  type;
@@ -131,6 +134,7 @@ void         task_set_application_uid(pid_t pid, char const *unique_id);
 bool         task_application_is_running(char const *unique_id);
 uint32_t     get_num_tasks();
 task_info_t *get_taskinfo_for_pid(pid_t pid);
+void         task_sched_classes_update(sched_window_t const *windows, int num_windows);
 
 BaseType_t create_kernel_task(
     TaskFunction_t      pvTaskCode,
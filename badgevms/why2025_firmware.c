@@ -30,6 +30,7 @@
 #include "drivers/badgevms_i2c_bus.h"
 #include "drivers/bosch_bmi270.h"
 #include "drivers/fatfs.h"
+#include "drivers/ramdisk.h"
 #include "drivers/socket.h"
 #include "drivers/st7703.h"
 #include "drivers/tca8418.h"
@@ -40,6 +41,7 @@
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_private/panic_internal.h"
+#include "file_map_private.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "init.h"
@@ -98,6 +100,11 @@ int app_main(void) {
         invalidate_ota_partition();
     }
 
+    if (!file_map_init()) {
+        ESP_LOGE(TAG, "Failed to initialize file mapping subsystem");
+        invalidate_ota_partition();
+    }
+
     if (!logical_names_system_init()) {
         ESP_LOGE(TAG, "Failed to initialize logical names subsystem");
         invalidate_ota_partition();
@@ -111,13 +118,13 @@ int app_main(void) {
         ret = nvs_flash_init();
     }
 
-    if (!device_register("FLASH0", fatfs_create_spi("FLASH0", "storage", true))) {
+    if (!device_register("FLASH0", fatfs_create_spi("FLASH0", "storage", true, FATFS_FLASH_WRITEBACK))) {
         ESP_LOGE(TAG, "Failed to initialize FLASH0 driver");
         invalidate_ota_partition();
     }
 
     // Allowed to fail
-    device_register("SD0", fatfs_create_sd("SD0", true));
+    device_register("SD0", fatfs_create_sd("SD0", true, FATFS_SD_WRITEBACK));
 
     if (device_get("SD0")) {
         logical_name_set("STORAGE:", "SD0:, FLASH0:", false);
@@ -129,6 +136,12 @@ int app_main(void) {
         application_init("APPS:", NULL, "FLASH0:[BADGEVMS.APPS]");
     }
 
+    if (!device_register("RAM0", ramdisk_create_psram(RAMDISK_MAX_BYTES))) {
+        ESP_LOGE(TAG, "Failed to initialize RAM0 driver");
+        invalidate_ota_partition();
+    }
+    logical_name_set("TMP:", "RAM0:", false);
+
     if (!device_register("WIFI0", wifi_create())) {
         ESP_LOGE(TAG, "Failed to initialize WIFI0 driver");
         invalidate_ota_partition();
@@ -139,11 +152,17 @@ int app_main(void) {
         invalidate_ota_partition();
     }
 
-    if (!device_register("PANEL0", st7703_create())) {
+    if (!device_register("PANEL0", st7703_create(init_display_framebuffers()))) {
         ESP_LOGE(TAG, "Failed to initialize PANEL0 driver");
         invalidate_ota_partition();
     }
 
+    // The keyboard reads through I2CBUS0
+    if (!device_register("I2CBUS0", badgevms_i2c_bus_create("I2CBUS0", 0, I2C0_MASTER_FREQ_HZ))) {
+        ESP_LOGE(TAG, "Failed to initialize I2CBUS0 driver");
+        invalidate_ota_partition();
+    }
+
     if (!device_register("KEYBOARD0", tca8418_keyboard_create())) {
         ESP_LOGE(TAG, "Failed to initialize KEYBOARD0 driver");
         invalidate_ota_partition();
@@ -154,11 +173,6 @@ int app_main(void) {
         invalidate_ota_partition();
     }
 
-    if (!device_register("I2CBUS0", badgevms_i2c_bus_create("I2CBUS0", 0, I2C0_MASTER_FREQ_HZ))) {
-        ESP_LOGE(TAG, "Failed to initialize I2CBUS0 driver");
-        invalidate_ota_partition();
-    }
-
     if (!device_register("ORIENTATION0", bosch_bmi270_sensor_create())) {
         ESP_LOGE(TAG, "Failed to initialize ORIENTATION0 driver");
         // invalidate_ota_partition();
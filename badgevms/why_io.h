@@ -79,6 +79,7 @@ int            why_unlink(char const *pathname);
 int            why_mkdir(char const *pathname, mode_t mode);
 int            why_rmdir(char const *pathname);
 int            why_fstat(int fd, struct stat *restrict statbuf);
+int            why_fsync(int fd);
 int            why_rename(char const *oldpath, char const *newpath);
 int            why_remove(char const *pathname);
 DIR           *why_opendir(char const *name);
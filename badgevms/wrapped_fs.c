@@ -15,7 +15,9 @@
  */
 
 #include "badgevms/pathfuncs.h"
+#include "dir_merge.h"
 #include "logical_names.h"
+#include "pathfuncs_private.h"
 #include "task.h"
 #include "why_io.h"
 
@@ -25,51 +27,36 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#define kcalloc(N, Z)  why_calloc(N, Z)
-#define kmalloc(Z)     why_malloc(Z)
-#define krealloc(P, Z) why_realloc(P, Z)
-#define kfree(P)       why_free(P)
-
-#include "thirdparty/khash.h"
-
-KHASH_SET_INIT_STR(seen);
-typedef khash_t(seen) * seen_names_t;
-
 typedef int (*fs_operation_func)(filesystem_device_t *fs_dev, path_t *path, void *extra_data);
 typedef int (*why_helper_func)(char const *resolved_path, void *extra_data);
 
-typedef struct why_dirent_entry {
-    struct dirent            dirent;        // Standard dirent structure
-    char                    *badgevms_name; // BadgeVMS name
-    struct why_dirent_entry *next;
-} why_dirent_entry_t;
-
 typedef struct why_dir {
-    char               *original_badgevms_path; // Original BadgeVMS path requested
-    why_dirent_entry_t *entries;
-    why_dirent_entry_t *current;
-    size_t              entry_count;
+    dir_merge_t            merge;
+    logical_name_result_t *locations;     // The search list, resolved once at opendir
+    size_t                 num_locations;
+    filesystem_device_t   *device;        // Of the location being read
+    struct dirent          dirent;
 } why_dir_t;
 
 static int _why_filesystem_op(char const *resolved_path, fs_operation_func operation, void *extra_data) {
-    path_t parsed_path;
-    int    res = parse_path(resolved_path, &parsed_path);
+    path_buffer_t parsed_path;
+    int           res = parse_path_buffer(resolved_path, &parsed_path);
 
     if (res != 0) {
         return -1;
     }
 
-    device_t *device = device_get(parsed_path.device);
+    device_t *device = device_get(parsed_path.path.device);
     if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
-        path_free(&parsed_path);
+        path_buffer_free(&parsed_path);
         return -1;
     }
 
     filesystem_device_t *fs_device = (filesystem_device_t *)device;
 
-    int result = operation(fs_device, &parsed_path, extra_data);
+    int result = operation(fs_device, &parsed_path.path, extra_data);
 
-    path_free(&parsed_path);
+    path_buffer_free(&parsed_path);
     return result;
 }
 
@@ -142,45 +129,45 @@ static int _why_searchlist_try_all(
 }
 
 static int _why_rename_single(char const *oldpath_resolved, char const *newpath_resolved) {
-    path_t parsed_oldpath, parsed_newpath;
-    int    res_old = parse_path(oldpath_resolved, &parsed_oldpath);
-    int    res_new = parse_path(newpath_resolved, &parsed_newpath);
+    path_buffer_t parsed_oldpath, parsed_newpath;
+    int           res_old = parse_path_buffer(oldpath_resolved, &parsed_oldpath);
+    int           res_new = parse_path_buffer(newpath_resolved, &parsed_newpath);
 
     if (res_old != 0 || res_new != 0) {
         if (res_old == 0)
-            path_free(&parsed_oldpath);
+            path_buffer_free(&parsed_oldpath);
         if (res_new == 0)
-            path_free(&parsed_newpath);
+            path_buffer_free(&parsed_newpath);
         return -1;
     }
 
-    device_t *device = device_get(parsed_oldpath.device);
+    device_t *device = device_get(parsed_oldpath.path.device);
     if (!device || device->type != DEVICE_TYPE_FILESYSTEM ||
-        strcmp(parsed_oldpath.device, parsed_newpath.device) != 0) {
+        strcmp(parsed_oldpath.path.device, parsed_newpath.path.device) != 0) {
         ESP_LOGW(
             "_why_rename_single",
             "Unable to open device for %s -> %s, dev: %s -> %s",
             oldpath_resolved,
             newpath_resolved,
-            parsed_oldpath.device,
-            parsed_newpath.device
+            parsed_oldpath.path.device,
+            parsed_newpath.path.device
         );
-        path_free(&parsed_oldpath);
-        path_free(&parsed_newpath);
+        path_buffer_free(&parsed_oldpath);
+        path_buffer_free(&parsed_newpath);
         return -1;
     }
 
     filesystem_device_t *fs_device = (filesystem_device_t *)device;
     if (!fs_device->_rename) {
-        path_free(&parsed_oldpath);
-        path_free(&parsed_newpath);
+        path_buffer_free(&parsed_oldpath);
+        path_buffer_free(&parsed_newpath);
         return -1;
     }
 
-    int result = fs_device->_rename(fs_device, &parsed_oldpath, &parsed_newpath);
+    int result = fs_device->_rename(fs_device, &parsed_oldpath.path, &parsed_newpath.path);
 
-    path_free(&parsed_oldpath);
-    path_free(&parsed_newpath);
+    path_buffer_free(&parsed_oldpath);
+    path_buffer_free(&parsed_newpath);
     return result;
 }
 
@@ -289,6 +276,30 @@ int why_fstat(int fd, struct stat *restrict statbuf) {
     return fs_device->_fstat(fs_device, task_info->thread->file_handles[fd].dev_fd, statbuf);
 }
 
+int why_fsync(int fd) {
+    task_info_t *task_info = get_task_info();
+    ESP_LOGI("why_fsync", "Calling fsync from task %p for fd %d", task_info->handle, fd);
+
+    if (fd < 0 || fd >= MAXFD || !task_info->thread->file_handles[fd].is_open) {
+        task_info->_errno = EBADF;
+        return -1;
+    }
+
+    device_t *device = task_info->thread->file_handles[fd].device;
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        task_info->_errno = EINVAL;
+        return -1;
+    }
+
+    // Filesystems without a write-back policy have nothing to sync
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_fsync) {
+        return 0;
+    }
+
+    return fs_device->_fsync(fs_device, task_info->thread->file_handles[fd].dev_fd);
+}
+
 int why_rename(char const *oldpath, char const *newpath) {
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_rename", "Calling rename from task %p: %s -> %s", task_info->handle, oldpath, newpath);
@@ -349,123 +360,88 @@ int why_remove(char const *pathname) {
     }
 }
 
-static void seen_names_init(seen_names_t *seen) {
-    *seen = kh_init(seen);
-}
-
-static bool seen_names_contains(seen_names_t seen, char const *name) {
-    khiter_t k = kh_get(seen, seen, name);
-    return (k != kh_end(seen));
-}
-
-static bool seen_names_add(seen_names_t seen, char const *name) {
-    if (seen_names_contains(seen, name)) {
-        return false; // Already seen (shadowed)
-    }
-
-    int   ret;
-    char *name_copy = why_strdup(name);
-    if (!name_copy)
-        return false;
+static void *merge_open(void *context, size_t location) {
+    why_dir_t    *dir = context;
+    path_buffer_t parsed_path;
 
-    kh_put(seen, seen, name_copy, &ret);
-    if (ret < 0) {
-        why_free(name_copy); // Put failed
-        return false;
-    }
-    return true;
-}
-
-static void seen_names_cleanup(seen_names_t seen) {
-    khiter_t k;
-    // Free all the strdup'd keys
-    for (k = kh_begin(seen); k != kh_end(seen); ++k) {
-        if (kh_exist(seen, k)) {
-            why_free((void *)kh_key(seen, k));
-        }
+    if (parse_path_buffer(dir->locations[location].result, &parsed_path) != PATH_PARSE_OK) {
+        return NULL;
     }
-    kh_destroy(seen, seen);
-}
 
-static why_dirent_entry_t *create_dirent_entry(const struct dirent *original_dirent, char const *badgevms_name) {
-    why_dirent_entry_t *entry = why_malloc(sizeof(why_dirent_entry_t));
-    if (!entry)
+    device_t *device = device_get(parsed_path.path.device);
+    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
+        path_buffer_free(&parsed_path);
         return NULL;
+    }
 
-    memcpy(&entry->dirent, original_dirent, sizeof(struct dirent));
-
-    entry->badgevms_name = why_strdup(badgevms_name);
-    if (!entry->badgevms_name) {
-        why_free(entry);
+    filesystem_device_t *fs_device = (filesystem_device_t *)device;
+    if (!fs_device->_opendir || !fs_device->_readdir || !fs_device->_closedir) {
+        path_buffer_free(&parsed_path);
         return NULL;
     }
 
-    strncpy(entry->dirent.d_name, badgevms_name, sizeof(entry->dirent.d_name) - 1);
-    entry->dirent.d_name[sizeof(entry->dirent.d_name) - 1] = '\0';
+    ESP_LOGI("why_opendir", "Reading location: %s", dir->locations[location].result);
+    DIR *device_dir = fs_device->_opendir(fs_device, &parsed_path.path);
+    path_buffer_free(&parsed_path);
 
-    entry->next = NULL;
-    return entry;
+    dir->device = fs_device;
+    return device_dir;
 }
 
-static void free_dirent_entry(why_dirent_entry_t *entry) {
-    if (entry) {
-        why_free(entry->badgevms_name);
-        why_free(entry);
-    }
+static struct dirent *merge_read(void *context, void *handle) {
+    why_dir_t *dir = context;
+    return dir->device->_readdir(dir->device, handle);
 }
 
-static void add_entry_to_list(why_dir_t *dir, why_dirent_entry_t *entry) {
-    entry->next  = dir->entries;
-    dir->entries = entry;
-    dir->entry_count++;
+static void merge_close(void *context, void *handle) {
+    why_dir_t *dir = context;
+    dir->device->_closedir(dir->device, handle);
 }
 
-static bool read_directory_location(char const *resolved_path, why_dir_t *merged_dir, seen_names_t seen) {
-    path_t parsed_path;
-    int    res = parse_path(resolved_path, &parsed_path);
-
-    if (res != 0) {
-        return false;
-    }
-
-    device_t *device = device_get(parsed_path.device);
-    if (!device || device->type != DEVICE_TYPE_FILESYSTEM) {
-        path_free(&parsed_path);
-        return false;
-    }
-
-    filesystem_device_t *fs_device = (filesystem_device_t *)device;
-    if (!fs_device->_opendir || !fs_device->_readdir || !fs_device->_closedir) {
-        path_free(&parsed_path);
-        return false;
+// Only asked for names the filter has seen, which are nearly always there.
+// The name comes from a device listing and need not be a valid BadgeVMS
+// filename, so it is put in the parsed location as is instead of going
+// through path_fileconcat() and parse_path(). Stat needs no directory to be
+// opened next to the one being read.
+static bool merge_contains(void *context, size_t location, char const *name) {
+    why_dir_t    *dir   = context;
+    bool          found = false;
+    path_buffer_t parsed_path;
+
+    if (parse_path_buffer(dir->locations[location].result, &parsed_path) == PATH_PARSE_OK) {
+        device_t *device = device_get(parsed_path.path.device);
+        if (device && device->type == DEVICE_TYPE_FILESYSTEM) {
+            struct stat statbuf;
+
+            // len only decides whether the unix path fits inline, it may be too long
+            parsed_path.path.filename  = (char *)name;
+            parsed_path.filename_len   = strlen(name);
+            parsed_path.path.len      += parsed_path.filename_len;
+
+            found = _stat_operation((filesystem_device_t *)device, &parsed_path.path, &statbuf) == 0;
+        }
     }
 
-    DIR *device_dir = fs_device->_opendir(fs_device, &parsed_path);
-    if (!device_dir) {
-        path_free(&parsed_path);
-        return false;
-    }
+    path_buffer_free(&parsed_path);
+    return found;
+}
 
-    struct dirent *entry;
-    while ((entry = fs_device->_readdir(fs_device, device_dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+static dir_merge_ops_t const merge_ops = {
+    .open     = merge_open,
+    .read     = merge_read,
+    .close    = merge_close,
+    .contains = merge_contains,
+};
 
-        if (seen_names_add(seen, entry->d_name)) {
-            why_dirent_entry_t *new_entry = create_dirent_entry(entry, entry->d_name);
-            if (new_entry) {
-                add_entry_to_list(merged_dir, new_entry);
-            }
-        }
+static void free_locations(why_dir_t *dir) {
+    for (size_t i = 0; i < dir->num_locations; ++i) {
+        logical_name_result_free(dir->locations[i]);
     }
-
-    fs_device->_closedir(fs_device, device_dir);
-    path_free(&parsed_path);
-
-    return true;
+    why_free(dir->locations);
 }
 
+// Entries are streamed from each location of the search list in turn, see
+// dir_merge.h
 DIR *why_opendir(char const *name) {
     task_info_t *task_info = get_task_info();
     ESP_LOGI("why_opendir", "Calling opendir from task %p for path %s", task_info->handle, name);
@@ -475,59 +451,38 @@ DIR *why_opendir(char const *name) {
         return NULL;
     }
 
-    why_dir_t *merged_dir = why_malloc(sizeof(why_dir_t));
+    why_dir_t *merged_dir = why_calloc(1, sizeof(why_dir_t));
     if (!merged_dir) {
         task_info->_errno = ENOMEM;
         return NULL;
     }
 
-    merged_dir->original_badgevms_path = why_strdup(name);
-    merged_dir->entries                = NULL;
-    merged_dir->current                = NULL;
-    merged_dir->entry_count            = 0;
+    logical_name_result_t lname          = logical_name_resolve_const(name, 0);
+    size_t                location_slots = lname.result_count ? lname.result_count : 1;
 
-    if (!merged_dir->original_badgevms_path) {
+    merged_dir->locations = why_calloc(location_slots, sizeof(logical_name_result_t));
+    if (!merged_dir->locations) {
+        logical_name_result_free(lname);
         why_free(merged_dir);
         task_info->_errno = ENOMEM;
         return NULL;
     }
 
-    seen_names_t seen;
-    seen_names_init(&seen);
-
-    logical_name_result_t lname               = logical_name_resolve_const(name, 0);
-    size_t                result_count        = lname.result_count;
-    bool                  found_any_directory = false;
-
-    ESP_LOGI("why_opendir", "Reading directory %s from %zi locations", name, result_count);
-    for (int i = 0; i < result_count; ++i) {
-        ESP_LOGI("why_opendir", "Trying location: %s", lname.result);
-
-        if (read_directory_location(lname.result, merged_dir, seen)) {
-            ESP_LOGI("why_opendir", "Successfully read entries from %s", lname.result);
-            found_any_directory = true;
-        }
-
-        logical_name_result_free(lname);
-        ESP_LOGI("why_opendir", "Resolving at index %i", i + 1);
-        lname = logical_name_resolve_const(name, i + 1);
+    merged_dir->num_locations = lname.result_count;
+    merged_dir->locations[0]  = lname;
+    for (size_t i = 1; i < merged_dir->num_locations; ++i) {
+        merged_dir->locations[i] = logical_name_resolve_const(name, i);
     }
 
-    logical_name_result_free(lname);
-    seen_names_cleanup(seen);
-
-    if (!found_any_directory) {
+    ESP_LOGI("why_opendir", "Reading directory %s from %zi locations", name, merged_dir->num_locations);
+    if (!dir_merge_open(&merged_dir->merge, &merge_ops, merged_dir, merged_dir->num_locations)) {
         ESP_LOGI("why_opendir", "No readable directories found for %s", name);
-        why_free(merged_dir->original_badgevms_path);
+        free_locations(merged_dir);
         why_free(merged_dir);
         task_info->_errno = ENOENT;
         return NULL;
     }
 
-    merged_dir->current = merged_dir->entries;
-
-    ESP_LOGI("why_opendir", "Successfully opened merged directory %s with %zi entries", name, merged_dir->entry_count);
-
     return (DIR *)merged_dir;
 }
 
@@ -537,16 +492,15 @@ struct dirent *why_readdir(DIR *dirp) {
         return NULL;
     }
 
-    why_dir_t *merged_dir = (why_dir_t *)dirp;
-
-    if (!merged_dir->current) {
+    why_dir_t     *merged_dir = (why_dir_t *)dirp;
+    struct dirent *entry      = dir_merge_read(&merged_dir->merge);
+    if (!entry) {
         return NULL;
     }
 
-    why_dirent_entry_t *current_entry = merged_dir->current;
-    merged_dir->current               = current_entry->next;
-
-    return &current_entry->dirent;
+    // The device entry is gone once the location is closed
+    memcpy(&merged_dir->dirent, entry, sizeof(struct dirent));
+    return &merged_dir->dirent;
 }
 
 int why_closedir(DIR *dirp) {
@@ -560,19 +514,14 @@ int why_closedir(DIR *dirp) {
 
     why_dir_t *merged_dir = (why_dir_t *)dirp;
 
-    why_dirent_entry_t *current = merged_dir->entries;
-    while (current) {
-        why_dirent_entry_t *next = current->next;
-        free_dirent_entry(current);
-        current = next;
-    }
-
-    why_free(merged_dir->original_badgevms_path);
+    dir_merge_close(&merged_dir->merge);
+    free_locations(merged_dir);
     why_free(merged_dir);
 
     return 0;
 }
 
+// Starts over from the first location, picking up changes made since opendir
 void why_rewinddir(DIR *dirp) {
     if (!dirp) {
         get_task_info()->_errno = EBADF;
@@ -581,7 +530,7 @@ void why_rewinddir(DIR *dirp) {
 
     why_dir_t *merged_dir = (why_dir_t *)dirp;
 
-    merged_dir->current = merged_dir->entries;
+    dir_merge_rewind(&merged_dir->merge);
 
     get_task_info()->_errno = 0;
 }
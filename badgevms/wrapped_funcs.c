@@ -22,6 +22,7 @@
 #include "lwip/ip4_addr.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
+#include "pathfuncs_private.h"
 #include "rom/uart.h"
 #include "task.h"
 #include "thirdparty/dlmalloc.h"
@@ -358,26 +359,26 @@ off_t why_lseek(int fd, off_t offset, int whence) {
 }
 
 static int _why_open(char const *pathname, int flags, mode_t mode, device_t **device) {
-    int    dev_fd = -1;
-    path_t parsed_path;
-    int    res = parse_path(pathname, &parsed_path);
+    int           dev_fd = -1;
+    path_buffer_t parsed_path;
+    int           res = parse_path_buffer(pathname, &parsed_path);
 
     if (res) {
         goto out;
     }
 
-    *device = device_get(parsed_path.device);
+    *device = device_get(parsed_path.path.device);
     if (!*device) {
         goto out;
     }
 
-    dev_fd = (*device)->_open(device, &parsed_path, flags, mode);
+    dev_fd = (*device)->_open(device, &parsed_path.path, flags, mode);
     if (dev_fd < 0) {
         goto out;
     }
 
 out:
-    path_free(&parsed_path);
+    path_buffer_free(&parsed_path);
     return dev_fd;
 }
 
@@ -0,0 +1,56 @@
+#include "badgevms/compositor.h"
+#include "badgevms/framebuffer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#define NUM_SWAPS 1000
+#define FB_WIDTH  720
+#define FB_HEIGHT 720
+
+int main(int argc, char *argv[]) {
+    struct timeval start, end;
+    window_size_t  size = {FB_WIDTH, FB_HEIGHT};
+
+    window_handle_t window = window_create("Swap bench", size, WINDOW_FLAG_DOUBLE_BUFFERED | WINDOW_FLAG_FULLSCREEN);
+    if (!window) {
+        printf("Unable to create window\n");
+        return 1;
+    }
+
+    framebuffer_t *framebuffer = window_framebuffer_create(window, size, BADGEVMS_PIXELFORMAT_RGB565);
+    if (!framebuffer) {
+        printf("Unable to create framebuffer\n");
+        window_destroy(window);
+        return 1;
+    }
+
+    // Dirty every cache line of the back buffer, like a game rendering a full frame
+    memset(framebuffer->pixels, 0x55, FB_WIDTH * FB_HEIGHT * 2);
+    window_present(window, false, NULL, 0);
+
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < NUM_SWAPS; ++i) {
+        memset(framebuffer->pixels, i, FB_WIDTH * FB_HEIGHT * 2);
+        window_present(window, false, NULL, 0);
+    }
+
+    gettimeofday(&end, NULL);
+
+    long microseconds = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+    window_stats_t stats;
+    window_stats_get(window, &stats);
+
+    printf("Framebuffer Swap Benchmark Results:\n");
+    printf("Total swaps: %d\n", NUM_SWAPS);
+    printf("Total time: %ld microseconds\n", microseconds);
+    printf("Average per frame (fill + swap): %ld microseconds\n", microseconds / NUM_SWAPS);
+    printf("Frames per second: %ld\n", (long)(NUM_SWAPS * 1000000.0 / microseconds));
+    printf("Frames composited: %u, dropped: %u\n", (unsigned)stats.composited, (unsigned)stats.drops);
+
+    window_destroy(window);
+}
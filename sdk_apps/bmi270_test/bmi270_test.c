@@ -21,4 +21,30 @@ int main(int argc, char *argv[]) {
     printf("Orientation: %d \n", ret);
     int degrees = orientation->_get_orientation_degrees(orientation);
     printf("Orientation degrees: %d \n", degrees);
+
+    device_t *stream = orientation->_stream_create(orientation, 100);
+    if (stream == NULL) {
+        printf("Could not stream samples\n");
+        return 0;
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        imu_sample_t samples[16];
+        usleep(100 * 1000);
+        ssize_t n = stream->_read(stream, 0, samples, sizeof(samples)) / sizeof(imu_sample_t);
+        for (ssize_t j = 0; j < n; ++j) {
+            printf(
+                "%lld acc %d %d %d gyr %d %d %d\n",
+                samples[j].timestamp,
+                samples[j].acc[0],
+                samples[j].acc[1],
+                samples[j].acc[2],
+                samples[j].gyr[0],
+                samples[j].gyr[1],
+                samples[j].gyr[2]
+            );
+        }
+    }
+
+    stream->_destroy(stream);
 }
\ No newline at end of file
@@ -54,48 +54,48 @@ void BADGEVMS_PumpEvents(SDL_VideoDevice *_this)
             continue;
         }
 
-        event_t badgevms_event;
+        event_t badgevms_events[16];
         SDL_Event sdl_event;
-
-        while (true) {
-            badgevms_event = window_event_poll(window_data->badgevms_window, false, 0);
-
-            if (badgevms_event.type == EVENT_NONE) {
-                break; // No more events from this window
-            }
-
-            SDL_zero(sdl_event);
-
-            switch (badgevms_event.type) {
-            case EVENT_QUIT:
-                sdl_event.type = SDL_EVENT_QUIT;
-                SDL_PushEvent(&sdl_event);
-                break;
-
-            case EVENT_KEY_DOWN:
-            case EVENT_KEY_UP:
-                sdl_event.type = badgevms_event.keyboard.down ? SDL_EVENT_KEY_DOWN : SDL_EVENT_KEY_UP;
-                sdl_event.key.windowID = SDL_GetWindowID(sdl_window);
-                sdl_event.key.scancode = badgevms_event.keyboard.scancode;
-                sdl_event.key.key = SDL_GetKeyFromScancode(badgevms_event.keyboard.scancode, badgevms_event.keyboard.mod, true);
-                sdl_event.key.mod = badgevms_event.keyboard.mod;
-                sdl_event.key.down = badgevms_event.keyboard.down;
-                sdl_event.key.repeat = badgevms_event.keyboard.repeat;
-                sdl_event.key.timestamp = SDL_GetTicksNS();
-                SDL_PushEvent(&sdl_event);
-
-                if (badgevms_event.keyboard.down && badgevms_event.keyboard.text != 0) {
-                    char text[2] = { badgevms_event.keyboard.text, 0 };
-                    SDL_SendKeyboardText(text);
+        int num_events;
+
+        // Fetch events in batches rather than one call per event
+        while ((num_events = window_event_poll_many(window_data->badgevms_window, badgevms_events, SDL_arraysize(badgevms_events), false, 0)) > 0) {
+            for (int j = 0; j < num_events; j++) {
+                event_t badgevms_event = badgevms_events[j];
+
+                SDL_zero(sdl_event);
+
+                switch (badgevms_event.type) {
+                case EVENT_QUIT:
+                    sdl_event.type = SDL_EVENT_QUIT;
+                    SDL_PushEvent(&sdl_event);
+                    break;
+
+                case EVENT_KEY_DOWN:
+                case EVENT_KEY_UP:
+                    sdl_event.type = badgevms_event.keyboard.down ? SDL_EVENT_KEY_DOWN : SDL_EVENT_KEY_UP;
+                    sdl_event.key.windowID = SDL_GetWindowID(sdl_window);
+                    sdl_event.key.scancode = badgevms_event.keyboard.scancode;
+                    sdl_event.key.key = SDL_GetKeyFromScancode(badgevms_event.keyboard.scancode, badgevms_event.keyboard.mod, true);
+                    sdl_event.key.mod = badgevms_event.keyboard.mod;
+                    sdl_event.key.down = badgevms_event.keyboard.down;
+                    sdl_event.key.repeat = badgevms_event.keyboard.repeat;
+                    sdl_event.key.timestamp = SDL_GetTicksNS();
+                    SDL_PushEvent(&sdl_event);
+
+                    if (badgevms_event.keyboard.down && badgevms_event.keyboard.text != 0) {
+                        char text[2] = { badgevms_event.keyboard.text, 0 };
+                        SDL_SendKeyboardText(text);
+                    }
+                    break;
+
+                case EVENT_WINDOW_RESIZE:
+                    break;
+
+                default:
+                    // Unknown event type, ignore
+                    break;
                 }
-                break;
-
-            case EVENT_WINDOW_RESIZE:
-                break;
-
-            default:
-                // Unknown event type, ignore
-                break;
             }
         }
     }